@@ -0,0 +1,29 @@
+;;;; Creates and calls lots of closures, some of them capturing mutable state
+
+(define (make-counter)
+  (let ((n 0))
+    (lambda ()
+      (set! n (+ n 1))
+      n)))
+
+(define (make-adder k)
+  (lambda (x) (+ x k)))
+
+(define (compose f g)
+  (lambda (x) (f (g x))))
+
+;; Applies `f` to `x` `k` times
+(define (iterate k f x)
+  (if (= k 0)
+      x
+      (iterate (- k 1) f (f x))))
+
+(define (run k counter acc)
+  (if (= k 0)
+      (+ acc (counter))
+      (run (- k 1)
+           counter
+           (iterate 100 (compose (make-adder k) (make-adder 1)) (+ acc (counter))))))
+
+;; => 202303001
+(run 2000 (make-counter) 0)
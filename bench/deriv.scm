@@ -0,0 +1,45 @@
+;;;; Symbolic differentiation of a polynomial, allocating lots of small lists
+;;;; The language can't tell symbols apart yet, so expressions are tagged lists instead:
+;;;;   (0 c) a constant, (1) the variable x, (2 a b) a + b, (3 a b) a * b
+
+(define (const c) (cons 0 (cons c '())))
+(define (var) (cons 1 '()))
+(define (add a b) (cons 2 (cons a (cons b '()))))
+(define (mul a b) (cons 3 (cons a (cons b '()))))
+
+(define (lhs e) (car (cdr e)))
+(define (rhs e) (car (cdr (cdr e))))
+
+(define (deriv e)
+  (let ((tag (car e)))
+    (if (= tag 0)
+        (const 0)
+        (if (= tag 1)
+            (const 1)
+            (if (= tag 2)
+                (add (deriv (lhs e)) (deriv (rhs e)))
+                (add (mul (lhs e) (deriv (rhs e)))
+                     (mul (deriv (lhs e)) (rhs e))))))))
+
+;; Number of nodes in an expression
+(define (size e)
+  (let ((tag (car e)))
+    (if (< tag 2)
+        1
+        (+ 1 (size (lhs e)) (size (rhs e))))))
+
+;; 3x^3 + 2x^2 + x + 5, in Horner form nested `depth` more times
+(define (poly depth)
+  (if (= depth 0)
+      (add (mul (const 3) (mul (var) (mul (var) (var))))
+           (add (mul (const 2) (mul (var) (var)))
+                (add (var) (const 5))))
+      (mul (poly (- depth 1)) (add (var) (const depth)))))
+
+(define (repeat n e acc)
+  (if (= n 0)
+      acc
+      (repeat (- n 1) e (+ acc (size (deriv e))))))
+
+;; => 365000
+(repeat 1000 (poly 8) 0)
@@ -0,0 +1,44 @@
+;;;; bench/dispatch.scm with the (case) written out as the chain of ifs it replaces, to compare the two
+;;;; Same program, same opcodes in the same order: opcode k takes k + 1 comparisons to find
+
+(define program
+  '((0 0)    ; 0: acc <- 0
+    (1 1)    ; 1: i <- 1
+    (2 0)    ; 2: acc <- acc + i
+    (3 1)    ; 3: i <- i + 1
+    (4 7)    ; 4: if i > n goto 7
+    (5 2)    ; 5: goto 2
+    (15 0)   ; 6: never reached
+    (6 0)))  ; 7: halt
+
+(define (nth lst k)
+  (if (= k 0) (car lst) (nth (cdr lst) (- k 1))))
+
+(define (run pc acc i n steps)
+  (let ((insn (nth program pc)))
+    (let ((op (car insn))
+          (arg (car (cdr insn))))
+      (if (= op 0) (run (+ pc 1) arg i n (+ steps 1))
+      (if (= op 1) (run (+ pc 1) acc arg n (+ steps 1))
+      (if (= op 2) (run (+ pc 1) (+ acc i) i n (+ steps 1))
+      (if (= op 3) (run (+ pc 1) acc (+ i arg) n (+ steps 1))
+      (if (= op 4) (if (> i n) (run arg acc i n (+ steps 1)) (run (+ pc 1) acc i n (+ steps 1)))
+      (if (= op 5) (run arg acc i n (+ steps 1))
+      (if (= op 6) acc
+      (if (= op 7) (run (+ pc 1) (- acc arg) i n steps)
+      (if (= op 8) (run (+ pc 1) (* acc arg) i n steps)
+      (if (= op 9) (run (+ pc 1) acc (- i arg) n steps)
+      (if (= op 10) (run (+ pc 1) acc (* i arg) n steps)
+      (if (= op 11) (run arg (- acc 1) i n steps)
+      (if (= op 12) (run arg acc (- i 1) n steps)
+      (if (= op 13) (run (+ pc 1) 0 0 n steps)
+      (if (= op 14) (run (+ pc 1) acc acc n steps)
+      'bad-opcode))))))))))))))))))
+
+(define (rounds k total)
+  (if (= k 0)
+      total
+      (rounds (- k 1) (+ total (run 0 0 0 100 0)))))
+
+;; => 2525000
+(rounds 500 0)
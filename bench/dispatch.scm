@@ -0,0 +1,45 @@
+;;;; A little bytecode interpreter, dispatching on opcodes with (case) like interpreters written in Scheme usually do
+;;;; The program sums 1..n in a loop: acc and i live in registers, `code` is a list of (op arg) pairs
+
+(define program
+  '((0 0)    ; 0: acc <- 0
+    (1 1)    ; 1: i <- 1
+    (2 0)    ; 2: acc <- acc + i
+    (3 1)    ; 3: i <- i + 1
+    (4 7)    ; 4: if i > n goto 7
+    (5 2)    ; 5: goto 2
+    (15 0)   ; 6: never reached
+    (6 0)))  ; 7: halt
+
+(define (nth lst k)
+  (if (= k 0) (car lst) (nth (cdr lst) (- k 1))))
+
+(define (run pc acc i n steps)
+  (let ((insn (nth program pc)))
+    (let ((op (car insn))
+          (arg (car (cdr insn))))
+      (case op
+        ((0) (run (+ pc 1) arg i n (+ steps 1)))
+        ((1) (run (+ pc 1) acc arg n (+ steps 1)))
+        ((2) (run (+ pc 1) (+ acc i) i n (+ steps 1)))
+        ((3) (run (+ pc 1) acc (+ i arg) n (+ steps 1)))
+        ((4) (if (> i n) (run arg acc i n (+ steps 1)) (run (+ pc 1) acc i n (+ steps 1))))
+        ((5) (run arg acc i n (+ steps 1)))
+        ((6) acc)
+        ((7) (run (+ pc 1) (- acc arg) i n steps))
+        ((8) (run (+ pc 1) (* acc arg) i n steps))
+        ((9) (run (+ pc 1) acc (- i arg) n steps))
+        ((10) (run (+ pc 1) acc (* i arg) n steps))
+        ((11) (run arg (- acc 1) i n steps))
+        ((12) (run arg acc (- i 1) n steps))
+        ((13) (run (+ pc 1) 0 0 n steps))
+        ((14) (run (+ pc 1) acc acc n steps))
+        (else 'bad-opcode)))))
+
+(define (rounds k total)
+  (if (= k 0)
+      total
+      (rounds (- k 1) (+ total (run 0 0 0 100 0)))))
+
+;; => 2525000
+(rounds 500 0)
@@ -0,0 +1,24 @@
+;;;; Validates items deep inside a recursion, with every other one invalid and bailing out to a guard at the top
+
+(define (check item depth)
+  (if (= depth 0)
+      (if (< item 0) (raise 'invalid) item)
+      (+ 0 (check item (- depth 1)))))
+
+(define (validate item)
+  (guard (e (#t 0))
+    (check item 200)))
+
+;; Alternates between valid and invalid items: 1, -1, 1, ...
+(define (validate-all i n item acc)
+  (if (= i n)
+      acc
+      (validate-all (+ i 1) n (- 0 item) (+ acc (validate item)))))
+
+(define (rounds k acc)
+  (if (= k 0)
+      acc
+      (rounds (- k 1) (+ acc (validate-all 0 100 1 0)))))
+
+;; => 5000
+(rounds 100 0)
@@ -0,0 +1,24 @@
+;;;; Builds long lists and reverses them: allocation and list traversal
+
+(define (build n acc)
+  (if (= n 0)
+      acc
+      (build (- n 1) (cons n acc))))
+
+(define (rev l acc)
+  (if (null? l)
+      acc
+      (rev (cdr l) (cons (car l) acc))))
+
+(define (sum l acc)
+  (if (null? l)
+      acc
+      (sum (cdr l) (+ acc (car l)))))
+
+(define (round k acc)
+  (if (= k 0)
+      acc
+      (round (- k 1) (+ acc (sum (rev (build 5000 '()) '()) 0)))))
+
+;; => 250050000
+(round 20 0)
@@ -0,0 +1,35 @@
+;;;; Calls procedures written with macros in a loop, where each use expands the same way every time
+
+(define-syntax my-and
+  (syntax-rules ()
+    ((_) #t)
+    ((_ e) e)
+    ((_ e rest ...) (if e (my-and rest ...) #f))))
+
+(define-syntax my-unless
+  (syntax-rules ()
+    ((_ c body ...) (if c 0 (let () body ...)))))
+
+(define-syntax inc!
+  (syntax-rules ()
+    ((_ var) (set! var (+ var 1)))
+    ((_ var n) (set! var (+ var n)))))
+
+(define (in-range? x lo hi)
+  (my-and (>= x lo) (< x hi) (my-unless (= x 13) #t)))
+
+(define (count i n acc)
+  (if (= i n)
+      acc
+      (let ((next acc))
+        (my-unless (in-range? i 10 500) (inc! next))
+        (inc! next 2)
+        (count (+ i 1) n next))))
+
+(define (rounds k acc)
+  (if (= k 0)
+      acc
+      (rounds (- k 1) (+ acc (count 0 1000 0)))))
+
+;; => 251000
+(rounds 100 0)
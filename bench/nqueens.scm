@@ -0,0 +1,37 @@
+;;;; Counts the solutions to the n-queens problem, by trying every permutation of rows
+;;;; Adapted from the Gabriel benchmark, without `and`/`not`/`append` which the language doesn't have
+
+(define (iota1 n)
+  (let loop ((i n) (l '()))
+    (if (= i 0)
+        l
+        (loop (- i 1) (cons i l)))))
+
+(define (append2 a b)
+  (if (null? a)
+      b
+      (cons (car a) (append2 (cdr a) b))))
+
+;; Whether a queen on `row` is safe from every queen in `placed`, the nearest of which is `dist` columns away
+(define (ok? row dist placed)
+  (if (null? placed)
+      #t
+      (if (= (car placed) (+ row dist))
+          #f
+          (if (= (car placed) (- row dist))
+              #f
+              (ok? row (+ dist 1) (cdr placed))))))
+
+(define (try-it x y z)
+  (if (null? x)
+      (if (null? y) 1 0)
+      (+ (if (ok? (car x) 1 z)
+             (try-it (append2 (cdr x) y) '() (cons (car x) z))
+             0)
+         (try-it (cdr x) (cons (car x) y) z))))
+
+(define (queens n)
+  (try-it (iota1 n) '() '()))
+
+;; => 724
+(queens 10)
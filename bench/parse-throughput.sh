@@ -0,0 +1,26 @@
+#!/bin/sh
+# Measures reader throughput in MB/s, by running `ywrk --parse-only` over a generated data file
+# Usage: bench/parse-throughput.sh [path/to/ywrk] [size in MB]
+set -e
+
+YWRK=${1:-build/ywrk}
+SIZE_MB=${2:-16}
+CORPUS=${TMPDIR:-/tmp}/ywrk-parse-corpus-${SIZE_MB}mb.scm
+
+if [ ! -f "$CORPUS" ]; then
+    # A mix of what generated data files usually contain: nested lists, symbols, numbers, strings and comments
+    awk -v target=$((SIZE_MB * 1024 * 1024)) 'BEGIN {
+        srand(42);
+        size = 0;
+        while (size < target) {
+            line = sprintf("(record %d (name \"item-%d\") (price %.2f) (tags (alpha beta-%d gamma)) (flags #t #f))", NR, size, rand() * 1000, size % 97);
+            if (size % 7 == 0)
+                line = line " ; trailing comment";
+            print line;
+            size += length(line) + 1;
+            NR++;
+        }
+    }' > "$CORPUS"
+fi
+
+"$YWRK" --parse-only --quiet --stats "$CORPUS"
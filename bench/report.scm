@@ -0,0 +1,34 @@
+;;;; Builds a large text report by appending to a string in a loop, and again through a string builder
+
+(define (row i)
+  (string-append "item " (number->string i) ": price " (number->string (* i 1.5)) ", tags alpha beta gamma\n"))
+
+(define (rows i n acc)
+  (if (= i n)
+      acc
+      (rows (+ i 1) n (string-append acc (row i)))))
+
+(define (section k acc)
+  (if (= k 0)
+      acc
+      (section (- k 1) (string-append acc "== section ==\n" (rows 0 2000 "")))))
+
+(define (build-rows sb i n)
+  (if (= i n)
+      sb
+      (begin-rows sb i n)))
+
+(define (begin-rows sb i n)
+  (string-builder-append! sb (row i))
+  (build-rows sb (+ i 1) n))
+
+(define (build-sections sb k)
+  (if (= k 0)
+      sb
+      (build-sections (build-rows sb 0 2000) (- k 1))))
+
+(define report (section 20 ""))
+(define built (string-builder->string (build-sections (make-string-builder) 20)))
+
+;; => 3606240
+(+ (string-length report) (string-length built))
@@ -0,0 +1,21 @@
+;;;; Reads the output of a subprocess line by line, building a string per line
+;;;; See report.scm for building strings out of pieces instead
+
+(define (read-lines port acc)
+  (let ((line (read-line port)))
+    (if line
+        (read-lines port (cons line acc))
+        acc)))
+
+(define (count l n)
+  (if (null? l)
+      n
+      (count (cdr l) (+ n 1))))
+
+(define (round k acc)
+  (if (= k 0)
+      acc
+      (round (- k 1) (+ acc (count (read-lines (open-input-pipe "seq 1 5000") '()) 0)))))
+
+;; => 100000
+(round 20 0)
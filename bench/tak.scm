@@ -0,0 +1,11 @@
+;;;; Takeuchi function: deep non-tail recursion with three arguments
+
+(define (tak x y z)
+  (if (< y x)
+      (tak (tak (- x 1) y z)
+           (tak (- y 1) z x)
+           (tak (- z 1) x y))
+      z))
+
+;; => 9
+(tak 22 16 8)
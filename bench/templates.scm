@@ -0,0 +1,27 @@
+;;;; Generates code from a quasiquote template in a loop, where most of the template is the same every time
+
+(define (emit-handler i)
+  `(define (,(string->symbol (string-append "handler-" (number->string i))) request)
+     (let ((id ,i)
+           (route (quote (api v1 items detail)))
+           (headers (quote ((content-type json) (cache-control no-store) (vary accept)))))
+       (if (< (request-size request) 4096)
+           (respond 200 headers (render-item id route))
+           (respond 413 headers (quote (error payload-too-large)))))))
+
+;; The id out of (define (name request) (let ((id i) ...) ...))
+(define (handler-id code)
+  (car (cdr (car (car (cdr (car (cdr (cdr code)))))))))
+
+(define (emit-all i n acc)
+  (if (= i n)
+      acc
+      (emit-all (+ i 1) n (+ acc (handler-id (emit-handler i))))))
+
+(define (rounds k acc)
+  (if (= k 0)
+      acc
+      (rounds (- k 1) (+ acc (emit-all 0 1000 0)))))
+
+;; => 49950000
+(rounds 100 0)
@@ -0,0 +1,297 @@
+// Runs each benchmark in bench/ several times with a given ywrk, and prints the results as JSON to stdout.
+// Usage: ywrk-bench [--ywrk path/to/ywrk] [--runs N] [--filter substring] [--corpus-mb N] [bench dir]
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+import std;
+
+namespace fs = std::filesystem;
+using namespace std::literals;
+
+#ifndef YWRK_BENCH_DIR
+#    define YWRK_BENCH_DIR "bench"
+#endif
+
+struct Options {
+    fs::path ywrk;
+    fs::path bench_dir = YWRK_BENCH_DIR;
+    int runs = 5;
+    std::string filter;
+    /// Size of the generated corpus for the parse-throughput benchmark
+    size_t corpus_mb = 16;
+};
+
+struct Benchmark {
+    std::string name;
+    std::vector<std::string> args;
+    /// What the last line printed should be, from the last `;; => ` comment in the file; empty to not check
+    std::string expected;
+};
+
+struct RunResult {
+    double wall_ms = 0;
+    long peak_rss_kb = 0;
+    std::string output;
+    std::string stats;
+    /// Empty if the run went fine
+    std::string error;
+};
+
+struct HeapStats {
+    size_t objects = 0;
+    size_t bytes = 0;
+};
+
+std::string read_file(const fs::path& path) {
+    std::ifstream ifs(path, std::ios::binary);
+    return { std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>() };
+}
+
+fs::path default_ywrk_path() {
+    // Built next to us, by either CMake (ywrk) or xmake (yawarakai)
+    std::error_code ec;
+    auto dir = fs::read_symlink("/proc/self/exe", ec).parent_path();
+    for (auto name : { "ywrk", "yawarakai" }) {
+        if (fs::exists(dir / name))
+            return dir / name;
+    }
+    return "ywrk";
+}
+
+std::string expected_result(const fs::path& script) {
+    std::ifstream ifs(script);
+    std::string line, res;
+    while (std::getline(ifs, line)) {
+        if (line.starts_with(";; => "))
+            res = line.substr(";; => "sv.size());
+    }
+    return res;
+}
+
+/// Generates a data file like bench/parse-throughput.sh does: nested lists, symbols, numbers, strings and comments
+fs::path ensure_corpus(size_t size_mb) {
+    auto path = fs::temp_directory_path() / std::format("ywrk-bench-corpus-{}mb.scm", size_mb);
+    if (fs::exists(path))
+        return path;
+
+    auto tmp_path = path;
+    tmp_path += std::format(".{}.tmp", getpid());
+    {
+        std::ofstream ofs(tmp_path, std::ios::binary);
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<double> price(0, 1000);
+        size_t target = size_mb * 1024 * 1024;
+        size_t size = 0;
+        for (size_t nr = 0; size < target; ++nr) {
+            auto line = std::format("(record {} (name \"item-{}\") (price {:.2f}) (tags (alpha beta-{} gamma)) (flags #t #f))", nr, size, price(rng), size % 97);
+            if (size % 7 == 0)
+                line += " ; trailing comment";
+            line += '\n';
+            ofs << line;
+            size += line.size();
+        }
+    }
+    fs::rename(tmp_path, path);
+    return path;
+}
+
+std::vector<Benchmark> find_benchmarks(const Options& opts) {
+    std::vector<Benchmark> res;
+
+    std::vector<fs::path> scripts;
+    for (auto& entry : fs::directory_iterator(opts.bench_dir)) {
+        if (entry.path().extension() == ".scm")
+            scripts.push_back(entry.path());
+    }
+    std::ranges::sort(scripts);
+
+    for (auto& script : scripts) {
+        res.push_back({
+            .name = script.stem().string(),
+            .args = { "--stats", fs::absolute(script).string() },
+            .expected = expected_result(script),
+        });
+    }
+
+    res.push_back({
+        .name = "parse-throughput",
+        .args = { "--parse-only", "--quiet", "--stats", ensure_corpus(opts.corpus_mb).string() },
+        .expected = {},
+    });
+
+    if (!opts.filter.empty())
+        std::erase_if(res, [&](const Benchmark& b) { return !b.name.contains(opts.filter); });
+    return res;
+}
+
+RunResult run_once(const Options& opts, const Benchmark& bench) {
+    RunResult res;
+
+    // stdout is usually tiny, but stderr must be drained while the child runs; put both in files so neither can block it
+    auto out_path = fs::temp_directory_path() / std::format("ywrk-bench-{}.out", getpid());
+    auto err_path = fs::temp_directory_path() / std::format("ywrk-bench-{}.err", getpid());
+
+    std::vector<std::string> args{ opts.ywrk.string() };
+    args.insert(args.end(), bench.args.begin(), bench.args.end());
+    std::vector<char*> argv;
+    for (auto& arg : args)
+        argv.push_back(arg.data());
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, err_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    posix_spawn_file_actions_addchdir_np(&actions, opts.bench_dir.c_str());
+
+    auto begin = std::chrono::steady_clock::now();
+    pid_t pid;
+    int err = posix_spawn(&pid, opts.ywrk.c_str(), &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        res.error = std::format("unable to run {}: {}", opts.ywrk.string(), std::strerror(err));
+        return res;
+    }
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) == -1 && errno == EINTR) {}
+    res.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    // Kilobytes on Linux
+    res.peak_rss_kb = usage.ru_maxrss;
+
+    res.output = read_file(out_path);
+    res.stats = read_file(err_path);
+    fs::remove(out_path);
+    fs::remove(err_path);
+
+    if (WIFSIGNALED(status))
+        res.error = std::format("killed by signal {}", WTERMSIG(status));
+    else if (WEXITSTATUS(status) != 0)
+        res.error = std::format("exited with {}", WEXITSTATUS(status));
+    return res;
+}
+
+std::string last_line(std::string_view output) {
+    while (output.ends_with('\n'))
+        output.remove_suffix(1);
+    auto nl = output.rfind('\n');
+    return std::string(nl == std::string_view::npos ? output : output.substr(nl + 1));
+}
+
+/// Finds the number right after `prefix` in the output of `ywrk --stats`
+std::optional<double> stats_value(std::string_view stats, std::string_view prefix) {
+    auto pos = stats.find(prefix);
+    if (pos == std::string_view::npos)
+        return std::nullopt;
+    auto begin = stats.data() + pos + prefix.size();
+    double v;
+    auto [_, ec] = std::from_chars(begin, stats.data() + stats.size(), v);
+    if (ec != std::errc())
+        return std::nullopt;
+    return v;
+}
+
+std::string json_string(std::string_view str) {
+    std::string res = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\')
+            res += '\\';
+        if (static_cast<unsigned char>(c) < 0x20)
+            res += std::format("\\u{:04x}", c);
+        else
+            res += c;
+    }
+    res += '"';
+    return res;
+}
+
+int main(int argc, char** argv) {
+    Options opts;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg(argv[i]);
+        auto next_arg = [&]() -> std::string_view {
+            if (i + 1 >= argc) {
+                std::cerr << std::format("Missing value for {}\n", arg);
+                std::exit(2);
+            }
+            return argv[++i];
+        };
+
+        if (arg == "--ywrk"sv)
+            opts.ywrk = next_arg();
+        else if (arg == "--runs"sv)
+            opts.runs = std::max(1, std::stoi(std::string(next_arg())));
+        else if (arg == "--filter"sv)
+            opts.filter = next_arg();
+        else if (arg == "--corpus-mb"sv)
+            opts.corpus_mb = std::stoul(std::string(next_arg()));
+        else
+            opts.bench_dir = arg;
+    }
+    if (opts.ywrk.empty())
+        opts.ywrk = default_ywrk_path();
+    opts.ywrk = fs::absolute(opts.ywrk);
+
+    bool all_ok = true;
+    std::string json = std::format("{{\n  \"ywrk\": {},\n  \"runs\": {},\n  \"benchmarks\": [", json_string(opts.ywrk.string()), opts.runs);
+
+    auto benchmarks = find_benchmarks(opts);
+    for (size_t bi = 0; bi < benchmarks.size(); ++bi) {
+        auto& bench = benchmarks[bi];
+        std::cerr << std::format("{}: ", bench.name) << std::flush;
+
+        std::vector<RunResult> results;
+        std::string error;
+        for (int i = 0; i < opts.runs; ++i) {
+            auto res = run_once(opts, bench);
+            if (res.error.empty() && !bench.expected.empty() && last_line(res.output) != bench.expected)
+                res.error = std::format("expected {}, got {}", bench.expected, last_line(res.output));
+            if (!res.error.empty()) {
+                error = res.error;
+                break;
+            }
+            results.push_back(std::move(res));
+        }
+
+        json += bi == 0 ? "\n" : ",\n";
+        json += std::format("    {{ \"name\": {}", json_string(bench.name));
+
+        if (!error.empty()) {
+            all_ok = false;
+            std::cerr << std::format("FAILED, {}\n", error);
+            json += std::format(", \"error\": {} }}", json_string(error));
+            continue;
+        }
+
+        std::vector<double> times;
+        long peak_rss_kb = 0;
+        for (auto& r : results) {
+            times.push_back(r.wall_ms);
+            peak_rss_kb = std::max(peak_rss_kb, r.peak_rss_kb);
+        }
+        std::ranges::sort(times);
+        double median = times.size() % 2 ? times[times.size() / 2] : (times[times.size() / 2 - 1] + times[times.size() / 2]) / 2;
+
+        // Allocation counts are deterministic, take them from any run
+        auto& stats = results.back().stats;
+        auto heap_objects = stats_value(stats, "heap: "sv).value_or(0);
+        auto heap_bytes = stats_value(stats, " objects, "sv).value_or(0);
+
+        json += std::format(", \"median_ms\": {:.3f}, \"min_ms\": {:.3f}, \"max_ms\": {:.3f}, \"peak_rss_kb\": {}, \"heap_objects\": {:.0f}, \"heap_bytes\": {:.0f}",
+                            median, times.front(), times.back(), peak_rss_kb, heap_objects, heap_bytes);
+        if (auto mbps = stats_value(stats, " ms, "sv); mbps && bench.name == "parse-throughput")
+            json += std::format(", \"parse_mb_per_s\": {:.1f}", *mbps);
+        json += " }";
+
+        std::cerr << std::format("{:.1f} ms\n", median);
+    }
+
+    json += "\n  ]\n}\n";
+    std::cout << json;
+    return all_ok ? 0 : 1;
+}
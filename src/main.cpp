@@ -1,3 +1,10 @@
+#include <pthread.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 import std;
 import yawarakai;
 
@@ -11,6 +18,36 @@ namespace TaskType { constexpr int FILE = 0, LITERAL = 1; };
 struct ProgramOptions {
     std::vector<Task> tasks;
     bool parse_only = false;
+    /// Print each top-level form with its macros expanded instead of evaluating it, leaving out the macro definitions
+    bool expand_only = false;
+    /// Parse whole files on all cores before running them, instead of reading one form at a time
+    bool parallel_parse = false;
+    /// Load input files from their FASL cache when it's up to date, and refresh it otherwise
+    bool use_fasl = false;
+    /// Don't print the result of each top-level form
+    bool quiet = false;
+    /// Print timing and allocation statistics to stderr when done
+    bool stats = false;
+    /// If not empty, profile the run and write folded stacks here, along with a summary to stderr
+    fs::path profile_output;
+    /// Print the forms that allocated the most to stderr when done
+    bool alloc_profile = false;
+    /// If not empty, run the tasks and then keep serving eval requests on this socket until interrupted
+    fs::path serve_socket;
+    /// If not empty, send the tasks to the server on this socket instead of running them here
+    fs::path connect_socket;
+    /// As a client, have the server run the request in a fork of its environment, which none of its changes outlive
+    bool isolate = false;
+    /// Limits on evaluation, for the tasks as a whole and then for each request served (see arm_budget())
+    std::optional<uint64_t> max_steps;
+    std::optional<uint64_t> max_depth;
+    std::optional<uint64_t> max_heap;
+    std::optional<uint64_t> timeout_ms;
+};
+
+struct RunStats {
+    size_t parsed_bytes = 0;
+    std::chrono::steady_clock::duration parse_time{};
 };
 
 ProgramOptions parse_args(int argc, char** argv) {
@@ -22,9 +59,27 @@ ProgramOptions parse_args(int argc, char** argv) {
 
     bool positional_only = false;
     bool accept_str_input = false;
+    // Option that takes the next argument as its value
+    fs::path* accept_path = nullptr;
+    std::optional<uint64_t>* accept_number = nullptr;
     for (int i = 1; i < argc; ++i) {
         std::string_view arg(argv[i]);
 
+        if (accept_path) {
+            *std::exchange(accept_path, nullptr) = arg;
+            continue;
+        }
+        if (accept_number) {
+            uint64_t value;
+            auto [end, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), value);
+            if (ec != std::errc() || end != arg.data() + arg.size()) {
+                std::cerr << std::format("Expected a number for {}, found '{}'\n", argv[i - 1], arg);
+                std::exit(-1);
+            }
+            *std::exchange(accept_number, nullptr) = value;
+            continue;
+        }
+
         if (positional_only)
             goto handle_positional_arg;
 
@@ -32,6 +87,62 @@ ProgramOptions parse_args(int argc, char** argv) {
             res.parse_only = true;
             continue;
         }
+        if (arg == "--expand"sv) {
+            res.expand_only = true;
+            continue;
+        }
+        if (arg == "--parallel-parse"sv) {
+            res.parallel_parse = true;
+            continue;
+        }
+        if (arg == "--fasl"sv) {
+            res.use_fasl = true;
+            continue;
+        }
+        if (arg == "--quiet"sv || arg == "-q"sv) {
+            res.quiet = true;
+            continue;
+        }
+        if (arg == "--stats"sv) {
+            res.stats = true;
+            continue;
+        }
+        if (arg == "--profile"sv) {
+            accept_path = &res.profile_output;
+            continue;
+        }
+        if (arg == "--alloc-profile"sv) {
+            res.alloc_profile = true;
+            continue;
+        }
+        if (arg == "--serve"sv) {
+            accept_path = &res.serve_socket;
+            continue;
+        }
+        if (arg == "--connect"sv) {
+            accept_path = &res.connect_socket;
+            continue;
+        }
+        if (arg == "--isolate"sv) {
+            res.isolate = true;
+            continue;
+        }
+        if (arg == "--max-steps"sv) {
+            accept_number = &res.max_steps;
+            continue;
+        }
+        if (arg == "--max-depth"sv) {
+            accept_number = &res.max_depth;
+            continue;
+        }
+        if (arg == "--max-heap"sv) {
+            accept_number = &res.max_heap;
+            continue;
+        }
+        if (arg == "--timeout"sv) {
+            accept_number = &res.timeout_ms;
+            continue;
+        }
         if (arg == "--exec"sv || arg == "-e"sv) {
             accept_str_input = true;
             continue;
@@ -53,64 +164,680 @@ ProgramOptions parse_args(int argc, char** argv) {
     return res;
 }
 
-void run_buffer(std::string_view buffer, const ProgramOptions& opts, Environment& env) {
+/// Writes an error to stderr, in order with the results printed before it
+void report_error(std::string_view what, std::string_view msg, const std::optional<SourceLocation>& location, SexpPrinter& out) {
+    out.flush();
+    if (location)
+        std::cerr << std::format("{} at {}: {}\n", what, format_location(*location), msg);
+    else
+        std::cerr << std::format("{}: {}\n", what, msg);
+}
+
+/// Starts what `env` may evaluate from now on over, within the limits in `opts`.
+/// The heap limit is on what `env`'s heap grows by from now on, which counts allocations of anything else sharing that heap too.
+void arm_budget(const ProgramOptions& opts, Environment& env) {
+    auto& budget = env.budget;
+    budget.steps_left = opts.max_steps.value_or(ExecutionBudget::UNLIMITED_STEPS);
+    constexpr uint64_t max_depth_limit = std::numeric_limits<uint32_t>::max();
+    budget.max_depth = static_cast<uint32_t>(std::min(opts.max_depth.value_or(ExecutionBudget::DEFAULT_MAX_DEPTH), max_depth_limit));
+    budget.deadline = opts.timeout_ms ? std::chrono::steady_clock::now() + std::chrono::milliseconds(*opts.timeout_ms) : std::chrono::steady_clock::time_point::max();
+    // Don't carry on with steps drawn under the previous limits
+    env.fuel = 0;
+    if (opts.max_heap)
+        env.set_heap_limit(*opts.max_heap);
+}
+
+/// Lets the native stacks of the main thread and of threads started from now on grow deep enough for the call depth in `opts` (see ExecutionBudget::STACK_BYTES_PER_CALL), as coroutine stacks do.
+/// Must run before any other thread is started.
+void fit_stacks_to_depth(const ProgramOptions& opts) {
+    // Within reason, as for a coroutine's
+    constexpr uint64_t MAX_STACK_SIZE = 1024 * 1024 * 1024;
+    auto depth = opts.max_depth.value_or(ExecutionBudget::DEFAULT_MAX_DEPTH);
+    auto wanted = static_cast<rlim_t>(std::min(depth * ExecutionBudget::STACK_BYTES_PER_CALL, MAX_STACK_SIZE));
+
+    // The main thread's stack grows on demand, up to this
+    rlimit limit;
+    if (getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < wanted) {
+        limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? wanted : std::min(wanted, limit.rlim_max);
+        setrlimit(RLIMIT_STACK, &limit);
+    }
+
+    pthread_attr_t attr;
+    if (pthread_getattr_default_np(&attr) == 0) {
+        size_t size;
+        if (pthread_attr_getstacksize(&attr, &size) == 0 && size < wanted) {
+            pthread_attr_setstacksize(&attr, wanted);
+            pthread_setattr_default_np(&attr);
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+void run_sexp(Sexp sexp, const ProgramOptions& opts, SexpPrinter& out, Environment& env) {
+    try {
+        std::optional<Sexp> res;
+        if (opts.parse_only)
+            res = sexp;
+        else if (opts.expand_only)
+            res = expand_top_level(sexp, env);
+        else
+            res = eval(sexp, env);
+
+        if (res && !opts.quiet) {
+            out.print(*res);
+            out.write('\n');
+        }
+    } catch (const EvalException& e) {
+        report_error("Eval exception", error_message(e, env), e.location, out);
+    } catch (const std::runtime_error& e) {
+        out.flush();
+        std::cerr << "Internal error: " << e.what() << '\n';
+    }
+}
+
+void run_program(Sexp program, const ProgramOptions& opts, SexpPrinter& out, Environment& env) {
+    for (auto& sexp : iterate(program, env)) {
+        run_sexp(sexp, opts, out, env);
+    }
+}
+
+/// If `borrow_source` is true, `buffer` outlives `env` and may be pointed into by what's parsed out of it
+void run_buffer(std::string_view buffer, bool borrow_source, SourceFileId file, const ProgramOptions& opts, SexpPrinter& out, RunStats& stats, Environment& env) {
     Sexp program;
     try {
-        program = parse_sexp(buffer, env);
+        auto begin = std::chrono::steady_clock::now();
+        program = opts.parallel_parse ? parse_sexp_parallel(buffer, env, borrow_source, file) : parse_sexp(buffer, env, borrow_source, file);
+        stats.parse_time += std::chrono::steady_clock::now() - begin;
+        stats.parsed_bytes += buffer.size();
     } catch (const ParseException& e) {
-        std::cerr << "Parsing exception: " << e.msg << '\n';
+        report_error("Parsing exception", e.msg, e.location, out);
         return;
     }
 
-    for (auto& sexp : iterate(program, env)) {
+    run_program(program, opts, out, env);
+}
+
+/// Runs the source file at `path`, mapped as `source` in Environment::source_files, out of its FASL cache.
+/// If the cache is missing or stale, parses `source` and writes a fresh one.
+/// Returns false without running anything if `source` doesn't parse, so that the caller can fall back to reading it form by form.
+bool run_cached_file(const fs::path& path, std::string_view source, SourceFileId file, const ProgramOptions& opts, SexpPrinter& out, RunStats& stats, Environment& env) {
+    auto begin = std::chrono::steady_clock::now();
+    auto source_hash = fasl_source_hash(source);
+    auto cache_path = fasl_path_for(path);
+
+    std::optional<Sexp> program;
+    if (auto image = MappedFile::open(cache_path)) {
+        program = read_fasl(image->contents(), source_hash, file, env);
+        if (program)
+            env.source_files.push_back(std::move(*image));
+    }
+
+    if (!program) {
+        try {
+            program = opts.parallel_parse ? parse_sexp_parallel(source, env, true, file) : parse_sexp(source, env, true, file);
+        } catch (const ParseException&) {
+            return false;
+        }
+        // The cache is only an optimization, e.g. the directory may well be read-only
+        save_fasl(cache_path, write_fasl(*program, source_hash, env));
+    }
+
+    stats.parse_time += std::chrono::steady_clock::now() - begin;
+    stats.parsed_bytes += source.size();
+
+    run_program(*program, opts, out, env);
+    return true;
+}
+
+/// Parses and runs one top-level form at a time, so the input never has to fit in memory as a whole
+/// If `interactive`, each result is written out before waiting for the next form.
+void run_reader(SexpReader& reader, bool interactive, const ProgramOptions& opts, SexpPrinter& out, RunStats& stats, Environment& env) {
+    while (true) {
+        if (interactive)
+            out.flush();
+
+        Sexp sexp;
+        bool has_more;
+        auto begin = std::chrono::steady_clock::now();
         try {
-            if (opts.parse_only) {
-                std::cout << dump_sexp(sexp, env) << std::endl;
-            } else {
-                auto res = eval(sexp, env);
-                std::cout << dump_sexp(res, env) << std::endl;
+            has_more = reader.next(sexp);
+        } catch (const ParseException& e) {
+            stats.parse_time += std::chrono::steady_clock::now() - begin;
+            report_error("Parsing exception", e.msg, e.location, out);
+            continue;
+        }
+        stats.parse_time += std::chrono::steady_clock::now() - begin;
+        if (!has_more)
+            break;
+
+        run_sexp(sexp, opts, out, env);
+    }
+    stats.parsed_bytes += reader.bytes_consumed();
+}
+
+/******** Eval server ********/
+
+// A request is a connection on which the client sends an OPTIONS frame, then a SOURCE frame ("name\0text") for each thing to run, and shuts down its side.
+// The server answers with STDOUT and STDERR frames as results come in, and a DONE frame once everything has run.
+// Every frame is a type byte, a little-endian u32 payload size and the payload.
+namespace FrameType { constexpr char OPTIONS = 'O', SOURCE = 'S', STDOUT = 'o', STDERR = 'e', DONE = 'x'; };
+/// Larger frames are refused, the size comes from the other end and isn't to be trusted with an allocation
+constexpr size_t MAX_FRAME_SIZE = 64 * 1024 * 1024;
+
+struct Frame {
+    char type;
+    std::string payload;
+};
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        // Not SIGPIPE if the other end is gone, just an error
+        auto n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, char* data, size_t size) {
+    while (size > 0) {
+        auto n = recv(fd, data, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool write_frame(int fd, char type, std::string_view payload) {
+    if (payload.size() > MAX_FRAME_SIZE)
+        return false;
+    auto size = static_cast<uint32_t>(payload.size());
+    char header[5] = { type, static_cast<char>(size), static_cast<char>(size >> 8), static_cast<char>(size >> 16), static_cast<char>(size >> 24) };
+    return write_all(fd, header, sizeof(header)) && write_all(fd, payload.data(), payload.size());
+}
+
+/// Why read_frame() returned nullopt
+enum class FrameEnd {
+    /// The other end is done sending, after a whole frame
+    CLOSED,
+    /// It went away or timed out (see SO_RCVTIMEO) partway through a frame, or reading failed otherwise
+    BROKEN,
+    /// The frame is larger than MAX_FRAME_SIZE
+    TOO_LARGE,
+};
+
+/// Returns nullopt once the other end is done sending, or on errors, telling which in `end` if given.
+std::optional<Frame> read_frame(int fd, FrameEnd* end = nullptr) {
+    auto fail = [&](FrameEnd why) -> std::optional<Frame> {
+        if (end)
+            *end = why;
+        return std::nullopt;
+    };
+
+    unsigned char header[5];
+    // Reading the first byte on its own tells a shutdown between frames from one in the middle of a frame
+    ssize_t n;
+    do {
+        n = recv(fd, header, 1, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n == 0)
+        return fail(FrameEnd::CLOSED);
+    if (n < 0 || !read_all(fd, reinterpret_cast<char*>(header) + 1, sizeof(header) - 1))
+        return fail(FrameEnd::BROKEN);
+
+    uint32_t size = header[1] | header[2] << 8 | header[3] << 16 | static_cast<uint32_t>(header[4]) << 24;
+    if (size > MAX_FRAME_SIZE)
+        return fail(FrameEnd::TOO_LARGE);
+
+    Frame frame{ static_cast<char>(header[0]), {} };
+    frame.payload.resize(size);
+    if (!read_all(fd, frame.payload.data(), frame.payload.size()))
+        return fail(FrameEnd::BROKEN);
+    return frame;
+}
+
+std::optional<sockaddr_un> make_socket_address(const fs::path& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    auto& str = path.native();
+    // Room for the terminating null
+    if (str.size() >= sizeof(addr.sun_path)) {
+        std::cerr << std::format("Socket path too long: {}\n", str);
+        return std::nullopt;
+    }
+    std::ranges::copy(str, addr.sun_path);
+    return addr;
+}
+
+int connect_to(const sockaddr_un& addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+/// Sends whatever is written to it to the client, as frames of one type
+class FrameStreamBuf : public std::streambuf {
+private:
+    int _fd;
+    char _type;
+    /// Set once a write fails, i.e. the client has gone away; the rest of the output is dropped
+    bool _broken = false;
+    std::array<char, 4096> _buffer;
+
+public:
+    FrameStreamBuf(int fd, char type)
+        : _fd{ fd }
+        , _type{ type } //
+    {
+        setp(_buffer.data(), _buffer.data() + _buffer.size());
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        send_buffered();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override {
+        send_buffered();
+        return 0;
+    }
+
+private:
+    void send_buffered() {
+        if (pptr() > pbase() && !_broken)
+            _broken = !write_frame(_fd, _type, std::string_view(pbase(), pptr()));
+        setp(_buffer.data(), _buffer.data() + _buffer.size());
+    }
+};
+
+/// Points a standard stream somewhere else for as long as it lives
+class StreamRedirect {
+private:
+    std::ostream& _stream;
+    std::streambuf* _prev;
+
+public:
+    StreamRedirect(std::ostream& stream, std::streambuf& buf)
+        : _stream{ stream }
+        , _prev{ stream.rdbuf(&buf) } {}
+
+    StreamRedirect(const StreamRedirect&) = delete;
+    StreamRedirect& operator=(const StreamRedirect&) = delete;
+
+    ~StreamRedirect() {
+        _stream.flush();
+        _stream.rdbuf(_prev);
+    }
+};
+
+volatile std::sig_atomic_t g_stop_serving = 0;
+/// Interrupted along with stopping, so that a request that's still running doesn't hold up the server's exit
+ExecutionBudget* g_serving_budget = nullptr;
+
+/// `request_files` are the source file ids of earlier requests, the n-th source of each request reuses the n-th of them
+void handle_request(int fd, const ProgramOptions& server_opts, RunStats& stats, std::vector<SourceFileId>& request_files, Environment& env) {
+    // A client that never finishes its request, or stops reading the results, would hold up everyone queued behind it
+    timeval timeout{ .tv_sec = 10, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // The server's own -q is for its tasks, the client says whether it wants results
+    auto opts = server_opts;
+    opts.tasks.clear();
+    opts.quiet = false;
+    bool isolate = false;
+    std::vector<std::pair<std::string, std::string>> sources;
+    FrameEnd end;
+    while (auto frame = read_frame(fd, &end)) {
+        switch (frame->type) {
+            case FrameType::OPTIONS: {
+                for (auto word : std::views::split(std::string_view(frame->payload), ' ')) {
+                    auto sv = std::string_view(word);
+                    if (sv == "quiet"sv)
+                        opts.quiet = true;
+                    else if (sv == "isolate"sv)
+                        isolate = true;
+                }
+            } break;
+
+            case FrameType::SOURCE: {
+                auto nul = frame->payload.find('\0');
+                if (nul == std::string::npos)
+                    return;
+                sources.emplace_back(frame->payload.substr(0, nul), frame->payload.substr(nul + 1));
+            } break;
+
+            default:
+                return;
+        }
+    }
+
+    // Only a request that was sent in full is run, not whatever part of it came in before the client stalled or went away
+    if (end != FrameEnd::CLOSED) {
+        if (end == FrameEnd::TOO_LARGE)
+            write_frame(fd, FrameType::STDERR, std::format("Request refused: frames are limited to {} bytes\n", MAX_FRAME_SIZE));
+        else
+            write_frame(fd, FrameType::STDERR, "Request refused: it was cut off partway through a frame\n"sv);
+        write_frame(fd, FrameType::DONE, {});
+        return;
+    }
+
+    // In the server's own map, so that a fork sees them as well
+    for (size_t i = 0; i < sources.size(); ++i) {
+        if (i < request_files.size())
+            env.source_map.rename_file(request_files[i], std::move(sources[i].first));
+        else
+            request_files.push_back(env.source_map.add_file(std::move(sources[i].first)));
+    }
+
+    FrameStreamBuf out_buf(fd, FrameType::STDOUT);
+    FrameStreamBuf err_buf(fd, FrameType::STDERR);
+    {
+        StreamRedirect redirect_out(std::cout, out_buf);
+        StreamRedirect redirect_err(std::cerr, err_buf);
+        // Isolated requests get a fork of the environment, and with it a heap of their own that is freed afterwards.
+        // The others define things in a scope that goes away with the request, but can set! globals for good.
+        std::unique_ptr<Environment> forked;
+        if (isolate)
+            forked = env.fork();
+        auto& req_env = forked ? *forked : env;
+        arm_budget(opts, req_env);
+
+        SexpPrinter out(std::cout, req_env);
+        try {
+            if (!forked) {
+                auto [scope, _] = env.heap.allocate<Scope>();
+                scope->prev = HeapPtr(env.global_scope);
+                env.curr_scope = scope;
+            }
+
+            for (size_t i = 0; i < sources.size(); ++i) {
+                std::istringstream iss(std::move(sources[i].second));
+                SexpReader reader(iss, req_env, request_files[i]);
+                // Interactive, so each result is sent as soon as it's there
+                run_reader(reader, true, opts, out, stats, req_env);
             }
         } catch (const EvalException& e) {
-            std::cerr << "Eval exception: " << e.msg << std::endl;
-        } catch (const std::runtime_error& e) {
-            std::cerr << "Internal error: " << e.what() << std::endl;
+            // Reading allocates too, and can run out of heap (see --max-heap)
+            report_error("Eval exception", error_message(e, req_env), e.location, out);
         }
+        out.flush();
+
+        env.curr_scope = env.global_scope;
     }
+
+    write_frame(fd, FrameType::DONE, {});
 }
 
-int main(int argc, char** argv) {
-    auto opts = parse_args(argc, argv);
+/// Keeps `env` around and runs requests in it one at a time, until SIGINT or SIGTERM
+int serve(const fs::path& socket_path, const ProgramOptions& opts, RunStats& stats, Environment& env) {
+    auto addr = make_socket_address(socket_path);
+    if (!addr)
+        return -1;
 
-    Environment env;
+    // Take over from a server that went away without cleaning up, but not from one that is still there
+    std::error_code ec;
+    if (fs::is_socket(socket_path, ec)) {
+        if (int fd = connect_to(*addr); fd >= 0) {
+            close(fd);
+            std::cerr << std::format("Another server is already listening on {}\n", socket_path.string());
+            return -1;
+        }
+        fs::remove(socket_path, ec);
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<const sockaddr*>(&*addr), sizeof(*addr)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        std::cerr << std::format("Unable to listen on {}: {}\n", socket_path.string(), std::strerror(errno));
+        if (listen_fd >= 0)
+            close(listen_fd);
+        return -1;
+    }
+
+    // No SA_RESTART, so that accept() returns to check the flag
+    struct sigaction action{};
+    g_serving_budget = &env.budget;
+    action.sa_handler = [](int) {
+        g_stop_serving = 1;
+        g_serving_budget->interrupted.store(true, std::memory_order_relaxed);
+    };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    int exit_code = 0;
+    std::vector<SourceFileId> request_files;
+    while (!g_stop_serving) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            // A client that gave up while queued, or a signal, that may be the one to stop on
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            // Out of descriptors or memory, which retrying right away won't change
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                std::this_thread::sleep_for(100ms);
+                continue;
+            }
+            std::cerr << std::format("Unable to accept connections on {}: {}\n", socket_path.string(), std::strerror(errno));
+            exit_code = -1;
+            break;
+        }
+        handle_request(fd, opts, stats, request_files, env);
+        close(fd);
+    }
+
+    close(listen_fd);
+    fs::remove(socket_path, ec);
+    return exit_code;
+}
+
+/// Sends the tasks to a server and writes out what comes back, without setting up an environment of our own
+int run_on_server(const ProgramOptions& opts) {
+    std::vector<std::pair<std::string, std::string>> sources;
     for (auto& task : opts.tasks) {
         switch (task.index()) {
             case TaskType::FILE: {
                 auto& input_file = *std::get_if<TaskType::FILE>(&task);
-
-                if (input_file.empty()) {
-                    std::cerr << "Supply an input file to run it.\n";
-                    return -1;
+                if (input_file == "-") {
+                    sources.emplace_back("<stdin>", std::string(std::istreambuf_iterator<char>(std::cin), {}));
+                    break;
                 }
 
-                std::ifstream ifs(input_file);
-                if (!ifs) {
+                std::ifstream ifs(input_file, std::ios::binary);
+                if (input_file.empty() || !ifs) {
                     std::cerr << "Unable to open input file.\n";
                     return -1;
                 }
-
-                std::stringstream buffer;
-                buffer << ifs.rdbuf();
-
-                run_buffer(buffer.view(), opts, env);
+                sources.emplace_back(input_file.string(), std::string(std::istreambuf_iterator<char>(ifs), {}));
             } break;
 
             case TaskType::LITERAL: {
-                auto& input = *std::get_if<TaskType::LITERAL>(&task);
-
-                run_buffer(input, opts, env);
+                sources.emplace_back("<command line>", *std::get_if<TaskType::LITERAL>(&task));
             } break;
         }
     }
 
-    return 0;
+    auto addr = make_socket_address(opts.connect_socket);
+    if (!addr)
+        return -1;
+    int fd = connect_to(*addr);
+    if (fd < 0) {
+        std::cerr << std::format("Unable to connect to {}: {}\n", opts.connect_socket.string(), std::strerror(errno));
+        return -1;
+    }
+
+    std::string options;
+    if (opts.quiet)
+        options += "quiet ";
+    if (opts.isolate)
+        options += "isolate ";
+    for (auto& [name, text] : sources) {
+        // Name, null and text
+        if (name.size() + 1 + text.size() > MAX_FRAME_SIZE) {
+            std::cerr << std::format("{} is too large to send, the limit is {} bytes\n", name, MAX_FRAME_SIZE);
+            close(fd);
+            return -1;
+        }
+    }
+
+    bool sent = write_frame(fd, FrameType::OPTIONS, options);
+    for (auto& [name, text] : sources) {
+        if (!sent)
+            break;
+        sent = write_frame(fd, FrameType::SOURCE, std::format("{}{}{}", name, '\0', text));
+    }
+    shutdown(fd, SHUT_WR);
+
+    // Even if not everything could be sent, the server may have said why
+    while (auto frame = read_frame(fd)) {
+        switch (frame->type) {
+            case FrameType::STDOUT: std::cout.write(frame->payload.data(), frame->payload.size()).flush(); break;
+            case FrameType::STDERR: std::cerr.write(frame->payload.data(), frame->payload.size()); break;
+            case FrameType::DONE: close(fd); return 0;
+        }
+    }
+
+    close(fd);
+    std::cerr << "Connection to server lost.\n";
+    return -1;
+}
+
+int main(int argc, char** argv) {
+    auto opts = parse_args(argc, argv);
+
+    if (!opts.connect_socket.empty())
+        return run_on_server(opts);
+    fit_stacks_to_depth(opts);
+
+    Environment env;
+    SexpPrinter out(std::cout, env);
+    RunStats stats;
+    // Nothing gets evaluated with --parse-only, so recording positions for error messages and profiles would be wasted
+    env.source_map.set_enabled(!opts.parse_only);
+    arm_budget(opts, env);
+
+    std::optional<Profiler> profiler;
+    if (!opts.profile_output.empty())
+        profiler.emplace();
+    std::optional<AllocationProfiler> alloc_profiler;
+    if (opts.alloc_profile)
+        alloc_profiler.emplace();
+
+    for (auto& task : opts.tasks) {
+        try {
+            switch (task.index()) {
+                case TaskType::FILE: {
+                    auto& input_file = *std::get_if<TaskType::FILE>(&task);
+
+                    if (input_file.empty()) {
+                        out.flush();
+                        std::cerr << "Supply an input file to run it.\n";
+                        return -1;
+                    }
+
+                    if (input_file == "-") {
+                        SexpReader reader(std::cin, env, env.source_map.add_file("<stdin>"), true);
+                        run_reader(reader, true, opts, out, stats, env);
+                        break;
+                    }
+
+                    auto file = env.source_map.add_file(input_file.string());
+
+                    // Parse regular files in place, symbols and strings can then point right into the mapping
+                    if (auto mapped = MappedFile::open(input_file)) {
+                        auto source = mapped->contents();
+                        env.source_files.push_back(std::move(*mapped));
+
+                        if (opts.use_fasl && run_cached_file(input_file, source, file, opts, out, stats, env))
+                            break;
+
+                        if (opts.parallel_parse) {
+                            run_buffer(source, true, file, opts, out, stats, env);
+                            break;
+                        }
+
+                        SexpReader reader(source, env, file);
+                        run_reader(reader, false, opts, out, stats, env);
+                        break;
+                    }
+
+                    // Something that can't be mapped, e.g. a named pipe
+                    std::ifstream ifs(input_file, std::ios::binary);
+                    if (!ifs) {
+                        out.flush();
+                        std::cerr << "Unable to open input file.\n";
+                        return -1;
+                    }
+
+                    SexpReader reader(ifs, env, file);
+                    run_reader(reader, false, opts, out, stats, env);
+                } break;
+
+                case TaskType::LITERAL: {
+                    auto& input = *std::get_if<TaskType::LITERAL>(&task);
+
+                    run_buffer(input, false, env.source_map.add_file("<command line>"), opts, out, stats, env);
+                } break;
+            }
+        } catch (const EvalException& e) {
+            // Reading allocates too, and can run out of heap (see --max-heap)
+            report_error("Eval exception", error_message(e, env), e.location, out);
+        }
+    }
+
+    out.flush();
+
+    int exit_code = 0;
+    if (!opts.serve_socket.empty())
+        exit_code = serve(opts.serve_socket, opts, stats, env);
+
+    if (profiler) {
+        profiler->stop();
+        std::ofstream ofs(opts.profile_output);
+        if (ofs)
+            profiler->write_folded(ofs);
+        else
+            std::cerr << std::format("Unable to write profile to {}\n", opts.profile_output.string());
+        profiler->write_summary(std::cerr);
+    }
+
+    if (alloc_profiler) {
+        alloc_profiler->stop();
+        alloc_profiler->write_summary(std::cerr, env);
+    }
+
+    if (opts.stats) {
+        using namespace std::chrono;
+        auto secs = duration_cast<duration<double>>(stats.parse_time).count();
+        auto mb = static_cast<double>(stats.parsed_bytes) / (1024 * 1024);
+        std::cerr << std::format("parse: {} bytes in {:.3f} ms, {:.1f} MB/s\n", stats.parsed_bytes, secs * 1000, secs > 0 ? mb / secs : 0.0);
+
+        auto heap_stats = env.heap.stats();
+        std::cerr << std::format("heap: {} objects, {} bytes in {} segments\n", heap_stats.objects, heap_stats.bytes, heap_stats.segments);
+        auto constant_stats = env.constants.stats();
+        std::cerr << std::format("constants: {} objects, {} bytes\n", constant_stats.objects, constant_stats.bytes);
+    }
+
+    return exit_code;
 }
@@ -0,0 +1,59 @@
+module;
+#include <cassert>
+
+export module yawarakai:async;
+import :lisp;
+import :memory;
+import std;
+
+namespace yawarakai {
+
+/// A green thread, see async.cpp
+struct Coroutine;
+
+/// Drops the coroutines of this thread that run in `env`, which is going away, without finishing what they were in the middle of.
+/// Only forks go away while their tasks may still be running, see Environment::fork().
+void abandon_coroutines(Environment& env);
+
+/// An input source that can be read without blocking the whole interpreter: a file, or the stdout of a subprocess
+export struct Port {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_PORT;
+
+    int fd = -1;
+    /// pid of the subprocess if this is a pipe port, otherwise 0
+    int pid = 0;
+    bool eof = false;
+    /// Bytes read from `fd` but not yet consumed
+    std::string buffer;
+
+    Port() = default;
+    Port(const Port&) = delete;
+    Port& operator=(const Port&) = delete;
+    /// Closes what (close-port) didn't, for a port that goes away with its heap (see Heap::destroy_objects()), e.g. a fork's
+    ~Port();
+};
+
+/// An unbounded FIFO queue for passing values between tasks
+export struct Channel {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_CHANNEL;
+
+    std::deque<Sexp> values;
+    /// Coroutines suspended in (channel-receive) on this channel, oldest first
+    std::deque<Coroutine*> receivers;
+};
+
+/// Handle to a coroutine created by (spawn), kept alive after it finishes to hold its outcome
+export struct TaskHandle {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_TASK;
+
+    bool finished = false;
+    Sexp result;
+    /// If not empty, the task died with this error
+    std::string error;
+    /// If the task died of a raise nothing caught, what was raised, to be raised again by (join)
+    std::optional<Sexp> raised;
+    /// Coroutines suspended in (join) on this task
+    std::vector<Coroutine*> joiners;
+};
+
+} // namespace yawarakai
@@ -0,0 +1,67 @@
+export module yawarakai:fasl;
+import :lisp;
+import std;
+
+export namespace yawarakai {
+
+/// Layout of a FASL ("fast load") image, a parsed program stored in binary so it can be loaded back without going through the reader.
+/// All sections are 8-byte aligned, in this order:
+///   - FaslHeader
+///   - uint32_t symbol_lengths[symbol_count]
+///   - uint32_t string_lengths[string_count]
+///   - uint64_t nodes[node_words], the cons cells, see fasl.cpp
+///   - FaslPosition positions[position_count]
+///   - the names of all symbols back to back, then the contents of all strings back to back
+struct FaslHeader {
+    static constexpr std::array<char, 8> MAGIC{ 'Y', 'W', 'F', 'A', 'S', 'L', '\0', '\0' };
+    static constexpr uint32_t VERSION = 3;
+    /// Written in native byte order, so that an image from a machine with a different one is rejected
+    static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+    /// `positions` was filled in, i.e. the source map was enabled when it was written
+    static constexpr uint32_t FLAG_HAS_POSITIONS = 1 << 0;
+
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t byte_order_mark;
+    /// fasl_source_hash() of the source this was produced from
+    uint64_t source_hash;
+    /// Encoded Sexp of the whole program
+    uint64_t root;
+    uint32_t symbol_count;
+    uint32_t string_count;
+    /// Number of cons cells
+    uint64_t cell_count;
+    uint64_t node_words;
+    uint64_t symbol_bytes;
+    uint64_t string_bytes;
+    uint32_t position_count;
+    uint32_t flags;
+};
+
+/// Where the cell at `cell_index` in the image was parsed from, for Environment::source_map
+struct FaslPosition {
+    uint32_t cell_index;
+    uint32_t line;
+    uint32_t column;
+};
+
+/// Hash of a source file's contents that its FASL image is keyed by
+uint64_t fasl_source_hash(std::string_view source);
+
+/// Where the FASL image for the source file at `source_path` is cached, next to it
+std::filesystem::path fasl_path_for(const std::filesystem::path& source_path);
+
+/// Serializes `program`, a list of top-level forms as produced by parse_sexp(), into a FASL image.
+/// Only what the reader can produce is supported: cons cells, strings, symbols and immediates.
+std::string write_fasl(Sexp program, uint64_t source_hash, Environment& env);
+
+/// Rebuilds the program stored in `image`, with its quoted data as constants and the positions of its conses recorded as being in `file`, same as parsing it would.
+/// Returns nullopt if `image` is malformed, or isn't the image of a source with `source_hash`, or has no positions while the source map is enabled.
+/// Symbols and strings point into `image`, so it must outlive `env` (e.g. by being in Environment::source_files).
+std::optional<Sexp> read_fasl(std::string_view image, uint64_t source_hash, SourceFileId file, Environment& env);
+
+/// Replaces the file at `path` with `image` atomically, so that readers never see a partial image.
+/// Returns false if it couldn't be written, e.g. the directory is read-only.
+bool save_fasl(const std::filesystem::path& path, std::string_view image);
+
+} // namespace yawarakai
@@ -8,21 +8,40 @@ import :util;
 import std;
 
 namespace yawarakai {
-export struct ParseException {
-    std::string msg;
+/// Where something is in a source file, for pointing errors and profiles at it
+export struct SourceLocation {
+    /// Empty if the source isn't a named file
+    std::string_view file;
+    /// Both 1-based
+    uint32_t line;
+    uint32_t column;
 };
 
-export struct EvalException {
+export struct ParseException {
     std::string msg;
+    /// Where parsing stopped
+    std::optional<SourceLocation> location;
 };
 
+/// "file:line:column", leaving out the file if there isn't one
+export std::string format_location(const SourceLocation& loc);
+
+/// Dense, sequential index of a symbol in its SymbolPool, starting from 0.
+/// Tables with an entry per symbol can therefore be plain arrays indexed by this.
+export enum class SymbolId : uint32_t {};
+
 export class SymbolPool;
 export class Symbol {
 private:
     friend class SymbolPool;
 
-    uintptr_t _data = 0;
+    /// Set in `_size` if `_data` is borrowed (a string literal, or a source file that outlives the pool) instead of owned by us
+    // NOTE: this can't be kept in the low bit of `_data`, a name borrowed from source text may start at any address
+    static constexpr size_t BORROWED_FLAG = size_t(1) << (sizeof(size_t) * 8 - 1);
+
+    const char* _data = nullptr;
     size_t _size = 0;
+    SymbolId _id{};
 
 public:
     /// Constructs an empty symbol
@@ -32,86 +51,123 @@ public:
     Symbol& operator=(const Symbol&) = delete;
 
     Symbol(Symbol&& s) noexcept
-        : _data{ s._data }
-        , _size{ s._size } //
-    {
-        s._data = 0;
-        s._size = 0;
-    }
+        : _data{ std::exchange(s._data, nullptr) }
+        , _size{ std::exchange(s._size, 0) }
+        , _id{ s._id } {}
 
     Symbol& operator=(Symbol&& s) noexcept {
-        if ((_data & 0x1) == 0) {
-            delete data();
-        }
-        this->_data = std::exchange(s._data, 0);
+        release();
+        this->_data = std::exchange(s._data, nullptr);
         this->_size = std::exchange(s._size, 0);
+        this->_id = s._id;
         return *this;
     }
 
     ~Symbol() {
-        // NOTE: for _data == nullptr, delete is no-op, so considering that as heap-allocated is fine
-        if ((_data & 0x1) == 0) {
-            delete data();
-        }
+        release();
     }
 
-    const char* data() const { return std::bit_cast<const char*>(_data & ~0x1); }
-    size_t size() const { return _size; }
+    SymbolId id() const { return _id; }
+
+    const char* data() const { return _data; }
+    size_t size() const { return _size & ~BORROWED_FLAG; }
+    bool is_borrowed() const { return _size & BORROWED_FLAG; }
 
     operator std::string_view() const { return { data(), size() }; }
 
-    bool empty() const { return _size == 0; }
+    bool empty() const { return size() == 0; }
+
+private:
+    void release() {
+        // NOTE: for _data == nullptr, delete is no-op, so considering that as owned is fine
+        if (!is_borrowed()) {
+            delete[] _data;
+        }
+    }
 };
 
+/// Interns symbol names, handing out a Symbol with a unique SymbolId for each distinct name.
+/// Symbols are never removed, and references to them stay valid for the lifetime of the pool.
+/// Safe to use from multiple threads at once: lookups of existing symbols are lock-free, and only adding a new one takes a lock.
 export class SymbolPool {
 private:
-    // TODO custom hashtable
-    std::unordered_map<std::string, Symbol, StringHash, std::equal_to<>> _pool;
+    /// Linear probing table with a power of two size, kept at most half full
+    struct Table {
+        size_t mask;
+        /// Each slot holds (low 32 bits of the name's hash) << 32 | (SymbolId + 1), or 0 if empty
+        std::unique_ptr<std::atomic<uint64_t>[]> slots;
+    };
+
+    /// Symbols are stored in segments of doubling size, so they never move and can be read while new ones are being added.
+    /// Segment k holds FIRST_SEGMENT_SIZE << k symbols.
+    static constexpr size_t FIRST_SEGMENT_SIZE = 1024;
+    // Enough for every 32-bit SymbolId
+    static constexpr size_t MAX_SEGMENTS = 23;
+    std::array<std::atomic<Symbol*>, MAX_SEGMENTS> _segments{};
+    std::atomic<uint32_t> _size = 0;
+
+    std::atomic<Table*> _table;
+    /// Every table ever used, since a reader might still be probing an old one after it has been replaced
+    std::vector<std::unique_ptr<Table>> _tables;
+    /// Held while adding a symbol
+    std::mutex _insert_mutex;
 
 public:
+    SymbolPool();
+    ~SymbolPool();
+
+    SymbolPool(const SymbolPool&) = delete;
+    SymbolPool& operator=(const SymbolPool&) = delete;
+
     // Constructor for string literals
     // This *technically* also accepts things like `const char arr[5];` - just don't do it
     template <size_t N>
     const Symbol& intern(const char (&str)[N]) {
         // Length of the char array from a literal contains the null terminator
-        size_t actual_len = N - 1;
-        auto& sym = _pool[std::string(str, actual_len)];
-        // If this Symbol is default constructed, i.e. this is a new entry in the symbol pool
-        if (sym.data() == nullptr) {
-            // `str` is of type const char[N], we need a pointer for std::bit_cast
-            const char* str_ptr = str;
-
-            // Sanity check: the pointer is not using the lowest bit
-            assert((std::bit_cast<uintptr_t>(str_ptr) & 0x1) == 0);
-
-            // Set lowest bit, indicating this is a literal
-            sym._data = std::bit_cast<uintptr_t>(str_ptr) | 0x1;
-            sym._size = actual_len;
-        }
-        return sym;
+        return intern_borrowed(std::string_view(str, N - 1));
     }
 
     // Constructor for runtime strings (make a copy)
     const Symbol& intern(const char* str, size_t len) {
-        auto& sym = _pool[std::string(str, len)];
-        if (sym.data() == nullptr) {
-            char* data = new char[len + 1]{};
-            sym._size = len;
-            sym._data = std::bit_cast<uintptr_t>(data);
-            // Sanity check: the pointer is not using the lowest bit
-            assert((std::bit_cast<uintptr_t>(data) & 0x1) == 0);
-            // Copy string content
-            std::memcpy(data, str, len);
-            // Null terminate
-            data[len] = 0;
-        }
-        return sym;
+        return intern_impl(std::string_view(str, len), false);
     }
 
     // Constructor for runtime strings (make a copy)
     const Symbol& intern(std::string_view str) {
-        return intern(str.data(), str.size());
+        return intern_impl(str, false);
+    }
+
+    /// Interns `str` without copying it, if it's not in the pool already.
+    /// The caller guarantees that the bytes stay alive and unchanged for as long as this pool, e.g. because they are part of a string literal or a mapped source file.
+    /// N.B. such a name is not null terminated.
+    const Symbol& intern_borrowed(std::string_view str) {
+        return intern_impl(str, true);
+    }
+
+    /// Returns the symbol named `str` if it has been interned, without interning it otherwise
+    const Symbol* find(std::string_view str) const;
+
+    const Symbol& get(SymbolId id) const {
+        auto [segment, offset] = locate(std::to_underlying(id));
+        return _segments[segment].load(std::memory_order_acquire)[offset];
     }
+
+    /// Number of symbols interned, i.e. one past the largest SymbolId handed out so far
+    size_t size() const { return _size.load(std::memory_order_acquire); }
+
+private:
+    /// Maps a SymbolId to its segment, and the index inside of it
+    static std::pair<size_t, size_t> locate(uint32_t idx) {
+        size_t q = idx / FIRST_SEGMENT_SIZE + 1;
+        size_t segment = std::bit_width(q) - 1;
+        size_t offset = idx - FIRST_SEGMENT_SIZE * ((size_t(1) << segment) - 1);
+        return { segment, offset };
+    }
+
+    const Symbol& intern_impl(std::string_view str, bool borrow);
+    /// Returns the index of the slot holding `str`, or the empty slot it would go in
+    size_t probe(const Table& table, std::string_view str, size_t hash) const;
+    Table& grow(const Table& old_table);
 };
 
 // All heap objects are 8-byte aligned
@@ -137,6 +193,9 @@ export constexpr unsigned int SCVAL_FLAG_PTR = 0b001;
 // All address bits are 0 and flag == SCVAL_MASK_PTR
 export constexpr uintptr_t SCVAL_NIL = 0x0000'0000'0000'0000 | SCVAL_FLAG_PTR;
 
+// Never produced as a value, marks empty slots in tables of Sexp (e.g. unbound symbols in Scope::dense_bindings)
+export constexpr uintptr_t SCVAL_UNBOUND = 0x0000'0000'0000'0020 | SCVAL_FLAG_BOOL;
+
 export struct Sexp {
     uintptr_t _value;
 
@@ -210,17 +269,16 @@ export struct Sexp {
 
     constexpr bool is_symbol() const { return get_flags() == SCVAL_FLAG_SYMBOL; }
 
-    constexpr const Symbol& as_symbol() const {
+    constexpr SymbolId as_symbol() const {
         assert(is_symbol());
-        return *std::bit_cast<const Symbol*>(_value & ~0b111);
+        return static_cast<SymbolId>(_value >> 32);
     }
 
-    constexpr explicit Sexp(const Symbol& sym) { set_symbol(sym); }
+    constexpr explicit Sexp(SymbolId id) { set_symbol(id); }
+    explicit Sexp(const Symbol& sym) { set_symbol(sym.id()); }
 
-    constexpr void set_symbol(const Symbol& sym) {
-        auto bits = std::bit_cast<uintptr_t>(&sym);
-        assert((bits & SCVAL_MASK_FLAG) == 0);
-        _value = bits | SCVAL_FLAG_SYMBOL;
+    constexpr void set_symbol(SymbolId id) {
+        _value = (static_cast<uint64_t>(std::to_underlying(id)) << 32) | SCVAL_FLAG_SYMBOL;
     }
 
     /******** Heap pointer ********/
@@ -264,18 +322,300 @@ export struct Sexp {
     }
 };
 
+export struct EvalException {
+    /// Empty for a raise, see error_message()
+    std::string msg;
+    /// The innermost form with a known location that was being evaluated when this got thrown, filled in by eval() as it unwinds
+    std::optional<SourceLocation> location;
+    /// What was given to (raise), if this is a raise that had no (guard) to return to, see Environment::unwinding
+    std::optional<Sexp> raised;
+    /// Set for running out of the ExecutionBudget or the heap limit, which (guard) lets through: code under a budget can't catch its way past it
+    bool budget_exceeded = false;
+};
+
+export struct ConsCell;
+export struct String;
+
+/// Index of a source file in its SourceMap
+export enum class SourceFileId : uint16_t {
+    /// Text whose positions aren't recorded, e.g. built at runtime
+    NONE = 0xFFFF,
+};
+
+/// Where the parser found each cons it made, kept on the side so that ConsCell doesn't grow.
+/// Safe to use from multiple threads at once.
+export class SourceMap {
+public:
+    /// 16 bytes a cons; columns past 65535 are clamped
+    struct Entry {
+        const ConsCell* cell;
+        uint32_t line;
+        uint16_t column;
+        SourceFileId file;
+    };
+
+private:
+    mutable std::mutex _mutex;
+    /// Map of the environment this one's was forked from, which has the positions and files from before the fork
+    const SourceMap* _base = nullptr;
+    /// Ids below this are files of `_base`
+    size_t _first_file = 0;
+    /// Names of the source files, indexed by SourceFileId - `_first_file`
+    std::deque<std::string> _files;
+    /// Sorted by address up to `_n_sorted`, the rest is in the order added
+    mutable std::vector<Entry> _entries;
+    mutable size_t _n_sorted = 0;
+    bool _enabled = false;
+
+public:
+    SourceMap() = default;
+    /// A map for a fork of the environment with `base`
+    explicit SourceMap(const SourceMap& base);
+
+    /// Whether parsers record anything, off unless turned on
+    bool is_enabled() const { return _enabled; }
+    void set_enabled(bool enabled) { _enabled = enabled; }
+
+    SourceFileId add_file(std::string name);
+    /// Reuses `file` for another source, so that something that reads many of them (e.g. a server, one per request) doesn't run out of ids.
+    /// Positions recorded before now report the new name, and names from file_name() for it are no longer valid.
+    void rename_file(SourceFileId file, std::string name);
+    std::string_view file_name(SourceFileId file) const;
+
+    void add(std::span<const Entry> entries);
+    /// Where `cell` was parsed from, or nullopt if it wasn't (or positions weren't being recorded)
+    std::optional<SourceLocation> find(const ConsCell* cell) const;
+
+    size_t size() const;
+};
+
+/// What's been worked out from a form the first time it was evaluated, to skip doing it again (e.g. a compiled quasiquote template), by the cons the form starts with.
+/// Safe to use from multiple threads at once.
+export class FormCache {
+private:
+    mutable std::shared_mutex _mutex;
+    std::unordered_map<const ConsCell*, Sexp> _entries;
+    /// Cache of the environment this one's was forked from.
+    /// Its entries hold for the fork too, but the fork's own are in the fork's heap and go away with it, so they're kept apart.
+    const FormCache* _base = nullptr;
+
+public:
+    FormCache() = default;
+    /// A cache for a fork of the environment with `base`
+    explicit FormCache(const FormCache& base)
+        : _base{ &base } {}
+
+    std::optional<Sexp> find(const ConsCell* form) const;
+    /// Keeps `value` for `form`, unless another thread has got there first, and returns the one that's kept
+    Sexp add(const ConsCell* form, Sexp value);
+};
+
+/// Read-only copies of the data quoted in programs, hash-consed so that equal literals are stored once however many times they're read, across files and environments.
+/// Objects live in address space of their own, and the pages they're on are made read-only as they fill up, so that a constant can't be changed even by mistake.
+/// Safe to use from multiple threads at once.
+export class ConstantPool {
+private:
+    /// Pool of the environment this one's was forked from.
+    /// Its constants are used as they are, the fork's own go here and away with it, so that a long running host doesn't keep every literal of every request.
+    const ConstantPool* _base = nullptr;
+    std::byte* _begin = nullptr;
+    size_t _reserved_size = 0;
+    /// Where the next object goes
+    std::byte* _cursor = nullptr;
+    /// End of the pages that have been made writable, and of the ones that have been made read-only again since
+    std::byte* _committed_end = nullptr;
+    std::byte* _sealed_end = nullptr;
+    size_t _page_size;
+
+    struct PairHash {
+        size_t operator()(std::pair<uint64_t, uint64_t> p) const {
+            return std::hash<uint64_t>{}(p.first * 0x9E3779B97F4A7C15 ^ p.second);
+        }
+    };
+    /// Conses by the bits of their car and cdr, which are themselves constants, so that equal data are the same pointer
+    std::unordered_map<std::pair<uint64_t, uint64_t>, ConsCell*, PairHash> _conses;
+    std::unordered_map<std::string_view, String*> _strings;
+    /// Items of the lists being interned, see intern_locked()
+    std::vector<Sexp> _items;
+    size_t _n_objects = 0;
+    mutable std::mutex _mutex;
+
+public:
+    /// Address space reserved up front, only backed by memory as it's used.
+    /// Anything that doesn't fit once it's full stays where it was, in the ordinary heap.
+    static constexpr size_t RESERVED_SIZE = size_t(256) << 20;
+    /// Made writable this much at a time
+    static constexpr size_t COMMIT_SIZE = 64 * 1024;
+    /// Reserved for the pool of a fork. Past that its literals stay in its heap, where they count towards its heap limit.
+    static constexpr size_t FORK_RESERVED_SIZE = size_t(4) << 20;
+
+    ConstantPool();
+    /// A pool for a fork of the environment with `base`, holding up to `reserved_size` bytes of constants of its own
+    ConstantPool(const ConstantPool& base, size_t reserved_size);
+    ~ConstantPool();
+
+    ConstantPool(const ConstantPool&) = delete;
+    ConstantPool& operator=(const ConstantPool&) = delete;
+
+    /// Whether `obj` is a constant, of this pool or one of its bases
+    bool contains(const void* obj) const {
+        auto p = static_cast<const std::byte*>(obj);
+        return (p >= _begin && p < _begin + _reserved_size) || (_base && _base->contains(obj));
+    }
+
+    /// Returns a constant equal to `datum`: the same conses and strings, with the same symbols and numbers.
+    /// Parts that are already constants are taken as they are, so a list whose items have been interned costs a lookup per cons.
+    Sexp intern(Sexp datum);
+
+    struct Stats {
+        size_t objects = 0;
+        /// Including object headers
+        size_t bytes = 0;
+    };
+    Stats stats();
+
+private:
+    /// Reserves `size` bytes of address space for the pool, or leaves it empty (and everything in the heap) if that fails
+    void reserve(size_t size);
+    Sexp intern_locked(Sexp datum);
+    /// The constants in the bases of this pool equal to the given ones, or null
+    ConsCell* find_in_bases(Sexp car, Sexp cdr) const;
+    String* find_in_bases(std::string_view str) const;
+    /// Makes every page that has filled up read-only
+    void seal();
+    /// Returns null once the pool is full
+    std::byte* allocate(size_t size, ObjectType type);
+};
+
+/// Limits on how much evaluation may do, past which it throws an EvalException from wherever it has got to.
+/// Everything but the call depth is unlimited unless set. The host may change any of it between evaluations, and set `interrupted` from any thread (or a signal handler) at any time.
+export struct ExecutionBudget {
+    static constexpr uint64_t UNLIMITED_STEPS = std::numeric_limits<uint64_t>::max();
+    /// Native stack a nested call to a user procedure may take, with some room for the builtins in between (e.g. a let, or a guard), in an unoptimized build
+    static constexpr size_t STACK_BYTES_PER_CALL = 4 * 1024;
+    /// Deep enough for recursing over a list of a few thousand elements without tail calls.
+    /// Coroutine stacks are sized to fit `max_depth` calls (see STACK_BYTES_PER_CALL), the other threads' stacks are up to the OS.
+    static constexpr uint32_t DEFAULT_MAX_DEPTH = 10000;
+
+    /// Steps left to take, each call to a procedure or special form being one.
+    /// Environments draw from it FUEL_CHUNK steps at a time, so it runs out up to that many steps late when several of them share it.
+    std::atomic<uint64_t> steps_left = UNLIMITED_STEPS;
+    /// How deep calls to user procedures may nest, counted separately on each thread and coroutine
+    uint32_t max_depth = DEFAULT_MAX_DEPTH;
+    /// Checked along with `steps_left`, if not time_point::max()
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    /// Stops evaluation at the next check when set, and keeps stopping it until cleared
+    std::atomic<bool> interrupted = false;
+
+    static constexpr int64_t FUEL_CHUNK = 1024;
+};
+
 export struct Environment {
-    Heap heap;
-    SymbolPool sym_pool;
+    /// Backing storage of `heap` and `sym_pool`, null for worker environments (which share their parent's)
+    std::unique_ptr<Heap> owned_heap;
+    std::unique_ptr<SymbolPool> owned_sym_pool;
+    std::unique_ptr<SourceMap> owned_source_map;
+    Heap& heap;
+    SymbolPool& sym_pool;
+    SourceMap& source_map;
+    /// Input files mapped into memory, which symbols and string literals parsed from them may point into
+    std::vector<MappedFile> source_files;
+
+    /// The environment this one was forked from, or null
+    Environment* base = nullptr;
+    /// For a fork, the values it has set! for bindings in scopes shared with its base, by the address of the binding.
+    /// Null for anything else. Worker environments share their parent's, so it's locked for (parallel-map) and the like.
+    struct BindingOverlay {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<const Sexp*, Sexp> values;
+    };
+    std::unique_ptr<BindingOverlay> owned_overlay;
+    BindingOverlay* overlay = nullptr;
 
     /// A stack of scopes, added as we call into functions and popped as we exit
     Scope* curr_scope;
     Scope* global_scope;
 
+    /// Null for worker environments, which share their parent's
+    std::unique_ptr<ConstantPool> owned_constants;
+    ConstantPool& constants;
+
+    /// Null for worker environments, which share their parent's
+    std::unique_ptr<FormCache> owned_form_cache;
+    FormCache& form_cache;
+
+    /// Null for worker environments and forks, which share their parent's (or base's)
+    std::unique_ptr<ExecutionBudget> owned_budget;
+    ExecutionBudget& budget;
+    /// Steps this environment may take before drawing more from `budget`, see refuel()
+    int64_t fuel = 0;
+    /// Number of calls to user procedures currently nested on this thread (or coroutine)
+    uint32_t call_depth = 0;
+    /// Unique to each worker environment, 0 for any other. Stamped on the scopes it makes, see Scope::worker_id.
+    uint64_t worker_id = 0;
+
+    /// Number of (guard) forms whose body is being evaluated on this thread (or coroutine), and that a (raise) can therefore return to.
+    /// With none, or from inside C++ code that calls back into Scheme (see call()), a raise throws an EvalException instead.
+    uint32_t guard_depth = 0;
+    /// Set while a (raise) is returning out to the innermost (guard): everything evaluating gives up and returns '() as soon as it sees this.
+    /// Only ever set while `guard_depth` is non-zero, and cleared by the guard it gets to.
+    bool unwinding = false;
+    /// What was raised, while `unwinding`
+    Sexp raised;
+
+    /// `else` and `=>`, which (cond) and (case) look for in their clauses, interned once by setup_scope_for_control_builtins()
+    SymbolId sym_else{};
+    SymbolId sym_arrow{};
+
     Environment();
+    ~Environment();
+
+    struct WorkerTag {};
+    /// Constructs an environment for evaluating on another thread.
+    /// It allocates into the heap of `parent` (through this thread's allocation buffer), and resolves bindings through the scopes of `parent`, which must outlive it.
+    Environment(Environment& parent, WorkerTag);
+
+    struct ForkTag {};
+    /// See fork()
+    Environment(Environment& base, ForkTag);
+
+    /// Makes an environment that starts out with everything `this` has defined, but whose own changes stay out of `this`.
+    /// It allocates into a heap of its own, which goes away with it, and shares the rest by reference, so forking costs the same however much is in here.
+    /// - Globals are copy-on-write: the fork gets its own binding for one when it defines or set!s it.
+    /// - set! on a variable of a scope from before the fork (captured by a closure) is kept in an overlay of the fork.
+    /// - Pairs, string builders, channels and ports from before the fork can't be modified in it, nor can it wait for tasks from before it:
+    ///   they'd end up pointing into the fork's heap, or at its coroutines, which go away with it.
+    /// Symbols are shared and stay interned after the fork is gone. Literals go into a constant pool of the fork's, unless `this` has them already.
+    /// `this` must outlive the fork, and shouldn't change while it's around: the fork sees changes to anything it hasn't taken over.
+    std::unique_ptr<Environment> fork();
+
+    /// Whether `obj` was allocated before this environment was forked, i.e. belongs to one of its bases.
+    /// Always false if it isn't a fork.
+    bool is_from_base(HeapPtr<void> obj) const {
+        return obj.get_header()->get_generation() < heap.get_generation();
+    }
 
-    const Sexp* lookup_binding(const Symbol& name) const;
-    void set_binding(const Symbol& name, Sexp value);
+    const Sexp* lookup_binding(SymbolId name) const;
+    void set_binding(SymbolId name, Sexp value);
+
+    /// Called by eval() once `fuel` has run out: draws more from `budget`, or throws if the budget is exhausted, past its deadline or interrupted
+    void refuel();
+    /// Throws if `budget` is past its deadline or interrupted, for builtins that wait for something instead of evaluating (e.g. (join))
+    void check_interrupted() const;
+    /// Caps the heap this environment allocates into at `limit` bytes, past which allocating throws an EvalException.
+    /// Worker environments share their parent's heap and with it the limit; a fork has a heap (and limit) of its own.
+    void set_heap_limit(size_t limit);
+
+    /// Binds `name` globally to a procedure that calls `fn`, replacing any existing binding, and returns the procedure.
+    /// `fn` is any callable with a fixed signature, e.g. `[](double x, double y) { return std::hypot(x, y); }`: calls from Scheme are checked for the number and types of arguments against it, see NativeType for the types it may take and return.
+    /// It may also take an `Environment&` first, which is passed the calling environment and doesn't count as an argument.
+    template <typename Fn>
+    Sexp define_native(std::string_view name, Fn&& fn);
+
+    /// Calls the Scheme procedure `proc` with `args`, converted like the arguments of a define_native() function, and returns the result converted to `R`.
+    /// Nothing is allocated for the arguments themselves.
+    template <typename R = Sexp, typename... Args>
+    R call(Sexp proc, Args&&... args);
 };
 
 /// A heap allocated cons, with a car/left and cdr/right Sexp
@@ -286,22 +626,201 @@ export struct ConsCell {
     Sexp cdr;
 };
 
+/// An immutable string.
+/// Its contents are either flat, or a rope node that only stands for two other strings one after the other, so that appending doesn't copy anything.
 export struct String {
     static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_STRING;
 
     std::string v;
+    /// If not null, the contents are these bytes instead of `v`, borrowed from a source file kept alive by the Environment (see Environment::source_files), or from the string this is a substring of
+    const char* borrowed = nullptr;
+    size_t borrowed_size = 0;
+
+    /// If not null, this is a rope node: `left` followed by `right`
+    String* left = nullptr;
+    String* right = nullptr;
+    size_t rope_size = 0;
+    /// Contents of a rope node in one piece, once view() has been called on it
+    mutable std::atomic<std::string*> flattened{ nullptr };
+
+    ~String() {
+        delete flattened.load(std::memory_order_relaxed);
+    }
+
+    bool is_rope() const { return left != nullptr; }
+
+    size_t size() const {
+        return is_rope() ? rope_size : borrowed ? borrowed_size : v.size();
+    }
+
+    /// The contents in one piece. A rope node gets flattened, which is only done once for each.
+    std::string_view view() const {
+        if (is_rope()) [[unlikely]]
+            return flatten();
+        return borrowed ? std::string_view(borrowed, borrowed_size) : std::string_view(v);
+    }
+
+    /// Calls `fn` with each flat piece of the contents in order, without flattening anything
+    template <typename Fn>
+    void for_each_piece(Fn&& fn) const {
+        if (!is_rope()) {
+            fn(view());
+            return;
+        }
+
+        // Ropes built up in a loop are about as deep as they are long, so no recursion
+        std::vector<const String*> pending{ this };
+        while (!pending.empty()) {
+            auto s = pending.back();
+            pending.pop_back();
+
+            if (!s->is_rope()) {
+                fn(s->view());
+            } else if (auto flat = s->flattened.load(std::memory_order_acquire)) {
+                fn(std::string_view(*flat));
+            } else {
+                pending.push_back(s->right);
+                pending.push_back(s->left);
+            }
+        }
+    }
+
+private:
+    std::string_view flatten() const;
+};
+
+/// A mutable buffer to build a string in, see (make-string-builder)
+export struct StringBuilder {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_STRING_BUILDER;
+
+    std::string buffer;
+};
+
+/// A quasiquote template compiled into the steps that build it, see quasiquote.cpp
+export struct QuasiTemplate {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_QUASI_TEMPLATE;
+
+    struct Node {
+        enum Kind : uint8_t {
+            /// `value` itself, shared by every result
+            CONSTANT,
+            /// What `value` evaluates to
+            UNQUOTE,
+            /// The elements of the list `value` evaluates to, only as an item of a LIST
+            SPLICE,
+            /// A list of `n_items` nodes starting at `items[first_item]`, followed by the node `tail`
+            LIST,
+        } kind;
+        uint32_t first_item = 0;
+        uint32_t n_items = 0;
+        uint32_t tail = 0;
+        Sexp value = Sexp();
+    };
+
+    /// The template as a whole is the last one
+    std::vector<Node> nodes;
+    /// Indices into `nodes` of the items of each LIST
+    std::vector<uint32_t> items;
+};
+
+/// A macro made by (syntax-rules), see macro.cpp
+export struct Macro {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_MACRO;
+
+    const Symbol* name;
+    /// The symbol standing for "repeated", `...` unless given otherwise
+    SymbolId ellipsis;
+    /// List of symbols that match only themselves
+    Sexp literals;
+    /// List of (pattern template)
+    Sexp rules;
+};
+
+/// The clauses of a (case) form, indexed by their datums, see control.cpp
+export struct CaseTable {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_CASE_TABLE;
+
+    struct Clause {
+        /// Forms to evaluate, or for `=> proc`, the form giving the procedure
+        Sexp body;
+        bool is_arrow;
+    };
+    std::vector<Clause> clauses;
+    /// Index into `clauses` of the else clause, or NO_CLAUSE
+    uint32_t else_clause;
+
+    static constexpr uint32_t NO_CLAUSE = std::numeric_limits<uint32_t>::max();
+
+    /// If every datum is a fixnum, and they're close enough together: the clause of `jump_base + i` at `jump[i]`
+    int32_t jump_base = 0;
+    std::vector<uint32_t> jump;
+    /// Otherwise, the clause of each datum by its bits, which is what eqv? compares
+    std::unordered_map<uint64_t, uint32_t> by_value;
+
+    uint32_t find(Sexp key) const {
+        if (!jump.empty()) {
+            if (!key.is_int())
+                return else_clause;
+            auto i = static_cast<uint64_t>(static_cast<int64_t>(key.as_int()) - jump_base);
+            return i < jump.size() ? jump[i] : else_clause;
+        }
+        auto it = by_value.find(key._value);
+        return it != by_value.end() ? it->second : else_clause;
+    }
 };
 
+/// An error object, as made by (error) or out of an EvalException caught by (guard).
+/// The message and irritants are kept as they were given, and only put into words once printed, see format_condition().
+export struct Condition {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_CONDITION;
+
+    Sexp message;
+    /// List of the values the error is about
+    Sexp irritants;
+};
+
+/// The message of `cond` followed by its irritants, e.g. `bad value: 1 "x"`
+export std::string format_condition(const Condition& cond, Environment& env);
+
+/// Implements (raise): returns '() with env.unwinding set if a (guard) can be returned to, throws an EvalException otherwise
+export Sexp raise(Sexp obj, Environment& env);
+
+/// What `e` says went wrong. For a raise nothing caught, the object raised is only put into words here, by whoever reports it.
+export std::string error_message(const EvalException& e, Environment& env);
+
+/// An error object of `message` and `irritants`, taken as they are: `message` is borrowed rather than copied, so it has to be a string literal
+export Sexp make_error_object(std::string_view message, std::initializer_list<Sexp> irritants, Environment& env);
+
+/// Reports an error of a builtin about `irritants`.
+/// If a (guard) can be returned to, raises make_error_object() of them to it, without formatting anything, and returns '() for the builtin to return in turn.
+/// Otherwise throws an EvalException with the message `describe()` gives, which only the host will see.
+export template <typename Describe>
+Sexp raise_error(std::string_view message, std::initializer_list<Sexp> irritants, Environment& env, Describe&& describe) {
+    if (env.guard_depth == 0)
+        throw EvalException(describe());
+    return raise(make_error_object(message, irritants, env), env);
+}
+
+/// Same as above, for a message that says everything there is to say without the irritants
+export Sexp raise_error(std::string_view message, std::initializer_list<Sexp> irritants, Environment& env) {
+    return raise_error(message, irritants, env, [message] { return std::string(message); });
+}
+
+/// Makes a flat string holding `v`
+Sexp make_string(std::string v, Environment& env);
+
 export struct UserProc {
     static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_USER_PROC;
 
     const Symbol* name;
     HeapPtr<Scope> closure_frame;
-    std::vector<const Symbol*> arguments;
+    std::vector<SymbolId> arguments;
     // NOTE: we could use Sexp here, but since the body is always a list, pointing directly to ConsCell is just easier
     HeapPtr<ConsCell> body;
 };
 
+/// A special form, e.g. (if) or (define): given its argument list as it's written, to evaluate as much of it as it sees fit.
+/// Procedures that just take the values of their arguments are PrimitiveProc instead.
 export struct BuiltinProc {
     static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_BUILTIN_PROC;
 
@@ -312,12 +831,114 @@ export struct BuiltinProc {
     FnPtr fn;
 };
 
+/// A procedure implemented in C++, given its arguments already evaluated.
+/// Being an ordinary procedure, it can be passed around and called with values by higher-order code, see apply_proc().
+export struct PrimitiveProc {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_PRIMITIVE_PROC;
+
+    /// For `max_args`, if there's no upper limit
+    static constexpr uint32_t VARIADIC = std::numeric_limits<uint32_t>::max();
+
+    /// Only ever called with a number of arguments in [min_args, max_args]
+    using FnPtr = Sexp (*)(std::span<const Sexp> args, Environment& env);
+    using Fn1Ptr = Sexp (*)(Sexp a, Environment& env);
+    using Fn2Ptr = Sexp (*)(Sexp a, Sexp b, Environment& env);
+
+    const Symbol* name;
+    uint32_t min_args;
+    uint32_t max_args;
+    FnPtr fn;
+    /// Optional entry points for calls with exactly 1 or 2 arguments, which then don't need to be collected anywhere.
+    /// Only set if that many arguments are allowed, and must do the same as `fn`.
+    Fn1Ptr fn1 = nullptr;
+    Fn2Ptr fn2 = nullptr;
+
+    /// `fn` for a primitive that's written to take exactly 1 argument, to go with it as `fn1`
+    template <Fn1Ptr f>
+    static Sexp unary(std::span<const Sexp> args, Environment& env) {
+        return f(args[0], env);
+    }
+
+    /// `fn` for a primitive that's written to take exactly 2 arguments, to go with it as `fn2`
+    template <Fn2Ptr f>
+    static Sexp binary(std::span<const Sexp> args, Environment& env) {
+        return f(args[0], args[1], env);
+    }
+};
+
+/// A procedure defined by the host through Environment::define_native().
+/// Like a PrimitiveProc it's given its arguments already evaluated, and always takes exactly `arity` of them.
+export struct NativeProc {
+    static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_NATIVE_PROC;
+
+    using Fn = std::function<Sexp(std::span<const Sexp> args, Environment& env)>;
+
+    const Symbol* name;
+    size_t arity;
+    /// Converts the arguments and result for the function given to define_native(), and calls it
+    Fn fn;
+};
+
 export struct Scope {
     static constexpr auto HEAP_OBJECT_TYPE = ObjectType::TYPE_CALL_FRAME;
 
     /// The CallFrame in the "previous level" of closure
     HeapPtr<Scope> prev;
-    std::unordered_map<const Symbol*, Sexp> bindings;
+    /// Bindings of a local scope
+    std::unordered_map<SymbolId, Sexp> bindings;
+    /// If true, this is the global scope, whose bindings are kept in `dense_bindings` instead: indexed by SymbolId, holding SCVAL_UNBOUND for unbound symbols.
+    /// Nearly every symbol ends up bound globally, so an array beats hashing.
+    /// The global scope of a forked environment has its base's in `prev`, and only holds what the fork has bound itself; the rest is found in the base.
+    bool is_global = false;
+    std::vector<Sexp> dense_bindings;
+    /// Environment::worker_id of the worker environment that made this, 0 if none.
+    /// A worker may only set! bindings of scopes it made itself, the others are shared with the workers running alongside it.
+    uint64_t worker_id = 0;
+
+    Sexp* find(SymbolId name) {
+        if (is_global) {
+            auto idx = std::to_underlying(name);
+            if (idx >= dense_bindings.size() || dense_bindings[idx]._value == SCVAL_UNBOUND)
+                return prev ? prev->find(name) : nullptr;
+            return &dense_bindings[idx];
+        }
+
+        auto iter = bindings.find(name);
+        return iter != bindings.end() ? &iter->second : nullptr;
+    }
+
+    const Sexp* find(SymbolId name) const {
+        return const_cast<Scope*>(this)->find(name);
+    }
+
+    /// Binds `name` in this scope, replacing any existing binding
+    void define(SymbolId name, Sexp value) {
+        if (is_global)
+            dense_slot(name) = value;
+        else
+            bindings.insert_or_assign(name, value);
+    }
+
+    /// Binds `name` in this scope, unless it's already bound here
+    void try_define(SymbolId name, Sexp value) {
+        if (is_global) {
+            if (find(name) == nullptr)
+                dense_slot(name) = value;
+        } else {
+            bindings.try_emplace(name, value);
+        }
+    }
+
+private:
+    Sexp& dense_slot(SymbolId name) {
+        auto idx = std::to_underlying(name);
+        if (idx >= dense_bindings.size()) {
+            Sexp unbound;
+            unbound._value = SCVAL_UNBOUND;
+            dense_bindings.resize(std::max<size_t>(idx + 1, dense_bindings.size() * 2), unbound);
+        }
+        return dense_bindings[idx];
+    }
 };
 
 /// Constructs a ConsCell on heap, with car = a and cdr = b, and return a reference Sexp to it.
@@ -354,6 +975,11 @@ export bool is_list(Sexp s) {
     return is_list(*s.as_ptr().as<ConsCell>());
 }
 
+/// Whether `s` is a (non-empty) list or pair
+export bool is_cons(Sexp s) {
+    return !s.is_nil() && s.is_ptr<ConsCell>();
+}
+
 export Sexp car(Sexp s);
 export Sexp cdr(Sexp s);
 export Sexp list_nth_elm(Sexp list, int idx, Environment& env);
@@ -411,12 +1037,140 @@ export SexpListIterable iterate(Sexp s, Environment& env) {
     return { SexpListIterator(s, env) };
 }
 
-export Sexp parse_sexp(std::string_view src, Environment& env);
+/// If `borrow_source` is true, symbols and strings may point into `src`, so it must outlive `env` (see SexpReader(std::string_view, Environment&)).
+/// Positions of the conses are recorded in env.source_map as being in `file`, if it's enabled.
+export Sexp parse_sexp(std::string_view src, Environment& env, bool borrow_source = false, SourceFileId file = SourceFileId::NONE);
+/// Same as parse_sexp(), but splits `src` at top-level form boundaries and parses the pieces on WorkStealingPool::shared().
+export Sexp parse_sexp_parallel(std::string_view src, Environment& env, bool borrow_source = false, SourceFileId file = SourceFileId::NONE);
+/// Prints `sexp` into a fresh string, see SexpPrinter
 export std::string dump_sexp(Sexp sexp, Environment& env);
 
+/// Prints data into a large buffer that's only written to the output when it fills up, or on flush(), so printing many small results doesn't cost a syscall each.
+/// Cyclic structure is printed with datum labels, e.g. #0=(1 . #0#).
+export class SexpPrinter {
+private:
+    struct ListFrame {
+        /// Next cell whose car is to be printed, null once there are no more
+        ConsCell* next;
+        /// What's left after the last cell: nil for a proper list, otherwise printed after a " . "
+        Sexp tail;
+        bool first;
+    };
+
+    /// Null if only collecting into `_buffer`, see take()
+    std::ostream* _output = nullptr;
+    Environment* _env;
+    std::string _buffer;
+    /// Lists currently being printed, innermost last
+    std::vector<ListFrame> _stack;
+    /// Cells that are part of a cycle in the datum currently being printed, with their label, or -1 if they haven't been printed yet
+    std::unordered_map<const ConsCell*, int> _labels;
+    int _next_label = 0;
+    std::vector<Sexp> _scan_stack;
+
+public:
+    static constexpr size_t BUFFER_SIZE = 64 * 1024;
+    /// Data with up to this many cells are checked for cycles by just counting them, bigger ones with a full search
+    static constexpr size_t CYCLE_SCAN_THRESHOLD = 4096;
+
+    /// Collects everything into a string instead of writing it anywhere
+    explicit SexpPrinter(Environment& env);
+    SexpPrinter(std::ostream& output, Environment& env);
+    ~SexpPrinter();
+
+    SexpPrinter(const SexpPrinter&) = delete;
+    SexpPrinter& operator=(const SexpPrinter&) = delete;
+
+    void print(Sexp sexp);
+    void write(std::string_view str);
+    void write(char c);
+
+    /// Writes out everything buffered so far, e.g. before writing to another stream that shares the same terminal
+    void flush();
+    /// Returns everything printed so far, for a printer without an output
+    std::string take();
+
+private:
+    void maybe_flush() {
+        if (_output && _buffer.size() >= BUFFER_SIZE)
+            flush();
+    }
+
+    void begin_datum(Sexp sexp);
+    void print_atom(Sexp sexp);
+    template <typename T>
+    void print_number(T v);
+    bool is_labeled(const ConsCell* cell) const;
+    void find_cycles(Sexp sexp);
+};
+
+class SexpParser;
+
+/// Reads top-level data out of a stream one at a time, e.g. to evaluate each form as soon as it has been read.
+/// Only the text of the datum currently being read is buffered, so memory use doesn't grow with the size of the input.
+export class SexpReader {
+private:
+    /// Null if reading from a borrowed source
+    std::istream* _input = nullptr;
+    std::unique_ptr<SexpParser> _parser;
+    std::string _buffer;
+    /// What we're reading from: either `_buffer`, or the borrowed source
+    std::string_view _view;
+    /// Start of the first datum in `_view` that hasn't been returned yet
+    size_t _datum_begin = 0;
+    size_t _total_consumed = 0;
+    bool _eof = false;
+    /// Take input as it comes, a line at a time, instead of waiting for a whole chunk of it
+    bool _interactive = false;
+    /// Line and start of the line `_datum_begin` is on, for picking up the count from there; see LineCounter in general.cpp
+    uint32_t _line = 1;
+    ptrdiff_t _line_start = 0;
+
+public:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    /// If `interactive`, e.g. for a terminal or another program writing to a pipe, each line is read as soon as it's there.
+    /// Otherwise input is read a chunk at a time, which blocks until the whole chunk (or EOF) has arrived.
+    SexpReader(std::istream& input, Environment& env, SourceFileId file = SourceFileId::NONE, bool interactive = false);
+    /// Reads straight out of `source` without copying it: symbols and strings may point into it, so it must outlive `env` (e.g. by being in Environment::source_files).
+    SexpReader(std::string_view source, Environment& env, SourceFileId file = SourceFileId::NONE);
+    ~SexpReader();
+
+    /// Reads the next top-level datum into `out`. Returns false once the input is exhausted.
+    /// Throws ParseException for a malformed datum, after which reading continues past the end of it, nothing in it gets read as a datum of its own.
+    bool next(Sexp& out);
+
+    /// Number of source bytes read past so far
+    size_t bytes_consumed() const { return _total_consumed; }
+
+private:
+    bool fill_buffer();
+    /// Reads into `buf` up to the end of a line, and on past it only as far as the input has already buffered. Returns the number of bytes read.
+    size_t read_lines(char* buf, size_t size);
+    /// Skips to the end of the top-level datum starting at `_datum_begin`
+    void skip_datum();
+    /// Moves `_datum_begin` forward by `n`, keeping track of the lines passed
+    void consume(size_t n);
+};
+
 export Sexp call_user_proc(const UserProc& proc, Sexp params, Environment& env);
+/// Same as above, but binds already evaluated values to the parameters
+export Sexp call_user_proc(const UserProc& proc, std::span<const Sexp> args, Environment& env);
 
 void setup_scope_for_builtins(Environment& env);
+void setup_scope_for_parallel_builtins(Environment& env);
+void setup_scope_for_async_builtins(Environment& env);
+void setup_scope_for_string_builtins(Environment& env);
+void setup_scope_for_quasiquote_builtins(Environment& env);
+void setup_scope_for_macro_builtins(Environment& env);
+void setup_scope_for_control_builtins(Environment& env);
+
+/// Expands one use of `macro`, the form in `form`. Each use is expanded once, and after that the same expansion is reused.
+export Sexp expand_macro_use(const Macro& macro, const ConsCell& form, Environment& env);
+/// Expands every macro use in `form` and in the expansions, leaving quoted data alone. Implements (macroexpand)
+export Sexp expand_all(Sexp form, Environment& env);
+/// Expands a form at the top level of a file ahead of time. Macro definitions are evaluated instead, and have nothing left to run, giving nullopt.
+export std::optional<Sexp> expand_top_level(Sexp form, Environment& env);
 
 /// Implements (eval)
 export Sexp eval(Sexp sexp, Environment& env);
@@ -427,4 +1181,165 @@ export Sexp eval_maybe_many(Sexp forms, Environment& env);
 /// Implements (progn): evalute each element in `forms`, and return the result of the last one.
 export Sexp eval_many(ConsCell* forms, Environment& env);
 
+/// Calls a procedure with already evaluated arguments. Special forms (BuiltinProc) aren't procedures, and throw.
+export Sexp apply_proc(Sexp proc, std::span<const Sexp> args, Environment& env);
+/// Whether `v` is a procedure that apply_proc() can call
+export bool is_proc(Sexp v);
+
+/// Throws the EvalException for argument `index` of `who` not being `expected`, kept out of line so that the checks of NativeType stay small
+[[noreturn]] void throw_native_type_error(std::string_view who, size_t index, std::string_view expected);
+
+/// How values of `T` are converted to and from Sexp, for the arguments and results of define_native() functions and Environment::call().
+/// - `DESCRIPTION` is what the error says a value should have been, e.g. "a number"
+/// - `check(v)` is whether `v` converts to `T`
+/// - `get(v, env)` converts a `v` that passed check()
+/// - `make(x, env)` converts back to a Sexp
+export template <typename T>
+struct NativeType;
+
+export template <>
+struct NativeType<Sexp> {
+    static constexpr std::string_view DESCRIPTION = "anything";
+    static bool check(Sexp) { return true; }
+    static Sexp get(Sexp v, Environment&) { return v; }
+    static Sexp make(Sexp v, Environment&) { return v; }
+};
+
+/// Any value converts to a bool, the way (if) sees it
+export template <>
+struct NativeType<bool> {
+    static constexpr std::string_view DESCRIPTION = "a boolean";
+    static bool check(Sexp) { return true; }
+    static bool get(Sexp v, Environment&) { return v.evalute_bool(); }
+    static Sexp make(bool v, Environment&) { return Sexp(v); }
+};
+
+export template <>
+struct NativeType<int32_t> {
+    static constexpr std::string_view DESCRIPTION = "an integer";
+    static bool check(Sexp v) { return v.is_int(); }
+    static int32_t get(Sexp v, Environment&) { return v.as_int(); }
+    static Sexp make(int32_t v, Environment&) { return Sexp(v); }
+};
+
+/// Integers are accepted as well. Results are stored as float, the only flonum there is.
+export template <std::floating_point T>
+struct NativeType<T> {
+    static constexpr std::string_view DESCRIPTION = "a number";
+    static bool check(Sexp v) { return v.is_numeric(); }
+    static T get(Sexp v, Environment&) { return v.is_int() ? static_cast<T>(v.as_int()) : static_cast<T>(v.as_float()); }
+    static Sexp make(T v, Environment&) { return Sexp(static_cast<float>(v)); }
+};
+
+export template <>
+struct NativeType<SymbolId> {
+    static constexpr std::string_view DESCRIPTION = "a symbol";
+    static bool check(Sexp v) { return v.is_symbol(); }
+    static SymbolId get(Sexp v, Environment&) { return v.as_symbol(); }
+    static Sexp make(SymbolId v, Environment&) { return Sexp(v); }
+};
+
+/// Views the contents of a string, flattening it if it's a rope. Results are copied into a new string.
+export template <>
+struct NativeType<std::string_view> {
+    static constexpr std::string_view DESCRIPTION = "a string";
+    static bool check(Sexp v) { return !v.is_nil() && v.is_ptr<String>(); }
+    static std::string_view get(Sexp v, Environment&) { return v.as_ptr<String>()->view(); }
+    static Sexp make(std::string_view v, Environment& env) { return make_string(std::string(v), env); }
+};
+
+export template <>
+struct NativeType<std::string> {
+    static constexpr std::string_view DESCRIPTION = "a string";
+    static bool check(Sexp v) { return NativeType<std::string_view>::check(v); }
+    static std::string get(Sexp v, Environment&) { return std::string(v.as_ptr<String>()->view()); }
+    static Sexp make(std::string v, Environment& env) { return make_string(std::move(v), env); }
+};
+
+/// Only for passing string literals to Environment::call()
+export template <>
+struct NativeType<const char*> {
+    static Sexp make(const char* v, Environment& env) { return make_string(std::string(v), env); }
+};
+
+/// Any kind of heap object by pointer, e.g. ConsCell* or UserProc*. Doesn't accept '().
+export template <typename T>
+    requires requires { T::HEAP_OBJECT_TYPE; }
+struct NativeType<T*> {
+    static constexpr std::string_view DESCRIPTION = std::is_same_v<T, ConsCell> ? std::string_view("a pair") : std::string_view("an object of the right type");
+    static bool check(Sexp v) { return !v.is_nil() && v.is_ptr<T>(); }
+    static T* get(Sexp v, Environment&) { return v.as_ptr<T>().get(); }
+    static Sexp make(T* v, Environment&) { return Sexp(v); }
+};
+
+/// Parameter and result types of a callable given to define_native(), figured out through the deduction guides of std::function
+template <typename Signature>
+struct NativeSignature;
+
+template <typename R, typename... Args>
+struct NativeSignature<std::function<R(Args...)>> {
+    static constexpr bool TAKES_ENV = false;
+    using Result = R;
+    using Params = std::tuple<std::remove_cvref_t<Args>...>;
+};
+
+template <typename R, typename... Args>
+struct NativeSignature<std::function<R(Environment&, Args...)>> {
+    static constexpr bool TAKES_ENV = true;
+    using Result = R;
+    using Params = std::tuple<std::remove_cvref_t<Args>...>;
+};
+
+template <typename Fn>
+Sexp Environment::define_native(std::string_view name, Fn&& fn) {
+    using Signature = NativeSignature<decltype(std::function{ fn })>;
+    using Params = typename Signature::Params;
+    using Result = typename Signature::Result;
+    constexpr size_t arity = std::tuple_size_v<Params>;
+
+    auto& sym = sym_pool.intern(name);
+    auto thunk = [fn = std::forward<Fn>(fn), &sym](std::span<const Sexp> args, Environment& env) -> Sexp {
+        return [&]<size_t... I>(std::index_sequence<I...>) -> Sexp {
+            // Check everything before converting anything, get() may assume it's been checked
+            ((NativeType<std::tuple_element_t<I, Params>>::check(args[I])
+                  ? void()
+                  : throw_native_type_error(sym, I, NativeType<std::tuple_element_t<I, Params>>::DESCRIPTION)),
+             ...);
+
+            auto invoke = [&]() -> decltype(auto) {
+                if constexpr (Signature::TAKES_ENV)
+                    return fn(env, NativeType<std::tuple_element_t<I, Params>>::get(args[I], env)...);
+                else
+                    return fn(NativeType<std::tuple_element_t<I, Params>>::get(args[I], env)...);
+            };
+            if constexpr (std::is_void_v<Result>) {
+                invoke();
+                return Sexp();
+            } else {
+                return NativeType<std::remove_cvref_t<Result>>::make(invoke(), env);
+            }
+        }(std::make_index_sequence<arity>());
+    };
+
+    auto [proc, _] = heap.allocate<NativeProc>(&sym, arity, std::move(thunk));
+    global_scope->define(sym.id(), Sexp(proc));
+    return Sexp(proc);
+}
+
+template <typename R, typename... Args>
+R Environment::call(Sexp proc, Args&&... args) {
+    std::array<Sexp, sizeof...(Args)> values{ NativeType<std::decay_t<Args>>::make(std::forward<Args>(args), *this)... };
+    // The caller doesn't know to check for Environment::unwinding, so a raise has to get past it by throwing
+    DEFER_RESTORE_VALUE(guard_depth);
+    guard_depth = 0;
+    Sexp res = apply_proc(proc, values, *this);
+    if constexpr (std::is_same_v<R, Sexp>) {
+        return res;
+    } else {
+        if (!NativeType<R>::check(res))
+            throw EvalException(std::format("expected the procedure to return {}", NativeType<R>::DESCRIPTION));
+        return NativeType<R>::get(res, *this);
+    }
+}
+
 } // namespace yawarakai
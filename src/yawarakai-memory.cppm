@@ -19,11 +19,24 @@ export enum class ObjectType : uint16_t {
     TYPE_USER_PROC,
     TYPE_BUILTIN_PROC,
     TYPE_CALL_FRAME,
+    TYPE_PORT,
+    TYPE_CHANNEL,
+    TYPE_TASK,
+    TYPE_STRING_BUILDER,
+    TYPE_NATIVE_PROC,
+    TYPE_PRIMITIVE_PROC,
+    TYPE_QUASI_TEMPLATE,
+    TYPE_MACRO,
+    TYPE_CASE_TABLE,
+    TYPE_CONDITION,
 };
 
 export struct ObjectHeader {
     static constexpr int TRACKED_FLAG_BIT = 0;
     static constexpr int TRACKED_GC_MARK_BIT = 1;
+    /// The rest of the flags hold the generation of the heap the object was allocated in, see Heap::get_generation()
+    static constexpr int GENERATION_SHIFT = 2;
+    static constexpr uint8_t MAX_GENERATION = 0xFF >> GENERATION_SHIFT;
 
     // TODO we should move the size as an extra allocation after the header, only for UNKNOWN heap objects
     uint8_t _size_p0, _size_p1, _size_p2, _size_p3;
@@ -37,6 +50,9 @@ export struct ObjectHeader {
     bool is_flag_set(int flag_bit) const;
     void set_flag(int flag_bit, bool value);
 
+    uint8_t get_generation() const;
+    void set_generation(uint8_t generation);
+
     size_t _read_size() const;
     size_t get_size() const;
     void set_size(size_t size);
@@ -55,6 +71,8 @@ struct HeapSegment {
     std::byte* arena;
     std::byte* last_object;
     size_t arena_size;
+    /// Number of objects allocated in here, only for statistics
+    size_t n_objects = 0;
 };
 
 export template <typename T>
@@ -146,14 +164,48 @@ struct HeapPtr<void> {
     }
 };
 
+/// A run of `count` objects of type T allocated at once by Heap::allocate_run().
+/// Each one is preceded by its header like any other heap object, so they're `STRIDE` bytes apart.
+export template <typename T>
+struct ObjectRun {
+    static constexpr size_t STRIDE = sizeof(ObjectHeader) + sizeof(T);
+
+    std::byte* first;
+    size_t count;
+
+    T* operator[](size_t i) const { return reinterpret_cast<T*>(first + i * STRIDE); }
+};
+
+/// True while an AllocationProfiler is running, see yawarakai-profile.cppm
+export inline bool allocation_profiling_active = false;
+/// Counts `count` objects of `bytes` in total (headers included) towards the current allocation site
+void profile_allocation(size_t count, size_t bytes);
+
+/// A heap shared by any number of threads.
+/// Each thread bump allocates from a segment of its own (its thread-local allocation buffer) without any synchronization; only grabbing a fresh segment goes through `segments_mutex`.
 export class Heap {
 private:
-    std::vector<HeapSegment> heap_segments;
+    /// Every segment ever handed out, including the ones currently owned by some thread
+    /// NOTE: std::deque so that pointers to the segments stay valid as we add more
+    std::deque<HeapSegment> heap_segments;
+    std::mutex segments_mutex;
+    /// Process-wide unique id, so a thread-local allocation buffer can never be confused with one of a destroyed heap at the same address
+    uint64_t heap_id;
+    uint8_t generation;
+    /// Total size of the segments handed out so far
+    size_t reserved_bytes = 0;
+    /// What `reserved_bytes` may grow by past `limit_baseline`, its value when the limit was set
+    size_t byte_limit = std::numeric_limits<size_t>::max();
+    size_t limit_baseline = 0;
+    void (*on_limit_exceeded)(size_t limit) = nullptr;
 
 public:
-    Heap();
+    explicit Heap(uint8_t generation = 0);
     ~Heap();
 
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
     std::pair<std::byte*, ObjectHeader*> allocate(size_t size, size_t alignment);
 
     template <typename T, typename... TArgs>
@@ -171,9 +223,52 @@ public:
         return { reinterpret_cast<T*>(obj_raw), header };
     }
 
+    /// Allocates `count` objects of type T with their headers set up, but not constructed, in a segment of their own.
+    /// Much cheaper than allocating them one by one when `count` is large, e.g. when loading a whole program at once.
+    template <typename T>
+    ObjectRun<T> allocate_run(size_t count) {
+        return { allocate_run(count, sizeof(T), T::HEAP_OBJECT_TYPE), count };
+    }
+
+    std::byte* allocate_run(size_t count, size_t size, ObjectType type);
+
+    /// Stamped on every object allocated here.
+    /// A forked environment allocates into a heap one generation above its base's, so objects older than the fork can be told apart from its own (see Environment::fork()).
+    uint8_t get_generation() const { return generation; }
+
+    /// Called with the limit when the heap would grow past it.
+    /// It must not return normally (i.e. it throws), as there's nothing to hand out instead.
+    using LimitHandler = void (*)(size_t limit);
+
+    /// Caps how much the heap may grow from now on at `limit` bytes, calling `handler` instead of growing past it.
+    /// Setting it again starts counting over, e.g. for each request to a server that keeps running in the same heap.
+    /// Only checked when a thread needs a fresh segment, so allocations may carry on into what's left of the threads' current ones.
+    void set_byte_limit(size_t limit, LimitHandler handler) {
+        std::lock_guard lock(segments_mutex);
+        byte_limit = limit;
+        limit_baseline = reserved_bytes;
+        on_limit_exceeded = handler;
+    }
+
+    /// Runs the destructors of all the objects in here, which ~Heap() doesn't do by itself.
+    /// Only worth it for a heap that goes away long before the program exits: until then, whatever the objects own is leaked.
+    /// NOTE: must not run concurrently with allocations, and nothing may be used afterwards
+    void destroy_objects();
+
+    struct Stats {
+        size_t objects = 0;
+        /// Including object headers and alignment padding
+        size_t bytes = 0;
+        size_t segments = 0;
+    };
+
+    /// NOTE: must not run concurrently with allocations
+    Stats stats() const;
+
     std::byte* find_object(ObjectHeader* header) const;
     ObjectHeader* find_header(std::byte* object) const;
 
+    /// NOTE: must not run concurrently with allocations
     void walk_heap_objects(auto&& visitor) const {
         for (auto& hg : heap_segments) {
             auto curr = std::bit_cast<uintptr_t>(hg.last_object);
@@ -214,7 +309,9 @@ public:
     }
 
 private:
-    void new_heap_segment();
+    HeapSegment* get_tlab_segment();
+    HeapSegment* refill_tlab_segment(size_t min_size);
+    HeapSegment* new_heap_segment(size_t min_size);
 };
 
 } // namespace yawarakai
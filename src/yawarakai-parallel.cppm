@@ -0,0 +1,63 @@
+module;
+#include <cassert>
+
+export module yawarakai:parallel;
+import std;
+
+namespace yawarakai {
+
+/// A fixed set of worker threads, each owning a deque of tasks.
+/// Workers pop from the back of their own deque, and steal from the front of others' when they run dry, so uneven chunks get balanced out automatically.
+export class WorkStealingPool {
+public:
+    using Task = std::function<void(size_t worker_id)>;
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::thread> _threads;
+    std::unique_ptr<Worker[]> _workers;
+    size_t _n_workers;
+
+    /// Held by run_all() for a whole batch, there's only ever one in flight
+    std::mutex _run_mutex;
+    std::mutex _batch_mutex;
+    std::condition_variable _batch_cv;
+    std::condition_variable _done_cv;
+    /// Incremented every time run_all() hands out a new batch of tasks
+    uint64_t _batch_gen = 0;
+    /// Number of tasks in the current batch that haven't finished yet
+    std::atomic<size_t> _pending = 0;
+    /// The first exception a task of the current batch let out, guarded by `_batch_mutex`
+    std::exception_ptr _batch_error;
+    bool _shutdown = false;
+
+public:
+    explicit WorkStealingPool(size_t n_workers);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    /// The process-wide pool, sized to the number of hardware threads. Created on first use.
+    static WorkStealingPool& shared();
+
+    /// Returns true if the calling thread is one of the workers of any pool
+    static bool is_worker_thread();
+
+    size_t worker_count() const { return _n_workers; }
+
+    /// Runs every task to completion, blocking the calling thread until all of them finish, then rethrows the first exception any of them threw.
+    /// When called from a worker thread (i.e. a nested parallel operation), the tasks are simply run inline: waiting for a batch of its own there could deadlock.
+    /// Calls from several other threads at once take turns.
+    void run_all(std::vector<Task> tasks);
+
+private:
+    void worker_main(size_t worker_id);
+    bool try_pop_or_steal(size_t worker_id, Task& out);
+};
+
+} // namespace yawarakai
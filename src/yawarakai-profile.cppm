@@ -0,0 +1,124 @@
+export module yawarakai:profile;
+import :lisp;
+import std;
+
+export namespace yawarakai {
+
+/// True while a Profiler is running.
+/// Everything on the evaluation path checks this before doing any profiling work, so that it costs a load and a branch when profiling is off.
+inline bool profiling_active = false;
+
+/// Shadow stack of the procedures active on one thread (or coroutine), see profile.cpp
+struct ProfileStack;
+
+/// Push a procedure on the current thread's shadow stack, only to be called while `profiling_active`.
+/// Returns the stack it has been pushed on, to be passed to profile_leave() when the procedure returns.
+ProfileStack* profile_enter(const UserProc& proc);
+ProfileStack* profile_enter(const BuiltinProc& proc);
+ProfileStack* profile_enter(const PrimitiveProc& proc);
+ProfileStack* profile_enter(const NativeProc& proc);
+void profile_leave(ProfileStack* stack);
+
+/// Makes `stack` the shadow stack of the current thread, creating a fresh one if it's null, and returns the one it replaces.
+/// Used when switching between coroutines, which each have a stack of their own.
+ProfileStack* profile_switch_stack(ProfileStack* stack);
+
+/// Names the lambdas created from `proc`'s body the first time one of them is seen, `lambda_params` being the rest of the (lambda ...) form.
+/// They're named after where that is in the source, or if it isn't known, after the innermost named procedure that creates them.
+/// Only to be called while `profiling_active`.
+void profile_note_lambda(const UserProc& proc, Sexp lambda_params, Environment& env);
+
+/// Keeps a procedure on the shadow stack for as long as it lives, if profiling
+class ProfileScope {
+private:
+    ProfileStack* _stack = nullptr;
+
+public:
+    template <typename Proc>
+    explicit ProfileScope(const Proc& proc) {
+        if (profiling_active) [[unlikely]]
+            _stack = profile_enter(proc);
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+
+    ~ProfileScope() {
+        if (_stack) [[unlikely]]
+            profile_leave(_stack);
+    }
+};
+
+/// Makes `form` the site that allocations on this thread are attributed to, returning the previous one
+const ConsCell* enter_allocation_site(const ConsCell* form);
+
+/// Attributes allocations to a form for as long as it lives, if profiling allocations
+class AllocationSite {
+private:
+    const ConsCell* _prev = nullptr;
+    bool _active = false;
+
+public:
+    explicit AllocationSite(const ConsCell& form) {
+        if (allocation_profiling_active) [[unlikely]] {
+            _prev = enter_allocation_site(&form);
+            _active = true;
+        }
+    }
+
+    AllocationSite(const AllocationSite&) = delete;
+    AllocationSite& operator=(const AllocationSite&) = delete;
+
+    ~AllocationSite() {
+        if (_active) [[unlikely]]
+            enter_allocation_site(_prev);
+    }
+};
+
+/// Samples the shadow stacks on a SIGPROF timer for as long as it's running, and counts calls and time spent in each procedure.
+/// Only one can run at a time.
+/// Times are wall-clock, so a procedure in a coroutine is charged for the time spent switched out as well.
+class Profiler {
+public:
+    /// Starts profiling, sampling every `interval` of CPU time
+    explicit Profiler(std::chrono::microseconds interval = std::chrono::milliseconds(1));
+    ~Profiler();
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    /// Stops sampling and counting, after which the results may be written out.
+    /// Called by the destructor if not before.
+    void stop();
+
+    /// Writes the samples as folded stacks, one "outermost;...;innermost count" line per distinct stack, as taken by flamegraph.pl and most other flame graph tools
+    void write_folded(std::ostream& os) const;
+
+    /// Writes a table of the call count, inclusive and exclusive time of each procedure, most expensive first
+    void write_summary(std::ostream& os) const;
+
+private:
+    std::chrono::microseconds _interval;
+    bool _running = false;
+};
+
+/// Counts the objects allocated on the heap for as long as it's running, by the innermost form that was being evaluated at the time.
+/// Only one can run at a time.
+class AllocationProfiler {
+public:
+    AllocationProfiler();
+    ~AllocationProfiler();
+
+    AllocationProfiler(const AllocationProfiler&) = delete;
+    AllocationProfiler& operator=(const AllocationProfiler&) = delete;
+
+    void stop();
+
+    /// Writes the `max_sites` sites that allocated the most bytes, then the ones that allocated the most objects
+    void write_summary(std::ostream& os, Environment& env, size_t max_sites = 20) const;
+
+private:
+    bool _running = false;
+};
+
+} // namespace yawarakai
@@ -1,5 +1,10 @@
 module;
+#include "yawarakai/util.hpp"
 #include <cassert>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 export module yawarakai:util;
 import std;
@@ -77,4 +82,69 @@ uintptr_t shift_down_and_align(uintptr_t start, size_t size, size_t alignment) {
     return res_unaligned & ~(alignment - 1);
 }
 
+/// A whole file mapped read-only into memory, so it can be read without copying it into a buffer first
+class MappedFile {
+private:
+    const char* _data = nullptr;
+    size_t _size = 0;
+
+    MappedFile(const char* data, size_t size)
+        : _data{ data }
+        , _size{ size } {}
+
+public:
+    MappedFile() = default;
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& that) noexcept
+        : _data{ std::exchange(that._data, nullptr) }
+        , _size{ std::exchange(that._size, 0) } {}
+
+    MappedFile& operator=(MappedFile&& that) noexcept {
+        unmap();
+        _data = std::exchange(that._data, nullptr);
+        _size = std::exchange(that._size, 0);
+        return *this;
+    }
+
+    ~MappedFile() {
+        unmap();
+    }
+
+    /// Returns nullopt if `path` can't be opened, or isn't something that can be mapped (e.g. a pipe)
+    static std::optional<MappedFile> open(const std::filesystem::path& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return std::nullopt;
+        DEFER { ::close(fd); };
+
+        struct stat st;
+        if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+            return std::nullopt;
+
+        // mmap() refuses zero-length mappings
+        if (st.st_size == 0)
+            return MappedFile();
+
+        auto size = static_cast<size_t>(st.st_size);
+        void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            return std::nullopt;
+        // Source files are read front to back exactly once
+        madvise(data, size, MADV_SEQUENTIAL);
+
+        return MappedFile(static_cast<const char*>(data), size);
+    }
+
+    std::string_view contents() const { return { _data, _size }; }
+
+private:
+    void unmap() {
+        if (_data)
+            munmap(const_cast<char*>(_data), _size);
+    }
+};
+
 } // namespace yawarakai
@@ -1,5 +1,9 @@
 export module yawarakai;
 
+export import :async;
+export import :fasl;
 export import :lisp;
 export import :memory;
+export import :parallel;
+export import :profile;
 export import :util;
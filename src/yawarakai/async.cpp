@@ -0,0 +1,569 @@
+module;
+#include "util.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+module yawarakai;
+import std;
+
+using namespace std::literals;
+
+namespace yawarakai {
+
+/// Size of the address space to reserve for a coroutine's native stack: room for as many nested calls as `budget` allows, within reason.
+/// Pages only get backed by memory once touched, so a suspended coroutine costs about as much as the deepest it has recursed.
+size_t coroutine_stack_size(const ExecutionBudget& budget, size_t page_size) {
+    constexpr size_t MIN_SIZE = 256 * 1024;
+    // For an all but unlimited depth, about as much as any thread's stack would have
+    constexpr size_t MAX_SIZE = 1024 * 1024 * 1024;
+    auto size = std::clamp(size_t(budget.max_depth) * ExecutionBudget::STACK_BYTES_PER_CALL, MIN_SIZE, MAX_SIZE);
+    // Plus the guard page
+    return (size + page_size - 1) / page_size * page_size + page_size;
+}
+
+Port::~Port() {
+    if (fd != -1)
+        close(fd);
+    if (pid != 0) {
+        // Nobody is left to read what it writes, and it's not to outlive the request that started it as a zombie
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+}
+
+struct Coroutine {
+    ucontext_t ctx;
+    /// Base of the mmap'd stack (the lowest page is a guard page), null for the root coroutine which runs on the thread's own stack
+    std::byte* stack = nullptr;
+    size_t stack_size = 0;
+
+    Environment* env = nullptr;
+    /// Value of env->curr_scope while this coroutine is switched out
+    Scope* saved_scope = nullptr;
+    /// Value of env->call_depth while this coroutine is switched out, as each one has a native stack of its own
+    uint32_t saved_call_depth = 0;
+    /// Value of env->guard_depth while this coroutine is switched out, a raise can only return to the guards on its own stack
+    uint32_t saved_guard_depth = 0;
+    /// The shadow stack of the profiler while this coroutine is switched out, null if it hasn't got one yet
+    ProfileStack* saved_profile_stack = nullptr;
+    /// The form allocations were attributed to when this coroutine got switched out
+    const ConsCell* saved_allocation_site = nullptr;
+
+    /// The procedure this coroutine runs, and where its outcome goes. Unused for the root coroutine.
+    Sexp thunk;
+    HeapPtr<TaskHandle> task;
+
+    /// The channel/task/etc. this coroutine is suspended on, so that stale entries in wait lists are ignored
+    const void* blocked_on = nullptr;
+    /// The file descriptor this coroutine is registered with epoll for, until it's made ready, otherwise -1
+    int waiting_fd = -1;
+    /// Set when the coroutine is resumed only to be told that nothing will ever wake it up
+    bool deadlocked = false;
+};
+
+namespace {
+/// Cooperative scheduler of all coroutines on the current thread.
+/// The code that is running when the first coroutine gets spawned becomes the root coroutine, and is scheduled like any other.
+class Scheduler {
+public:
+    Coroutine root;
+    Coroutine* current = &root;
+    std::deque<Coroutine*> ready;
+    /// Every coroutine that has been spawned and not finished yet
+    std::unordered_set<Coroutine*> spawned;
+    /// Finished coroutines, whose stacks are freed as soon as we're no longer running on them
+    std::vector<Coroutine*> zombies;
+
+    int epoll_fd = -1;
+    /// Number of coroutines suspended until a file descriptor becomes readable
+    size_t n_io_waiters = 0;
+
+    ~Scheduler() {
+        if (epoll_fd != -1)
+            close(epoll_fd);
+    }
+
+    static Scheduler& of_this_thread() {
+        thread_local Scheduler sched;
+        return sched;
+    }
+
+    /// Whether something other than the current coroutine is able to run, now or after some I/O
+    bool can_make_progress() const {
+        return !ready.empty() || n_io_waiters > 0;
+    }
+
+    void make_ready(Coroutine* c) {
+        c->blocked_on = nullptr;
+        ready.push_back(c);
+    }
+
+    /// Switches away from the current coroutine, and returns once something has made it ready again.
+    /// The caller must have already registered the current coroutine in a place it'll be woken up from.
+    /// Throws if the budget was interrupted or has run out of time meanwhile, which wakes the root up if nothing else would.
+    void suspend() {
+        switch_to(pick_next());
+        free_zombies();
+
+        if (current->deadlocked) {
+            current->deadlocked = false;
+            current->blocked_on = nullptr;
+            throw EvalException("deadlock: every task is waiting for something that will never happen"s);
+        }
+        if (current->env) {
+            try {
+                current->env->check_interrupted();
+            } catch (...) {
+                current->blocked_on = nullptr;
+                throw;
+            }
+        }
+    }
+
+    void yield() {
+        // Give tasks waiting on I/O a chance even if the ready tasks keep yielding to each other forever
+        poll_io(0);
+        make_ready(current);
+        suspend();
+    }
+
+    Coroutine* pick_next() {
+        // Everyone runs in environments sharing the same budget, or at least the same host
+        const ExecutionBudget* budget = current->env ? &current->env->budget : nullptr;
+        while (ready.empty()) {
+            if (n_io_waiters == 0) {
+                // Only the root can still be suspended at this point (it never finishes), report the deadlock there
+                root.deadlocked = true;
+                return &root;
+            }
+            if (!budget) {
+                poll_io(-1);
+                continue;
+            }
+
+            // Nobody is going to get to a check of the budget while everyone waits for I/O, so wake the root up to report it
+            if (budget->interrupted.load(std::memory_order_relaxed) || std::chrono::steady_clock::now() >= budget->deadline)
+                return &root;
+            // An interrupt may come from another thread, without a signal to cut the wait short
+            constexpr auto POLL_INTERVAL = 100ms;
+            auto wait = std::min<std::chrono::steady_clock::duration>(POLL_INTERVAL, budget->deadline - std::chrono::steady_clock::now());
+            poll_io(static_cast<int>(std::max<int64_t>(std::chrono::ceil<std::chrono::milliseconds>(wait).count(), 0)));
+        }
+
+        auto c = ready.front();
+        ready.pop_front();
+        return c;
+    }
+
+    void switch_to(Coroutine* next) {
+        Coroutine* prev = current;
+        if (next == prev)
+            return;
+
+        if (prev->env) {
+            prev->saved_scope = prev->env->curr_scope;
+            prev->saved_call_depth = prev->env->call_depth;
+            prev->saved_guard_depth = prev->env->guard_depth;
+        }
+        if (next->env) {
+            next->env->curr_scope = next->saved_scope;
+            next->env->call_depth = next->saved_call_depth;
+            next->env->guard_depth = next->saved_guard_depth;
+        }
+        if (profiling_active) [[unlikely]]
+            prev->saved_profile_stack = profile_switch_stack(next->saved_profile_stack);
+        if (allocation_profiling_active) [[unlikely]]
+            prev->saved_allocation_site = enter_allocation_site(next->saved_allocation_site);
+
+        current = next;
+        swapcontext(&prev->ctx, &next->ctx);
+    }
+
+    void free_zombies() {
+        for (auto c : zombies) {
+            munmap(c->stack, c->stack_size);
+            delete c;
+        }
+        zombies.clear();
+    }
+
+    /// Suspends the current coroutine until `fd` is readable
+    void wait_readable(int fd) {
+        if (epoll_fd == -1) {
+            epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            if (epoll_fd == -1)
+                throw EvalException(std::format("epoll_create1() failed: {}", std::strerror(errno)));
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = current;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            // Regular files can't be polled, but reading them never blocks on anything other than the disk anyway
+            if (errno == EPERM)
+                return;
+            throw EvalException(std::format("epoll_ctl() failed: {}", std::strerror(errno)));
+        }
+
+        n_io_waiters += 1;
+        current->blocked_on = &epoll_fd;
+        current->waiting_fd = fd;
+        DEFER {
+            // Still waiting if woken up to be told about an interrupt instead
+            if (current->waiting_fd != -1) {
+                current->waiting_fd = -1;
+                n_io_waiters -= 1;
+            }
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        };
+        // NOTE: can't deadlock, we ourselves count as an I/O waiter
+        suspend();
+    }
+
+    /// Makes every coroutine whose file descriptor has become readable ready, waiting at most `timeout_ms` (-1 for forever) for at least one of them
+    void poll_io(int timeout_ms) {
+        if (n_io_waiters == 0)
+            return;
+
+        epoll_event events[64];
+        int n = epoll_wait(epoll_fd, events, std::size(events), timeout_ms);
+        if (n == -1) {
+            if (errno == EINTR)
+                return;
+            throw EvalException(std::format("epoll_wait() failed: {}", std::strerror(errno)));
+        }
+
+        for (int i = 0; i < n; ++i) {
+            auto c = static_cast<Coroutine*>(events[i].data.ptr);
+            n_io_waiters -= 1;
+            c->waiting_fd = -1;
+            make_ready(c);
+        }
+    }
+
+    void abandon(Environment& env) {
+        // It'll be set again the next time the root runs anything
+        if (root.env == &env)
+            root.env = nullptr;
+
+        std::erase_if(ready, [&](Coroutine* c) { return c->env == &env; });
+        std::erase_if(spawned, [&](Coroutine* c) {
+            if (c->env != &env || c == current)
+                return false;
+            if (c->waiting_fd != -1) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->waiting_fd, nullptr);
+                n_io_waiters -= 1;
+            }
+            // Nobody will ever switch to it again, so whatever is on its stack just goes away with it
+            munmap(c->stack, c->stack_size);
+            delete c;
+            return true;
+        });
+    }
+};
+
+Scheduler& get_scheduler(Environment& env) {
+    auto& sched = Scheduler::of_this_thread();
+    if (sched.current == &sched.root)
+        sched.root.env = &env;
+    return sched;
+}
+
+void coroutine_main() {
+    auto& sched = Scheduler::of_this_thread();
+    sched.free_zombies();
+
+    Coroutine* self = sched.current;
+    auto& task = *self->task;
+    try {
+        task.result = call_user_proc(*self->thunk.as_ptr<UserProc>(), std::span<const Sexp>(), *self->env);
+    } catch (const EvalException& e) {
+        // A raise stays an object, it's only put into words if it gets to the host
+        task.error = e.msg;
+        task.raised = e.raised;
+    } catch (const std::exception& e) {
+        task.error = e.what();
+    }
+
+    task.finished = true;
+    for (auto c : task.joiners) {
+        if (c->blocked_on == &task)
+            sched.make_ready(c);
+    }
+    task.joiners.clear();
+
+    // We are still running on our own stack, so someone else has to free it
+    sched.spawned.erase(self);
+    sched.zombies.push_back(self);
+    sched.switch_to(sched.pick_next());
+    std::unreachable();
+}
+
+template <typename T>
+T& heap_object_arg(Sexp v, std::string_view what) {
+    if (v.is_nil() || !v.is_ptr<T>())
+        throw EvalException(std::format("expected {}", what));
+    return *v.as_ptr<T>();
+}
+
+/// Like heap_object_arg(), for an object `who` changes, which therefore can't be from before the environment was forked (see Environment::fork())
+template <typename T>
+T& owned_object_arg(Sexp v, std::string_view what, std::string_view who, Environment& env) {
+    auto& obj = heap_object_arg<T>(v, what);
+    if (env.is_from_base(HeapPtr(&obj)))
+        throw EvalException(std::format("({}) cannot modify {} from before the environment was forked", who, what));
+    return obj;
+}
+
+/// Reads more bytes into the port's buffer, suspending the current coroutine while there is nothing to read yet.
+/// Returns false on EOF.
+bool fill_port(Port& port, Environment& env) {
+    if (port.fd == -1)
+        throw EvalException("port is closed"s);
+
+    constexpr size_t READ_SIZE = 16 * 1024;
+    while (true) {
+        size_t old_size = port.buffer.size();
+        port.buffer.resize(old_size + READ_SIZE);
+        auto n = read(port.fd, port.buffer.data() + old_size, READ_SIZE);
+        port.buffer.resize(old_size + std::max<ssize_t>(n, 0));
+
+        if (n > 0)
+            return true;
+        if (n == 0) {
+            port.eof = true;
+            return false;
+        }
+
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            get_scheduler(env).wait_readable(port.fd);
+            continue;
+        }
+        throw EvalException(std::format("read() failed: {}", std::strerror(errno)));
+    }
+}
+
+Sexp builtin_spawn(Sexp thunk, Environment& env) {
+    if (thunk.is_nil() || !thunk.is_ptr<UserProc>())
+        throw EvalException("(spawn) expected a procedure"s);
+    if (!thunk.as_ptr<UserProc>()->arguments.empty())
+        throw EvalException("(spawn) expected a procedure taking no arguments"s);
+
+    auto& sched = get_scheduler(env);
+    auto [task, _] = env.heap.allocate<TaskHandle>();
+
+    auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    auto stack_size = coroutine_stack_size(env.budget, page_size);
+    auto stack = static_cast<std::byte*>(mmap(nullptr, stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0));
+    if (stack == MAP_FAILED)
+        throw EvalException(std::format("failed to allocate coroutine stack: {}", std::strerror(errno)));
+    // Guard page, so that running off the stack faults instead of scribbling over someone else's memory
+    mprotect(stack, page_size, PROT_NONE);
+
+    auto co = new Coroutine{
+        .stack = stack,
+        .stack_size = stack_size,
+        .env = &env,
+        .saved_scope = env.curr_scope,
+        .thunk = thunk,
+        .task = HeapPtr(task),
+    };
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = stack + page_size;
+    co->ctx.uc_stack.ss_size = stack_size - page_size;
+    co->ctx.uc_link = nullptr;
+    makecontext(&co->ctx, coroutine_main, 0);
+
+    sched.spawned.insert(co);
+    sched.make_ready(co);
+    return Sexp(task);
+}
+
+Sexp builtin_yield(std::span<const Sexp> args, Environment& env) {
+    get_scheduler(env).yield();
+    return Sexp();
+}
+
+Sexp builtin_join(Sexp task_v, Environment& env) {
+    auto& task = heap_object_arg<TaskHandle>(task_v, "a task"sv);
+    auto& sched = get_scheduler(env);
+    if (!task.finished) {
+        // Its joiners would be left pointing at our coroutine
+        if (env.is_from_base(task_v.as_ptr<TaskHandle>()))
+            throw EvalException("(join) cannot wait for a task from before the environment was forked"s);
+        if (!sched.can_make_progress())
+            throw EvalException("deadlock: joining a task that can never finish"s);
+
+        task.joiners.push_back(sched.current);
+        sched.current->blocked_on = &task;
+        sched.suspend();
+    }
+
+    if (task.raised)
+        return raise(*task.raised, env);
+    if (!task.error.empty())
+        throw EvalException(std::format("joined task failed: {}", task.error));
+    return task.result;
+}
+
+Sexp builtin_make_channel(std::span<const Sexp> args, Environment& env) {
+    auto [ch, _] = env.heap.allocate<Channel>();
+    return Sexp(ch);
+}
+
+Sexp builtin_channel_send(Sexp ch_v, Sexp value, Environment& env) {
+    auto& ch = owned_object_arg<Channel>(ch_v, "a channel"sv, "channel-send"sv, env);
+    ch.values.push_back(value);
+
+    auto& sched = get_scheduler(env);
+    while (!ch.receivers.empty()) {
+        auto c = ch.receivers.front();
+        ch.receivers.pop_front();
+        if (c->blocked_on == &ch) {
+            sched.make_ready(c);
+            break;
+        }
+    }
+
+    return Sexp();
+}
+
+Sexp builtin_channel_receive(Sexp ch_v, Environment& env) {
+    auto& ch = owned_object_arg<Channel>(ch_v, "a channel"sv, "channel-receive"sv, env);
+    auto& sched = get_scheduler(env);
+    // Someone else may grab the value between us being woken up and actually running
+    while (ch.values.empty()) {
+        if (!sched.can_make_progress())
+            throw EvalException("deadlock: receiving from a channel nobody can send to"s);
+
+        ch.receivers.push_back(sched.current);
+        sched.current->blocked_on = &ch;
+        sched.suspend();
+    }
+
+    Sexp v = ch.values.front();
+    ch.values.pop_front();
+    return v;
+}
+
+Sexp builtin_open_input_file(Sexp path_v, Environment& env) {
+    auto path = std::string(heap_object_arg<String>(path_v, "a path string"sv).view());
+    int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+        throw EvalException(std::format("unable to open '{}': {}", path, std::strerror(errno)));
+
+    auto [port, _] = env.heap.allocate<Port>();
+    port->fd = fd;
+    return Sexp(port);
+}
+
+Sexp builtin_open_input_pipe(Sexp cmd_v, Environment& env) {
+    auto cmd = std::string(heap_object_arg<String>(cmd_v, "a command string"sv).view());
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+        throw EvalException(std::format("pipe2() failed: {}", std::strerror(errno)));
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    // N.B. dup2() clears FD_CLOEXEC on the new descriptor
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+    const char* argv[] = { "/bin/sh", "-c", cmd.c_str(), nullptr };
+    pid_t pid;
+    int err = posix_spawn(&pid, "/bin/sh", &actions, nullptr, const_cast<char**>(argv), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+
+    if (err != 0) {
+        close(fds[0]);
+        throw EvalException(std::format("unable to run '{}': {}", cmd, std::strerror(err)));
+    }
+
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+    auto [port, _] = env.heap.allocate<Port>();
+    port->fd = fds[0];
+    port->pid = pid;
+    return Sexp(port);
+}
+
+// (read-line port) => the next line without its terminator, or #f at EOF
+Sexp builtin_read_line(Sexp port_v, Environment& env) {
+    auto& port = owned_object_arg<Port>(port_v, "a port"sv, "read-line"sv, env);
+    size_t searched = 0;
+    while (true) {
+        auto nl = port.buffer.find('\n', searched);
+        if (nl != std::string::npos) {
+            auto line = port.buffer.substr(0, nl);
+            port.buffer.erase(0, nl + 1);
+            return make_string(std::move(line), env);
+        }
+        searched = port.buffer.size();
+
+        if (port.eof || !fill_port(port, env)) {
+            if (port.buffer.empty())
+                return Sexp(false);
+            return make_string(std::exchange(port.buffer, {}), env);
+        }
+    }
+}
+
+// (read-all port) => everything left in the port as a single string
+Sexp builtin_read_all(Sexp port_v, Environment& env) {
+    auto& port = owned_object_arg<Port>(port_v, "a port"sv, "read-all"sv, env);
+    while (!port.eof && fill_port(port, env)) {}
+
+    return make_string(std::exchange(port.buffer, {}), env);
+}
+
+Sexp builtin_close_port(Sexp port_v, Environment& env) {
+    auto& port = owned_object_arg<Port>(port_v, "a port"sv, "close-port"sv, env);
+    if (port.fd != -1) {
+        close(port.fd);
+        port.fd = -1;
+    }
+    if (port.pid != 0) {
+        // Whatever it has yet to write won't be read. It would get SIGPIPE for writing it, but one that isn't writing (e.g. sleeping)
+        // would have the waitpid() block the whole scheduler, past deadlines and interrupts: so stop it right away.
+        kill(port.pid, SIGTERM);
+        int status;
+        waitpid(port.pid, &status, 0);
+        port.pid = 0;
+    }
+
+    return Sexp();
+}
+} // namespace
+
+void abandon_coroutines(Environment& env) {
+    Scheduler::of_this_thread().abandon(env);
+}
+
+void setup_scope_for_async_builtins(Environment& env) {
+    auto& s = *env.global_scope;
+    auto& h = env.heap;
+    auto& p = env.sym_pool;
+    PRIMITIVE("spawn", 1, 1, PrimitiveProc::unary<builtin_spawn>, builtin_spawn);
+    PRIMITIVE("yield", 0, 0, builtin_yield);
+    PRIMITIVE("join", 1, 1, PrimitiveProc::unary<builtin_join>, builtin_join);
+    PRIMITIVE("make-channel", 0, 0, builtin_make_channel);
+    PRIMITIVE("channel-send", 2, 2, PrimitiveProc::binary<builtin_channel_send>, nullptr, builtin_channel_send);
+    PRIMITIVE("channel-receive", 1, 1, PrimitiveProc::unary<builtin_channel_receive>, builtin_channel_receive);
+    PRIMITIVE("open-input-file", 1, 1, PrimitiveProc::unary<builtin_open_input_file>, builtin_open_input_file);
+    PRIMITIVE("open-input-pipe", 1, 1, PrimitiveProc::unary<builtin_open_input_pipe>, builtin_open_input_pipe);
+    PRIMITIVE("read-line", 1, 1, PrimitiveProc::unary<builtin_read_line>, builtin_read_line);
+    PRIMITIVE("read-all", 1, 1, PrimitiveProc::unary<builtin_read_all>, builtin_read_all);
+    PRIMITIVE("close-port", 1, 1, PrimitiveProc::unary<builtin_close_port>, builtin_close_port);
+}
+
+} // namespace yawarakai
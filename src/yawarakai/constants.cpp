@@ -0,0 +1,174 @@
+module;
+#include "util.hpp"
+#include <sys/mman.h>
+#include <unistd.h>
+
+module yawarakai;
+import std;
+
+using namespace std::literals;
+
+namespace yawarakai {
+
+ConstantPool::ConstantPool()
+    : _page_size{ static_cast<size_t>(sysconf(_SC_PAGESIZE)) } //
+{
+    reserve(RESERVED_SIZE);
+}
+
+ConstantPool::ConstantPool(const ConstantPool& base, size_t reserved_size)
+    : _base{ &base }
+    , _page_size{ base._page_size } //
+{
+    reserve(reserved_size);
+}
+
+void ConstantPool::reserve(size_t size) {
+    // Nothing is backed by memory until it's made writable
+    void* p = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return;
+    _begin = static_cast<std::byte*>(p);
+    _reserved_size = size;
+    _cursor = _begin;
+    _committed_end = _begin;
+    _sealed_end = _begin;
+}
+
+ConstantPool::~ConstantPool() {
+    // Strings in here borrow their bytes from the pool, there's nothing else to destroy
+    if (_begin)
+        munmap(_begin, _reserved_size);
+}
+
+Sexp ConstantPool::intern(Sexp datum) {
+    std::lock_guard lock(_mutex);
+    auto res = intern_locked(datum);
+    seal();
+    return res;
+}
+
+Sexp ConstantPool::intern_locked(Sexp datum) {
+    if (datum.is_nil() || !datum.is_ptr() || contains(datum.as_ptr().get()))
+        return datum;
+
+    switch (datum.as_ptr().get_type()) {
+        using enum ObjectType;
+
+        case TYPE_STRING: {
+            auto v = datum.as_ptr<String>()->view();
+            if (auto str = find_in_bases(v))
+                return Sexp(str);
+            if (auto it = _strings.find(v); it != _strings.end())
+                return Sexp(it->second);
+
+            auto bytes = allocate(std::max<size_t>(v.size(), 1), ObjectType::TYPE_UNKNOWN);
+            auto obj = allocate(sizeof(String), ObjectType::TYPE_STRING);
+            if (!bytes || !obj)
+                return datum;
+
+            std::memcpy(bytes, v.data(), v.size());
+            auto str = new (obj) String();
+            str->borrowed = reinterpret_cast<const char*>(bytes);
+            str->borrowed_size = v.size();
+            _strings.try_emplace(str->view(), str);
+            return Sexp(str);
+        }
+
+        case TYPE_CONS_CELL: {
+            // Interned from the last cons back, the cdr of each has to be a constant before the cons itself can be looked up.
+            // The items go on `_items` above those of the lists we're in the middle of.
+            size_t first_item = _items.size();
+            Sexp curr = datum;
+            while (!curr.is_nil() && curr.is_ptr<ConsCell>() && !contains(curr.as_ptr().get())) {
+                Sexp item = intern_locked(curr.as_ptr<ConsCell>()->car);
+                _items.push_back(item);
+                curr = curr.as_ptr<ConsCell>()->cdr;
+            }
+
+            Sexp tail = intern_locked(curr);
+            while (_items.size() > first_item) {
+                Sexp item = _items.back();
+                _items.pop_back();
+                if (auto cell = find_in_bases(item, tail)) {
+                    tail = Sexp(cell);
+                    continue;
+                }
+                auto [entry, inserted] = _conses.try_emplace({ item._value, tail._value }, nullptr);
+                if (inserted) {
+                    auto obj = allocate(sizeof(ConsCell), ObjectType::TYPE_CONS_CELL);
+                    if (!obj) {
+                        _conses.erase(entry);
+                        _items.resize(first_item);
+                        return datum;
+                    }
+                    entry->second = new (obj) ConsCell(item, tail);
+                }
+                tail = Sexp(entry->second);
+            }
+            return tail;
+        }
+
+        // Procedures and the like aren't literal data
+        default: return datum;
+    }
+}
+
+ConsCell* ConstantPool::find_in_bases(Sexp car, Sexp cdr) const {
+    for (auto pool = _base; pool; pool = pool->_base) {
+        std::lock_guard lock(pool->_mutex);
+        if (auto it = pool->_conses.find({ car._value, cdr._value }); it != pool->_conses.end())
+            return it->second;
+    }
+    return nullptr;
+}
+
+String* ConstantPool::find_in_bases(std::string_view str) const {
+    for (auto pool = _base; pool; pool = pool->_base) {
+        std::lock_guard lock(pool->_mutex);
+        if (auto it = pool->_strings.find(str); it != pool->_strings.end())
+            return it->second;
+    }
+    return nullptr;
+}
+
+void ConstantPool::seal() {
+    auto full_end = _begin + (_cursor - _begin) / _page_size * _page_size;
+    if (full_end <= _sealed_end)
+        return;
+    mprotect(_sealed_end, full_end - _sealed_end, PROT_READ);
+    _sealed_end = full_end;
+}
+
+ConstantPool::Stats ConstantPool::stats() {
+    std::lock_guard lock(_mutex);
+    return { .objects = _n_objects, .bytes = static_cast<size_t>(_cursor - _begin) };
+}
+
+std::byte* ConstantPool::allocate(size_t size, ObjectType type) {
+    // Same layout as objects in a Heap, so that they're told apart the same way
+    size = (size + alignof(void*) - 1) & ~(alignof(void*) - 1);
+    size_t needed = sizeof(ObjectHeader) + size;
+    if (!_begin || needed > static_cast<size_t>(_begin + _reserved_size - _cursor))
+        return nullptr;
+
+    if (_cursor + needed > _committed_end) {
+        size_t grow = std::max(COMMIT_SIZE, (needed + _page_size - 1) / _page_size * _page_size);
+        grow = std::min(grow, static_cast<size_t>(_begin + _reserved_size - _committed_end));
+        if (mprotect(_committed_end, grow, PROT_READ | PROT_WRITE) != 0)
+            return nullptr;
+        _committed_end += grow;
+    }
+
+    auto h = new (_cursor) ObjectHeader{};
+    h->set_size(size);
+    h->set_alignment(alignof(void*));
+    h->set_type(type);
+    h->set_generation(0);
+    auto obj = _cursor + sizeof(ObjectHeader);
+    _cursor += needed;
+    _n_objects += 1;
+    return obj;
+}
+
+} // namespace yawarakai
@@ -0,0 +1,331 @@
+module;
+#include "util.hpp"
+
+module yawarakai;
+import std;
+
+using namespace std::literals;
+
+namespace yawarakai {
+
+namespace {
+/// Evaluates the forms of a clause body in order, giving the value of the last one, or '() if there are none
+Sexp eval_body(Sexp body, Environment& env) {
+    return is_cons(body) ? eval_many(body.as_ptr<ConsCell>().get(), env) : Sexp();
+}
+
+bool is_symbol_named(Sexp x, SymbolId name) {
+    return x.is_symbol() && x.as_symbol() == name;
+}
+
+/// Whether the clause body `rest` is `=> proc`
+bool is_arrow_body(Sexp rest, Environment& env) {
+    return is_cons(rest) && is_symbol_named(rest.as_ptr<ConsCell>()->car, env.sym_arrow);
+}
+
+/// Calls the procedure the form after `=>` in `rest` evaluates to with `value`
+Sexp call_arrow(Sexp rest, Sexp value, std::string_view who, Environment& env) {
+    Sexp proc_form = rest.as_ptr<ConsCell>()->cdr;
+    if (!is_cons(proc_form) || !proc_form.as_ptr<ConsCell>()->cdr.is_nil())
+        throw EvalException(std::format("({}) expected exactly one form after =>", who));
+    Sexp proc = eval(proc_form.as_ptr<ConsCell>()->car, env);
+    RETURN_IF_UNWINDING(env);
+    return apply_proc(proc, std::span(&value, 1), env);
+}
+
+/// Evaluates the first of the (cond) clauses in `clauses` that applies, or gives nullopt if none does
+std::optional<Sexp> eval_cond_clauses(Sexp clauses, std::string_view who, Environment& env) {
+    for (Sexp curr = clauses; is_cons(curr); curr = curr.as_ptr<ConsCell>()->cdr) {
+        Sexp clause = curr.as_ptr<ConsCell>()->car;
+        if (!is_cons(clause))
+            throw EvalException(std::format("({}) expected each clause to be a list", who));
+
+        auto& c = *clause.as_ptr<ConsCell>();
+        if (is_symbol_named(c.car, env.sym_else)) {
+            if (!curr.as_ptr<ConsCell>()->cdr.is_nil())
+                throw EvalException(std::format("({}) else clause must be the last one", who));
+            return eval_body(c.cdr, env);
+        }
+
+        Sexp test = eval(c.car, env);
+        RETURN_IF_UNWINDING(env);
+        if (!test.evalute_bool())
+            continue;
+        if (is_arrow_body(c.cdr, env))
+            return call_arrow(c.cdr, test, who, env);
+        return c.cdr.is_nil() ? test : eval_body(c.cdr, env);
+    }
+    return std::nullopt;
+}
+
+// (cond (test expr ...) ... [(else expr ...)])
+// A clause may also be just (test), giving the value of the test, or (test => proc), calling proc with it
+Sexp builtin_cond(Sexp params, Environment& env) {
+    return eval_cond_clauses(params, "cond"sv, env).value_or(Sexp());
+}
+
+CaseTable& compile_case(Sexp clauses, Environment& env) {
+    auto [table, _] = env.heap.allocate<CaseTable>();
+    table->else_clause = CaseTable::NO_CLAUSE;
+
+    std::vector<std::pair<Sexp, uint32_t>> datums;
+    for (Sexp curr = clauses; is_cons(curr); curr = curr.as_ptr<ConsCell>()->cdr) {
+        Sexp clause = curr.as_ptr<ConsCell>()->car;
+        if (!is_cons(clause))
+            throw EvalException("(case) expected each clause to be a list"s);
+
+        auto& c = *clause.as_ptr<ConsCell>();
+        auto index = static_cast<uint32_t>(table->clauses.size());
+        table->clauses.push_back({ .body = c.cdr, .is_arrow = is_arrow_body(c.cdr, env) });
+
+        if (is_symbol_named(c.car, env.sym_else)) {
+            if (!curr.as_ptr<ConsCell>()->cdr.is_nil())
+                throw EvalException("(case) else clause must be the last one"s);
+            table->else_clause = index;
+            continue;
+        }
+        if (!c.car.is_nil() && !is_cons(c.car))
+            throw EvalException("(case) expected a list of datums at the start of each clause"s);
+        for (Sexp d = c.car; is_cons(d); d = d.as_ptr<ConsCell>()->cdr)
+            datums.emplace_back(d.as_ptr<ConsCell>()->car, index);
+    }
+
+    // Fixnums close enough together are looked up by their offset from the smallest one
+    constexpr int64_t MAX_JUMP_TABLE_WASTE = 4;
+    bool all_ints = !datums.empty() && std::ranges::all_of(datums, [](auto& d) { return d.first.is_int(); });
+    if (all_ints) {
+        auto [lo, hi] = std::ranges::minmax(datums | std::views::transform([](auto& d) { return static_cast<int64_t>(d.first.as_int()); }));
+        auto span = hi - lo + 1;
+        if (span <= static_cast<int64_t>(datums.size()) * MAX_JUMP_TABLE_WASTE + 16) {
+            table->jump_base = static_cast<int32_t>(lo);
+            table->jump.assign(static_cast<size_t>(span), table->else_clause);
+            // The first clause a datum appears in wins
+            for (auto it = datums.rbegin(); it != datums.rend(); ++it)
+                table->jump[static_cast<size_t>(it->first.as_int() - lo)] = it->second;
+            return *table;
+        }
+    }
+
+    for (auto& [datum, index] : datums)
+        table->by_value.try_emplace(datum._value, index);
+    return *table;
+}
+
+// (case key ((datum ...) expr ...) ... [(else expr ...)])
+// Compiled into a table the first time it's evaluated, so that finding the clause doesn't depend on how many there are
+Sexp builtin_case(Sexp params, Environment& env) {
+    if (!is_cons(params))
+        throw EvalException("(case) expected a key"s);
+
+    auto& form = *params.as_ptr<ConsCell>();
+    const CaseTable* table;
+    if (auto cached = env.form_cache.find(&form)) {
+        table = cached->as_ptr<CaseTable>().get();
+    } else {
+        auto& compiled = compile_case(form.cdr, env);
+        table = env.form_cache.add(&form, Sexp(&compiled)).as_ptr<CaseTable>().get();
+    }
+
+    Sexp key = eval(form.car, env);
+    RETURN_IF_UNWINDING(env);
+    uint32_t index = table->find(key);
+    if (index == CaseTable::NO_CLAUSE)
+        return Sexp();
+
+    auto& clause = table->clauses[index];
+    if (clause.is_arrow)
+        return call_arrow(clause.body, key, "case"sv, env);
+    return eval_body(clause.body, env);
+}
+
+// (and expr ...)
+Sexp builtin_and(Sexp params, Environment& env) {
+    Sexp res(true);
+    for (Sexp curr = params; is_cons(curr); curr = curr.as_ptr<ConsCell>()->cdr) {
+        res = eval(curr.as_ptr<ConsCell>()->car, env);
+        RETURN_IF_UNWINDING(env);
+        if (!res.evalute_bool())
+            return res;
+    }
+    return res;
+}
+
+// (or expr ...)
+Sexp builtin_or(Sexp params, Environment& env) {
+    Sexp res(false);
+    for (Sexp curr = params; is_cons(curr); curr = curr.as_ptr<ConsCell>()->cdr) {
+        res = eval(curr.as_ptr<ConsCell>()->car, env);
+        RETURN_IF_UNWINDING(env);
+        if (res.evalute_bool())
+            return res;
+    }
+    return res;
+}
+
+// (when test expr ...)
+Sexp builtin_when(Sexp params, Environment& env) {
+    if (!is_cons(params))
+        throw EvalException("(when) expected a test"s);
+    auto& form = *params.as_ptr<ConsCell>();
+    Sexp test = eval(form.car, env);
+    RETURN_IF_UNWINDING(env);
+    return test.evalute_bool() ? eval_body(form.cdr, env) : Sexp();
+}
+
+// (unless test expr ...)
+Sexp builtin_unless(Sexp params, Environment& env) {
+    if (!is_cons(params))
+        throw EvalException("(unless) expected a test"s);
+    auto& form = *params.as_ptr<ConsCell>();
+    Sexp test = eval(form.car, env);
+    RETURN_IF_UNWINDING(env);
+    return test.evalute_bool() ? Sexp() : eval_body(form.cdr, env);
+}
+
+/// What (guard) binds for an EvalException it caught: the object raised if it was a raise, otherwise an error object with its message
+Sexp condition_of(const EvalException& e, Environment& env) {
+    if (e.raised)
+        return *e.raised;
+    auto [cond, _] = env.heap.allocate<Condition>(make_string(e.msg, env), Sexp());
+    return Sexp(cond);
+}
+
+// (guard (var clause ...) body ...)
+// Evaluates the body, and if something gets raised in it, binds that to var and evaluates the first of the clauses that applies, as (cond) would.
+// If none does, it gets raised again from here.
+Sexp builtin_guard(Sexp params, Environment& env) {
+    if (!is_cons(params) || !is_cons(params.as_ptr<ConsCell>()->car))
+        throw EvalException("(guard) expected (var clause ...) as 1st argument"s);
+    auto& form = *params.as_ptr<ConsCell>();
+    auto& spec = *form.car.as_ptr<ConsCell>();
+    if (!spec.car.is_symbol())
+        throw EvalException("(guard) expected a symbol to bind the raised object to"s);
+
+    Sexp res;
+    std::optional<Sexp> raised;
+    {
+        DEFER_RESTORE_VALUE(env.guard_depth);
+        env.guard_depth += 1;
+        // Raises, including the errors of builtins that use raise_error(), arrive by returning with env.unwinding set; other errors from C++ as exceptions
+        try {
+            res = eval_body(form.cdr, env);
+        } catch (const EvalException& e) {
+            if (e.budget_exceeded) {
+                env.unwinding = false;
+                throw;
+            }
+            // Thrown by code that didn't check for a raise already on its way here, which takes precedence
+            if (!env.unwinding)
+                raised = condition_of(e, env);
+        }
+    }
+    if (env.unwinding) {
+        raised = std::exchange(env.raised, Sexp());
+        env.unwinding = false;
+    }
+    if (!raised)
+        return res;
+
+    auto [scope, _] = env.heap.allocate<Scope>();
+    scope->prev = HeapPtr(env.curr_scope);
+    scope->worker_id = env.worker_id;
+    scope->try_define(spec.car.as_symbol(), *raised);
+
+    DEFER_RESTORE_VALUE(env.curr_scope);
+    env.curr_scope = scope;
+    if (auto handled = eval_cond_clauses(spec.cdr, "guard"sv, env))
+        return *handled;
+    return raise(*raised, env);
+}
+
+Sexp builtin_raise(Sexp obj, Environment& env) {
+    return raise(obj, env);
+}
+
+// (error message irritant ...)
+Sexp builtin_error(std::span<const Sexp> args, Environment& env) {
+    auto irritants = make_list(args.rbegin(), args.rend() - 1, env);
+    auto [cond, _] = env.heap.allocate<Condition>(args[0], irritants);
+    return raise(Sexp(cond), env);
+}
+
+Sexp builtin_is_error_object(Sexp x, Environment& env) {
+    return Sexp(!x.is_nil() && x.is_ptr<Condition>());
+}
+
+const Condition& condition_arg(Sexp x, std::string_view who) {
+    if (x.is_nil() || !x.is_ptr<Condition>())
+        throw EvalException(std::format("({}) expected an error object", who));
+    return *x.as_ptr<Condition>();
+}
+
+Sexp builtin_error_object_message(Sexp x, Environment& env) {
+    return condition_arg(x, "error-object-message"sv).message;
+}
+
+Sexp builtin_error_object_irritants(Sexp x, Environment& env) {
+    return condition_arg(x, "error-object-irritants"sv).irritants;
+}
+} // namespace
+
+std::string format_condition(const Condition& cond, Environment& env) {
+    // The message is meant to be read as it is, the irritants as data
+    std::string res = !cond.message.is_nil() && cond.message.is_ptr<String>()
+        ? std::string(cond.message.as_ptr<String>()->view())
+        : dump_sexp(cond.message, env);
+    for (auto& irritant : iterate(cond.irritants, env)) {
+        res += ' ';
+        res += dump_sexp(irritant, env);
+    }
+    return res;
+}
+
+Sexp raise(Sexp obj, Environment& env) {
+    // Nothing to catch it but the host. It may well not need the message: e.g. the raise of a task is raised again by whoever joins it.
+    if (env.guard_depth == 0)
+        throw EvalException{ .raised = obj };
+
+    env.unwinding = true;
+    env.raised = obj;
+    return Sexp();
+}
+
+std::string error_message(const EvalException& e, Environment& env) {
+    if (!e.raised || !e.msg.empty())
+        return e.msg;
+    Sexp obj = *e.raised;
+    if (!obj.is_nil() && obj.is_ptr<Condition>())
+        return format_condition(*obj.as_ptr<Condition>(), env);
+    return std::format("uncaught raise of {}", dump_sexp(obj, env));
+}
+
+Sexp make_error_object(std::string_view message, std::initializer_list<Sexp> irritants, Environment& env) {
+    auto [str, DISCARD] = env.heap.allocate<String>();
+    str->borrowed = message.data();
+    str->borrowed_size = message.size();
+    auto [cond, DISCARD] = env.heap.allocate<Condition>(Sexp(str), make_list(std::rbegin(irritants), std::rend(irritants), env));
+    return Sexp(cond);
+}
+
+void setup_scope_for_control_builtins(Environment& env) {
+    auto& s = *env.global_scope;
+    auto& h = env.heap;
+    auto& p = env.sym_pool;
+    constexpr auto VARIADIC = PrimitiveProc::VARIADIC;
+    env.sym_else = p.intern("else"sv).id();
+    env.sym_arrow = p.intern("=>"sv).id();
+    PROC("cond", builtin_cond);
+    PROC("case", builtin_case);
+    PROC("and", builtin_and);
+    PROC("or", builtin_or);
+    PROC("when", builtin_when);
+    PROC("unless", builtin_unless);
+    PROC("guard", builtin_guard);
+    PRIMITIVE("raise", 1, 1, PrimitiveProc::unary<builtin_raise>, builtin_raise);
+    PRIMITIVE("error", 1, VARIADIC, builtin_error);
+    PRIMITIVE("error-object?", 1, 1, PrimitiveProc::unary<builtin_is_error_object>, builtin_is_error_object);
+    PRIMITIVE("error-object-message", 1, 1, PrimitiveProc::unary<builtin_error_object_message>, builtin_error_object_message);
+    PRIMITIVE("error-object-irritants", 1, 1, PrimitiveProc::unary<builtin_error_object_irritants>, builtin_error_object_irritants);
+}
+
+} // namespace yawarakai
@@ -17,101 +17,120 @@ Sexp wrap_number(double v) {
         return Sexp(static_cast<float>(v));
 }
 
-Sexp builtin_add(Sexp params, Environment& env) {
-    double res = 0.0;
+/// Same as wrap_number(), for the result of integer arithmetic done in 64 bits
+Sexp wrap_int(int64_t v) {
+    if (v >= std::numeric_limits<int32_t>::min() && v <= std::numeric_limits<int32_t>::max())
+        return Sexp(static_cast<int32_t>(v));
+    return Sexp(static_cast<float>(v));
+}
 
-    for (auto& param : iterate(params, env)) {
-        auto v = eval(param, env);
-        switch (v.get_flags()) {
-            case SCVAL_FLAG_INT: res += v.as_int(); break;
-            case SCVAL_FLAG_FLOAT: res += v.as_float(); break;
-            default: throw EvalException("+ cannot accept non-numerical parameters"s);
-        }
+/// The value of a numerical argument, or nullopt if it isn't a number
+std::optional<double> numeric_value(Sexp v) {
+    switch (v.get_flags()) {
+        case SCVAL_FLAG_INT: return v.as_int();
+        case SCVAL_FLAG_FLOAT: return v.as_float();
+        default: return std::nullopt;
     }
+}
 
-    return wrap_number(res);
+/// Reports `v`, an argument of an arithmetic operator that isn't a number, with the `message` of that operator
+Sexp non_numerical_arg(Sexp v, std::string_view message, Environment& env) {
+    return raise_error(message, { v }, env);
 }
 
-Sexp builtin_sub(Sexp params, Environment& env) {
+constexpr auto ADD_ARG_ERROR = "+ cannot accept non-numerical parameters"sv;
+constexpr auto SUB_ARG_ERROR = "- cannot accept non-numerical parameters"sv;
+constexpr auto MUL_ARG_ERROR = "* cannot accept non-numerical parameters"sv;
+constexpr auto DIV_ARG_ERROR = "/ cannot accept non-numerical parameters"sv;
+
+Sexp builtin_add(std::span<const Sexp> args, Environment& env) {
     double res = 0.0;
-    int param_cnt = 0;
-    for (auto& param : iterate(params, env)) {
-        auto v = eval(param, env);
-        double vf;
-        switch (v.get_flags()) {
-            case SCVAL_FLAG_INT: vf = v.as_int(); break;
-            case SCVAL_FLAG_FLOAT: vf = v.as_float(); break;
-            default: throw EvalException("- cannot accept non-numerical parameters"s);
-        }
+    for (Sexp v : args) {
+        auto x = numeric_value(v);
+        if (!x) [[unlikely]]
+            return non_numerical_arg(v, ADD_ARG_ERROR, env);
+        res += *x;
+    }
+    return wrap_number(res);
+}
 
-        if (param_cnt == 0)
-            res = vf;
-        else
-            res -= vf;
+Sexp builtin_add2(Sexp a, Sexp b, Environment& env) {
+    if (a.is_int() && b.is_int())
+        return wrap_int(int64_t(a.as_int()) + b.as_int());
+    auto x = numeric_value(a);
+    auto y = numeric_value(b);
+    if (!x || !y) [[unlikely]]
+        return non_numerical_arg(x ? b : a, ADD_ARG_ERROR, env);
+    return wrap_number(*x + *y);
+}
 
-        param_cnt += 1;
-    }
+Sexp builtin_sub(std::span<const Sexp> args, Environment& env) {
+    if (args.empty())
+        return Sexp(0);
 
+    auto first = numeric_value(args[0]);
+    if (!first) [[unlikely]]
+        return non_numerical_arg(args[0], SUB_ARG_ERROR, env);
+    double res = *first;
     // Unary minus
-    if (param_cnt == 1) {
-        res = -res;
+    if (args.size() == 1)
+        return wrap_number(-res);
+
+    for (Sexp v : args.subspan(1)) {
+        auto x = numeric_value(v);
+        if (!x) [[unlikely]]
+            return non_numerical_arg(v, SUB_ARG_ERROR, env);
+        res -= *x;
     }
-
     return wrap_number(res);
 }
 
-Sexp builtin_mul(Sexp params, Environment& env) {
-    double res = 1.0;
-    for (auto& param : iterate(params, env)) {
-        auto v = eval(param, env);
-        switch (v.get_flags()) {
-            case SCVAL_FLAG_INT: res *= v.as_int(); break;
-            case SCVAL_FLAG_FLOAT: res *= v.as_float(); break;
-            default: throw EvalException("* cannot accept non-numerical parameters"s);
-        }
-    }
-
-    return wrap_number(res);
+Sexp builtin_sub2(Sexp a, Sexp b, Environment& env) {
+    if (a.is_int() && b.is_int())
+        return wrap_int(int64_t(a.as_int()) - b.as_int());
+    auto x = numeric_value(a);
+    auto y = numeric_value(b);
+    if (!x || !y) [[unlikely]]
+        return non_numerical_arg(x ? b : a, SUB_ARG_ERROR, env);
+    return wrap_number(*x - *y);
 }
 
-Sexp builtin_div(Sexp params, Environment& env) {
-    double res = 0.0;
-    bool is_first = true;
-    for (auto& param : iterate(params, env)) {
-        auto v = eval(param, env);
-        double vf;
-        switch (v.get_flags()) {
-            case SCVAL_FLAG_INT: vf = v.as_int(); break;
-            case SCVAL_FLAG_FLOAT: vf = v.as_float(); break;
-            default: throw EvalException("/ cannot accept non-numerical parameters"s);
-        }
-
-        if (is_first) {
-            is_first = false;
-            res = vf;
-        } else {
-            res /= vf;
-        }
+Sexp builtin_mul(std::span<const Sexp> args, Environment& env) {
+    double res = 1.0;
+    for (Sexp v : args) {
+        auto x = numeric_value(v);
+        if (!x) [[unlikely]]
+            return non_numerical_arg(v, MUL_ARG_ERROR, env);
+        res *= *x;
     }
-
     return wrap_number(res);
 }
 
-Sexp builtin_sqrt(Sexp params, Environment& env) {
-    Sexp p;
-    list_get_everything(params, { &p }, env);
+Sexp builtin_mul2(Sexp a, Sexp b, Environment& env) {
+    if (a.is_int() && b.is_int())
+        return wrap_int(int64_t(a.as_int()) * b.as_int());
+    auto x = numeric_value(a);
+    auto y = numeric_value(b);
+    if (!x || !y) [[unlikely]]
+        return non_numerical_arg(x ? b : a, MUL_ARG_ERROR, env);
+    return wrap_number(*x * *y);
+}
 
-    auto v = eval(p, env);
-    double x;
-    switch (v.get_flags()) {
-        case SCVAL_FLAG_INT: x = v.as_int(); break;
-        case SCVAL_FLAG_FLOAT: x = v.as_float(); break;
-        default: throw EvalException("sqrt cannot accept non-numerical parameters"s);
+Sexp builtin_div(std::span<const Sexp> args, Environment& env) {
+    if (args.empty())
+        return Sexp(0);
+
+    auto first = numeric_value(args[0]);
+    if (!first) [[unlikely]]
+        return non_numerical_arg(args[0], DIV_ARG_ERROR, env);
+    double res = *first;
+    for (Sexp v : args.subspan(1)) {
+        auto x = numeric_value(v);
+        if (!x) [[unlikely]]
+            return non_numerical_arg(v, DIV_ARG_ERROR, env);
+        res /= *x;
     }
-
-    double res = std::sqrt(x);
-
-    return Sexp(static_cast<float>(res));
+    return wrap_number(res);
 }
 
 Sexp builtin_if(Sexp params, Environment& env) {
@@ -121,6 +140,7 @@ Sexp builtin_if(Sexp params, Environment& env) {
     list_get_everything(params, { &cond, &true_case, &false_case }, env);
 
     Sexp cond_val = eval(cond, env);
+    RETURN_IF_UNWINDING(env);
     if (cond_val.evalute_bool()) {
         return eval(true_case, env);
     } else {
@@ -128,71 +148,73 @@ Sexp builtin_if(Sexp params, Environment& env) {
     }
 }
 
-Sexp builtin_eq(Sexp params, Environment& env) {
-    bool is_first = true;
-    Sexp prev;
-    for (auto& param : iterate(params, env)) {
-        Sexp curr = eval(param, env);
-
-        if (is_first) {
-            is_first = false;
-            prev = curr;
-            continue;
-        }
+constexpr auto COMPARISON_ARG_ERROR = "parameters must be numerical"sv;
 
-        if (curr._value != prev._value)
+template <typename Op>
+Sexp builtin_compare(std::span<const Sexp> args, Environment& env) {
+    Op op{};
+    double prev = 0.0;
+    for (size_t i = 0; i < args.size(); ++i) {
+        auto curr = numeric_value(args[i]);
+        if (!curr) [[unlikely]]
+            return raise_error(COMPARISON_ARG_ERROR, { args[i] }, env);
+        if (i > 0 && !op(prev, *curr))
             return Sexp(false);
-
-        prev = curr;
+        prev = *curr;
     }
 
     return Sexp(true);
 }
 
 template <typename Op>
-Sexp builtin_binary_op(Sexp params, Environment& env) {
-    bool is_first = true;
-    double prev;
+Sexp builtin_compare2(Sexp a, Sexp b, Environment& env) {
     Op op{};
-    for (auto& param : iterate(params, env)) {
-        auto v = eval(param, env);
-        double curr;
-        if (v.is_float())
-            curr = v.as_float();
-        else if (v.is_int())
-            curr = v.as_int();
-        else
-            throw EvalException("parameters must be numerical"s);
-        if (!is_first) {
-            bool success = op(prev, curr);
-            if (!success)
-                return Sexp(false);
-        }
-        is_first = false;
-        prev = curr;
-    }
-
-    return Sexp(true);
+    if (a.is_int() && b.is_int())
+        return Sexp(op(a.as_int(), b.as_int()));
+    auto x = numeric_value(a);
+    auto y = numeric_value(b);
+    if (!x || !y) [[unlikely]]
+        return raise_error(COMPARISON_ARG_ERROR, { x ? b : a }, env);
+    return Sexp(op(*x, *y));
 }
 
-Sexp builtin_car(Sexp params, Environment& env) {
-    return car(eval(list_nth_elm(params, 0, env), env));
+Sexp builtin_car(Sexp x, Environment& env) {
+    if (!is_cons(x)) [[unlikely]]
+        return raise_error("car(): argument is not not a cons"sv, { x }, env);
+    return x.as_ptr<ConsCell>()->car;
 }
-Sexp builtin_cdr(Sexp params, Environment& env) {
-    return cdr(eval(list_nth_elm(params, 0, env), env));
+Sexp builtin_cdr(Sexp x, Environment& env) {
+    if (!is_cons(x)) [[unlikely]]
+        return raise_error("cdr(): argument is not not a cons"sv, { x }, env);
+    return x.as_ptr<ConsCell>()->cdr;
+}
+Sexp builtin_cons(Sexp a, Sexp b, Environment& env) {
+    return cons(a, b, env);
+}
+
+template <Sexp ConsCell::*member>
+Sexp builtin_set_cons_member(Sexp pair, Sexp value, Environment& env) {
+    auto cons_cell = pair.is_ptr() ? pair.as_ptr<ConsCell>() : HeapPtr<ConsCell>();
+    if (cons_cell == nullptr)
+        return raise_error("(set-car!)/(set-cdr!) expected a cons as 1st argument"sv, { pair }, env);
+    // Shared by every place the same literal was read, and read-only anyways
+    if (env.constants.contains(cons_cell.get()))
+        return raise_error("(set-car!)/(set-cdr!) cannot modify a constant, such as quoted data"sv, { pair }, env);
+    // Can't be copied on write, other conses point to it where they are
+    if (env.is_from_base(cons_cell))
+        return raise_error("(set-car!)/(set-cdr!) cannot modify a cons from before the environment was forked"sv, { pair }, env);
+
+    (*cons_cell).*member = value;
+    return Sexp();
 }
-Sexp builtin_cons(Sexp params, Environment& env) {
-    Sexp a;
-    Sexp b;
-    list_get_everything(params, { &a, &b }, env);
-    return cons(
-        eval(a, env),
-        eval(b, env),
-        env);
+
+Sexp builtin_is_null(Sexp x, Environment& env) {
+    return Sexp(x.is_nil());
 }
 
-Sexp builtin_is_null(Sexp params, Environment& env) {
-    return Sexp(eval(car(params), env).is_nil());
+// Same object, or same symbol or number
+Sexp builtin_is_eq(Sexp a, Sexp b, Environment& env) {
+    return Sexp(a._value == b._value);
 }
 
 Sexp builtin_quote(Sexp params, Environment& env) {
@@ -200,8 +222,6 @@ Sexp builtin_quote(Sexp params, Environment& env) {
 }
 
 Sexp builtin_define(Sexp params, Environment& env) {
-    auto& curr_scope = env.curr_scope->bindings;
-
     Sexp declaration;
     Sexp body;
     list_get_prefix(params, { &declaration }, &body, env);
@@ -209,12 +229,14 @@ Sexp builtin_define(Sexp params, Environment& env) {
     switch (declaration.get_flags()) {
         // Defining a value
         case SCVAL_FLAG_SYMBOL: {
-            auto& name = declaration.as_symbol();
+            auto name = declaration.as_symbol();
 
             Sexp val;
             list_get_everything(body, { &val }, env);
 
-            curr_scope.insert_or_assign(&name, eval(val, env));
+            Sexp value = eval(val, env);
+            RETURN_IF_UNWINDING(env);
+            env.curr_scope->define(name, value);
         } break;
 
         // Defining a function
@@ -225,12 +247,12 @@ Sexp builtin_define(Sexp params, Environment& env) {
 
             if (!decl_name.is_symbol())
                 throw EvalException("proc name must be a symbol"s);
-            auto& proc_name = decl_name.as_symbol();
+            auto proc_name = decl_name.as_symbol();
 
             auto p = make_user_proc(decl_params, body, env);
-            p->name = &proc_name;
+            p->name = &env.sym_pool.get(proc_name);
 
-            env.curr_scope->bindings.insert_or_assign(&proc_name, Sexp(p));
+            env.curr_scope->define(proc_name, Sexp(p));
         } break;
 
         default:
@@ -246,6 +268,8 @@ Sexp builtin_lambda(Sexp params, Environment& env) {
     list_get_prefix(params, { &decl_params }, &body, env);
 
     auto p = make_user_proc(decl_params, body, env);
+    if (profiling_active)
+        profile_note_lambda(*p, params, env);
 
     return Sexp(p);
 }
@@ -258,9 +282,9 @@ Sexp builtin_set(Sexp params, Environment& env) {
     if (!binding.is_symbol())
         throw EvalException("(set!) expected symbol as 1st argument"s);
 
-    env.set_binding(
-        binding.as_symbol(),
-        eval(value, env));
+    Sexp new_value = eval(value, env);
+    RETURN_IF_UNWINDING(env);
+    env.set_binding(binding.as_symbol(), new_value);
 
     return Sexp();
 }
@@ -270,6 +294,7 @@ Sexp builtin_set(Sexp params, Environment& env) {
 Sexp do_let_unnamed(Sexp binding_forms, Sexp body, Environment& env, bool prebind_scope) {
     auto [scope, _] = env.heap.allocate<Scope>();
     scope->prev = HeapPtr(env.curr_scope);
+    scope->worker_id = env.worker_id;
 
     DEFER_RESTORE_VALUE(env.curr_scope);
     if (prebind_scope)
@@ -283,9 +308,11 @@ Sexp do_let_unnamed(Sexp binding_forms, Sexp body, Environment& env, bool prebin
 
         if (!id.is_symbol())
             throw EvalException("(let) id must be a symbol");
-        auto& id_sym = id.as_symbol();
+        auto id_sym = id.as_symbol();
 
-        scope->bindings.try_emplace(&id_sym, eval(val_expr, env));
+        Sexp val = eval(val_expr, env);
+        RETURN_IF_UNWINDING(env);
+        scope->try_define(id_sym, val);
     }
 
     if (!prebind_scope)
@@ -295,15 +322,16 @@ Sexp do_let_unnamed(Sexp binding_forms, Sexp body, Environment& env, bool prebin
 }
 
 // (let proc-id ((id val-expr) ...) body ...)
-Sexp do_let_named(const Symbol& proc_name, Sexp binding_forms, Sexp body, Environment& env) {
+Sexp do_let_named(SymbolId proc_name, Sexp binding_forms, Sexp body, Environment& env) {
     auto [scope, _] = env.heap.allocate<Scope>();
     scope->prev = HeapPtr(env.curr_scope);
+    scope->worker_id = env.worker_id;
 
     DEFER_RESTORE_VALUE(env.curr_scope);
     env.curr_scope = scope;
 
     // Extract parameter ids, and bind val-exprs after evaluating them
-    std::vector<const Symbol*> proc_args;
+    std::vector<SymbolId> proc_args;
     for (auto& form : iterate(binding_forms, env)) {
         Sexp id;
         Sexp val_expr;
@@ -311,10 +339,12 @@ Sexp do_let_named(const Symbol& proc_name, Sexp binding_forms, Sexp body, Enviro
 
         if (!id.is_symbol())
             throw EvalException("(let) id must be a symbol"s);
-        auto& id_sym = id.as_symbol();
+        auto id_sym = id.as_symbol();
 
-        proc_args.push_back(&id_sym);
-        scope->bindings.try_emplace(&id_sym, eval(val_expr, env));
+        proc_args.push_back(id_sym);
+        Sexp val = eval(val_expr, env);
+        RETURN_IF_UNWINDING(env);
+        scope->try_define(id_sym, val);
     }
 
     auto [proc, DISCARD] = env.heap.allocate_only<UserProc>();
@@ -323,7 +353,7 @@ Sexp do_let_named(const Symbol& proc_name, Sexp binding_forms, Sexp body, Enviro
         .arguments = std::move(proc_args),
         .body = body.as_ptr<ConsCell>(),
     };
-    scope->bindings.try_emplace(&proc_name, Sexp(HeapPtr<void>(proc)));
+    scope->try_define(proc_name, Sexp(HeapPtr<void>(proc)));
 
     return eval_many(body.as_ptr<ConsCell>().get(), env);
 }
@@ -335,6 +365,7 @@ Sexp do_let(Sexp params, Environment& env, bool prebind_scope) {
 
     auto [scope, _] = env.heap.allocate<Scope>();
     scope->prev = HeapPtr(env.curr_scope);
+    scope->worker_id = env.worker_id;
 
     if (arg_1st.is_symbol()) {
         Sexp binding_forms;
@@ -359,11 +390,40 @@ Sexp builtin_let_star(Sexp params, Environment& env) {
 Sexp builtin_progn(Sexp params, Environment& env) {
     return eval_many(params.as_ptr<ConsCell>().get(), env);
 }
+
+/// Counts a call to a user procedure towards Environment::call_depth for as long as it lives, throwing if that goes over the budget
+class CallDepthScope {
+private:
+    Environment& _env;
+
+public:
+    explicit CallDepthScope(Environment& env)
+        : _env{ env } //
+    {
+        if (env.call_depth >= env.budget.max_depth) [[unlikely]]
+            throw EvalException{ .msg = std::format("maximum call depth of {} exceeded", env.budget.max_depth), .budget_exceeded = true };
+        ++env.call_depth;
+    }
+
+    CallDepthScope(const CallDepthScope&) = delete;
+    CallDepthScope& operator=(const CallDepthScope&) = delete;
+
+    ~CallDepthScope() { --_env.call_depth; }
+};
+
+/// Reports a call to `proc` with only `found` arguments
+Sexp too_few_args(const UserProc& proc, size_t found, Environment& env) {
+    auto expected = proc.arguments.size();
+    return raise_error("too few arguments provided to proc"sv, { Sexp(static_cast<int32_t>(expected)), Sexp(static_cast<int32_t>(found)) }, env, [&] {
+        return std::format("too few arguments provided to proc, expected {} but found {}", expected, found);
+    });
+}
 } // namespace
 
 Sexp call_user_proc(const UserProc& proc, Sexp params, Environment& env) {
     auto [s, _] = env.heap.allocate<Scope>();
     s->prev = proc.closure_frame;
+    s->worker_id = env.worker_id;
 
     auto it_decl = proc.arguments.begin();
     auto it_value = SexpListIterator(params, env);
@@ -372,7 +432,8 @@ Sexp call_user_proc(const UserProc& proc, Sexp params, Environment& env) {
         auto& arg_name = *it_decl;
         // NOTE: we are still evaluating in the parent CallFrame, but merely storing the result in the current CallFrame
         auto arg_value = eval(*it_value, env);
-        s->bindings.try_emplace(arg_name, std::move(arg_value));
+        RETURN_IF_UNWINDING(env);
+        s->try_define(arg_name, std::move(arg_value));
 
         ++it_decl;
         ++it_value;
@@ -380,41 +441,219 @@ Sexp call_user_proc(const UserProc& proc, Sexp params, Environment& env) {
     }
 
     if (it_decl != proc.arguments.end())
-        throw EvalException(std::format("too few arguments provided to proc, expected {} but found {}", proc.arguments.size(), n_args));
+        return too_few_args(proc, n_args, env);
 
+    CallDepthScope depth(env);
+    ProfileScope profile(proc);
     DEFER_RESTORE_VALUE(env.curr_scope);
     env.curr_scope = s;
 
     return eval_many(proc.body.get(), env);
 }
 
-Sexp eval(Sexp sexp, Environment& env) {
-    switch (sexp.get_flags()) {
-        case SCVAL_FLAG_PTR: {
-            auto& cons_cell = *sexp.as_ptr<ConsCell>();
-            auto& func = cons_cell.car;
-            auto& params = cons_cell.cdr;
+Sexp call_user_proc(const UserProc& proc, std::span<const Sexp> args, Environment& env) {
+    if (args.size() < proc.arguments.size())
+        return too_few_args(proc, args.size(), env);
 
-            if (func.is_symbol()) {
-                auto& proc_name = func.as_symbol();
-                auto proc = env.lookup_binding(proc_name);
+    auto [s, _] = env.heap.allocate<Scope>();
+    s->prev = proc.closure_frame;
+    s->worker_id = env.worker_id;
+    for (size_t i = 0; i < proc.arguments.size(); ++i) {
+        s->try_define(proc.arguments[i], args[i]);
+    }
+
+    CallDepthScope depth(env);
+    ProfileScope profile(proc);
+    DEFER_RESTORE_VALUE(env.curr_scope);
+    env.curr_scope = s;
 
-                if (proc == nullptr)
-                    return Sexp();
+    return eval_many(proc.body.get(), env);
+}
 
-                if (auto up = proc->as_ptr<UserProc>())
-                    return call_user_proc(*up, params, env);
-                if (auto bp = proc->as_ptr<BuiltinProc>())
-                    return bp->fn(params, env);
+void throw_native_type_error(std::string_view who, size_t index, std::string_view expected) {
+    throw EvalException(std::format("({}) expected {} for argument {}", who, expected, index + 1));
+}
 
-                throw EvalException(std::format("proc '{}' not found", std::string_view(proc_name)));
+namespace {
+/// Arguments of a call to a primitive or native procedure, evaluated into a buffer that lives on the native stack.
+/// NOTE: not a stack kept in the Environment: the coroutines of a thread share their Environment, and one may get switched out halfway through evaluating arguments, while its own native stack stays put.
+class EvaluatedArgs {
+private:
+    static constexpr size_t INLINE_SIZE = 8;
+
+    Sexp _inline[INLINE_SIZE];
+    size_t _size = 0;
+    /// Everything, once there are more than fit in `_inline`
+    std::vector<Sexp> _spilled;
+
+public:
+    EvaluatedArgs(Sexp params, Environment& env) {
+        for (auto& param : iterate(params, env)) {
+            Sexp v = eval(param, env);
+            // Left incomplete, the caller checks for this itself
+            if (env.unwinding) [[unlikely]]
+                return;
+            if (_size < INLINE_SIZE) [[likely]] {
+                _inline[_size] = v;
+            } else {
+                if (_spilled.empty())
+                    _spilled.assign(_inline, _inline + INLINE_SIZE);
+                _spilled.push_back(v);
             }
+            _size += 1;
+        }
+    }
+
+    EvaluatedArgs(const EvaluatedArgs&) = delete;
+    EvaluatedArgs& operator=(const EvaluatedArgs&) = delete;
+
+    std::span<const Sexp> span() const {
+        return _size <= INLINE_SIZE ? std::span<const Sexp>(_inline, _size) : std::span<const Sexp>(_spilled);
+    }
+};
+
+/// Reports a call to the procedure `name` with `found` arguments, where it takes `min_args` to `max_args`
+Sexp arity_error(const Symbol& name, size_t min_args, size_t max_args, size_t found, Environment& env) {
+    return raise_error("wrong number of arguments"sv, { Sexp(name.id()), Sexp(static_cast<int32_t>(found)) }, env, [&] {
+        std::string expected;
+        if (min_args == max_args)
+            expected = std::format("{}", min_args);
+        else if (max_args == PrimitiveProc::VARIADIC)
+            expected = std::format("at least {}", min_args);
+        else
+            expected = std::format("{} to {}", min_args, max_args);
+        return std::format("wrong number of arguments to ({}), expected {} but found {}", std::string_view(name), expected, found);
+    });
+}
+
+Sexp call_primitive_proc(const PrimitiveProc& proc, std::span<const Sexp> args, Environment& env) {
+    if (args.size() < proc.min_args || args.size() > proc.max_args) [[unlikely]]
+        return arity_error(*proc.name, proc.min_args, proc.max_args, args.size(), env);
+
+    ProfileScope profile(proc);
+    return proc.fn(args, env);
+}
+
+Sexp call_primitive_proc(const PrimitiveProc& proc, Sexp params, Environment& env) {
+    // Calls with 1 or 2 arguments keep them in locals, if there's an entry point for that
+    if (auto first = SexpListIterator::calc_next(params, env)) {
+        auto second = SexpListIterator::calc_next(first->cdr, env);
+        if (!second && proc.fn1) {
+            Sexp a = eval(first->car, env);
+            RETURN_IF_UNWINDING(env);
+            ProfileScope profile(proc);
+            return proc.fn1(a, env);
+        }
+        if (second && proc.fn2 && !SexpListIterator::calc_next(second->cdr, env)) {
+            Sexp a = eval(first->car, env);
+            RETURN_IF_UNWINDING(env);
+            Sexp b = eval(second->car, env);
+            RETURN_IF_UNWINDING(env);
+            ProfileScope profile(proc);
+            return proc.fn2(a, b, env);
+        }
+    }
+
+    EvaluatedArgs args(params, env);
+    RETURN_IF_UNWINDING(env);
+    return call_primitive_proc(proc, args.span(), env);
+}
+
+Sexp call_native_proc(const NativeProc& proc, std::span<const Sexp> args, Environment& env) {
+    if (args.size() != proc.arity)
+        return arity_error(*proc.name, proc.arity, proc.arity, args.size(), env);
+
+    ProfileScope profile(proc);
+    return proc.fn(args, env);
+}
+
+Sexp call_native_proc(const NativeProc& proc, Sexp params, Environment& env) {
+    EvaluatedArgs args(params, env);
+    RETURN_IF_UNWINDING(env);
+    return call_native_proc(proc, args.span(), env);
+}
+} // namespace
 
-            throw EvalException("(proc-call ...) form must begin with a symbol"s);
+Sexp apply_proc(Sexp proc, std::span<const Sexp> args, Environment& env) {
+    if (!proc.is_nil() && proc.is_ptr()) {
+        auto ptr = proc.as_ptr();
+        switch (ptr.get_type()) {
+            using enum ObjectType;
+            case TYPE_USER_PROC: return call_user_proc(*ptr.get_as_unchecked<UserProc>(), args, env);
+            case TYPE_PRIMITIVE_PROC: return call_primitive_proc(*ptr.get_as_unchecked<PrimitiveProc>(), args, env);
+            case TYPE_NATIVE_PROC: return call_native_proc(*ptr.get_as_unchecked<NativeProc>(), args, env);
+            case TYPE_BUILTIN_PROC:
+                throw EvalException(std::format("({}) is a special form, it can't be called with values", std::string_view(*ptr.get_as_unchecked<BuiltinProc>()->name)));
+            default: break;
+        }
+    }
+
+    throw EvalException("expected a procedure"s);
+}
+
+bool is_proc(Sexp v) {
+    return !v.is_nil() && (v.is_ptr<UserProc>() || v.is_ptr<PrimitiveProc>() || v.is_ptr<NativeProc>());
+}
+
+namespace {
+Sexp eval_call(const ConsCell& cons_cell, Environment& env) {
+    auto& func = cons_cell.car;
+    auto& params = cons_cell.cdr;
+
+    if (func.is_symbol()) {
+        auto proc_name = func.as_symbol();
+        auto proc = env.lookup_binding(proc_name);
+
+        if (proc == nullptr)
+            return Sexp();
+
+        if (!proc->is_nil() && proc->is_ptr()) {
+            auto ptr = proc->as_ptr();
+            switch (ptr.get_type()) {
+                using enum ObjectType;
+                case TYPE_USER_PROC: return call_user_proc(*ptr.get_as_unchecked<UserProc>(), params, env);
+                case TYPE_PRIMITIVE_PROC: return call_primitive_proc(*ptr.get_as_unchecked<PrimitiveProc>(), params, env);
+                case TYPE_BUILTIN_PROC: {
+                    auto& bp = *ptr.get_as_unchecked<BuiltinProc>();
+                    ProfileScope profile(bp);
+                    return bp.fn(params, env);
+                }
+                case TYPE_NATIVE_PROC: return call_native_proc(*ptr.get_as_unchecked<NativeProc>(), params, env);
+                case TYPE_MACRO: return eval(expand_macro_use(*ptr.get_as_unchecked<Macro>(), cons_cell, env), env);
+                default: break;
+            }
+        }
+
+        throw EvalException(std::format("proc '{}' not found", std::string_view(env.sym_pool.get(proc_name))));
+    }
+
+    throw EvalException("(proc-call ...) form must begin with a symbol"s);
+}
+} // namespace
+
+Sexp eval(Sexp sexp, Environment& env) {
+    switch (sexp.get_flags()) {
+        case SCVAL_FLAG_PTR: {
+            // Strings, procs, etc. evaluate to themselves, same as atoms
+            if (sexp.is_nil() || !sexp.is_ptr<ConsCell>())
+                return sexp;
+
+            auto& cons_cell = *sexp.as_ptr<ConsCell>();
+            AllocationSite site(cons_cell);
+            try {
+                if (--env.fuel < 0) [[unlikely]]
+                    env.refuel();
+                return eval_call(cons_cell, env);
+            } catch (EvalException& e) {
+                // Point at the innermost form that came from source, the ones further in were made at runtime
+                if (!e.location)
+                    e.location = env.source_map.find(&cons_cell);
+                throw;
+            }
         } break;
 
         case SCVAL_FLAG_SYMBOL: {
-            const auto& name = sexp.as_symbol();
+            auto name = sexp.as_symbol();
 
             if (auto binding = env.lookup_binding(name))
                 return *binding;
@@ -444,6 +683,7 @@ Sexp eval_many(ConsCell* forms, Environment& env) {
             return eval(curr->car, env);
         } else {
             eval(curr->car, env);
+            RETURN_IF_UNWINDING(env);
             curr = curr->cdr.as_ptr<ConsCell>().get();
         }
     }
@@ -452,37 +692,43 @@ Sexp eval_many(ConsCell* forms, Environment& env) {
 }
 
 void setup_scope_for_builtins(Environment& env) {
-    auto& s = env.global_scope->bindings;
+    auto& s = *env.global_scope;
     auto& h = env.heap;
     auto& p = env.sym_pool;
-#define PROC(name, func)                                      \
-    do {                                                      \
-        auto& sym = p.intern(name);                           \
-        auto [proc, _] = h.allocate<BuiltinProc>(&sym, func); \
-        s.emplace(&sym, Sexp(proc));                          \
-    } while (false)
-    PROC("+", builtin_add);
-    PROC("-", builtin_sub);
-    PROC("*", builtin_mul);
-    PROC("/", builtin_div);
-    PROC("sqrt", builtin_sqrt);
+    constexpr auto VARIADIC = PrimitiveProc::VARIADIC;
+    PRIMITIVE("+", 0, VARIADIC, builtin_add, nullptr, builtin_add2);
+    PRIMITIVE("-", 0, VARIADIC, builtin_sub, nullptr, builtin_sub2);
+    PRIMITIVE("*", 0, VARIADIC, builtin_mul, nullptr, builtin_mul2);
+    PRIMITIVE("/", 0, VARIADIC, builtin_div);
+    PRIMITIVE("=", 0, VARIADIC, builtin_compare<std::equal_to<>>, nullptr, builtin_compare2<std::equal_to<>>);
+    PRIMITIVE("<", 0, VARIADIC, builtin_compare<std::less<>>, nullptr, builtin_compare2<std::less<>>);
+    PRIMITIVE("<=", 0, VARIADIC, builtin_compare<std::less_equal<>>, nullptr, builtin_compare2<std::less_equal<>>);
+    PRIMITIVE(">", 0, VARIADIC, builtin_compare<std::greater<>>, nullptr, builtin_compare2<std::greater<>>);
+    PRIMITIVE(">=", 0, VARIADIC, builtin_compare<std::greater_equal<>>, nullptr, builtin_compare2<std::greater_equal<>>);
+    PRIMITIVE("car", 1, 1, PrimitiveProc::unary<builtin_car>, builtin_car);
+    PRIMITIVE("cdr", 1, 1, PrimitiveProc::unary<builtin_cdr>, builtin_cdr);
+    PRIMITIVE("cons", 2, 2, PrimitiveProc::binary<builtin_cons>, nullptr, builtin_cons);
+    PRIMITIVE("set-car!", 2, 2, PrimitiveProc::binary<builtin_set_cons_member<&ConsCell::car>>, nullptr, builtin_set_cons_member<&ConsCell::car>);
+    PRIMITIVE("set-cdr!", 2, 2, PrimitiveProc::binary<builtin_set_cons_member<&ConsCell::cdr>>, nullptr, builtin_set_cons_member<&ConsCell::cdr>);
+    PRIMITIVE("null?", 1, 1, PrimitiveProc::unary<builtin_is_null>, builtin_is_null);
+    PRIMITIVE("eq?", 2, 2, PrimitiveProc::binary<builtin_is_eq>, nullptr, builtin_is_eq);
+
     PROC("if", builtin_if);
-    PROC("=", builtin_binary_op<std::equal_to<>>);
-    PROC("<", builtin_binary_op<std::less<>>);
-    PROC("<=", builtin_binary_op<std::less_equal<>>);
-    PROC(">", builtin_binary_op<std::greater<>>);
-    PROC(">=", builtin_binary_op<std::greater_equal<>>);
-    PROC("car", builtin_car);
-    PROC("cdr", builtin_cdr);
-    PROC("cons", builtin_cons);
-    PROC("null?", builtin_is_null);
     PROC("quote", builtin_quote);
     PROC("define", builtin_define);
     PROC("lambda", builtin_lambda);
     PROC("set!", builtin_set);
     PROC("let", builtin_let_basic);
     PROC("let*", builtin_let_star);
-#undef PROC
+
+    env.define_native("sqrt", [](double x) { return std::sqrt(x); });
+
+    setup_scope_for_parallel_builtins(env);
+    setup_scope_for_async_builtins(env);
+    setup_scope_for_string_builtins(env);
+    setup_scope_for_quasiquote_builtins(env);
+    setup_scope_for_macro_builtins(env);
+    setup_scope_for_control_builtins(env);
 }
 
 } // namespace yawarakai
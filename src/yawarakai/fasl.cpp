@@ -0,0 +1,465 @@
+module;
+#include <unistd.h>
+
+module yawarakai;
+import std;
+
+using namespace std::literals;
+
+namespace yawarakai {
+
+namespace {
+
+// Sexps are stored in the node stream as:
+//   - numbers, booleans and nil as themselves, their bits don't depend on anything in this process
+//   - symbols with their index into the image's symbol table, in place of the SymbolId
+//   - cons cells and strings with SCVAL_FLAG_PTR, one of the FASL_REF_* kinds, and their index into the cells or strings,
+//     plus FASL_REF_CONSTANT if it was a constant (see ConstantPool) not inside of another one, i.e. a literal to intern again on load
+// None of which use bits 6 and 7.
+//
+// Cells are stored in post-order, so the cdr of a cell is either an atom or the cell right before it.
+// Each one is the encoded car with one of the FASL_CDR_* modes in bits 6 and 7, followed by the encoded cdr only for FASL_CDR_NEXT_WORD.
+// Proper lists therefore take a word per element.
+constexpr uint64_t FASL_REF_CONS = 1 << 3;
+constexpr uint64_t FASL_REF_STRING = 2 << 3;
+constexpr uint64_t FASL_REF_KIND_MASK = 3 << 3;
+constexpr uint64_t FASL_REF_CONSTANT = 1 << 5;
+constexpr int FASL_REF_INDEX_SHIFT = 8;
+
+constexpr uint64_t FASL_CDR_NEXT_WORD = 0 << 6;
+constexpr uint64_t FASL_CDR_NIL = 1 << 6;
+constexpr uint64_t FASL_CDR_PREVIOUS_CELL = 2 << 6;
+constexpr uint64_t FASL_CDR_MODE_MASK = 3 << 6;
+
+uint64_t encode_ref(uint64_t kind, size_t idx) {
+    return (static_cast<uint64_t>(idx) << FASL_REF_INDEX_SHIFT) | kind | SCVAL_FLAG_PTR;
+}
+
+size_t align_section(size_t size) {
+    return (size + 7) & ~size_t(7);
+}
+
+template <typename T>
+T load_unaligned(const char* p) {
+    T v;
+    std::memcpy(&v, p, sizeof(T));
+    return v;
+}
+
+// XXH64, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+constexpr uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87;
+constexpr uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4F;
+constexpr uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9;
+constexpr uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63;
+constexpr uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5;
+
+uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = std::rotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+uint64_t xxh64_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t xxh64(std::string_view data, uint64_t seed) {
+    const char* p = data.data();
+    const char* end = p + data.size();
+    uint64_t h;
+
+    if (data.size() >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        for (; end - p >= 32; p += 32) {
+            v1 = xxh64_round(v1, load_unaligned<uint64_t>(p));
+            v2 = xxh64_round(v2, load_unaligned<uint64_t>(p + 8));
+            v3 = xxh64_round(v3, load_unaligned<uint64_t>(p + 16));
+            v4 = xxh64_round(v4, load_unaligned<uint64_t>(p + 24));
+        }
+        h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) + std::rotl(v4, 18);
+        h = xxh64_merge_round(h, v1);
+        h = xxh64_merge_round(h, v2);
+        h = xxh64_merge_round(h, v3);
+        h = xxh64_merge_round(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+
+    h += data.size();
+
+    for (; end - p >= 8; p += 8) {
+        h ^= xxh64_round(0, load_unaligned<uint64_t>(p));
+        h = std::rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (end - p >= 4) {
+        h ^= load_unaligned<uint32_t>(p) * XXH_PRIME64_1;
+        h = std::rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; ++p) {
+        h ^= static_cast<uint8_t>(*p) * XXH_PRIME64_5;
+        h = std::rotl(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/// Offsets of each section of a FASL image, see FaslHeader
+struct FaslLayout {
+    size_t symbol_lengths;
+    size_t string_lengths;
+    size_t nodes;
+    size_t positions;
+    size_t symbol_names;
+    size_t string_contents;
+    size_t end;
+
+    explicit FaslLayout(const FaslHeader& h) {
+        symbol_lengths = sizeof(FaslHeader);
+        string_lengths = symbol_lengths + align_section(h.symbol_count * sizeof(uint32_t));
+        nodes = string_lengths + align_section(h.string_count * sizeof(uint32_t));
+        positions = nodes + h.node_words * sizeof(uint64_t);
+        symbol_names = positions + h.position_count * sizeof(FaslPosition);
+        string_contents = symbol_names + h.symbol_bytes;
+        end = string_contents + h.string_bytes;
+    }
+};
+
+static_assert(sizeof(FaslHeader) % 8 == 0);
+static_assert(sizeof(FaslPosition) == 12);
+
+} // namespace
+
+uint64_t fasl_source_hash(std::string_view source) {
+    return xxh64(source, 0);
+}
+
+std::filesystem::path fasl_path_for(const std::filesystem::path& source_path) {
+    auto res = source_path;
+    res += ".fasl";
+    return res;
+}
+
+std::string write_fasl(Sexp program, uint64_t source_hash, Environment& env) {
+    constexpr uint32_t NO_INDEX = ~uint32_t(0);
+    // Index into the image's symbol table, by SymbolId
+    std::vector<uint32_t> symbol_indices(env.sym_pool.size(), NO_INDEX);
+    std::vector<std::string_view> symbols;
+    std::vector<std::string_view> strings;
+    std::vector<uint64_t> nodes;
+    std::vector<FaslPosition> positions;
+    uint64_t cell_count = 0;
+    bool record_positions = env.source_map.is_enabled();
+
+    // Cells are written in post-order, so that loading can build each one out of already built ones.
+    // NOTE: explicit stack, since a program is one long cdr chain
+    struct Frame {
+        Sexp sexp;
+        bool children_visited;
+        /// Part of a constant, which is interned again as a whole
+        bool in_constant;
+    };
+    std::vector<Frame> stack;
+    // Encoded values that are done, waiting for their parent to be written
+    std::vector<uint64_t> done;
+
+    stack.push_back({ program, false, false });
+    while (!stack.empty()) {
+        auto [sexp, children_visited, in_constant] = stack.back();
+
+        if (sexp.is_symbol()) {
+            auto& idx = symbol_indices[std::to_underlying(sexp.as_symbol())];
+            if (idx == NO_INDEX) {
+                idx = symbols.size();
+                symbols.push_back(env.sym_pool.get(sexp.as_symbol()));
+            }
+            done.push_back((static_cast<uint64_t>(idx) << 32) | SCVAL_FLAG_SYMBOL);
+            stack.pop_back();
+            continue;
+        }
+
+        if (!sexp.is_ptr() || sexp.is_nil()) {
+            done.push_back(sexp._value);
+            stack.pop_back();
+            continue;
+        }
+
+        uint64_t constant_flag = !in_constant && env.constants.contains(sexp.as_ptr().get()) ? FASL_REF_CONSTANT : 0;
+
+        if (auto str = sexp.as_ptr().get_as<String>()) {
+            done.push_back(encode_ref(FASL_REF_STRING, strings.size()) | constant_flag);
+            strings.push_back(str->view());
+            stack.pop_back();
+            continue;
+        }
+
+        auto cell = sexp.as_ptr().get_as<ConsCell>();
+        if (!cell)
+            throw std::runtime_error("write_fasl(): only cons cells and strings can be serialized"s);
+
+        if (!children_visited) {
+            stack.back().children_visited = true;
+            // car goes on top, so that it's done first
+            stack.push_back({ cell->cdr, false, in_constant || constant_flag });
+            stack.push_back({ cell->car, false, in_constant || constant_flag });
+            continue;
+        }
+
+        // Constants get theirs from where they're interned on load, the same as when they're parsed: none
+        if (record_positions && !in_constant && !constant_flag) {
+            if (auto loc = env.source_map.find(cell))
+                positions.push_back({ static_cast<uint32_t>(cell_count), loc->line, loc->column });
+        }
+
+        uint64_t cdr = done.back();
+        done.pop_back();
+        uint64_t car = done.back();
+        done.pop_back();
+        if (cdr == SCVAL_NIL) {
+            nodes.push_back(car | FASL_CDR_NIL);
+        } else if (cell_count > 0 && cdr == encode_ref(FASL_REF_CONS, cell_count - 1)) {
+            nodes.push_back(car | FASL_CDR_PREVIOUS_CELL);
+        } else {
+            nodes.push_back(car | FASL_CDR_NEXT_WORD);
+            nodes.push_back(cdr);
+        }
+        done.push_back(encode_ref(FASL_REF_CONS, cell_count) | constant_flag);
+        cell_count += 1;
+        stack.pop_back();
+    }
+
+    FaslHeader header{
+        .magic = FaslHeader::MAGIC,
+        .version = FaslHeader::VERSION,
+        .byte_order_mark = FaslHeader::BYTE_ORDER_MARK,
+        .source_hash = source_hash,
+        .root = done.back(),
+        .symbol_count = static_cast<uint32_t>(symbols.size()),
+        .string_count = static_cast<uint32_t>(strings.size()),
+        .cell_count = cell_count,
+        .node_words = nodes.size(),
+        .symbol_bytes = 0,
+        .string_bytes = 0,
+        .position_count = static_cast<uint32_t>(positions.size()),
+        .flags = record_positions ? FaslHeader::FLAG_HAS_POSITIONS : 0,
+    };
+    for (auto sym : symbols)
+        header.symbol_bytes += sym.size();
+    for (auto str : strings)
+        header.string_bytes += str.size();
+
+    FaslLayout layout(header);
+    std::string image(layout.end, '\0');
+    std::memcpy(image.data(), &header, sizeof(header));
+
+    auto write_table = [&](const std::vector<std::string_view>& table, size_t lengths_offset, size_t contents_offset) {
+        for (size_t i = 0; i < table.size(); ++i) {
+            auto len = static_cast<uint32_t>(table[i].size());
+            std::memcpy(image.data() + lengths_offset + i * sizeof(uint32_t), &len, sizeof(len));
+            std::memcpy(image.data() + contents_offset, table[i].data(), len);
+            contents_offset += len;
+        }
+    };
+    write_table(symbols, layout.symbol_lengths, layout.symbol_names);
+    write_table(strings, layout.string_lengths, layout.string_contents);
+    std::memcpy(image.data() + layout.nodes, nodes.data(), nodes.size() * sizeof(uint64_t));
+    std::memcpy(image.data() + layout.positions, positions.data(), positions.size() * sizeof(FaslPosition));
+
+    return image;
+}
+
+std::optional<Sexp> read_fasl(std::string_view image, uint64_t source_hash, SourceFileId file, Environment& env) {
+    if (image.size() < sizeof(FaslHeader))
+        return std::nullopt;
+
+    auto header = load_unaligned<FaslHeader>(image.data());
+    if (header.magic != FaslHeader::MAGIC ||
+        header.version != FaslHeader::VERSION ||
+        header.byte_order_mark != FaslHeader::BYTE_ORDER_MARK ||
+        header.source_hash != source_hash)
+        return std::nullopt;
+    // Written without them, errors and profiles would have nowhere to point to: parse it again instead
+    if (env.source_map.is_enabled() && !(header.flags & FaslHeader::FLAG_HAS_POSITIONS))
+        return std::nullopt;
+
+    // Bound every count by the image size first, so that computing the layout can't overflow
+    if (header.node_words > image.size() || header.position_count > image.size() || header.symbol_bytes > image.size() || header.string_bytes > image.size())
+        return std::nullopt;
+    FaslLayout layout(header);
+    if (layout.end > image.size())
+        return std::nullopt;
+
+    auto lengths_add_up = [&](size_t lengths_offset, uint32_t count, uint64_t total) {
+        uint64_t sum = 0;
+        for (uint32_t i = 0; i < count; ++i)
+            sum += load_unaligned<uint32_t>(image.data() + lengths_offset + i * sizeof(uint32_t));
+        return sum == total;
+    };
+    if (!lengths_add_up(layout.symbol_lengths, header.symbol_count, header.symbol_bytes) ||
+        !lengths_add_up(layout.string_lengths, header.string_count, header.string_bytes))
+        return std::nullopt;
+
+    auto node_word = [&](uint64_t i) {
+        return load_unaligned<uint64_t>(image.data() + layout.nodes + i * sizeof(uint64_t));
+    };
+
+    // Check every word before interning anything: symbols will point into `image`, which the caller drops if we fail
+    // `n_cells` is the number of cells before the one holding `word`, which it can only refer to
+    auto is_valid = [&](uint64_t word, uint64_t n_cells) {
+        switch (word & SCVAL_MASK_FLAG) {
+            case SCVAL_FLAG_INT:
+            case SCVAL_FLAG_FLOAT:
+                return static_cast<uint32_t>(word) == (word & SCVAL_MASK_FLAG);
+            case SCVAL_FLAG_BOOL:
+                return word == SCVAL_TRUE || word == SCVAL_FALSE;
+            case SCVAL_FLAG_SYMBOL:
+                return static_cast<uint32_t>(word) == SCVAL_FLAG_SYMBOL && (word >> 32) < header.symbol_count;
+            case SCVAL_FLAG_PTR:
+                switch (word & (FASL_REF_KIND_MASK | FASL_CDR_MODE_MASK)) {
+                    case 0: return word == SCVAL_NIL;
+                    case FASL_REF_CONS: return (word >> FASL_REF_INDEX_SHIFT) < n_cells;
+                    case FASL_REF_STRING: return (word >> FASL_REF_INDEX_SHIFT) < header.string_count;
+                }
+                return false;
+        }
+        return false;
+    };
+    uint64_t n_cells = 0;
+    for (uint64_t i = 0; i < header.node_words; ++n_cells) {
+        uint64_t word = node_word(i++);
+        if (!is_valid(word & ~FASL_CDR_MODE_MASK, n_cells))
+            return std::nullopt;
+
+        switch (word & FASL_CDR_MODE_MASK) {
+            case FASL_CDR_NEXT_WORD:
+                if (i == header.node_words || !is_valid(node_word(i++), n_cells))
+                    return std::nullopt;
+                break;
+            case FASL_CDR_NIL:
+                break;
+            case FASL_CDR_PREVIOUS_CELL:
+                if (n_cells == 0)
+                    return std::nullopt;
+                break;
+            default:
+                return std::nullopt;
+        }
+    }
+    if (n_cells != header.cell_count || !is_valid(header.root, n_cells))
+        return std::nullopt;
+
+    auto position = [&](uint32_t i) {
+        return load_unaligned<FaslPosition>(image.data() + layout.positions + i * sizeof(FaslPosition));
+    };
+    for (uint32_t i = 0; i < header.position_count; ++i) {
+        if (position(i).cell_index >= header.cell_count)
+            return std::nullopt;
+    }
+
+    std::vector<SymbolId> symbol_ids(header.symbol_count);
+    size_t name_offset = layout.symbol_names;
+    for (uint32_t i = 0; i < header.symbol_count; ++i) {
+        auto len = load_unaligned<uint32_t>(image.data() + layout.symbol_lengths + i * sizeof(uint32_t));
+        symbol_ids[i] = env.sym_pool.intern_borrowed(image.substr(name_offset, len)).id();
+        name_offset += len;
+    }
+
+    ObjectRun<String> strings{};
+    if (header.string_count > 0)
+        strings = env.heap.allocate_run<String>(header.string_count);
+    size_t contents_offset = layout.string_contents;
+    for (uint32_t i = 0; i < header.string_count; ++i) {
+        auto len = load_unaligned<uint32_t>(image.data() + layout.string_lengths + i * sizeof(uint32_t));
+        new (strings[i]) String{ .borrowed = image.data() + contents_offset, .borrowed_size = len };
+        contents_offset += len;
+    }
+
+    ObjectRun<ConsCell> cells{};
+    if (header.cell_count > 0)
+        cells = env.heap.allocate_run<ConsCell>(header.cell_count);
+
+    // Cells are built after everything they point to, so a constant can be interned as soon as it's referred to
+    auto decode = [&](uint64_t word) {
+        Sexp res;
+        switch (word & SCVAL_MASK_FLAG) {
+            case SCVAL_FLAG_SYMBOL:
+                return Sexp(symbol_ids[word >> 32]);
+            case SCVAL_FLAG_PTR:
+                switch (word & FASL_REF_KIND_MASK) {
+                    case FASL_REF_CONS: res = Sexp(cells[word >> FASL_REF_INDEX_SHIFT]); break;
+                    case FASL_REF_STRING: res = Sexp(strings[word >> FASL_REF_INDEX_SHIFT]); break;
+                }
+                if (word & FASL_REF_CONSTANT)
+                    res = env.constants.intern(res);
+                return res;
+            default:
+                res._value = word;
+                return res;
+        }
+    };
+    uint64_t i = 0;
+    for (uint64_t c = 0; c < header.cell_count; ++c) {
+        uint64_t word = node_word(i++);
+        Sexp cdr;
+        switch (word & FASL_CDR_MODE_MASK) {
+            case FASL_CDR_NEXT_WORD:
+                cdr = decode(node_word(i++));
+                break;
+            case FASL_CDR_PREVIOUS_CELL:
+                cdr = Sexp(cells[c - 1]);
+                break;
+        }
+        new (cells[c]) ConsCell(decode(word & ~FASL_CDR_MODE_MASK), cdr);
+    }
+
+    if (env.source_map.is_enabled() && file != SourceFileId::NONE) {
+        std::vector<SourceMap::Entry> entries;
+        entries.reserve(header.position_count);
+        for (uint32_t i = 0; i < header.position_count; ++i) {
+            auto pos = position(i);
+            auto column = std::min<uint32_t>(pos.column, std::numeric_limits<uint16_t>::max());
+            entries.push_back({ cells[pos.cell_index], pos.line, static_cast<uint16_t>(column), file });
+        }
+        env.source_map.add(entries);
+    }
+
+    return decode(header.root);
+}
+
+bool save_fasl(const std::filesystem::path& path, std::string_view image) {
+    // Write to a private file and rename it over, so that a concurrent reader either gets the old image or the new one in full
+    auto tmp_path = path;
+    tmp_path += std::format(".{}.tmp", getpid());
+
+    {
+        std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!ofs)
+            return false;
+        ofs.write(image.data(), image.size());
+        if (!ofs.flush()) {
+            ofs.close();
+            std::error_code ec;
+            std::filesystem::remove(tmp_path, ec);
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+} // namespace yawarakai
@@ -1,5 +1,8 @@
 module;
 #include <cassert>
+#if defined(__SSE2__) || defined(__AVX2__)
+#    include <immintrin.h>
+#endif
 
 module yawarakai;
 import std;
@@ -8,20 +11,321 @@ using namespace std::literals;
 
 namespace yawarakai {
 
-Environment::Environment() {
+SymbolPool::SymbolPool() {
+    auto& table = *_tables.emplace_back(std::make_unique<Table>(1023, std::make_unique<std::atomic<uint64_t>[]>(1024)));
+    _table.store(&table, std::memory_order_release);
+}
+
+SymbolPool::~SymbolPool() {
+    for (auto& segment : _segments) {
+        delete[] segment.load(std::memory_order_relaxed);
+    }
+}
+
+size_t SymbolPool::probe(const Table& table, std::string_view str, size_t hash) const {
+    auto tag = static_cast<uint32_t>(hash);
+    for (size_t i = hash & table.mask;; i = (i + 1) & table.mask) {
+        // Pairs with the release store in intern_impl(), so the Symbol is fully visible once we can see its slot
+        uint64_t slot = table.slots[i].load(std::memory_order_acquire);
+        if (slot == 0)
+            return i;
+        if (static_cast<uint32_t>(slot >> 32) == tag) {
+            auto& sym = get(static_cast<SymbolId>(static_cast<uint32_t>(slot) - 1));
+            if (std::string_view(sym) == str)
+                return i;
+        }
+    }
+}
+
+const Symbol* SymbolPool::find(std::string_view str) const {
+    auto& table = *_table.load(std::memory_order_acquire);
+    uint64_t slot = table.slots[probe(table, str, std::hash<std::string_view>{}(str))].load(std::memory_order_acquire);
+    if (slot == 0)
+        return nullptr;
+    return &get(static_cast<SymbolId>(static_cast<uint32_t>(slot) - 1));
+}
+
+const Symbol& SymbolPool::intern_impl(std::string_view str, bool borrow) {
+    size_t hash = std::hash<std::string_view>{}(str);
+
+    // Fast path: almost every lookup is of a symbol that already exists
+    {
+        auto& table = *_table.load(std::memory_order_acquire);
+        uint64_t slot = table.slots[probe(table, str, hash)].load(std::memory_order_acquire);
+        if (slot != 0)
+            return get(static_cast<SymbolId>(static_cast<uint32_t>(slot) - 1));
+    }
+
+    std::lock_guard lock(_insert_mutex);
+
+    // Another thread may have added it since we looked
+    auto* table = _table.load(std::memory_order_relaxed);
+    size_t i = probe(*table, str, hash);
+    if (uint64_t slot = table->slots[i].load(std::memory_order_relaxed); slot != 0)
+        return get(static_cast<SymbolId>(static_cast<uint32_t>(slot) - 1));
+
+    uint32_t idx = _size.load(std::memory_order_relaxed);
+    if ((size_t(idx) + 1) * 2 > table->mask + 1) {
+        table = &grow(*table);
+        i = probe(*table, str, hash);
+    }
+
+    auto [segment_idx, offset] = locate(idx);
+    auto* segment = _segments[segment_idx].load(std::memory_order_relaxed);
+    if (segment == nullptr) {
+        segment = new Symbol[FIRST_SEGMENT_SIZE << segment_idx];
+        _segments[segment_idx].store(segment, std::memory_order_release);
+    }
+
+    auto& sym = segment[offset];
+    sym._id = static_cast<SymbolId>(idx);
+    if (borrow) {
+        sym._data = str.data();
+        sym._size = str.size() | Symbol::BORROWED_FLAG;
+    } else {
+        char* data = new char[str.size() + 1];
+        std::memcpy(data, str.data(), str.size());
+        // Null terminate
+        data[str.size()] = 0;
+        sym._data = data;
+        sym._size = str.size();
+    }
+
+    _size.store(idx + 1, std::memory_order_release);
+    // Publish the symbol only after it's complete
+    table->slots[i].store((static_cast<uint64_t>(static_cast<uint32_t>(hash)) << 32) | (idx + 1), std::memory_order_release);
+    return sym;
+}
+
+SymbolPool::Table& SymbolPool::grow(const Table& old_table) {
+    size_t new_size = (old_table.mask + 1) * 2;
+    auto& table = *_tables.emplace_back(std::make_unique<Table>(new_size - 1, std::make_unique<std::atomic<uint64_t>[]>(new_size)));
+
+    for (size_t i = 0; i <= old_table.mask; ++i) {
+        uint64_t slot = old_table.slots[i].load(std::memory_order_relaxed);
+        if (slot == 0)
+            continue;
+        // Only the low bits of the hash are cached, recompute it to find the new home
+        auto& sym = get(static_cast<SymbolId>(static_cast<uint32_t>(slot) - 1));
+        size_t hash = std::hash<std::string_view>{}(sym);
+        size_t j = hash & table.mask;
+        while (table.slots[j].load(std::memory_order_relaxed) != 0)
+            j = (j + 1) & table.mask;
+        table.slots[j].store(slot, std::memory_order_relaxed);
+    }
+
+    // Readers still on the old table will miss new symbols, and come to the locked path which sees this one
+    _table.store(&table, std::memory_order_release);
+    return table;
+}
+
+std::string format_location(const SourceLocation& loc) {
+    if (loc.file.empty())
+        return std::format("{}:{}", loc.line, loc.column);
+    return std::format("{}:{}:{}", loc.file, loc.line, loc.column);
+}
+
+SourceMap::SourceMap(const SourceMap& base)
+    : _base{ &base }
+    , _first_file{ base._first_file + base._files.size() }
+    , _enabled{ base._enabled } {}
+
+SourceFileId SourceMap::add_file(std::string name) {
+    std::lock_guard lock(_mutex);
+    // Running out of ids just means positions in further files go unrecorded
+    if (_first_file + _files.size() >= std::to_underlying(SourceFileId::NONE))
+        return SourceFileId::NONE;
+    _files.push_back(std::move(name));
+    return static_cast<SourceFileId>(_first_file + _files.size() - 1);
+}
+
+void SourceMap::rename_file(SourceFileId file, std::string name) {
+    if (file == SourceFileId::NONE)
+        return;
+    assert(std::to_underlying(file) >= _first_file);
+
+    std::lock_guard lock(_mutex);
+    _files[std::to_underlying(file) - _first_file] = std::move(name);
+}
+
+std::string_view SourceMap::file_name(SourceFileId file) const {
+    if (file == SourceFileId::NONE)
+        return {};
+    if (std::to_underlying(file) < _first_file)
+        return _base->file_name(file);
+
+    std::lock_guard lock(_mutex);
+    // NOTE: std::deque never moves its elements, so the name stays put as more files are added
+    return _files[std::to_underlying(file) - _first_file];
+}
+
+void SourceMap::add(std::span<const Entry> entries) {
+    std::lock_guard lock(_mutex);
+    _entries.insert(_entries.end(), entries.begin(), entries.end());
+}
+
+std::optional<SourceLocation> SourceMap::find(const ConsCell* cell) const {
+    std::optional<Entry> found;
+    {
+        std::lock_guard lock(_mutex);
+
+        // Lookups only happen for errors and reports, so sort lazily instead of keeping it sorted as the parser adds to it
+        if (_n_sorted < _entries.size()) {
+            auto by_address = [](const Entry& a, const Entry& b) { return std::less<>{}(a.cell, b.cell); };
+            auto middle = _entries.begin() + _n_sorted;
+            std::sort(middle, _entries.end(), by_address);
+            std::inplace_merge(_entries.begin(), middle, _entries.end(), by_address);
+            _n_sorted = _entries.size();
+        }
+
+        auto it = std::lower_bound(_entries.begin(), _entries.end(), cell, [](const Entry& e, const ConsCell* c) { return std::less<>{}(e.cell, c); });
+        if (it != _entries.end() && it->cell == cell)
+            found = *it;
+    }
+
+    if (!found)
+        return _base ? _base->find(cell) : std::nullopt;
+    return SourceLocation{ file_name(found->file), found->line, found->column };
+}
+
+size_t SourceMap::size() const {
+    std::lock_guard lock(_mutex);
+    return _entries.size();
+}
+
+std::optional<Sexp> FormCache::find(const ConsCell* form) const {
+    {
+        std::shared_lock lock(_mutex);
+        if (auto it = _entries.find(form); it != _entries.end())
+            return it->second;
+    }
+    return _base ? _base->find(form) : std::nullopt;
+}
+
+Sexp FormCache::add(const ConsCell* form, Sexp value) {
+    std::unique_lock lock(_mutex);
+    auto [it, _] = _entries.try_emplace(form, value);
+    return it->second;
+}
+
+Environment::Environment()
+    : owned_heap{ std::make_unique<Heap>() }
+    , owned_sym_pool{ std::make_unique<SymbolPool>() }
+    , owned_source_map{ std::make_unique<SourceMap>() }
+    , heap{ *owned_heap }
+    , sym_pool{ *owned_sym_pool }
+    , source_map{ *owned_source_map }
+    , owned_constants{ std::make_unique<ConstantPool>() }
+    , constants{ *owned_constants }
+    , owned_form_cache{ std::make_unique<FormCache>() }
+    , form_cache{ *owned_form_cache }
+    , owned_budget{ std::make_unique<ExecutionBudget>() }
+    , budget{ *owned_budget } //
+{
     auto [s, _] = heap.allocate<Scope>();
+    s->is_global = true;
     curr_scope = s;
     global_scope = s;
 
     setup_scope_for_builtins(*this);
 }
 
-const Sexp* Environment::lookup_binding(const Symbol& name) const {
-    Scope* curr = curr_scope;
+Environment::Environment(Environment& parent, WorkerTag)
+    : heap{ parent.heap }
+    , sym_pool{ parent.sym_pool }
+    , source_map{ parent.source_map }
+    , base{ parent.base }
+    , overlay{ parent.overlay }
+    , curr_scope{ parent.curr_scope }
+    , global_scope{ parent.global_scope }
+    , constants{ parent.constants }
+    , form_cache{ parent.form_cache }
+    , budget{ parent.budget }
+    , sym_else{ parent.sym_else }
+    , sym_arrow{ parent.sym_arrow } //
+{
+    // NOTE: `sym_pool` is shared too, it's safe for concurrent use
+    static std::atomic<uint64_t> next_worker_id = 1;
+    worker_id = next_worker_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+Environment::Environment(Environment& base, ForkTag)
+    : owned_heap{ std::make_unique<Heap>(base.heap.get_generation() + 1) }
+    , owned_source_map{ std::make_unique<SourceMap>(base.source_map) }
+    , heap{ *owned_heap }
+    , sym_pool{ base.sym_pool }
+    , source_map{ *owned_source_map }
+    , base{ &base }
+    , owned_overlay{ std::make_unique<BindingOverlay>() }
+    , owned_constants{ std::make_unique<ConstantPool>(base.constants, ConstantPool::FORK_RESERVED_SIZE) }
+    , constants{ *owned_constants }
+    , owned_form_cache{ std::make_unique<FormCache>(base.form_cache) }
+    , form_cache{ *owned_form_cache }
+    , budget{ base.budget }
+    , sym_else{ base.sym_else }
+    , sym_arrow{ base.sym_arrow } //
+{
+    overlay = owned_overlay.get();
+    // Whatever the base has set! in its own base is still current for us
+    if (base.overlay) {
+        std::shared_lock lock(base.overlay->mutex);
+        overlay->values = base.overlay->values;
+    }
+
+    auto [s, _] = heap.allocate<Scope>();
+    s->is_global = true;
+    s->prev = HeapPtr(base.global_scope);
+    curr_scope = s;
+    global_scope = s;
+}
+
+Environment::~Environment() {
+    // Worker environments of a fork have a base too, but nothing of their own
+    if (!base || !owned_heap)
+        return;
+
+    // Tasks it spawned and that haven't finished run in it, and in its heap
+    abandon_coroutines(*this);
+
+    // Profiles refer to procedures and forms by address, keep them around for the report
+    if (profiling_active || allocation_profiling_active) {
+        std::ignore = owned_heap.release();
+        std::ignore = owned_source_map.release();
+        return;
+    }
+
+    // Nothing outside a fork can refer to what it allocated, and it may well be one of many
+    owned_heap->destroy_objects();
+}
+
+std::unique_ptr<Environment> Environment::fork() {
+    if (heap.get_generation() >= ObjectHeader::MAX_GENERATION)
+        throw EvalException(std::format("cannot fork more than {} levels deep", ObjectHeader::MAX_GENERATION));
+    return std::make_unique<Environment>(*this, ForkTag{});
+}
+
+namespace {
+/// Throws unless `env` may set! the bindings of `scope`: a worker environment only those of scopes it made itself.
+/// Every other scope, e.g. the global one or the closure of the procedure given to (parallel-map), is shared with the other workers without any locking.
+void check_settable(const Environment& env, const Scope& scope, SymbolId name) {
+    if (env.worker_id != 0 && scope.worker_id != env.worker_id) [[unlikely]]
+        throw EvalException(std::format("(set!) cannot change '{}' from a parallel worker, it's shared with the other workers", std::string_view(env.sym_pool.get(name))));
+}
+
+// Lookups in a fork are kept apart, so that they don't slow down the others
+const Sexp* lookup_forked_binding(const Environment& env, SymbolId name) {
+    Scope* curr = env.curr_scope;
     while (curr) {
-        auto iter = curr->bindings.find(&name);
-        if (iter != curr->bindings.end()) {
-            return &iter->second;
+        // Every chain of scopes ends at a global scope, which stands for ours: so that our globals are seen by closures made before the fork too
+        if (curr->is_global)
+            return env.global_scope->find(name);
+
+        if (auto binding = curr->find(name)) {
+            std::shared_lock lock(env.overlay->mutex);
+            // NOTE: the map's nodes stay put as it grows, so this can be held onto after unlocking
+            if (auto it = env.overlay->values.find(binding); it != env.overlay->values.end())
+                return &it->second;
+            return binding;
         }
 
         curr = curr->prev.get();
@@ -29,12 +333,58 @@ const Sexp* Environment::lookup_binding(const Symbol& name) const {
     return nullptr;
 }
 
-void Environment::set_binding(const Symbol& name, Sexp value) {
+void set_forked_binding(Environment& env, SymbolId name, Sexp value) {
+    Scope* curr = env.curr_scope;
+    while (curr) {
+        if (curr->is_global) {
+            // Defining takes it into our own bindings, rather than changing the base's
+            if (env.global_scope->find(name)) {
+                check_settable(env, *env.global_scope, name);
+                env.global_scope->define(name, value);
+            }
+            return;
+        }
+
+        if (auto binding = curr->find(name)) {
+            check_settable(env, *curr, name);
+            if (env.is_from_base(HeapPtr(curr))) {
+                std::lock_guard lock(env.overlay->mutex);
+                env.overlay->values.insert_or_assign(binding, value);
+            } else
+                *binding = value;
+            return;
+        }
+
+        curr = curr->prev.get();
+    }
+}
+} // namespace
+
+const Sexp* Environment::lookup_binding(SymbolId name) const {
+    if (base) [[unlikely]]
+        return lookup_forked_binding(*this, name);
+
     Scope* curr = curr_scope;
     while (curr) {
-        auto iter = curr->bindings.find(&name);
-        if (iter != curr->bindings.end()) {
-            iter->second = value;
+        if (auto binding = curr->find(name))
+            return binding;
+
+        curr = curr->prev.get();
+    }
+    return nullptr;
+}
+
+void Environment::set_binding(SymbolId name, Sexp value) {
+    if (base) [[unlikely]] {
+        set_forked_binding(*this, name, value);
+        return;
+    }
+
+    Scope* curr = curr_scope;
+    while (curr) {
+        if (auto binding = curr->find(name)) {
+            check_settable(*this, *curr, name);
+            *binding = value;
             return;
         }
 
@@ -42,6 +392,38 @@ void Environment::set_binding(const Symbol& name, Sexp value) {
     }
 }
 
+void Environment::check_interrupted() const {
+    if (budget.interrupted.load(std::memory_order_relaxed))
+        throw EvalException{ .msg = "evaluation interrupted"s, .budget_exceeded = true };
+    if (budget.deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= budget.deadline)
+        throw EvalException{ .msg = "evaluation timed out"s, .budget_exceeded = true };
+}
+
+void Environment::refuel() {
+    check_interrupted();
+
+    // Taking a chunk at a time keeps environments on different threads from contending on every step
+    uint64_t left = budget.steps_left.load(std::memory_order_relaxed);
+    uint64_t taken;
+    do {
+        if (left == 0)
+            throw EvalException{ .msg = "step limit exceeded"s, .budget_exceeded = true };
+        if (left == ExecutionBudget::UNLIMITED_STEPS) {
+            fuel = ExecutionBudget::FUEL_CHUNK - 1;
+            return;
+        }
+        taken = std::min<uint64_t>(left, ExecutionBudget::FUEL_CHUNK);
+    } while (!budget.steps_left.compare_exchange_weak(left, left - taken, std::memory_order_relaxed));
+    // One of them is for the step being taken now
+    fuel = static_cast<int64_t>(taken) - 1;
+}
+
+void Environment::set_heap_limit(size_t limit) {
+    heap.set_byte_limit(limit, [](size_t limit) {
+        throw EvalException{ .msg = std::format("heap limit of {} bytes exceeded", limit), .budget_exceeded = true };
+    });
+}
+
 Sexp cons(Sexp a, Sexp b, Environment& env) {
     auto [addr, _] = env.heap.allocate<ConsCell>(std::move(a), std::move(b));
     return Sexp(addr);
@@ -53,17 +435,15 @@ void cons_inplace(Sexp a, Sexp& list, Environment& env) {
 }
 
 Sexp car(Sexp s) {
-    auto cons_cell = s.as_ptr<ConsCell>();
-    if (cons_cell == nullptr)
+    if (!is_cons(s))
         throw EvalException("car(): argument is not not a cons");
-    return cons_cell->car;
+    return s.as_ptr<ConsCell>()->car;
 }
 
 Sexp cdr(Sexp s) {
-    auto cons_cell = s.as_ptr<ConsCell>();
-    if (cons_cell == nullptr)
+    if (!is_cons(s))
         throw EvalException("cdr(): argument is not not a cons");
-    return cons_cell->cdr;
+    return s.as_ptr<ConsCell>()->cdr;
 }
 
 Sexp list_nth_elm(Sexp list, int idx, Environment& env) {
@@ -86,7 +466,7 @@ Sexp list_nth_elm(Sexp list, int idx, Environment& env) {
 void list_get_prefix(Sexp list, std::initializer_list<Sexp*> out_prefix, Sexp* out_rest, Environment& env) {
     Sexp* curr = &list;
     auto it = out_prefix.begin();
-    while (curr->is_ptr()) {
+    while (curr->is_ptr() && !curr->is_nil()) {
         auto& cons_cell = *curr->as_ptr<ConsCell>();
         **it = cons_cell.car;
         curr = &cons_cell.cdr;
@@ -108,11 +488,11 @@ void list_get_everything(Sexp list, std::initializer_list<Sexp*> out, Environmen
 }
 
 UserProc* make_user_proc(Sexp param_decl, Sexp body_decl, Environment& env) {
-    std::vector<const Symbol*> proc_args;
+    std::vector<SymbolId> proc_args;
     for (Sexp param : iterate(param_decl, env)) {
         if (!param.is_symbol())
             throw EvalException("proc parameter must be a symbol"s);
-        proc_args.push_back(&param.as_symbol());
+        proc_args.push_back(param.as_symbol());
     }
 
     if (!is_list(body_decl))
@@ -128,14 +508,427 @@ UserProc* make_user_proc(Sexp param_decl, Sexp body_decl, Environment& env) {
     return proc;
 }
 
+namespace {
+/******** Lexer character classes ********/
+
+constexpr uint8_t CC_SPACE = 1 << 0;
+/// Characters that end a token: whitespace, parentheses, string quotes and comments
+constexpr uint8_t CC_DELIM = 1 << 1;
+/// Characters a numeric literal may begin with
+constexpr uint8_t CC_NUM_START = 1 << 2;
+constexpr uint8_t CC_DIGIT = 1 << 3;
+/// Characters that matter for finding where top-level forms end, see find_top_level_splits()
+constexpr uint8_t CC_STRUCTURAL = 1 << 4;
+
+// NOTE: std::isspace() is locale-dependent, and a function call per byte; a table is neither
+constexpr auto CHAR_CLASS = []() {
+    std::array<uint8_t, 256> res{};
+    for (unsigned char c : " \t\n\v\f\r"sv)
+        res[c] |= CC_SPACE | CC_DELIM;
+    for (unsigned char c : "();\""sv)
+        res[c] |= CC_DELIM;
+    for (unsigned char c = '0'; c <= '9'; ++c)
+        res[c] |= CC_NUM_START | CC_DIGIT;
+    for (unsigned char c : "+-."sv)
+        res[c] |= CC_NUM_START;
+    for (unsigned char c : "()\";'`,\n"sv)
+        res[c] |= CC_STRUCTURAL;
+    return res;
+}();
+
+bool has_class(char c, uint8_t cc) {
+    return CHAR_CLASS[static_cast<unsigned char>(c)] & cc;
+}
+
+/******** Block classifiers ********/
+// Each returns a bitmask with bit i set iff byte p[i] belongs to the class, for a whole block of LEXER_BLOCK_SIZE bytes
+
+#if defined(__AVX2__)
+#    define YWRK_LEXER_SIMD 1
+constexpr size_t LEXER_BLOCK_SIZE = 32;
+using BlockMask = uint32_t;
+using Block = __m256i;
+
+Block load_block(const char* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+Block splat(char c) { return _mm256_set1_epi8(c); }
+Block eq(Block a, Block b) { return _mm256_cmpeq_epi8(a, b); }
+Block either(Block a, Block b) { return _mm256_or_si256(a, b); }
+Block unsigned_le(Block a, char limit) { return eq(_mm256_min_epu8(a, splat(limit)), a); }
+Block sub(Block a, char b) { return _mm256_sub_epi8(a, splat(b)); }
+BlockMask to_mask(Block a) { return static_cast<BlockMask>(_mm256_movemask_epi8(a)); }
+constexpr BlockMask FULL_BLOCK_MASK = 0xFFFF'FFFF;
+#elif defined(__SSE2__)
+#    define YWRK_LEXER_SIMD 1
+constexpr size_t LEXER_BLOCK_SIZE = 16;
+using BlockMask = uint32_t;
+using Block = __m128i;
+
+Block load_block(const char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+Block splat(char c) { return _mm_set1_epi8(c); }
+Block eq(Block a, Block b) { return _mm_cmpeq_epi8(a, b); }
+Block either(Block a, Block b) { return _mm_or_si128(a, b); }
+Block unsigned_le(Block a, char limit) { return eq(_mm_min_epu8(a, splat(limit)), a); }
+Block sub(Block a, char b) { return _mm_sub_epi8(a, splat(b)); }
+BlockMask to_mask(Block a) { return static_cast<BlockMask>(_mm_movemask_epi8(a)); }
+constexpr BlockMask FULL_BLOCK_MASK = 0xFFFF;
+#else
+#    define YWRK_LEXER_SIMD 0
+#endif
+
+#if YWRK_LEXER_SIMD
+Block space_block(Block b) {
+    // ' ', or '\t' '\n' '\v' '\f' '\r' which are the contiguous range 9..13
+    return either(eq(b, splat(' ')), unsigned_le(sub(b, '\t'), '\r' - '\t'));
+}
+
+BlockMask space_mask(const char* p) {
+    return to_mask(space_block(load_block(p)));
+}
+
+BlockMask delim_mask(const char* p) {
+    auto b = load_block(p);
+    auto res = space_block(b);
+    res = either(res, eq(b, splat('(')));
+    res = either(res, eq(b, splat(')')));
+    res = either(res, eq(b, splat(';')));
+    res = either(res, eq(b, splat('"')));
+    return to_mask(res);
+}
+
+BlockMask string_stop_mask(const char* p) {
+    auto b = load_block(p);
+    return to_mask(either(eq(b, splat('"')), eq(b, splat('\\'))));
+}
+
+BlockMask structural_mask(const char* p) {
+    auto b = load_block(p);
+    auto res = either(eq(b, splat('(')), eq(b, splat(')')));
+    res = either(res, eq(b, splat('"')));
+    res = either(res, eq(b, splat(';')));
+    res = either(res, eq(b, splat('\'')));
+    res = either(res, eq(b, splat('`')));
+    res = either(res, eq(b, splat(',')));
+    res = either(res, eq(b, splat('\n')));
+    return to_mask(res);
+}
+#endif
+
+/// Returns the index of the first byte at or after `i` for which `stop_pred` is true (or src.size() if there isn't one).
+/// Whole blocks are classified at once with `stop_mask`, and the tail that doesn't fill a block is done byte by byte.
+template <typename TMaskFn, typename TPred>
+size_t scan_until(std::string_view src, size_t i, TMaskFn&& stop_mask, TPred&& stop_pred) {
+#if YWRK_LEXER_SIMD
+    while (i + LEXER_BLOCK_SIZE <= src.size()) {
+        BlockMask m = stop_mask(src.data() + i);
+        if (m != 0)
+            return i + std::countr_zero(m);
+        i += LEXER_BLOCK_SIZE;
+    }
+#endif
+    while (i < src.size() && !stop_pred(src[i]))
+        i += 1;
+    return i;
+}
+
+size_t skip_spaces(std::string_view src, size_t i) {
+#if YWRK_LEXER_SIMD
+    // Most runs of whitespace are short (a single space or a newline plus indentation), check the first byte before loading a block
+    if (i < src.size() && !has_class(src[i], CC_SPACE))
+        return i;
+    return scan_until(src, i, [](const char* p) { return ~space_mask(p) & FULL_BLOCK_MASK; }, [](char c) { return !has_class(c, CC_SPACE); });
+#else
+    return scan_until(src, i, nullptr, [](char c) { return !has_class(c, CC_SPACE); });
+#endif
+}
+
+size_t find_token_end(std::string_view src, size_t i) {
+#if YWRK_LEXER_SIMD
+    return scan_until(src, i, delim_mask, [](char c) { return has_class(c, CC_DELIM); });
+#else
+    return scan_until(src, i, nullptr, [](char c) { return has_class(c, CC_DELIM); });
+#endif
+}
+
+size_t find_string_stop(std::string_view src, size_t i) {
+#if YWRK_LEXER_SIMD
+    return scan_until(src, i, string_stop_mask, [](char c) { return c == '"' || c == '\\'; });
+#else
+    return scan_until(src, i, nullptr, [](char c) { return c == '"' || c == '\\'; });
+#endif
+}
+
+/// Tracks the line and column of offsets into some text, as they move forward through it
+struct LineCounter {
+    uint32_t line = 1;
+    /// Offset of the first byte of `line`; negative if the text picks up in the middle of a line that started before it
+    ptrdiff_t line_start = 0;
+    /// Every newline before this offset has been counted
+    size_t scanned = 0;
+
+    void advance_to(std::string_view text, size_t offset) {
+        const char* p = text.data() + scanned;
+        const char* end = text.data() + offset;
+        while (p < end) {
+            auto nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            if (!nl)
+                break;
+            line += 1;
+            line_start = nl + 1 - text.data();
+            p = nl + 1;
+        }
+        scanned = std::max(scanned, offset);
+    }
+
+    uint32_t column(size_t offset) const {
+        return static_cast<uint32_t>(static_cast<ptrdiff_t>(offset) - line_start + 1);
+    }
+};
+
+struct TopLevelSplit {
+    size_t offset;
+    /// Where the line containing `offset` is, to start counting lines from in the piece after it
+    uint32_t line;
+    ptrdiff_t line_start;
+};
+
+/// Picks places to split `src` into pieces of at least `piece_size` bytes, such that every piece holds whole top-level forms only and can be parsed on its own.
+/// Returns the split points in increasing order, not including 0 and src.size().
+// NOTE: this runs before any parallel work can start, so it goes through a block of input at a time, and only looks at the bytes that affect nesting
+std::vector<TopLevelSplit> find_top_level_splits(std::string_view src, size_t piece_size) {
+    std::vector<TopLevelSplit> res;
+    size_t next_split = piece_size;
+    size_t depth = 0;
+    // Newlines are structural, so counting lines along the way is nearly free
+    uint32_t line = 1;
+    ptrdiff_t line_start = 0;
+    // A quote prefix at the top level that may not have been attached to its datum yet.
+    // We skip over atoms without looking at them, so this is only cleared by a list or string; being conservative just delays the split.
+    bool pending_prefix = false;
+
+    auto maybe_split_at = [&](size_t pos) {
+        if (depth == 0 && !pending_prefix && pos >= next_split && pos < src.size()) {
+            res.push_back({ pos, line, line_start });
+            next_split = pos + piece_size;
+        }
+    };
+
+    size_t i = 0;
+    while (i < src.size()) {
+        // Bit k is set iff src[i + k] is a structural char
+        uint64_t mask = 0;
+        size_t next;
+#if YWRK_LEXER_SIMD
+        if (i + LEXER_BLOCK_SIZE <= src.size()) {
+            mask = structural_mask(src.data() + i);
+            next = i + LEXER_BLOCK_SIZE;
+        } else
+#endif
+        {
+            next = std::min(i + 64, src.size());
+            for (size_t k = i; k < next; ++k) {
+                if (has_class(src[k], CC_STRUCTURAL))
+                    mask |= uint64_t(1) << (k - i);
+            }
+        }
+
+        while (mask != 0) {
+            size_t pos = i + std::countr_zero(mask);
+            mask &= mask - 1;
+
+            switch (src[pos]) {
+                case '(':
+                    depth += 1;
+                    pending_prefix = false;
+                    break;
+
+                case ')':
+                    // A stray ')' at the top level is skipped by the parser anyway
+                    if (depth > 0)
+                        depth -= 1;
+                    maybe_split_at(pos + 1);
+                    break;
+
+                case '"': {
+                    size_t end = pos + 1;
+                    while (true) {
+                        end = find_string_stop(src, end);
+                        // Unterminated string, nowhere safe to split past here
+                        if (end >= src.size())
+                            return res;
+                        if (src[end] == '"')
+                            break;
+                        // Skip the escaped char
+                        end += 2;
+                    }
+                    end += 1;
+
+                    // The only newlines skipped without looking at them
+                    for (auto p = src.data() + pos; (p = static_cast<const char*>(std::memchr(p, '\n', src.data() + end - p))); ++p) {
+                        line += 1;
+                        line_start = p + 1 - src.data();
+                    }
+
+                    if (depth == 0)
+                        pending_prefix = false;
+                    maybe_split_at(end);
+
+                    // Continue with a fresh block after the string
+                    next = end;
+                    mask = 0;
+                } break;
+
+                case ';': {
+                    auto nl = static_cast<const char*>(std::memchr(src.data() + pos, '\n', src.size() - pos));
+                    if (!nl)
+                        return res;
+                    // Continue from the newline, which is a potential split point
+                    next = nl - src.data();
+                    mask = 0;
+                } break;
+
+                case '\'':
+                case '`':
+                case ',':
+                    if (depth == 0)
+                        pending_prefix = true;
+                    break;
+
+                case '\n':
+                    line += 1;
+                    line_start = pos + 1;
+                    maybe_split_at(pos + 1);
+                    break;
+            }
+        }
+
+        i = next;
+    }
+
+    return res;
+}
+
+/// Where the first top-level datum in `src` ends (quote prefixes, whitespace and comments before it included), or nullopt if `src` ends first.
+/// Only looks at nesting, strings and comments, so that a malformed datum can be skipped as a whole; see SexpReader::next()
+std::optional<size_t> find_datum_end(std::string_view src) {
+    size_t depth = 0;
+    size_t i = 0;
+    while (i < src.size()) {
+        switch (src[i]) {
+            case '(':
+                depth += 1;
+                i += 1;
+                break;
+
+            case ')':
+                i += 1;
+                // A stray ')' at the top level ends nothing, but gets skipped all the same
+                if (depth <= 1)
+                    return i;
+                depth -= 1;
+                break;
+
+            case '"':
+                i += 1;
+                while (true) {
+                    i = find_string_stop(src, i);
+                    if (i >= src.size())
+                        return std::nullopt;
+                    if (src[i] == '"')
+                        break;
+                    i += 2;
+                }
+                i += 1;
+                if (depth == 0)
+                    return i;
+                break;
+
+            case ';': {
+                auto nl = src.find('\n', i);
+                if (nl == std::string_view::npos)
+                    return std::nullopt;
+                i = nl + 1;
+            } break;
+
+            default:
+                if (has_class(src[i], CC_SPACE) || src[i] == '\'' || src[i] == '`' || src[i] == ',') {
+                    i += 1;
+                    break;
+                }
+                i = find_token_end(src, i);
+                // The atom may go on in input yet to come
+                if (i >= src.size())
+                    return std::nullopt;
+                if (depth == 0)
+                    return i;
+                break;
+        }
+    }
+    return std::nullopt;
+}
+
+/// Decides whether `token` is a numeric literal, and if so parses it into `out`
+bool parse_number(std::string_view token, Sexp& out) {
+    // Every symbol that doesn't start like a number is rejected right here, without trying to parse it
+    if (!has_class(token[0], CC_NUM_START))
+        return false;
+    // Lone +, -, ... are symbols
+    if (!has_class(token[0], CC_DIGIT) && (token.size() == 1 || !has_class(token[1], CC_DIGIT | CC_NUM_START)))
+        return false;
+    // Only one sign, from_chars() would take the second one after we skip a + (so +-3 isn't -3)
+    if ((token[0] == '+' || token[0] == '-') && (token[1] == '+' || token[1] == '-'))
+        return false;
+
+    const char* begin = token.data();
+    const char* end = token.data() + token.size();
+
+    // Try an exact integer first, floats can't represent every int32_t
+    int32_t n;
+    auto [n_end, n_ec] = std::from_chars(begin + (*begin == '+'), end, n);
+    if (n_ec == std::errc() && n_end == end) {
+        out = Sexp(n);
+        return true;
+    }
+
+    float v;
+    auto [v_end, v_ec] = std::from_chars(begin + (*begin == '+'), end, v);
+    if (v_ec == std::errc::result_out_of_range)
+        throw ParseException("number literal out of range"s);
+    if (v_ec != std::errc() || v_end != end) {
+        // Something like 1+ or -> which is a perfectly fine symbol
+        return false;
+    }
+
+    // TODO proper Scheme numeric literal parsing
+    if (auto i = static_cast<int32_t>(v); i == v)
+        out = Sexp(i);
+    else
+        out = Sexp(v);
+    return true;
+}
+
+/// Thrown by SexpParser when the source ends in the middle of a datum, but more of it is yet to come
+struct IncompleteInput {};
+} // namespace
+
 class SexpParser {
-public:
+private:
     /* ---- Inputs ---- */
-    /* Initalize them with aggregate initilization, and then call parse() */
     Environment* env;
     std::string_view src;
+    /// If true, `src` is only a prefix of the whole input, so running into its end means we need to wait for more instead of reaching EOF
+    bool more_input;
+    /// If true, `src` outlives the environment, so symbols and strings can point into it instead of making copies
+    bool borrow_source = false;
+    SourceFileId source_file = SourceFileId::NONE;
+    /// Line and start of the line that `src` begins on
+    uint32_t start_line = 1;
+    ptrdiff_t start_line_start = 0;
+
+    const Symbol& sym_quote;
+    const Symbol& sym_unquote;
+    const Symbol& sym_unquote_splicing;
+    const Symbol& sym_quasiquote;
 
-private:
     /* ---- State Variables ---- */
     /// A path of every list we have to visit to get to `curr`
     /// For example, suppose we are parsing the following source, and the cursor is denoted by '|':
@@ -145,283 +938,755 @@ private:
     /// To push some `Sexp s` into the current list, just set curr to a new ConsCell `(s . '())`, and then set `curr` to its cdr (same logic as `yawarakai::cons_inplace()`).
     std::vector<Sexp*> path;
     Sexp* curr;
-    /// If not null, the next sexp `x` produced by the parser loop shall be rewritten as `(wrapper x)`
-    const Symbol* next_sexp_wrapper = nullptr;
+    /// Quote prefixes read since the last sexp, outermost first: the next sexp `x` produced by the parser loop shall be rewritten as `(wrapper1 (wrapper2 ... x))`
+    struct PendingWrapper {
+        const Symbol* sym;
+        /// Where the prefix is
+        size_t begin;
+        /// The (sym x) list it turned into, once it has
+        ConsCell* cells[2];
+    };
+    std::vector<PendingWrapper> wrappers;
     size_t cursor;
 
+    /* ---- Quoted data ---- */
+    /// Where each list inside of quoted data we're in goes, innermost last, to be replaced by its constant (see ConstantPool) once complete
+    std::vector<Sexp*> quoted_lists;
+    /// The last sexp was the `quote` at the head of a list, so the next one is quoted data
+    bool quote_next = false;
+    /// What's left over from quoted data after it has been interned, made use of instead of allocating anew
+    std::vector<ConsCell*> spare_cells;
+    String* spare_string = nullptr;
+
+    /* ---- Source positions ---- */
+    /// Whether to record where each cons came from in env->source_map
+    bool record_positions = false;
+    LineCounter lines;
+    /// Where the datum being parsed starts
+    size_t datum_begin = 0;
+    /// Where the list we just entered starts, if its first cons hasn't been made yet: that one stands for the whole list
+    size_t list_begin = NO_OFFSET;
+    /// Positions recorded but not yet added to the SourceMap, which is done in batches to keep its lock out of the way
+    std::vector<SourceMap::Entry> positions;
+
+    static constexpr size_t NO_OFFSET = std::numeric_limits<size_t>::max();
+    static constexpr size_t POSITION_BATCH_SIZE = 4096;
+
 public:
-    // Defined out of line to reduce indentation
-    Sexp parse();
+    explicit SexpParser(Environment& env)
+        : env{ &env }
+        , sym_quote{ env.sym_pool.intern("quote") }
+        , sym_unquote{ env.sym_pool.intern("unquote") }
+        , sym_unquote_splicing{ env.sym_pool.intern("unquote-splicing") }
+        , sym_quasiquote{ env.sym_pool.intern("quasiquote") } {}
+
+    /// Parses every datum in `src`, and returns them as a list.
+    /// The same parser may be reused for any number of sources.
+    Sexp parse(std::string_view src) {
+        Sexp program;
+        run(src, false, false, program);
+        return program;
+    }
+
+    /// Same as parse(), but builds the list in `out`, and returns its last cdr so that more can be appended
+    Sexp* parse_into(std::string_view src, Sexp& out) {
+        run(src, false, false, out);
+        return top_level_tail();
+    }
+
+    /// Parses the first datum in `src` into `out`. Returns false if there is none; use position() for how much of `src` was consumed.
+    /// If `more_input` is true and `src` ends before the datum does, throws IncompleteInput.
+    bool parse_one(std::string_view src, bool more_input, Sexp& out) {
+        Sexp program;
+        run(src, more_input, true, program);
+        if (program.is_nil())
+            return false;
+        out = car(program);
+        return true;
+    }
+
+    /// Where the last parse stopped, e.g. where a ParseException was found
+    size_t position() const { return cursor; }
+
+    void set_borrow_source(bool v) { borrow_source = v; }
+    void set_source_file(SourceFileId file) { source_file = file; }
+
+    /// Sets the line that the next source begins on, and where that line starts relative to it (<= 0)
+    void set_start_position(uint32_t line, ptrdiff_t line_start) {
+        start_line = line;
+        start_line_start = line_start;
+    }
 
 private:
+    // Defined out of line to reduce indentation
+    void run(std::string_view src, bool more_input, bool single_datum, Sexp& program);
+    void run_loop(bool single_datum, Sexp& program);
+
+    /// The cdr of the last top-level cons produced by run() (or the list head itself if there were none)
+    Sexp* top_level_tail() const {
+        // Outside of every list `curr` is the top-level tail, otherwise it's the first thing we saved on entering a list
+        return path.empty() ? curr : path.front();
+    }
+
+    /// Called when we run into the end of `src`. Returns only if it's the actual end of input.
+    void hit_end() const {
+        if (more_input)
+            throw IncompleteInput{};
+    }
+
+    void record_position(ConsCell* cell, size_t offset) {
+        lines.advance_to(src, offset);
+        auto column = std::min<uint32_t>(lines.column(offset), std::numeric_limits<uint16_t>::max());
+        positions.push_back({ cell, lines.line, static_cast<uint16_t>(column), source_file });
+        if (positions.size() >= POSITION_BATCH_SIZE) {
+            env->source_map.add(positions);
+            positions.clear();
+        }
+    }
+
+    ConsCell* allocate_cell() {
+        if (!spare_cells.empty()) {
+            auto cell = spare_cells.back();
+            spare_cells.pop_back();
+            return cell;
+        }
+        auto [cell, _] = env->heap.allocate<ConsCell>();
+        return cell;
+    }
+
+    /// Whether the next sexp is (part of) quoted data
+    bool quoting() const {
+        return !quoted_lists.empty() || quote_next || (!wrappers.empty() && wrappers.back().sym == &sym_quote);
+    }
+
+    /// Takes back the conses of `list`, which nothing points to anymore now that its constant is used instead
+    void recycle(Sexp list) {
+        while (!list.is_nil() && list.is_ptr<ConsCell>() && !env->constants.contains(list.as_ptr().get())) {
+            auto cell = list.as_ptr<ConsCell>().get();
+            // Only the lists made by quote prefixes are left in there, every other one has already been replaced
+            recycle(cell->car);
+            list = cell->cdr;
+            spare_cells.push_back(cell);
+        }
+    }
+
     Sexp* push_sexp(Sexp val) {
         // Pointer to the `val` moved to the heap
         Sexp* p_val = nullptr;
+        bool first_in_list = list_begin != NO_OFFSET;
 
-        if (next_sexp_wrapper != nullptr) {
+        // Innermost first, e.g. `',x is (quasiquote (quote (unquote x)))
+        for (auto it = wrappers.rbegin(); it != wrappers.rend(); ++it) {
             // Rolling the logic of make_list_v() manually here to keep a pointer to `val`
-            // i.e. let s = cons1[next_sexp_wrapper cons2[val nil]]
-            auto [cons1, _] = env->heap.allocate<ConsCell>();
-            // WORKAROUND(msvc): no support for P2169 "Placeholder variables with no name" yet
-            auto [cons2, __] = env->heap.allocate<ConsCell>();
-            cons1->car = Sexp(*next_sexp_wrapper);
+            // i.e. let s = cons1[wrapper cons2[val nil]]
+            auto cons1 = allocate_cell();
+            auto cons2 = allocate_cell();
+            cons1->car = Sexp(*it->sym);
             cons1->cdr = Sexp(cons2);
             cons2->car = val;
             cons2->cdr = Sexp();
 
-            p_val = &cons2->car;
+            if (p_val == nullptr)
+                p_val = &cons2->car;
             val = Sexp(cons1);
+            it->cells[0] = cons1;
+            it->cells[1] = cons2;
         }
 
-        auto [the_cons, _] = env->heap.allocate<ConsCell>();
+        auto the_cons = allocate_cell();
         the_cons->car = val;
+        the_cons->cdr = Sexp();
         *curr = Sexp(the_cons);
 
+        // Conses in quoted data are going to be replaced, and never evaluated anyways
+        if (record_positions && quoted_lists.empty()) {
+            // In order of increasing offset
+            size_t val_begin = wrappers.empty() ? datum_begin : wrappers.front().begin;
+            record_position(the_cons, list_begin != NO_OFFSET ? list_begin : val_begin);
+            for (size_t i = 0; i < wrappers.size(); ++i) {
+                record_position(wrappers[i].cells[0], wrappers[i].begin);
+                record_position(wrappers[i].cells[1], i + 1 < wrappers.size() ? wrappers[i + 1].begin : datum_begin);
+            }
+        }
+        list_begin = NO_OFFSET;
+
         if (p_val == nullptr)
             p_val = &the_cons->car;
         curr = &the_cons->cdr;
 
-        next_sexp_wrapper = nullptr;
+        quote_next = first_in_list && wrappers.empty() && val.is_symbol() && val.as_symbol() == sym_quote.id();
+        wrappers.clear();
         return p_val;
     }
 
     void enter_nesting() {
         // The nil is our nested list
         // Sexp wrapping is taken care by push_sexp() automatically
+        bool quoted = quoting();
         Sexp* car = push_sexp(Sexp());
         Sexp* cdr = curr;
         path.push_back(cdr);
         curr = car;
+        list_begin = datum_begin;
+        if (quoted)
+            quoted_lists.push_back(car);
     }
 
     bool leave_nesting() {
+        // An empty list has no conses
+        list_begin = NO_OFFSET;
+        quote_next = false;
         if (path.empty())
             return false;
 
+        // Everything in the list is a constant by now, being closed before it
+        if (!quoted_lists.empty()) {
+            Sexp* slot = quoted_lists.back();
+            quoted_lists.pop_back();
+            Sexp list = *slot;
+            *slot = env->constants.intern(list);
+            // Unless the pool is full
+            if (slot->_value != list._value)
+                recycle(list);
+        }
+
         curr = path.back();
         path.pop_back();
         return true;
     }
 
-    static bool is_token_separator(char c) {
-        return std::isspace(c) || c == '(' || c == ')';
-    }
-
     std::string_view take_token() {
         size_t begin = cursor;
-        while (cursor < src.length() && !is_token_separator(src[cursor]))
-            cursor += 1;
-        size_t end = cursor;
-
-        const char* d = src.data();
-        return std::string_view(d + begin, d + end);
+        cursor = find_token_end(src, cursor);
+        // The token might continue past the end of what we have
+        if (cursor >= src.length())
+            hit_end();
+        return src.substr(begin, cursor - begin);
     }
 
-    void skip_until(char c) {
-        while (cursor < src.length() && src[cursor] != c)
-            cursor += 1;
-    }
+    void parse_string();
+    /// Pushes a string just parsed, or its constant if it's quoted
+    void push_string(String* h_str);
 };
 
-Sexp SexpParser::parse() {
-    this->path = {};
+void SexpParser::run(std::string_view src, bool more_input, bool single_datum, Sexp& program) {
+    this->src = src;
+    this->more_input = more_input;
+    this->path.clear();
     this->curr = {};
     this->cursor = 0;
-    this->next_sexp_wrapper = nullptr;
+    this->wrappers.clear();
+    this->quoted_lists.clear();
+    this->quote_next = false;
+    this->record_positions = source_file != SourceFileId::NONE && env->source_map.is_enabled();
+    this->lines = { start_line, start_line_start, 0 };
+    this->list_begin = NO_OFFSET;
+    this->positions.clear();
 
     // Synthesized a top-level list, so we can pretend that every sexp in the source file is actually inside a giant list enclosing everything
-    Sexp program;
     curr = &program;
     // We do not push into path, because it makes no sense to leave the synthesized top-level
     /*path.push_back(curr);*/
 
-    auto& sym_quote = env->sym_pool.intern("quote");
-    auto& sym_unquote = env->sym_pool.intern("unquote");
-    auto& sym_quasiquote = env->sym_pool.intern("quasiquote");
+    try {
+        run_loop(single_datum, program);
+    } catch (ParseException& e) {
+        lines.advance_to(src, std::min(cursor, src.size()));
+        e.location = SourceLocation{ env->source_map.file_name(source_file), lines.line, lines.column(std::min(cursor, src.size())) };
+        throw;
+    }
+
+    if (record_positions)
+        env->source_map.add(positions);
+}
+
+void SexpParser::run_loop(bool single_datum, Sexp& program) {
+    while (true) {
+        // Back at the top-level with something in the list, i.e. the first datum is complete
+        if (single_datum && path.empty() && !program.is_nil())
+            break;
 
-    while (cursor < src.length()) {
         // Skip all whitespace
-        // Token splitting is automatically handled by each case (it stops right on a whitespace character)
-        if (std::isspace(src[cursor])) {
-            ++cursor;
-            continue;
+        // Token splitting is automatically handled by each case (it stops right on a delimiter)
+        cursor = skip_spaces(src, cursor);
+        if (cursor >= src.length()) {
+            hit_end();
+            break;
         }
 
-        if (src[cursor] == ';') {
-            skip_until('\n');
+        datum_begin = cursor;
+        switch (src[cursor]) {
+            case ';': {
+                // N.B. memchr() is already vectorized by libc
+                auto nl = static_cast<const char*>(std::memchr(src.data() + cursor, '\n', src.size() - cursor));
+                if (!nl)
+                    hit_end();
+                cursor = nl ? nl - src.data() : src.size();
+            } continue;
+
+            case '\'': wrappers.push_back({ &sym_quote, cursor }); cursor += 1; continue;
+            case ',': {
+                size_t begin = cursor;
+                cursor += 1;
+                // Need the next byte to tell ,@ apart
+                if (cursor >= src.length())
+                    hit_end();
+                if (cursor < src.length() && src[cursor] == '@') {
+                    wrappers.push_back({ &sym_unquote_splicing, begin });
+                    cursor += 1;
+                } else {
+                    wrappers.push_back({ &sym_unquote, begin });
+                }
+            } continue;
+            case '`': wrappers.push_back({ &sym_quasiquote, cursor }); cursor += 1; continue;
+
+            case '(': enter_nesting(); cursor += 1; continue;
+            case ')': leave_nesting(); cursor += 1; continue;
+
+            case '"': parse_string(); continue;
+
+            case '#': {
+                cursor += 1;
+                if (cursor >= src.length()) {
+                    hit_end();
+                    throw ParseException("unexpected EOF while parsing #-symbols"s);
+                }
+
+                auto token = take_token();
+                if (token == "t"sv || token == "true"sv) {
+                    push_sexp(Sexp(true));
+                    continue;
+                }
+                if (token == "f"sv || token == "false"sv) {
+                    push_sexp(Sexp(false));
+                    continue;
+                }
+
+                throw ParseException("invalid #-symbol"s);
+            }
+
+            default: break;
+        }
+
+        auto token = take_token();
+
+        Sexp num;
+        if (parse_number(token, num)) {
+            push_sexp(num);
             continue;
         }
 
-#define CHECK_FOR_WRAP(literal, sym) \
-    if (src[cursor] == literal) {    \
-        next_sexp_wrapper = &(sym);  \
-        cursor++;                    \
-        continue;                    \
+        // Parse a symbol
+        // A fork's sources go away with it, but the symbols stay in the pool it shares with its base
+        const Symbol& h_sym = borrow_source && !env->base ? env->sym_pool.intern_borrowed(token) : env->sym_pool.intern(token);
+        push_sexp(Sexp(h_sym));
     }
-        CHECK_FOR_WRAP('\'', sym_quote);
-        CHECK_FOR_WRAP(',', sym_unquote);
-        CHECK_FOR_WRAP('`', sym_quasiquote);
-#undef CHECK_FOR_WRAP
+}
 
-        if (src[cursor] == '(') {
-            enter_nesting();
-            cursor += 1;
-            continue;
+void SexpParser::parse_string() {
+    // Skip the opening quote
+    cursor += 1;
+
+    String* h_str = std::exchange(spare_string, nullptr);
+    if (h_str) {
+        h_str->v.clear();
+        h_str->borrowed = nullptr;
+        h_str->borrowed_size = 0;
+    } else {
+        h_str = env->heap.allocate<String>().first;
+    }
+    auto& str = h_str->v;
+
+    // Without any escape sequences, the string is exactly the bytes between the quotes and can be used in place
+    if (borrow_source) {
+        size_t stop = find_string_stop(src, cursor);
+        if (stop < src.length() && src[stop] == '"') {
+            h_str->borrowed = src.data() + cursor;
+            h_str->borrowed_size = stop - cursor;
+            cursor = stop + 1;
+            push_string(h_str);
+            return;
         }
-        if (src[cursor] == ')') {
-            leave_nesting();
-            cursor += 1;
-            continue;
+    }
+
+    while (true) {
+        size_t stop = find_string_stop(src, cursor);
+        if (stop >= src.length()) {
+            hit_end();
+            cursor = stop;
+            throw ParseException("unexpected EOF while parsing string"s);
         }
 
+        // Copy everything up to the quote or backslash in one go
+        str.append(src.data() + cursor, stop - cursor);
+        cursor = stop;
+
         if (src[cursor] == '"') {
             cursor += 1;
+            break;
+        }
 
-            size_t str_size = 0;
-            size_t str_begin = cursor;
-            while (true) {
-                // Break conditions
-                if (cursor >= src.length())
-                    throw ParseException("unexpected EOF while parsing string"s);
-                if (src[cursor] == '"')
-                    break;
+        // Escape sequence
+        if (cursor + 1 >= src.length()) {
+            hit_end();
+            cursor = src.length();
+            throw ParseException("unexpected EOF while parsing string"s);
+        }
+        char esc = src[cursor + 1];
+        cursor += 2;
+        switch (esc) {
+            case 'n': str.push_back('\n'); break;
+            case '\\': str.push_back('\\'); break;
+            case '"': str.push_back('"'); break;
+            default: throw ParseException(std::format("invalid escaped char '{}'", esc));
+        }
+    }
 
-                if (src[cursor] == '\\') {
-                    str_size += 1;
-                    cursor += 2;
-                    continue;
-                }
+    push_string(h_str);
+}
 
-                // otherwise...
-                str_size += 1;
-                cursor += 1;
-            }
-            cursor += 1;
+void SexpParser::push_string(String* h_str) {
+    if (!quoting()) {
+        push_sexp(Sexp(h_str));
+        return;
+    }
 
-            auto [h_str, _] = env->heap.allocate<String>();
-            auto& str = h_str->v;
-            str.reserve(str_size);
+    Sexp constant = env->constants.intern(Sexp(h_str));
+    if (constant.as_ptr().get() != h_str)
+        spare_string = h_str;
+    push_sexp(constant);
+}
 
-            size_t i = str_begin;
-            while (i < str_begin + str_size) {
-                if (src[i] != '\\') {
-                    str.push_back(src[i]);
-                    i += 1;
-                    continue;
-                }
+Sexp parse_sexp(std::string_view src, Environment& env, bool borrow_source, SourceFileId file) {
+    SexpParser parser(env);
+    parser.set_borrow_source(borrow_source);
+    parser.set_source_file(file);
+    return parser.parse(src);
+}
 
-                char esc = src[i + 1];
-                i += 2;
-                switch (esc) {
-                    case 'n': str.push_back('\n'); break;
-                    case '\\': str.push_back('\\'); break;
-                    default: throw ParseException(std::format("invalid escaped char '{}'", esc));
-                }
+Sexp parse_sexp_parallel(std::string_view src, Environment& env, bool borrow_source, SourceFileId file) {
+    auto& pool = WorkStealingPool::shared();
+
+    // Several pieces per worker to even out the load, but not so small that the per-piece overhead shows
+    constexpr size_t MIN_PIECE_SIZE = 256 * 1024;
+    size_t piece_size = std::max(MIN_PIECE_SIZE, src.size() / (pool.worker_count() * 4));
+    auto splits = find_top_level_splits(src, piece_size);
+    splits.push_back({ src.size() });
+
+    size_t n_pieces = splits.size();
+    // The head of each piece's list, and the last cdr to link it to the next piece
+    std::vector<Sexp> heads(n_pieces);
+    std::vector<Sexp*> tails(n_pieces);
+    // Whatever a piece threw: a ParseException, or e.g. an EvalException for running out of heap
+    std::vector<std::exception_ptr> errors(n_pieces);
+
+    // Each worker allocates from its own allocation buffer in our heap
+    std::vector<std::unique_ptr<Environment>> worker_envs(pool.worker_count());
+    for (auto& we : worker_envs) {
+        we = std::make_unique<Environment>(env, Environment::WorkerTag{});
+    }
+
+    std::vector<WorkStealingPool::Task> tasks;
+    for (size_t i = 0; i < n_pieces; ++i) {
+        tasks.push_back([&, i](size_t worker_id) {
+            size_t begin = i == 0 ? 0 : splits[i - 1].offset;
+            size_t end = splits[i].offset;
+
+            SexpParser parser(*worker_envs[worker_id]);
+            parser.set_borrow_source(borrow_source);
+            parser.set_source_file(file);
+            if (i > 0)
+                parser.set_start_position(splits[i - 1].line, splits[i - 1].line_start - static_cast<ptrdiff_t>(begin));
+            try {
+                tails[i] = parser.parse_into(src.substr(begin, end - begin), heads[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
             }
+        });
+    }
 
-            push_sexp(Sexp(h_str));
+    pool.run_all(std::move(tasks));
 
+    // Stitch the pieces together in order
+    Sexp program;
+    Sexp* tail = &program;
+    for (size_t i = 0; i < n_pieces; ++i) {
+        // Report the same error a sequential parse would have stopped at, on this thread
+        if (errors[i])
+            std::rethrow_exception(errors[i]);
+        if (heads[i].is_nil())
             continue;
-        }
+        *tail = heads[i];
+        tail = tails[i];
+    }
+    return program;
+}
 
-        if (src[cursor] == '#') {
-            cursor += 1;
-            if (cursor >= src.length()) throw ParseException("unexpected EOF while parsing #-symbols"s);
+SexpReader::SexpReader(std::istream& input, Environment& env, SourceFileId file, bool interactive)
+    : _input{ &input }
+    , _parser{ std::make_unique<SexpParser>(env) }
+    , _interactive{ interactive } //
+{
+    _parser->set_source_file(file);
+}
 
-            char next_c = src[cursor];
-            cursor += 1;
+SexpReader::SexpReader(std::string_view source, Environment& env, SourceFileId file)
+    : _parser{ std::make_unique<SexpParser>(env) }
+    , _view{ source }
+    , _eof{ true } //
+{
+    _parser->set_borrow_source(true);
+    _parser->set_source_file(file);
+}
 
-            auto token = take_token();
-            if (token == "t"sv) {
-                push_sexp(Sexp(true));
-                continue;
-            }
-            if (token == "f"sv) {
-                push_sexp(Sexp(false));
-                continue;
-            }
+SexpReader::~SexpReader() = default;
 
-            throw ParseException("invalid #-symbol"s);
-        }
+bool SexpReader::fill_buffer() {
+    if (_eof)
+        return false;
 
-        auto token = take_token();
+    // Drop everything that has already been handed out, the buffer only ever holds the datum being read plus what's been read ahead
+    _buffer.erase(0, _datum_begin);
+    _line_start -= static_cast<ptrdiff_t>(_datum_begin);
+    _datum_begin = 0;
+
+    // Grow geometrically while a single datum keeps running past the end, so it gets reparsed only O(log n) times
+    size_t old_size = _buffer.size();
+    size_t to_read = std::max(CHUNK_SIZE, old_size);
+    _buffer.resize(old_size + to_read);
+    size_t n_read;
+    if (_interactive) {
+        n_read = read_lines(_buffer.data() + old_size, to_read);
+    } else {
+        _input->read(_buffer.data() + old_size, to_read);
+        n_read = _input->gcount();
+    }
+    _buffer.resize(old_size + n_read);
+    _view = _buffer;
+
+    if (n_read == 0) {
+        _eof = true;
+        return false;
+    }
+    return true;
+}
+
+size_t SexpReader::read_lines(char* buf, size_t size) {
+    auto sb = _input->rdbuf();
+    size_t n = 0;
+    while (n < size) {
+        auto c = sb->sbumpc();
+        if (c == std::char_traits<char>::eof())
+            break;
+        buf[n++] = static_cast<char>(c);
+        // Whatever is still to come may take a while, e.g. until someone types it
+        if (c == '\n' && sb->in_avail() <= 0)
+            break;
+    }
+    return n;
+}
+
+void SexpReader::skip_datum() {
+    while (true) {
+        auto end = find_datum_end(_view.substr(_datum_begin));
+        if (!end && fill_buffer())
+            continue;
+        auto left = _view.size() - _datum_begin;
+        consume(end ? std::min(std::max<size_t>(*end, 1), left) : left);
+        return;
+    }
+}
 
-        // Try parse a number literal
-        float v;
-        auto [rest, ec] = std::from_chars(&src[cursor], src.data() + src.size(), v);
-        if (ec == std::errc()) {
-            // TODO proper Scheme numeric literal parsing
-            if (auto n = static_cast<int32_t>(v); n == v)
-                push_sexp(Sexp(n));
-            else
-                push_sexp(Sexp(v));
-
-            cursor += rest - &src[cursor];
+bool SexpReader::next(Sexp& out) {
+    while (true) {
+        auto src = _view.substr(_datum_begin);
+
+        bool found;
+        try {
+            _parser->set_start_position(_line, _line_start - static_cast<ptrdiff_t>(_datum_begin));
+            found = _parser->parse_one(src, !_eof, out);
+        } catch (const IncompleteInput&) {
+            // Whatever was allocated for the partial datum is simply left behind; it's at most the size of the datum itself, since the buffer doubles each time
+            fill_buffer();
             continue;
-        } else if (ec == std::errc::result_out_of_range) {
-            throw ParseException("number literal out of range"s);
-        } else if (ec == std::errc::invalid_argument) {
-            // Not a number, continue
+        } catch (const ParseException&) {
+            // Skip the whole datum, what comes after the malformed part of it isn't a top-level datum of its own
+            skip_datum();
+            throw;
         }
 
-        // Parse a symbol
-        const Symbol& h_sym = env->sym_pool.intern(token);
-        push_sexp(Sexp(h_sym));
+        consume(_parser->position());
+        // Only false at the end of input, when there was nothing but whitespace and comments (or stray ')'s) left
+        return found;
     }
+}
 
-    return program;
+void SexpReader::consume(size_t n) {
+    LineCounter lines{ _line, _line_start, _datum_begin };
+    lines.advance_to(_view, _datum_begin + n);
+    _line = lines.line;
+    _line_start = lines.line_start;
+
+    _datum_begin += n;
+    _total_consumed += n;
 }
 
-Sexp parse_sexp(std::string_view src, Environment& env) {
-    SexpParser parser;
-    parser.env = &env;
-    parser.src = src;
+namespace {
+ConsCell* as_cons_cell(Sexp sexp) {
+    return sexp.is_ptr() && !sexp.is_nil() ? sexp.as_ptr().get_as<ConsCell>() : nullptr;
+}
+} // namespace
+
+SexpPrinter::SexpPrinter(Environment& env)
+    : _env{ &env } {}
 
-    return parser.parse();
+SexpPrinter::SexpPrinter(std::ostream& output, Environment& env)
+    : _output{ &output }
+    , _env{ &env } //
+{
+    _buffer.reserve(BUFFER_SIZE);
 }
 
-template <typename T>
-void dump_numerical_value(std::string& output, T v) {
-    // TODO I have no idea why max_digits10 isn't big enough
-    // constexpr auto BUF_SIZE = std::numeric_limits<T>::max_digits10;
-    const auto BUF_SIZE = 32;
-    char buf[BUF_SIZE];
-    auto res = std::to_chars(buf, buf + BUF_SIZE, v);
-
-    if (res.ec == std::errc()) {
-        output += std::string_view(buf, res.ptr);
-    } else {
-        throw std::runtime_error("failed to format number with std::to_chars()"s);
+SexpPrinter::~SexpPrinter() {
+    flush();
+}
+
+void SexpPrinter::write(std::string_view str) {
+    _buffer += str;
+    maybe_flush();
+}
+
+void SexpPrinter::write(char c) {
+    _buffer += c;
+    maybe_flush();
+}
+
+void SexpPrinter::flush() {
+    if (!_output || _buffer.empty())
+        return;
+    _output->write(_buffer.data(), _buffer.size());
+    _output->flush();
+    _buffer.clear();
+}
+
+std::string SexpPrinter::take() {
+    return std::exchange(_buffer, {});
+}
+
+void SexpPrinter::print(Sexp sexp) {
+    // Also if printing throws half way through, so that the next print() starts out clean
+    DEFER {
+        _stack.clear();
+        if (!_labels.empty()) {
+            _labels.clear();
+            _next_label = 0;
+        }
+    };
+
+    find_cycles(sexp);
+
+    // NOTE: explicit stack instead of recursion, so that deeply nested data can't overflow the native stack
+    begin_datum(sexp);
+    while (!_stack.empty()) {
+        auto& frame = _stack.back();
+
+        if (frame.next) {
+            auto cell = frame.next;
+            if (!frame.first)
+                write(' ');
+            frame.first = false;
+
+            // Cells with a label have to be printed as a tail, so they can be referred to
+            auto cdr_cell = as_cons_cell(cell->cdr);
+            if (cdr_cell && !is_labeled(cdr_cell)) {
+                frame.next = cdr_cell;
+            } else {
+                frame.next = nullptr;
+                frame.tail = cell->cdr;
+            }
+
+            // NB: might push another frame, invalidating `frame`
+            begin_datum(cell->car);
+        } else if (!frame.tail.is_nil()) {
+            auto tail = std::exchange(frame.tail, Sexp());
+            write(" . "sv);
+            begin_datum(tail);
+        } else {
+            write(')');
+            _stack.pop_back();
+        }
     }
 }
 
-void dump_sexp_impl(std::string& output, Sexp sexp, Environment& env) {
+void SexpPrinter::begin_datum(Sexp sexp) {
+    auto cell = as_cons_cell(sexp);
+    if (!cell) {
+        print_atom(sexp);
+        return;
+    }
+
+    if (!_labels.empty()) {
+        if (auto it = _labels.find(cell); it != _labels.end()) {
+            write('#');
+            if (it->second >= 0) {
+                print_number(it->second);
+                write('#');
+                return;
+            }
+            it->second = _next_label++;
+            print_number(it->second);
+            write('=');
+        }
+    }
+
+    write('(');
+    _stack.push_back(ListFrame{ .next = cell, .tail = Sexp(), .first = true });
+}
+
+bool SexpPrinter::is_labeled(const ConsCell* cell) const {
+    return !_labels.empty() && _labels.contains(cell);
+}
+
+template <typename T>
+void SexpPrinter::print_number(T v) {
+    // Format straight into the buffer, 32 chars is plenty for any int32_t or float
+    constexpr size_t MAX_CHARS = 32;
+    auto old_size = _buffer.size();
+    _buffer.resize_and_overwrite(old_size + MAX_CHARS, [&](char* buf, size_t n) {
+        auto res = std::to_chars(buf + old_size, buf + n, v);
+        if (res.ec != std::errc())
+            throw std::runtime_error("failed to format number with std::to_chars()"s);
+        return res.ptr - buf;
+    });
+    maybe_flush();
+}
+
+void SexpPrinter::print_atom(Sexp sexp) {
     switch (sexp.get_flags()) {
         case SCVAL_FLAG_INT: {
-            dump_numerical_value(output, sexp.as_int());
+            print_number(sexp.as_int());
         } break;
 
         case SCVAL_FLAG_FLOAT: {
-            dump_numerical_value(output, sexp.as_float());
+            print_number(sexp.as_float());
         } break;
 
         case SCVAL_FLAG_BOOL: {
             auto v = sexp.as_bool();
-            output += v ? "#t" : "#f";
+            write(v ? "#t"sv : "#f"sv);
         } break;
 
         case SCVAL_FLAG_SYMBOL: {
-            auto& v = sexp.as_symbol();
-            output += v;
+            auto& v = _env->sym_pool.get(sexp.as_symbol());
+            write(v);
         } break;
 
         case SCVAL_FLAG_PTR: {
             HeapPtr<void> ptr = sexp.as_ptr();
 
-            // Support dumping empty lists
-            // For non-empty lists, the terminating nil is automatically handled by SexpListIterator
+            // Support dumping empty lists, written as a datum when inside one, so that printed code reads back the same
             if (ptr == nullptr) {
-                output += "'()";
+                write(_stack.empty() ? "'()"sv : "()"sv);
                 break;
             }
 
@@ -429,55 +1694,152 @@ void dump_sexp_impl(std::string& output, Sexp sexp, Environment& env) {
                 using enum ObjectType;
 
                 case TYPE_UNKNOWN: {
-                    output += "#UNKNOWN";
+                    write("#UNKNOWN"sv);
                 } break;
 
                 case TYPE_CONS_CELL: {
-                    output += "(";
-                    for (Sexp elm : iterate(ptr.get_as_unchecked<ConsCell>(), env)) {
-                        dump_sexp_impl(output, elm, env);
-                        output += " ";
-                    }
-                    output.pop_back(); // Remove the trailing space
-                    output += ")";
+                    assert(false && "lists are handled by print()");
                 } break;
 
                 case TYPE_STRING: {
-                    auto& v = ptr.get_as_unchecked<String>()->v;
-                    output += '"';
-                    output += v;
-                    output += '"';
+                    // Piece by piece, a rope may well be too big to flatten just for this
+                    write('"');
+                    ptr.get_as_unchecked<String>()->for_each_piece([this](std::string_view piece) { write(piece); });
+                    write('"');
                 } break;
 
                 case TYPE_USER_PROC: {
                     auto& v = *ptr.get_as_unchecked<UserProc>();
-                    output += "#BUILTIN:";
-                    output += *v.name;
+                    if (!v.name) {
+                        // A lambda
+                        write("#PROC:<unnamed>"sv);
+                    } else {
+                        write("#PROC:"sv);
+                        write(*v.name);
+                    }
                 } break;
 
                 case TYPE_BUILTIN_PROC: {
                     auto& v = *ptr.get_as_unchecked<BuiltinProc>();
                     if (v.name->empty()) {
                         // Unnamed proc, probably a lambda
-                        output += "#PROC:<unnamed>";
+                        write("#PROC:<unnamed>"sv);
                     } else {
-                        output += "#PROC:";
-                        output += *v.name;
+                        write("#PROC:"sv);
+                        write(*v.name);
                     }
                 } break;
 
+                case TYPE_PRIMITIVE_PROC: {
+                    write("#PROC:"sv);
+                    write(*ptr.get_as_unchecked<PrimitiveProc>()->name);
+                } break;
+
+                case TYPE_NATIVE_PROC: {
+                    write("#PROC:"sv);
+                    write(*ptr.get_as_unchecked<NativeProc>()->name);
+                } break;
+
                 case TYPE_CALL_FRAME: {
                     assert(false && "unimplemented");
                 } break;
+
+                case TYPE_PORT: {
+                    write("#PORT"sv);
+                } break;
+
+                case TYPE_CHANNEL: {
+                    write("#CHANNEL"sv);
+                } break;
+
+                case TYPE_TASK: {
+                    write("#TASK"sv);
+                } break;
+
+                case TYPE_STRING_BUILDER: {
+                    write("#STRING-BUILDER"sv);
+                } break;
+
+                case TYPE_QUASI_TEMPLATE: {
+                    write("#TEMPLATE"sv);
+                } break;
+
+                case TYPE_MACRO: {
+                    write("#MACRO:"sv);
+                    write(*ptr.get_as_unchecked<Macro>()->name);
+                } break;
+
+                case TYPE_CASE_TABLE: {
+                    write("#CASE-TABLE"sv);
+                } break;
+
+                case TYPE_CONDITION: {
+                    write("#ERROR:"sv);
+                    write(format_condition(*ptr.get_as_unchecked<Condition>(), *_env));
+                } break;
             }
         } break;
     }
 }
 
+void SexpPrinter::find_cycles(Sexp sexp) {
+    // Most data are small enough that running out of cells to count proves there's no cycle, without keeping track of where we've been
+    size_t budget = CYCLE_SCAN_THRESHOLD;
+    _scan_stack.clear();
+    _scan_stack.push_back(sexp);
+    while (!_scan_stack.empty()) {
+        auto s = _scan_stack.back();
+        _scan_stack.pop_back();
+        for (auto cell = as_cons_cell(s); cell; cell = as_cons_cell(cell->cdr)) {
+            if (budget-- == 0)
+                goto full_search;
+            if (as_cons_cell(cell->car))
+                _scan_stack.push_back(cell->car);
+        }
+    }
+    return;
+
+full_search:
+    // Depth first, remembering which cells are on the path from the root: running into one of those again means a cycle.
+    // Cells reached again through some other path are merely shared, and just get printed twice.
+    struct ScanFrame {
+        ConsCell* cell;
+        int stage;
+    };
+    std::vector<ScanFrame> stack;
+    // true once a cell and everything reachable from it has been searched
+    std::unordered_map<const ConsCell*, bool> done;
+
+    auto visit = [&](Sexp s) {
+        auto cell = as_cons_cell(s);
+        if (!cell)
+            return;
+        auto [it, inserted] = done.try_emplace(cell, false);
+        if (inserted)
+            stack.push_back({ cell, 0 });
+        else if (!it->second)
+            _labels.try_emplace(cell, -1);
+    };
+
+    visit(sexp);
+    while (!stack.empty()) {
+        auto& frame = stack.back();
+        auto cell = frame.cell;
+        switch (frame.stage++) {
+            case 0: visit(cell->car); break;
+            case 1: visit(cell->cdr); break;
+            default:
+                done[cell] = true;
+                stack.pop_back();
+                break;
+        }
+    }
+}
+
 std::string dump_sexp(Sexp sexp, Environment& env) {
-    std::string result;
-    dump_sexp_impl(result, sexp, env);
-    return result;
+    SexpPrinter printer(env);
+    printer.print(sexp);
+    return printer.take();
 }
 
 } // namespace yawarakai
@@ -0,0 +1,610 @@
+module;
+#include "util.hpp"
+
+module yawarakai;
+import std;
+
+using namespace std::literals;
+
+namespace yawarakai {
+
+namespace {
+bool is_symbol(Sexp x, SymbolId name) {
+    return x.is_symbol() && x.as_symbol() == name;
+}
+
+/// Whether the data in a pattern matches `x`, for anything but symbols and lists
+bool datum_equal(Sexp pattern, Sexp x) {
+    if (pattern._value == x._value)
+        return true;
+    if (pattern.is_nil() || x.is_nil() || !pattern.is_ptr<String>() || !x.is_ptr<String>())
+        return false;
+    auto& a = *pattern.as_ptr<String>();
+    auto& b = *x.as_ptr<String>();
+    return a.size() == b.size() && a.view() == b.view();
+}
+
+/// What a pattern variable matched: a single form, or under `depth` ellipses, a sequence of what each repetition matched
+struct MatchTree {
+    Sexp value = Sexp();
+    std::vector<MatchTree> items;
+    bool is_sequence = false;
+};
+
+using MatchBindings = std::vector<std::pair<SymbolId, MatchTree>>;
+
+/// Numbers the fresh symbols that stand in for the binders of templates, see SyntaxRules::rename_binders()
+std::atomic<uint64_t> g_renames = 0;
+
+class SyntaxRules {
+private:
+    const Macro& _macro;
+    Environment& _env;
+    SymbolId _underscore;
+    SymbolId _quote;
+    SymbolId _lambda;
+    SymbolId _define;
+    SymbolId _let;
+    SymbolId _let_star;
+    SymbolId _guard;
+
+    /// Variables of the pattern of the rule being expanded
+    std::vector<SymbolId> _pattern_vars;
+
+public:
+    SyntaxRules(const Macro& macro, Environment& env)
+        : _macro{ macro }
+        , _env{ env }
+        , _underscore{ env.sym_pool.intern("_").id() }
+        , _quote{ env.sym_pool.intern("quote").id() }
+        , _lambda{ env.sym_pool.intern("lambda").id() }
+        , _define{ env.sym_pool.intern("define").id() }
+        , _let{ env.sym_pool.intern("let").id() }
+        , _let_star{ env.sym_pool.intern("let*").id() }
+        , _guard{ env.sym_pool.intern("guard").id() } {}
+
+    Sexp expand(const ConsCell& form) {
+        for (auto& rule : iterate(_macro.rules, _env)) {
+            Sexp pattern = car(rule);
+            Sexp tmpl = car(cdr(rule));
+
+            // The keyword position is never matched against, it may as well be _
+            MatchBindings bindings;
+            if (!is_cons(pattern) || !match_list(pattern.as_ptr<ConsCell>()->cdr, form.cdr, bindings))
+                continue;
+
+            std::vector<std::pair<SymbolId, const MatchTree*>> scope;
+            for (auto& [name, tree] : bindings) {
+                scope.emplace_back(name, &tree);
+                _pattern_vars.push_back(name);
+            }
+            Renames renames;
+            return instantiate(rename_binders(tmpl, renames), scope);
+        }
+
+        throw EvalException(std::format("no syntax rule of ({}) matches this use of it", std::string_view(*_macro.name)));
+    }
+
+private:
+    bool is_ellipsis(Sexp x) const { return is_symbol(x, _macro.ellipsis); }
+
+    bool is_literal(SymbolId name) const {
+        for (Sexp lit = _macro.literals; is_cons(lit); lit = lit.as_ptr<ConsCell>()->cdr) {
+            if (is_symbol(lit.as_ptr<ConsCell>()->car, name))
+                return true;
+        }
+        return false;
+    }
+
+    /******** Matching ********/
+
+    bool match(Sexp pattern, Sexp x, MatchBindings& bindings) {
+        if (pattern.is_symbol()) {
+            auto name = pattern.as_symbol();
+            if (is_literal(name))
+                return is_symbol(x, name);
+            if (name != _underscore)
+                bindings.emplace_back(name, MatchTree{ .value = x });
+            return true;
+        }
+        if (is_cons(pattern))
+            return is_cons(x) && match_list(pattern, x, bindings);
+        if (pattern.is_nil())
+            return x.is_nil();
+        return datum_equal(pattern, x);
+    }
+
+    /// Matches a list of patterns, one of which may be followed by an ellipsis, against the list `x`
+    bool match_list(Sexp patterns, Sexp x, MatchBindings& bindings) {
+        while (is_cons(patterns)) {
+            auto& p = *patterns.as_ptr<ConsCell>();
+            if (is_cons(p.cdr) && is_ellipsis(p.cdr.as_ptr<ConsCell>()->car))
+                return match_ellipsis(p.car, p.cdr.as_ptr<ConsCell>()->cdr, x, bindings);
+
+            if (!is_cons(x) || !match(p.car, x.as_ptr<ConsCell>()->car, bindings))
+                return false;
+            patterns = p.cdr;
+            x = x.as_ptr<ConsCell>()->cdr;
+        }
+        return x.is_nil();
+    }
+
+    /// Matches `repeated` against as many items of `x` as leaves enough for the patterns in `rest` after it
+    bool match_ellipsis(Sexp repeated, Sexp rest, Sexp x, MatchBindings& bindings) {
+        size_t n_rest = 0;
+        for (Sexp r = rest; is_cons(r); r = r.as_ptr<ConsCell>()->cdr)
+            n_rest += 1;
+        size_t n_items = 0;
+        for (Sexp i = x; is_cons(i); i = i.as_ptr<ConsCell>()->cdr)
+            n_items += 1;
+        if (n_items < n_rest)
+            return false;
+
+        // Every variable of the repeated pattern gets a sequence, even an empty one
+        std::vector<SymbolId> vars;
+        collect_pattern_vars(repeated, vars);
+        size_t first_binding = bindings.size();
+        for (auto var : vars)
+            bindings.emplace_back(var, MatchTree{ .is_sequence = true });
+
+        for (size_t i = 0; i < n_items - n_rest; ++i) {
+            MatchBindings one;
+            if (!match(repeated, x.as_ptr<ConsCell>()->car, one))
+                return false;
+            for (auto& [name, tree] : one) {
+                for (size_t b = first_binding; b < first_binding + vars.size(); ++b) {
+                    if (bindings[b].first == name)
+                        bindings[b].second.items.push_back(std::move(tree));
+                }
+            }
+            x = x.as_ptr<ConsCell>()->cdr;
+        }
+
+        return match_list(rest, x, bindings);
+    }
+
+    void collect_pattern_vars(Sexp pattern, std::vector<SymbolId>& out) const {
+        if (pattern.is_symbol()) {
+            auto name = pattern.as_symbol();
+            if (!is_literal(name) && name != _underscore && name != _macro.ellipsis)
+                out.push_back(name);
+            return;
+        }
+        for (; is_cons(pattern); pattern = pattern.as_ptr<ConsCell>()->cdr)
+            collect_pattern_vars(pattern.as_ptr<ConsCell>()->car, out);
+    }
+
+    /******** Renaming the binders of templates ********/
+
+    /// Symbols of a template that it binds itself, and the fresh symbols standing in for them, innermost last
+    using Renames = std::vector<std::pair<SymbolId, SymbolId>>;
+
+    /// A symbol named after `name` that hasn't been used for anything yet, and so can't be one the macro's user wrote
+    SymbolId fresh_symbol(SymbolId name) {
+        std::string_view base = _env.sym_pool.get(name);
+        while (true) {
+            auto candidate = std::format("{}.{}", base, g_renames.fetch_add(1, std::memory_order_relaxed) + 1);
+            if (!_env.sym_pool.find(candidate))
+                return _env.sym_pool.intern(candidate).id();
+        }
+    }
+
+    /// Whether `x` is a symbol the template itself may bind, as opposed to one that stands for what the use of the macro has in its place
+    bool is_template_binder(Sexp x) const {
+        if (!x.is_symbol())
+            return false;
+        auto name = x.as_symbol();
+        return !is_ellipsis(x) && std::ranges::find(_pattern_vars, name) == _pattern_vars.end();
+    }
+
+    /// Binds `x` to a fresh symbol in `renames`, if it's a symbol the template binds, and gives what it's renamed to
+    Sexp bind_fresh(Sexp x, Renames& renames) {
+        if (!is_template_binder(x))
+            return x;
+        auto fresh = fresh_symbol(x.as_symbol());
+        renames.emplace_back(x.as_symbol(), fresh);
+        return Sexp(fresh);
+    }
+
+    /// Binds each symbol of the formals of a (lambda) or (define), which may be a list, an improper one or a single symbol
+    Sexp bind_formals(Sexp formals, Renames& renames) {
+        if (!is_cons(formals))
+            return bind_fresh(formals, renames);
+        auto& cell = *formals.as_ptr<ConsCell>();
+        Sexp first = bind_fresh(cell.car, renames);
+        return cons(first, bind_formals(cell.cdr, renames), _env);
+    }
+
+    /// Renames the symbols that `tmpl` binds with (lambda), (define), (let), (let*) or (guard) to fresh ones, throughout their scope.
+    /// What the pattern variables stand for then can't refer to them, e.g. `t` in (my-or #f t) to a `t` that my-or's template binds.
+    Sexp rename_binders(Sexp tmpl, Renames& renames) {
+        if (tmpl.is_symbol()) {
+            for (auto it = renames.rbegin(); it != renames.rend(); ++it) {
+                if (it->first == tmpl.as_symbol())
+                    return Sexp(it->second);
+            }
+            return tmpl;
+        }
+        if (!is_cons(tmpl))
+            return tmpl;
+
+        auto& cell = *tmpl.as_ptr<ConsCell>();
+        Sexp head = cell.car;
+        if (!is_template_binder(head) || !is_cons(cell.cdr))
+            return rename_items(tmpl, renames);
+        auto& rest = *cell.cdr.as_ptr<ConsCell>();
+        auto id = head.as_symbol();
+        if (id == _quote)
+            return tmpl;
+
+        // What a form binds is only renamed inside of it, in `inner`
+        // (lambda formals body ...)
+        if (id == _lambda) {
+            Renames inner = renames;
+            Sexp formals = bind_formals(rest.car, inner);
+            return cons(head, cons(formals, rename_items(rest.cdr, inner), _env), _env);
+        }
+
+        // (define (name formals ...) body ...), the name itself being a binding of the scope the define is in
+        if (id == _define && is_cons(rest.car)) {
+            auto& decl = *rest.car.as_ptr<ConsCell>();
+            Renames inner = renames;
+            Sexp name = rename_binders(decl.car, renames);
+            Sexp formals = bind_formals(decl.cdr, inner);
+            return cons(head, cons(cons(name, formals, _env), rename_items(rest.cdr, inner), _env), _env);
+        }
+
+        // (let [name] ((var init) ...) body ...), each init of a (let*) seeing the vars before it
+        if (id == _let || id == _let_star) {
+            Sexp name = Sexp();
+            Sexp bindings = rest.car;
+            Sexp body = rest.cdr;
+            bool named = rest.car.is_symbol();
+            if (named && is_cons(rest.cdr)) {
+                bindings = rest.cdr.as_ptr<ConsCell>()->car;
+                body = rest.cdr.as_ptr<ConsCell>()->cdr;
+            }
+
+            Renames inner = renames;
+            Sexp new_bindings;
+            Sexp* tail = &new_bindings;
+            for (; is_cons(bindings); bindings = bindings.as_ptr<ConsCell>()->cdr) {
+                Sexp binding = bindings.as_ptr<ConsCell>()->car;
+                if (is_cons(binding)) {
+                    auto& b = *binding.as_ptr<ConsCell>();
+                    Sexp init = rename_items(b.cdr, id == _let_star ? inner : renames);
+                    binding = cons(bind_fresh(b.car, inner), init, _env);
+                }
+                *tail = cons(binding, Sexp(), _env);
+                tail = &tail->as_ptr<ConsCell>()->cdr;
+            }
+            *tail = bindings;
+            if (named)
+                name = bind_fresh(rest.car, inner);
+
+            Sexp new_rest = cons(new_bindings, rename_items(body, inner), _env);
+            return cons(head, named ? cons(name, new_rest, _env) : new_rest, _env);
+        }
+
+        // (guard (var clause ...) body ...)
+        if (id == _guard && is_cons(rest.car)) {
+            Sexp body = rename_items(rest.cdr, renames);
+            auto& spec = *rest.car.as_ptr<ConsCell>();
+            Renames inner = renames;
+            Sexp var = bind_fresh(spec.car, inner);
+            return cons(head, cons(cons(var, rename_items(spec.cdr, inner), _env), body, _env), _env);
+        }
+
+        return rename_items(tmpl, renames);
+    }
+
+    /// rename_binders() on each item of the list `tmpl`, sharing whatever didn't change
+    Sexp rename_items(Sexp tmpl, Renames& renames) {
+        if (!is_cons(tmpl))
+            return rename_binders(tmpl, renames);
+        auto& cell = *tmpl.as_ptr<ConsCell>();
+        Sexp car = rename_binders(cell.car, renames);
+        Sexp cdr = rename_items(cell.cdr, renames);
+        if (car._value == cell.car._value && cdr._value == cell.cdr._value)
+            return tmpl;
+        return cons(car, cdr, _env);
+    }
+
+    /******** Instantiating templates ********/
+
+    using Scope = std::vector<std::pair<SymbolId, const MatchTree*>>;
+
+    static const MatchTree* find(const Scope& scope, SymbolId name) {
+        // Innermost repetition last
+        for (auto it = scope.rbegin(); it != scope.rend(); ++it) {
+            if (it->first == name)
+                return it->second;
+        }
+        return nullptr;
+    }
+
+    Sexp instantiate(Sexp tmpl, Scope& scope) {
+        if (tmpl.is_symbol()) {
+            auto var = find(scope, tmpl.as_symbol());
+            if (!var)
+                return tmpl;
+            if (var->is_sequence)
+                throw EvalException(std::format("pattern variable '{}' of ({}) needs an ellipsis after it", std::string_view(_env.sym_pool.get(tmpl.as_symbol())), std::string_view(*_macro.name)));
+            return var->value;
+        }
+        if (!is_cons(tmpl) || !uses_any(tmpl, scope))
+            return tmpl;
+
+        // (... template) inserts the template with its ellipses taken as they are
+        auto& head = *tmpl.as_ptr<ConsCell>();
+        if (is_ellipsis(head.car) && is_cons(head.cdr)) {
+            Scope literal_scope = scope;
+            return instantiate_escaped(head.cdr.as_ptr<ConsCell>()->car, literal_scope);
+        }
+
+        Sexp res;
+        Sexp* tail = &res;
+        auto append = [&](Sexp v) {
+            auto [cell, _] = _env.heap.allocate<ConsCell>(v, Sexp());
+            *tail = Sexp(cell);
+            tail = &cell->cdr;
+        };
+
+        Sexp curr = tmpl;
+        while (is_cons(curr)) {
+            auto& cell = *curr.as_ptr<ConsCell>();
+            Sexp next = cell.cdr;
+            size_t depth = 0;
+            while (is_cons(next) && is_ellipsis(next.as_ptr<ConsCell>()->car)) {
+                depth += 1;
+                next = next.as_ptr<ConsCell>()->cdr;
+            }
+
+            if (depth == 0)
+                append(instantiate(cell.car, scope));
+            else
+                instantiate_repeated(cell.car, depth, scope, append);
+            curr = next;
+        }
+        *tail = instantiate(curr, scope);
+        return res;
+    }
+
+    /// Instantiates `tmpl` once for each repetition of the sequence variables in it, flattening `depth - 1` levels of nesting
+    void instantiate_repeated(Sexp tmpl, size_t depth, Scope& scope, auto&& append) {
+        std::vector<std::pair<SymbolId, const MatchTree*>> sequences;
+        collect_sequences(tmpl, scope, sequences);
+        if (sequences.empty())
+            throw EvalException(std::format("ellipsis in a template of ({}) follows no pattern variable that repeats", std::string_view(*_macro.name)));
+
+        size_t n = sequences.front().second->items.size();
+        for (auto& [name, tree] : sequences) {
+            if (tree->items.size() != n)
+                throw EvalException(std::format("pattern variables under the same ellipsis in ({}) matched different numbers of forms", std::string_view(*_macro.name)));
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            size_t scope_size = scope.size();
+            for (auto& [name, tree] : sequences)
+                scope.emplace_back(name, &tree->items[i]);
+            if (depth == 1)
+                append(instantiate(tmpl, scope));
+            else
+                instantiate_repeated(tmpl, depth - 1, scope, append);
+            scope.resize(scope_size);
+        }
+    }
+
+    void collect_sequences(Sexp tmpl, const Scope& scope, std::vector<std::pair<SymbolId, const MatchTree*>>& out) const {
+        if (tmpl.is_symbol()) {
+            auto name = tmpl.as_symbol();
+            auto var = find(scope, name);
+            if (var && var->is_sequence && std::ranges::find(out, name, &std::pair<SymbolId, const MatchTree*>::first) == out.end())
+                out.emplace_back(name, var);
+            return;
+        }
+        for (; is_cons(tmpl); tmpl = tmpl.as_ptr<ConsCell>()->cdr)
+            collect_sequences(tmpl.as_ptr<ConsCell>()->car, scope, out);
+    }
+
+    /// Whether anything in `tmpl` needs substituting, otherwise it's used as it is
+    bool uses_any(Sexp tmpl, const Scope& scope) const {
+        if (tmpl.is_symbol())
+            return find(scope, tmpl.as_symbol()) != nullptr;
+        for (; is_cons(tmpl); tmpl = tmpl.as_ptr<ConsCell>()->cdr) {
+            auto elm = tmpl.as_ptr<ConsCell>()->car;
+            if (is_ellipsis(elm) || uses_any(elm, scope))
+                return true;
+        }
+        return false;
+    }
+
+    /// Same as instantiate(), with the ellipsis being an ordinary symbol
+    Sexp instantiate_escaped(Sexp tmpl, Scope& scope) {
+        if (tmpl.is_symbol()) {
+            auto var = find(scope, tmpl.as_symbol());
+            return var && !var->is_sequence ? var->value : tmpl;
+        }
+        if (!is_cons(tmpl))
+            return tmpl;
+        auto& cell = *tmpl.as_ptr<ConsCell>();
+        return cons(instantiate_escaped(cell.car, scope), instantiate_escaped(cell.cdr, scope), _env);
+    }
+};
+
+/// The macro `head` names in `env`, if it does
+const Macro* find_macro(Sexp head, Environment& env) {
+    if (!head.is_symbol())
+        return nullptr;
+    auto binding = env.lookup_binding(head.as_symbol());
+    if (!binding || binding->is_nil() || !binding->is_ptr<Macro>())
+        return nullptr;
+    return binding->as_ptr<Macro>().get();
+}
+
+/// Expands everything in `x`, which is `depth` quasiquotes deep
+Sexp expand_all_impl(Sexp x, int depth, Environment& env);
+
+/// Expands each item of the list `x` in turn, sharing whatever didn't change
+Sexp expand_items(Sexp x, int depth, Environment& env) {
+    if (!is_cons(x))
+        return x;
+    auto& cell = *x.as_ptr<ConsCell>();
+    Sexp car = expand_all_impl(cell.car, depth, env);
+    Sexp cdr = expand_items(cell.cdr, depth, env);
+    if (car._value == cell.car._value && cdr._value == cell.cdr._value)
+        return x;
+    return cons(car, cdr, env);
+}
+
+/// Expands all but the first item of each list in `clauses`: the bodies of the clauses of a (case), leaving their datums alone,
+/// or the inits of the bindings of a (let), leaving the names they bind alone
+Sexp expand_clause_tails(Sexp clauses, Environment& env) {
+    if (!is_cons(clauses))
+        return clauses;
+    auto& cell = *clauses.as_ptr<ConsCell>();
+    Sexp clause = cell.car;
+    if (is_cons(clause)) {
+        auto& c = *clause.as_ptr<ConsCell>();
+        Sexp body = expand_items(c.cdr, 0, env);
+        if (body._value != c.cdr._value)
+            clause = cons(c.car, body, env);
+    }
+    Sexp rest = expand_clause_tails(cell.cdr, env);
+    if (clause._value == cell.car._value && rest._value == cell.cdr._value)
+        return clauses;
+    return cons(clause, rest, env);
+}
+
+Sexp expand_all_impl(Sexp x, int depth, Environment& env) {
+    if (!is_cons(x))
+        return x;
+
+    auto& cell = *x.as_ptr<ConsCell>();
+    if (cell.car.is_symbol()) {
+        auto& name = env.sym_pool.get(cell.car.as_symbol());
+        if (depth == 0) {
+            if (auto macro = find_macro(cell.car, env))
+                return expand_all_impl(expand_macro_use(*macro, cell, env), 0, env);
+            if (std::string_view(name) == "quote"sv)
+                return x;
+            // The datums of each clause aren't code either
+            if (std::string_view(name) == "case"sv && is_cons(cell.cdr)) {
+                auto& rest = *cell.cdr.as_ptr<ConsCell>();
+                return cons(cell.car, cons(expand_all_impl(rest.car, 0, env), expand_clause_tails(rest.cdr, env), env), env);
+            }
+            // Nor are the names that are bound, even where one of them is also the name of a macro, e.g. (define (my-or a b) ...)
+            if ((std::string_view(name) == "define"sv || std::string_view(name) == "lambda"sv) && is_cons(cell.cdr)) {
+                auto& rest = *cell.cdr.as_ptr<ConsCell>();
+                return cons(cell.car, cons(rest.car, expand_items(rest.cdr, 0, env), env), env);
+            }
+            if ((std::string_view(name) == "let"sv || std::string_view(name) == "let*"sv) && is_cons(cell.cdr)) {
+                auto& rest = *cell.cdr.as_ptr<ConsCell>();
+                // (let name ((var init) ...) body ...)
+                if (rest.car.is_symbol() && is_cons(rest.cdr)) {
+                    auto& named = *rest.cdr.as_ptr<ConsCell>();
+                    return cons(cell.car, cons(rest.car, cons(expand_clause_tails(named.car, env), expand_items(named.cdr, 0, env), env), env), env);
+                }
+                return cons(cell.car, cons(expand_clause_tails(rest.car, env), expand_items(rest.cdr, 0, env), env), env);
+            }
+        }
+        // Only the unquoted parts of a template are code
+        if (std::string_view(name) == "quasiquote"sv)
+            return expand_items(x, depth + 1, env);
+        if (depth > 0 && (std::string_view(name) == "unquote"sv || std::string_view(name) == "unquote-splicing"sv))
+            return expand_items(x, depth - 1, env);
+    }
+    return expand_items(x, depth, env);
+}
+
+// (define-syntax name transformer)
+Sexp builtin_define_syntax(Sexp params, Environment& env) {
+    Sexp name;
+    Sexp spec;
+    list_get_everything(params, { &name, &spec }, env);
+    if (!name.is_symbol())
+        throw EvalException("(define-syntax) expected a symbol as 1st argument"s);
+
+    Sexp transformer = eval(spec, env);
+    RETURN_IF_UNWINDING(env);
+    if (transformer.is_nil() || !transformer.is_ptr<Macro>())
+        throw EvalException("(define-syntax) expected a transformer such as (syntax-rules ...) as 2nd argument"s);
+
+    // Named after the first thing it's defined as, for error messages
+    auto& macro = *transformer.as_ptr<Macro>();
+    if (macro.name->empty())
+        macro.name = &env.sym_pool.get(name.as_symbol());
+    env.curr_scope->define(name.as_symbol(), transformer);
+    return Sexp();
+}
+
+// (syntax-rules [ellipsis] (literal ...) (pattern template) ...)
+Sexp builtin_syntax_rules(Sexp params, Environment& env) {
+    auto [macro, _] = env.heap.allocate<Macro>();
+    macro->name = &env.sym_pool.intern(""sv);
+    macro->ellipsis = env.sym_pool.intern("..."sv).id();
+
+    if (is_cons(params) && params.as_ptr<ConsCell>()->car.is_symbol()) {
+        macro->ellipsis = params.as_ptr<ConsCell>()->car.as_symbol();
+        params = params.as_ptr<ConsCell>()->cdr;
+    }
+    if (!is_cons(params) || !(params.as_ptr<ConsCell>()->car.is_nil() || is_cons(params.as_ptr<ConsCell>()->car)))
+        throw EvalException("(syntax-rules) expected a list of literals"s);
+    macro->literals = params.as_ptr<ConsCell>()->car;
+    macro->rules = params.as_ptr<ConsCell>()->cdr;
+
+    for (auto& rule : iterate(macro->rules, env)) {
+        if (!is_cons(rule) || !is_cons(rule.as_ptr<ConsCell>()->cdr) || !rule.as_ptr<ConsCell>()->cdr.as_ptr<ConsCell>()->cdr.is_nil())
+            throw EvalException("(syntax-rules) expected each rule to be (pattern template)"s);
+        if (!is_cons(rule.as_ptr<ConsCell>()->car))
+            throw EvalException("(syntax-rules) expected each pattern to be a list"s);
+    }
+    return Sexp(macro);
+}
+
+// (macroexpand form)
+Sexp builtin_macroexpand(Sexp form, Environment& env) {
+    return expand_all(form, env);
+}
+} // namespace
+
+Sexp expand_macro_use(const Macro& macro, const ConsCell& form, Environment& env) {
+    // Remembered along with the macro it came from, in case the name is later bound to another one.
+    // The first expansion of a use stays cached, the uses of a macro redefined after that are expanded every time.
+    if (auto cached = env.form_cache.find(&form)) {
+        auto& entry = *cached->as_ptr<ConsCell>();
+        if (entry.car.as_ptr<Macro>().get() == &macro)
+            return entry.cdr;
+        return SyntaxRules(macro, env).expand(form);
+    }
+
+    Sexp expansion = SyntaxRules(macro, env).expand(form);
+    auto [entry, _] = env.heap.allocate<ConsCell>(Sexp(const_cast<Macro*>(&macro)), expansion);
+    return env.form_cache.add(&form, Sexp(entry)).as_ptr<ConsCell>()->cdr;
+}
+
+Sexp expand_all(Sexp form, Environment& env) {
+    return expand_all_impl(form, 0, env);
+}
+
+std::optional<Sexp> expand_top_level(Sexp form, Environment& env) {
+    if (is_cons(form)) {
+        auto head = form.as_ptr<ConsCell>()->car;
+        if (head.is_symbol() && std::string_view(env.sym_pool.get(head.as_symbol())) == "define-syntax"sv) {
+            eval(form, env);
+            return std::nullopt;
+        }
+    }
+    return expand_all(form, env);
+}
+
+void setup_scope_for_macro_builtins(Environment& env) {
+    auto& s = *env.global_scope;
+    auto& h = env.heap;
+    auto& p = env.sym_pool;
+    PROC("define-syntax", builtin_define_syntax);
+    PROC("syntax-rules", builtin_syntax_rules);
+    PRIMITIVE("macroexpand", 1, 1, PrimitiveProc::unary<builtin_macroexpand>, builtin_macroexpand);
+}
+
+} // namespace yawarakai
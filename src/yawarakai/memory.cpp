@@ -19,6 +19,15 @@ void ObjectHeader::set_flag(int flag_bit, bool value) {
     }
 }
 
+uint8_t ObjectHeader::get_generation() const {
+    return _flags >> GENERATION_SHIFT;
+}
+
+void ObjectHeader::set_generation(uint8_t generation) {
+    assert(generation <= MAX_GENERATION);
+    _flags = (_flags & ((1 << GENERATION_SHIFT) - 1)) | (generation << GENERATION_SHIFT);
+}
+
 size_t ObjectHeader::_read_size() const {
     return (_size_p3 << 24) | (_size_p2 << 16) | (_size_p1 << 8) | _size_p0;
 }
@@ -33,6 +42,16 @@ size_t ObjectHeader::get_size() const {
         case TYPE_STRING: return sizeof(String);
         case TYPE_USER_PROC: return sizeof(UserProc);
         case TYPE_BUILTIN_PROC: return sizeof(BuiltinProc);
+        case TYPE_PORT: return sizeof(Port);
+        case TYPE_CHANNEL: return sizeof(Channel);
+        case TYPE_TASK: return sizeof(TaskHandle);
+        case TYPE_STRING_BUILDER: return sizeof(StringBuilder);
+        case TYPE_NATIVE_PROC: return sizeof(NativeProc);
+        case TYPE_PRIMITIVE_PROC: return sizeof(PrimitiveProc);
+        case TYPE_QUASI_TEMPLATE: return sizeof(QuasiTemplate);
+        case TYPE_MACRO: return sizeof(Macro);
+        case TYPE_CASE_TABLE: return sizeof(CaseTable);
+        case TYPE_CONDITION: return sizeof(Condition);
     }
     return 0;
 }
@@ -54,6 +73,16 @@ size_t ObjectHeader::get_alignment() const {
         case TYPE_STRING: return alignof(String);
         case TYPE_USER_PROC: return alignof(UserProc);
         case TYPE_BUILTIN_PROC: return alignof(BuiltinProc);
+        case TYPE_PORT: return alignof(Port);
+        case TYPE_CHANNEL: return alignof(Channel);
+        case TYPE_TASK: return alignof(TaskHandle);
+        case TYPE_STRING_BUILDER: return alignof(StringBuilder);
+        case TYPE_NATIVE_PROC: return alignof(NativeProc);
+        case TYPE_PRIMITIVE_PROC: return alignof(PrimitiveProc);
+        case TYPE_QUASI_TEMPLATE: return alignof(QuasiTemplate);
+        case TYPE_MACRO: return alignof(Macro);
+        case TYPE_CASE_TABLE: return alignof(CaseTable);
+        case TYPE_CONDITION: return alignof(Condition);
     }
     return 0;
 }
@@ -74,13 +103,33 @@ void ObjectHeader::set_type(ObjectType type) {
     _type_p1 = (n >> 8) & 0xFF;
 }
 
+
 constexpr size_t HEAP_SEGMENT_SIZE = 32 * 1024;
 
-Heap::Heap() {
-    new_heap_segment();
+namespace {
+struct TlabEntry {
+    uint64_t heap_id = 0;
+    HeapSegment* segment = nullptr;
+};
+
+/// Number of heaps a thread can allocate from alternately, without giving up its partially filled segments
+constexpr size_t TLAB_CACHE_SIZE = 4;
+
+/// The thread-local allocation buffers of this thread, most recently refilled first
+thread_local std::array<TlabEntry, TLAB_CACHE_SIZE> tl_tlabs;
+
+std::atomic<uint64_t> next_heap_id = 1;
+} // namespace
+
+Heap::Heap(uint8_t generation)
+    : heap_id{ next_heap_id.fetch_add(1, std::memory_order_relaxed) }
+    , generation{ generation } //
+{
+    assert(generation <= ObjectHeader::MAX_GENERATION);
 }
 
 Heap::~Heap() {
+    // Stale entries in other threads' tl_tlabs are harmless, heap ids are never reused
     for (auto& hg : heap_segments) {
         std::free(hg.arena);
     }
@@ -91,32 +140,108 @@ std::pair<std::byte*, ObjectHeader*> Heap::allocate(size_t size, size_t alignmen
     // because Sexp uses pointer tagging with the lowest 3 bits
     assert(alignment == alignof(void*));
 
-    auto& hg = heap_segments.back();
+    // Only this thread ever touches `hg`, so no synchronization is needed for bumping
+    HeapSegment* hg = get_tlab_segment();
 
-    auto start = std::bit_cast<uintptr_t>(hg.last_object);
-    uintptr_t raw = shift_down_and_align(start, size, alignment);
-    // N.B. no need to align because ObjectHeader has alignment of 1
-    uintptr_t raw_header = raw - sizeof(ObjectHeader);
+    uintptr_t raw;
+    uintptr_t raw_header;
+    while (true) {
+        auto start = std::bit_cast<uintptr_t>(hg->last_object);
+        raw = shift_down_and_align(start, size, alignment);
+        // N.B. no need to align because ObjectHeader has alignment of 1
+        raw_header = raw - sizeof(ObjectHeader);
+
+        // N.B. also check for wrap around, `size` might be bigger than the address itself
+        if (raw_header >= std::bit_cast<uintptr_t>(hg->arena) && raw_header < start)
+            break;
 
-    if (raw_header < std::bit_cast<uintptr_t>(hg.arena)) {
         // We ran out of space
-        new_heap_segment();
-        return allocate(size, alignment);
+        hg = refill_tlab_segment(size + alignment + sizeof(ObjectHeader));
     }
 
     auto new_obj_header = std::bit_cast<std::byte*>(raw_header);
     auto new_obj = std::bit_cast<std::byte*>(raw);
-    hg.last_object = new_obj_header;
+    hg->last_object = new_obj_header;
+    hg->n_objects += 1;
+    if (allocation_profiling_active) [[unlikely]]
+        profile_allocation(1, sizeof(ObjectHeader) + size);
 
     // Padding members initialized to 0 automatically
     auto h = new (new_obj_header) ObjectHeader{};
     h->set_size(size);
     h->set_alignment(alignment);
     h->set_type(ObjectType::TYPE_UNKNOWN);
+    h->set_generation(generation);
 
     return { new_obj, h };
 }
 
+std::byte* Heap::allocate_run(size_t count, size_t size, ObjectType type) {
+    // Same layout allocate() would have produced, without the bounds check on each object
+    assert(size % alignof(void*) == 0);
+    size_t stride = sizeof(ObjectHeader) + size;
+
+    HeapSegment* hg;
+    {
+        std::lock_guard lock(segments_mutex);
+        hg = new_heap_segment(count * stride);
+    }
+
+    auto first_header = hg->last_object - count * stride;
+    hg->last_object = first_header;
+    hg->n_objects += count;
+    if (allocation_profiling_active) [[unlikely]]
+        profile_allocation(count, count * stride);
+
+    for (size_t i = 0; i < count; ++i) {
+        auto h = new (first_header + i * stride) ObjectHeader{};
+        h->set_size(size);
+        h->set_alignment(alignof(void*));
+        h->set_type(type);
+        h->set_generation(generation);
+    }
+
+    return first_header + sizeof(ObjectHeader);
+}
+
+void Heap::destroy_objects() {
+    for (auto& hg : heap_segments) {
+        auto curr = hg.last_object;
+        auto end = hg.arena + hg.arena_size;
+        while (curr < end) {
+            auto header = reinterpret_cast<ObjectHeader*>(curr);
+            auto obj = curr + sizeof(ObjectHeader);
+            curr = obj + header->get_size();
+
+            switch (header->get_type()) {
+                using enum ObjectType;
+                case TYPE_STRING: std::destroy_at(reinterpret_cast<String*>(obj)); break;
+                case TYPE_USER_PROC: std::destroy_at(reinterpret_cast<UserProc*>(obj)); break;
+                case TYPE_CALL_FRAME: std::destroy_at(reinterpret_cast<Scope*>(obj)); break;
+                case TYPE_PORT: std::destroy_at(reinterpret_cast<Port*>(obj)); break;
+                case TYPE_CHANNEL: std::destroy_at(reinterpret_cast<Channel*>(obj)); break;
+                case TYPE_TASK: std::destroy_at(reinterpret_cast<TaskHandle*>(obj)); break;
+                case TYPE_STRING_BUILDER: std::destroy_at(reinterpret_cast<StringBuilder*>(obj)); break;
+                case TYPE_NATIVE_PROC: std::destroy_at(reinterpret_cast<NativeProc*>(obj)); break;
+                case TYPE_QUASI_TEMPLATE: std::destroy_at(reinterpret_cast<QuasiTemplate*>(obj)); break;
+                case TYPE_CASE_TABLE: std::destroy_at(reinterpret_cast<CaseTable*>(obj)); break;
+                // Nothing to destroy, or not an object at all
+                default: break;
+            }
+        }
+    }
+}
+
+Heap::Stats Heap::stats() const {
+    Stats res;
+    for (auto& hg : heap_segments) {
+        res.objects += hg.n_objects;
+        res.bytes += hg.arena + hg.arena_size - hg.last_object;
+        res.segments += 1;
+    }
+    return res;
+}
+
 std::byte* Heap::find_object(ObjectHeader* header) const {
     return reinterpret_cast<std::byte*>(header) + sizeof(ObjectHeader);
 }
@@ -125,11 +250,42 @@ ObjectHeader* Heap::find_header(std::byte* object) const {
     return reinterpret_cast<ObjectHeader*>(object - sizeof(ObjectHeader));
 }
 
-void Heap::new_heap_segment() {
+HeapSegment* Heap::get_tlab_segment() {
+    for (auto& entry : tl_tlabs) {
+        if (entry.heap_id == heap_id)
+            return entry.segment;
+    }
+    return refill_tlab_segment(0);
+}
+
+HeapSegment* Heap::refill_tlab_segment(size_t min_size) {
+    HeapSegment* hg;
+    {
+        std::lock_guard lock(segments_mutex);
+        hg = new_heap_segment(min_size);
+    }
+
+    // Replace our old buffer for this heap if there is one, otherwise evict the least recently refilled one
+    auto it = std::find_if(tl_tlabs.begin(), tl_tlabs.end(), [&](const TlabEntry& e) { return e.heap_id == heap_id; });
+    if (it == tl_tlabs.end())
+        it = tl_tlabs.end() - 1;
+    std::move_backward(tl_tlabs.begin(), it, it + 1);
+    tl_tlabs[0] = TlabEntry{ .heap_id = heap_id, .segment = hg };
+
+    return hg;
+}
+
+HeapSegment* Heap::new_heap_segment(size_t min_size) {
+    size_t arena_size = std::max(HEAP_SEGMENT_SIZE, min_size);
+    if (reserved_bytes - limit_baseline + arena_size > byte_limit && on_limit_exceeded) [[unlikely]]
+        on_limit_exceeded(byte_limit);
+    reserved_bytes += arena_size;
+
     auto& hg = heap_segments.emplace_back();
-    hg.arena = static_cast<std::byte*>(std::malloc(HEAP_SEGMENT_SIZE));
-    hg.last_object = hg.arena + HEAP_SEGMENT_SIZE;
-    hg.arena_size = HEAP_SEGMENT_SIZE;
+    hg.arena = static_cast<std::byte*>(std::malloc(arena_size));
+    hg.last_object = hg.arena + arena_size;
+    hg.arena_size = arena_size;
+    return &hg;
 }
 
 }
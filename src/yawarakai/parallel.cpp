@@ -0,0 +1,218 @@
+module;
+#include "util.hpp"
+
+module yawarakai;
+import std;
+
+using namespace std::literals;
+
+namespace yawarakai {
+
+namespace {
+thread_local bool tl_is_pool_worker = false;
+} // namespace
+
+WorkStealingPool::WorkStealingPool(size_t n_workers)
+    : _workers{ std::make_unique<Worker[]>(std::max<size_t>(n_workers, 1)) }
+    , _n_workers{ std::max<size_t>(n_workers, 1) } //
+{
+    _threads.reserve(_n_workers);
+    for (size_t i = 0; i < _n_workers; ++i) {
+        _threads.emplace_back([this, i]() { worker_main(i); });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard lock(_batch_mutex);
+        _shutdown = true;
+    }
+    _batch_cv.notify_all();
+    for (auto& t : _threads) {
+        t.join();
+    }
+}
+
+WorkStealingPool& WorkStealingPool::shared() {
+    static WorkStealingPool pool(std::thread::hardware_concurrency());
+    return pool;
+}
+
+bool WorkStealingPool::is_worker_thread() {
+    return tl_is_pool_worker;
+}
+
+void WorkStealingPool::run_all(std::vector<Task> tasks) {
+    if (tasks.empty())
+        return;
+
+    // Nested parallelism: every worker might be blocked in here waiting for each other, so just do the work ourselves
+    if (tl_is_pool_worker) {
+        for (auto& task : tasks) {
+            task(0);
+        }
+        return;
+    }
+
+    std::lock_guard run_lock(_run_mutex);
+
+    // Set this before any task becomes visible: a worker still spinning on the previous batch may pick one up right away
+    _pending.store(tasks.size(), std::memory_order_relaxed);
+
+    // Deal the tasks out round-robin; stealing evens out whatever imbalance is left
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        auto& w = _workers[i % _n_workers];
+        std::lock_guard lock(w.mutex);
+        w.tasks.push_back(std::move(tasks[i]));
+    }
+
+    std::unique_lock lock(_batch_mutex);
+    _batch_gen += 1;
+    _batch_cv.notify_all();
+
+    _done_cv.wait(lock, [this]() { return _pending.load(std::memory_order_acquire) == 0; });
+    if (auto error = std::exchange(_batch_error, nullptr))
+        std::rethrow_exception(error);
+}
+
+bool WorkStealingPool::try_pop_or_steal(size_t worker_id, Task& out) {
+    {
+        auto& own = _workers[worker_id];
+        std::lock_guard lock(own.mutex);
+        if (!own.tasks.empty()) {
+            out = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < _n_workers; ++i) {
+        auto& victim = _workers[(worker_id + i) % _n_workers];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            out = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void WorkStealingPool::worker_main(size_t worker_id) {
+    tl_is_pool_worker = true;
+
+    uint64_t seen_gen = 0;
+    while (true) {
+        {
+            std::unique_lock lock(_batch_mutex);
+            _batch_cv.wait(lock, [&]() { return _shutdown || _batch_gen != seen_gen; });
+            if (_shutdown)
+                return;
+            seen_gen = _batch_gen;
+        }
+
+        Task task;
+        while (try_pop_or_steal(worker_id, task)) {
+            // Nothing may escape, or the thread terminates the process and the batch never finishes
+            try {
+                task(worker_id);
+            } catch (...) {
+                std::lock_guard lock(_batch_mutex);
+                if (!_batch_error)
+                    _batch_error = std::current_exception();
+            }
+            task = nullptr;
+
+            if (_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                // Take the lock so the notification can't slip in between run_all()'s predicate check and its wait
+                std::lock_guard lock(_batch_mutex);
+                _done_cv.notify_all();
+            }
+        }
+    }
+}
+
+namespace {
+/// Shared implementation of (parallel-map) and (parallel-for-each)
+Sexp do_parallel_map(Sexp f, Sexp lst, Environment& env, bool collect_results) {
+    if (!is_proc(f))
+        throw EvalException("parallel-map: 1st argument must be a procedure"s);
+    if (!lst.is_nil() && !lst.is_ptr<ConsCell>())
+        throw EvalException("parallel-map: 2nd argument must be a list"s);
+
+    std::vector<Sexp> items;
+    for (Sexp elm : iterate(lst, env)) {
+        items.push_back(elm);
+    }
+    if (items.empty())
+        return Sexp();
+
+    auto& pool = WorkStealingPool::shared();
+
+    // Every worker allocates straight into our heap, each from its own thread-local allocation buffer
+    std::vector<std::unique_ptr<Environment>> worker_envs(pool.worker_count());
+    for (auto& we : worker_envs) {
+        we = std::make_unique<Environment>(env, Environment::WorkerTag{});
+    }
+
+    std::vector<Sexp> results(collect_results ? items.size() : 0);
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    // Several chunks per worker, so there is something left to steal when chunks take uneven time
+    size_t chunk_size = std::max<size_t>(1, items.size() / (pool.worker_count() * 4));
+    std::vector<WorkStealingPool::Task> tasks;
+    for (size_t begin = 0; begin < items.size(); begin += chunk_size) {
+        size_t end = std::min(begin + chunk_size, items.size());
+        tasks.push_back([&, begin, end](size_t worker_id) {
+            auto& wenv = *worker_envs[worker_id];
+            try {
+                for (size_t i = begin; i < end; ++i) {
+                    auto res = apply_proc(f, std::span(&items[i], 1), wenv);
+                    if (collect_results)
+                        results[i] = res;
+                }
+            } catch (...) {
+                std::lock_guard lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+        });
+    }
+
+    pool.run_all(std::move(tasks));
+
+    if (error)
+        std::rethrow_exception(error);
+
+    if (!collect_results)
+        return Sexp();
+
+    Sexp res_list;
+    for (auto it = results.rbegin(); it != results.rend(); ++it) {
+        cons_inplace(*it, res_list, env);
+    }
+    return res_list;
+}
+
+Sexp builtin_parallel_map(Sexp f, Sexp lst, Environment& env) {
+    return do_parallel_map(f, lst, env, true);
+}
+
+Sexp builtin_parallel_for_each(Sexp f, Sexp lst, Environment& env) {
+    return do_parallel_map(f, lst, env, false);
+}
+} // namespace
+
+void setup_scope_for_parallel_builtins(Environment& env) {
+    auto& s = *env.global_scope;
+    auto& h = env.heap;
+    auto& p = env.sym_pool;
+    // The procedure runs on several threads at once, which share every scope from before the call without any locking.
+    // So it may only set! variables bound within the call itself: anything else, e.g. a global or a variable it closes over, is an error.
+    PRIMITIVE("parallel-map", 2, 2, PrimitiveProc::binary<builtin_parallel_map>, nullptr, builtin_parallel_map);
+    PRIMITIVE("parallel-for-each", 2, 2, PrimitiveProc::binary<builtin_parallel_for_each>, nullptr, builtin_parallel_for_each);
+}
+
+} // namespace yawarakai
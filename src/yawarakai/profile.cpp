@@ -0,0 +1,528 @@
+module;
+#include "util.hpp"
+#include <cerrno>
+#include <signal.h>
+#include <sys/time.h>
+
+module yawarakai;
+import std;
+
+using namespace std::literals;
+
+namespace yawarakai {
+
+// Procedures are identified by a key that's the same for every closure created from the same source: the body of a UserProc, or the procedure itself for the others.
+// Keys are what the shadow stacks and samples hold, and get turned into names only when writing out the results.
+
+struct ProcStats {
+    /// One of the procedures with this key, to name it after
+    const UserProc* user = nullptr;
+    /// Name of any other kind of procedure
+    const Symbol* builtin_name = nullptr;
+
+    uint64_t calls = 0;
+    std::chrono::steady_clock::duration inclusive{};
+    std::chrono::steady_clock::duration exclusive{};
+    /// Number of activations on the stacks of this thread; inclusive time is only added up as the outermost one returns, so recursion isn't counted twice
+    int active = 0;
+};
+
+/// Statistics of everything run on one thread, so that counting needs no synchronization
+struct ThreadProfile {
+    std::unordered_map<const void*, ProcStats> procs;
+};
+
+struct ProfileFrame {
+    const void* key;
+    ProcStats* stats;
+    std::chrono::steady_clock::time_point start;
+    /// Time spent in procedures called from this one, which is excluded from its exclusive time
+    std::chrono::steady_clock::duration children{};
+};
+
+// NOTE: the SIGPROF handler reads `frames` and `depth` while interrupting the very thread that writes them, so compiler barriers are all the ordering needed
+struct ProfileStack {
+    std::unique_ptr<ProfileFrame[]> frames;
+    size_t capacity = 0;
+    std::atomic<size_t> depth = 0;
+    /// Set while `frames` is being reallocated, during which the signal handler must not look at it
+    std::atomic<bool> resizing = false;
+};
+
+namespace {
+constexpr size_t INITIAL_STACK_CAPACITY = 256;
+/// Samples of deeper stacks keep only their innermost frames
+constexpr size_t MAX_SAMPLE_DEPTH = 1024;
+/// Size of the sample buffer in words; a sample takes 1 + its depth
+constexpr size_t SAMPLE_BUFFER_WORDS = 8 * 1024 * 1024;
+
+/// First word of a sample that had frames cut off
+constexpr uintptr_t SAMPLE_TRUNCATED = uintptr_t(1) << (sizeof(uintptr_t) * 8 - 1);
+/// First word of where the buffer ran out, nothing after it is a sample
+constexpr uintptr_t SAMPLE_END = ~uintptr_t(0);
+
+struct ProfilerState {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadProfile>> threads;
+    std::vector<std::unique_ptr<ProfileStack>> stacks;
+
+    /// Names of anonymous lambdas by their body, see profile_note_lambda()
+    std::unordered_map<const ConsCell*, std::string> lambda_names;
+    /// Number of lambdas named after each enclosing procedure so far
+    std::unordered_map<std::string, int> lambda_counts;
+
+    /// Each sample is its depth (| SAMPLE_TRUNCATED), followed by the keys of its frames from the outermost
+    std::unique_ptr<uintptr_t[]> samples = std::make_unique_for_overwrite<uintptr_t[]>(SAMPLE_BUFFER_WORDS);
+    std::atomic<size_t> samples_size = 0;
+    std::atomic<size_t> n_samples = 0;
+    std::atomic<size_t> n_dropped = 0;
+
+    struct sigaction prev_action {};
+};
+
+std::atomic<ProfilerState*> g_state = nullptr;
+/// Bumped by every Profiler, so that threads notice their stack is from an earlier one
+std::atomic<uint64_t> g_generation = 0;
+
+thread_local ProfileStack* tl_stack = nullptr;
+thread_local ThreadProfile* tl_thread = nullptr;
+thread_local uint64_t tl_generation = 0;
+
+ThreadProfile& this_thread_profile(ProfilerState& state) {
+    if (tl_generation != g_generation.load(std::memory_order_relaxed)) {
+        tl_generation = g_generation.load(std::memory_order_relaxed);
+        tl_stack = nullptr;
+        tl_thread = nullptr;
+    }
+    if (!tl_thread) {
+        std::lock_guard lock(state.mutex);
+        tl_thread = state.threads.emplace_back(std::make_unique<ThreadProfile>()).get();
+    }
+    return *tl_thread;
+}
+
+ProfileStack* new_stack(ProfilerState& state) {
+    auto stack = std::make_unique<ProfileStack>();
+    stack->frames = std::make_unique<ProfileFrame[]>(INITIAL_STACK_CAPACITY);
+    stack->capacity = INITIAL_STACK_CAPACITY;
+
+    std::lock_guard lock(state.mutex);
+    return state.stacks.emplace_back(std::move(stack)).get();
+}
+
+ProfileStack& current_stack(ProfilerState& state) {
+    this_thread_profile(state);
+    if (!tl_stack)
+        tl_stack = new_stack(state);
+    return *tl_stack;
+}
+
+ProfileStack* push_frame(const void* key, ProcStats& stats) {
+    auto& state = *g_state.load(std::memory_order_relaxed);
+    auto& stack = current_stack(state);
+
+    size_t depth = stack.depth.load(std::memory_order_relaxed);
+    if (depth == stack.capacity) {
+        stack.resizing.store(true, std::memory_order_relaxed);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+
+        auto frames = std::make_unique<ProfileFrame[]>(stack.capacity * 2);
+        std::copy_n(stack.frames.get(), depth, frames.get());
+        stack.frames = std::move(frames);
+        stack.capacity *= 2;
+
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        stack.resizing.store(false, std::memory_order_relaxed);
+    }
+
+    stats.calls += 1;
+    stats.active += 1;
+    stack.frames[depth] = ProfileFrame{ key, &stats, std::chrono::steady_clock::now() };
+    std::atomic_signal_fence(std::memory_order_release);
+    stack.depth.store(depth + 1, std::memory_order_relaxed);
+    return &stack;
+}
+
+std::string_view user_proc_name(const UserProc& proc, ProfilerState& state) {
+    if (proc.name && !proc.name->empty())
+        return *proc.name;
+    if (auto it = state.lambda_names.find(proc.body.get()); it != state.lambda_names.end())
+        return it->second;
+    return "lambda"sv;
+}
+
+std::string_view stats_name(const ProcStats& stats, ProfilerState& state) {
+    if (stats.user)
+        return user_proc_name(*stats.user, state);
+    if (stats.builtin_name)
+        return *stats.builtin_name;
+    return "?"sv;
+}
+
+void on_sigprof(int) {
+    int saved_errno = errno;
+    DEFER { errno = saved_errno; };
+
+    auto state = g_state.load(std::memory_order_relaxed);
+    if (!state)
+        return;
+
+    // A thread that hasn't called anything yet (or since an earlier profiler) has an empty stack
+    ProfileStack* stack = tl_generation == g_generation.load(std::memory_order_relaxed) ? tl_stack : nullptr;
+    if (stack && stack->resizing.load(std::memory_order_relaxed)) {
+        state->n_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    size_t depth = stack ? stack->depth.load(std::memory_order_relaxed) : 0;
+    std::atomic_signal_fence(std::memory_order_acquire);
+
+    size_t n = std::min(depth, MAX_SAMPLE_DEPTH);
+    size_t begin = state->samples_size.fetch_add(n + 1, std::memory_order_relaxed);
+    if (begin + n + 1 > SAMPLE_BUFFER_WORDS) {
+        if (begin < SAMPLE_BUFFER_WORDS)
+            state->samples[begin] = SAMPLE_END;
+        state->n_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    auto out = &state->samples[begin];
+    *out++ = n | (n < depth ? SAMPLE_TRUNCATED : 0);
+    for (size_t i = depth - n; i < depth; ++i)
+        *out++ = reinterpret_cast<uintptr_t>(stack->frames[i].key);
+    state->n_samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+/// Calls `fn(frames, truncated)` on each sample, `frames` being a span of the keys from the outermost
+template <typename Fn>
+void for_each_sample(const ProfilerState& state, Fn&& fn) {
+    size_t end = std::min(state.samples_size.load(std::memory_order_acquire), SAMPLE_BUFFER_WORDS);
+    size_t i = 0;
+    while (i < end && state.samples[i] != SAMPLE_END) {
+        size_t n = state.samples[i] & ~SAMPLE_TRUNCATED;
+        bool truncated = state.samples[i] & SAMPLE_TRUNCATED;
+        fn(std::span(&state.samples[i + 1], n), truncated);
+        i += n + 1;
+    }
+}
+
+/// ProcStats of every thread merged, with one of them for each key to name it after
+std::unordered_map<const void*, ProcStats> merge_threads(ProfilerState& state) {
+    std::unordered_map<const void*, ProcStats> res;
+    for (auto& thread : state.threads) {
+        for (auto& [key, stats] : thread->procs) {
+            auto& merged = res[key];
+            merged.user = stats.user;
+            merged.builtin_name = stats.builtin_name;
+            merged.calls += stats.calls;
+            merged.inclusive += stats.inclusive;
+            merged.exclusive += stats.exclusive;
+        }
+    }
+    return res;
+}
+
+/// Enters any kind of procedure other than a UserProc
+ProfileStack* enter_builtin(const void* key, const Symbol& name) {
+    auto& stats = this_thread_profile(*g_state.load(std::memory_order_relaxed)).procs[key];
+    stats.builtin_name = &name;
+    return push_frame(key, stats);
+}
+} // namespace
+
+ProfileStack* profile_enter(const UserProc& proc) {
+    const void* key = proc.body.get();
+    auto& stats = this_thread_profile(*g_state.load(std::memory_order_relaxed)).procs[key];
+    stats.user = &proc;
+    return push_frame(key, stats);
+}
+
+ProfileStack* profile_enter(const BuiltinProc& proc) {
+    return enter_builtin(&proc, *proc.name);
+}
+
+ProfileStack* profile_enter(const PrimitiveProc& proc) {
+    return enter_builtin(&proc, *proc.name);
+}
+
+ProfileStack* profile_enter(const NativeProc& proc) {
+    return enter_builtin(&proc, *proc.name);
+}
+
+void profile_leave(ProfileStack* stack) {
+    size_t depth = stack->depth.load(std::memory_order_relaxed) - 1;
+    stack->depth.store(depth, std::memory_order_relaxed);
+    std::atomic_signal_fence(std::memory_order_release);
+
+    auto& frame = stack->frames[depth];
+    auto elapsed = std::chrono::steady_clock::now() - frame.start;
+    auto& stats = *frame.stats;
+    stats.exclusive += elapsed - frame.children;
+    if (--stats.active == 0)
+        stats.inclusive += elapsed;
+    if (depth > 0)
+        stack->frames[depth - 1].children += elapsed;
+}
+
+ProfileStack* profile_switch_stack(ProfileStack* stack) {
+    auto& state = *g_state.load(std::memory_order_relaxed);
+    this_thread_profile(state);
+    if (!stack)
+        stack = new_stack(state);
+    return std::exchange(tl_stack, stack);
+}
+
+void profile_note_lambda(const UserProc& proc, Sexp lambda_params, Environment& env) {
+    auto& state = *g_state.load(std::memory_order_relaxed);
+    auto& stack = current_stack(state);
+
+    std::lock_guard lock(state.mutex);
+    if (state.lambda_names.contains(proc.body.get()))
+        return;
+
+    // NOTE: the parser records where each cons starts, so this is where the parameter list is
+    if (auto cell = lambda_params.as_ptr<ConsCell>()) {
+        if (auto loc = env.source_map.find(cell.get())) {
+            state.lambda_names.emplace(proc.body.get(), std::format("lambda@{}", format_location(*loc)));
+            return;
+        }
+    }
+
+    // The innermost procedure with a body of its own, the builtins in between (e.g. `let`) are just how it got here
+    std::string_view enclosing;
+    for (size_t i = stack.depth.load(std::memory_order_relaxed); i-- > 0;) {
+        if (auto user = stack.frames[i].stats->user) {
+            enclosing = user_proc_name(*user, state);
+            break;
+        }
+    }
+
+    auto ordinal = ++state.lambda_counts[std::string(enclosing)];
+    auto name = enclosing.empty() ? std::format("lambda#{}", ordinal) : std::format("{}/lambda#{}", enclosing, ordinal);
+    state.lambda_names.emplace(proc.body.get(), std::move(name));
+}
+
+Profiler::Profiler(std::chrono::microseconds interval)
+    : _interval{ interval } //
+{
+    auto state = new ProfilerState();
+    g_generation.fetch_add(1, std::memory_order_relaxed);
+    g_state.store(state, std::memory_order_release);
+
+    struct sigaction action {};
+    action.sa_handler = on_sigprof;
+    // Let interrupted system calls carry on instead of failing with EINTR
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &state->prev_action);
+
+    itimerval timer{};
+    timer.it_interval.tv_sec = interval.count() / 1'000'000;
+    timer.it_interval.tv_usec = interval.count() % 1'000'000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+
+    profiling_active = true;
+    _running = true;
+}
+
+Profiler::~Profiler() {
+    stop();
+    delete g_state.exchange(nullptr);
+}
+
+void Profiler::stop() {
+    if (!_running)
+        return;
+    _running = false;
+    profiling_active = false;
+
+    itimerval timer{};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    sigaction(SIGPROF, &g_state.load()->prev_action, nullptr);
+}
+
+void Profiler::write_folded(std::ostream& os) const {
+    auto& state = *g_state.load();
+    auto procs = merge_threads(state);
+
+    std::map<std::string, size_t> stacks;
+    std::string line;
+    for_each_sample(state, [&](std::span<const uintptr_t> frames, bool truncated) {
+        line.clear();
+        if (frames.empty())
+            line = "[no procedure]";
+        if (truncated)
+            line = "[truncated]";
+        for (auto key : frames) {
+            if (!line.empty())
+                line += ';';
+            auto it = procs.find(reinterpret_cast<const void*>(key));
+            line += it != procs.end() ? stats_name(it->second, state) : "?"sv;
+        }
+        stacks[line] += 1;
+    });
+
+    for (auto& [stack, count] : stacks)
+        os << stack << ' ' << count << '\n';
+}
+
+void Profiler::write_summary(std::ostream& os) const {
+    auto& state = *g_state.load();
+
+    // Distinct keys may well share a name, e.g. a procedure that got redefined
+    struct Row {
+        std::string_view name;
+        uint64_t calls = 0;
+        std::chrono::steady_clock::duration inclusive{};
+        std::chrono::steady_clock::duration exclusive{};
+    };
+    std::unordered_map<std::string_view, Row> by_name;
+    for (auto& [_, stats] : merge_threads(state)) {
+        auto name = stats_name(stats, state);
+        auto& row = by_name[name];
+        row.name = name;
+        row.calls += stats.calls;
+        row.inclusive += stats.inclusive;
+        row.exclusive += stats.exclusive;
+    }
+
+    std::vector<Row> rows;
+    for (auto& [_, row] : by_name)
+        rows.push_back(row);
+    std::ranges::sort(rows, [](const Row& a, const Row& b) { return std::tie(b.exclusive, a.name) < std::tie(a.exclusive, b.name); });
+
+    using Ms = std::chrono::duration<double, std::milli>;
+    os << std::format("profile: {} samples, every {} us, {} dropped\n", state.n_samples.load(), _interval.count(), state.n_dropped.load());
+    os << std::format("{:>12} {:>12} {:>12}  {}\n", "calls", "incl ms", "excl ms", "procedure");
+    for (auto& row : rows)
+        os << std::format("{:>12} {:>12.3f} {:>12.3f}  {}\n", row.calls, Ms(row.inclusive).count(), Ms(row.exclusive).count(), row.name);
+}
+
+/******** Allocation profiling ********/
+
+namespace {
+struct SiteStats {
+    size_t objects = 0;
+    size_t bytes = 0;
+};
+
+/// Allocations of one thread by site, so that counting needs no synchronization
+struct ThreadAllocations {
+    std::unordered_map<const ConsCell*, SiteStats> sites;
+};
+
+struct AllocationProfilerState {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadAllocations>> threads;
+};
+
+AllocationProfilerState* g_alloc_state = nullptr;
+std::atomic<uint64_t> g_alloc_generation = 0;
+
+thread_local const ConsCell* tl_alloc_site = nullptr;
+/// Stats of `tl_alloc_site`, looked up again only once it changes
+thread_local SiteStats* tl_alloc_site_stats = nullptr;
+thread_local const ConsCell* tl_alloc_site_stats_of = nullptr;
+thread_local ThreadAllocations* tl_allocations = nullptr;
+thread_local uint64_t tl_alloc_generation = 0;
+} // namespace
+
+const ConsCell* enter_allocation_site(const ConsCell* form) {
+    return std::exchange(tl_alloc_site, form);
+}
+
+void profile_allocation(size_t count, size_t bytes) {
+    if (tl_alloc_generation != g_alloc_generation.load(std::memory_order_relaxed)) {
+        tl_alloc_generation = g_alloc_generation.load(std::memory_order_relaxed);
+        tl_allocations = nullptr;
+        tl_alloc_site_stats = nullptr;
+    }
+    if (!tl_allocations) {
+        std::lock_guard lock(g_alloc_state->mutex);
+        tl_allocations = g_alloc_state->threads.emplace_back(std::make_unique<ThreadAllocations>()).get();
+    }
+    if (!tl_alloc_site_stats || tl_alloc_site_stats_of != tl_alloc_site) {
+        tl_alloc_site_stats = &tl_allocations->sites[tl_alloc_site];
+        tl_alloc_site_stats_of = tl_alloc_site;
+    }
+
+    tl_alloc_site_stats->objects += count;
+    tl_alloc_site_stats->bytes += bytes;
+}
+
+AllocationProfiler::AllocationProfiler() {
+    g_alloc_state = new AllocationProfilerState();
+    g_alloc_generation.fetch_add(1, std::memory_order_relaxed);
+    allocation_profiling_active = true;
+    _running = true;
+}
+
+AllocationProfiler::~AllocationProfiler() {
+    stop();
+    delete std::exchange(g_alloc_state, nullptr);
+}
+
+void AllocationProfiler::stop() {
+    _running = false;
+    allocation_profiling_active = false;
+}
+
+void AllocationProfiler::write_summary(std::ostream& os, Environment& env, size_t max_sites) const {
+    struct Row {
+        std::string where;
+        SiteStats stats;
+    };
+
+    // Forms that weren't parsed from source, e.g. built by a program and then evaluated, are kept apart by address
+    std::unordered_map<const ConsCell*, SiteStats> merged;
+    SiteStats total;
+    for (auto& thread : g_alloc_state->threads) {
+        for (auto& [site, stats] : thread->sites) {
+            merged[site].objects += stats.objects;
+            merged[site].bytes += stats.bytes;
+            total.objects += stats.objects;
+            total.bytes += stats.bytes;
+        }
+    }
+
+    // Several forms can share a location, e.g. `'x` makes a (quote x) at the same place as the cons holding it
+    std::unordered_map<std::string, SiteStats> by_location;
+    for (auto& [site, stats] : merged) {
+        std::string where;
+        if (!site)
+            where = "[outside evaluation]";
+        else if (auto loc = env.source_map.find(site))
+            where = format_location(*loc);
+        else
+            where = std::format("[no source] {}", dump_sexp(Sexp(const_cast<ConsCell*>(site)), env));
+
+        // Keep the table readable when a big form was built at runtime
+        constexpr size_t MAX_WHERE_SIZE = 60;
+        if (where.size() > MAX_WHERE_SIZE) {
+            where.resize(MAX_WHERE_SIZE - 3);
+            where += "...";
+        }
+
+        auto& row = by_location[std::move(where)];
+        row.objects += stats.objects;
+        row.bytes += stats.bytes;
+    }
+
+    std::vector<Row> rows;
+    for (auto& [where, stats] : by_location)
+        rows.push_back({ where, stats });
+
+    auto write_top = [&](std::string_view title, auto key) {
+        std::ranges::sort(rows, [&](const Row& a, const Row& b) { return std::tie(key(b), a.where) < std::tie(key(a), b.where); });
+        os << std::format("allocations by {}:\n", title);
+        os << std::format("{:>12} {:>14}  {}\n", "objects", "bytes", "site");
+        for (size_t i = 0; i < std::min(max_sites, rows.size()); ++i)
+            os << std::format("{:>12} {:>14}  {}\n", rows[i].stats.objects, rows[i].stats.bytes, rows[i].where);
+    };
+
+    os << std::format("allocations: {} objects, {} bytes at {} sites\n", total.objects, total.bytes, rows.size());
+    write_top("bytes", [](const Row& r) -> const size_t& { return r.stats.bytes; });
+    write_top("count", [](const Row& r) -> const size_t& { return r.stats.objects; });
+}
+
+} // namespace yawarakai
@@ -0,0 +1,213 @@
+module;
+#include "util.hpp"
+
+module yawarakai;
+import std;
+
+using namespace std::literals;
+
+namespace yawarakai {
+
+namespace {
+/// Turns a template into the nodes of a QuasiTemplate.
+/// Anything without an unquote in it is left out, and taken as a constant by whichever node contains it, so that every result shares it.
+class TemplateCompiler {
+private:
+    QuasiTemplate& _tmpl;
+    Environment& _env;
+    SymbolId _quasiquote;
+    SymbolId _unquote;
+    SymbolId _unquote_splicing;
+
+public:
+    TemplateCompiler(QuasiTemplate& tmpl, Environment& env)
+        : _tmpl{ tmpl }
+        , _env{ env }
+        , _quasiquote{ env.sym_pool.intern("quasiquote").id() }
+        , _unquote{ env.sym_pool.intern("unquote").id() }
+        , _unquote_splicing{ env.sym_pool.intern("unquote-splicing").id() } {}
+
+    /// Compiles `x`, nested `depth` quasiquotes deep in the template (unquotes only count at 0), and returns its node, or nullopt if it's a constant
+    std::optional<uint32_t> compile(Sexp x, int depth) {
+        if (!is_cons(x))
+            return std::nullopt;
+
+        if (depth == 0 && is_form(x, _unquote))
+            return add_node({ .kind = QuasiTemplate::Node::UNQUOTE, .value = car(cdr(x)) });
+        if (depth == 0 && is_form(x, _unquote_splicing))
+            throw EvalException("(unquote-splicing) must be an item of a list"s);
+
+        // Nested quasiquotes keep their unquotes for later, down to the level they belong to
+        int inner = depth;
+        if (is_form(x, _quasiquote))
+            inner = depth + 1;
+        else if (is_form(x, _unquote) || is_form(x, _unquote_splicing))
+            inner = depth - 1;
+
+        struct Item {
+            std::optional<uint32_t> node;
+            Sexp value;
+            /// The rest of the list from this item on
+            Sexp rest;
+        };
+        std::vector<Item> items;
+        std::optional<uint32_t> tail;
+        Sexp tail_value;
+
+        for (Sexp curr = x;; curr = curr.as_ptr<ConsCell>()->cdr) {
+            if (!is_cons(curr)) {
+                tail_value = curr;
+                break;
+            }
+            // `(a . ,b) reads as (a unquote b)
+            if (!items.empty() && (is_form(curr, _unquote) || is_form(curr, _unquote_splicing))) {
+                tail = compile(curr, inner);
+                tail_value = curr;
+                break;
+            }
+
+            Sexp elm = curr.as_ptr<ConsCell>()->car;
+            if (inner == 0 && is_form(elm, _unquote_splicing))
+                items.push_back({ add_node({ .kind = QuasiTemplate::Node::SPLICE, .value = car(cdr(elm)) }), elm, curr });
+            else
+                items.push_back({ compile(elm, inner), elm, curr });
+        }
+
+        // Everything past the last item with a hole in it is shared as it is
+        size_t n_live = items.size();
+        if (!tail) {
+            while (n_live > 0 && !items[n_live - 1].node)
+                n_live -= 1;
+            if (n_live == 0)
+                return std::nullopt;
+        }
+
+        uint32_t tail_node = tail ? *tail : add_constant(n_live < items.size() ? items[n_live].rest : tail_value);
+        // The items of nested lists have all been added by now, ours go after them in one piece
+        auto first_item = static_cast<uint32_t>(_tmpl.items.size());
+        for (size_t i = 0; i < n_live; ++i) {
+            auto& item = items[i];
+            _tmpl.items.push_back(item.node ? *item.node : add_constant(item.value));
+        }
+
+        return add_node({
+            .kind = QuasiTemplate::Node::LIST,
+            .first_item = first_item,
+            .n_items = static_cast<uint32_t>(n_live),
+            .tail = tail_node,
+        });
+    }
+
+    uint32_t add_constant(Sexp value) {
+        // Read-only like quoted data, or modifying one result would change the template, and every result after it
+        return add_node({ .kind = QuasiTemplate::Node::CONSTANT, .value = _env.constants.intern(value) });
+    }
+
+private:
+    /// Whether `x` is `(name y)`
+    static bool is_form(Sexp x, SymbolId name) {
+        if (!is_cons(x))
+            return false;
+        auto& head = *x.as_ptr<ConsCell>();
+        if (!head.car.is_symbol() || head.car.as_symbol() != name || !is_cons(head.cdr))
+            return false;
+        return head.cdr.as_ptr<ConsCell>()->cdr.is_nil();
+    }
+
+    uint32_t add_node(QuasiTemplate::Node node) {
+        _tmpl.nodes.push_back(node);
+        return static_cast<uint32_t>(_tmpl.nodes.size() - 1);
+    }
+};
+
+Sexp instantiate(const QuasiTemplate& tmpl, uint32_t index, Environment& env) {
+    using Node = QuasiTemplate::Node;
+    auto& node = tmpl.nodes[index];
+    switch (node.kind) {
+        case Node::CONSTANT: return node.value;
+        case Node::UNQUOTE: return eval(node.value, env);
+        case Node::SPLICE: break;
+        case Node::LIST: {
+            // Built front to back, so that unquotes are evaluated left to right
+            Sexp res;
+            Sexp* tail = &res;
+            auto append = [&](Sexp v) {
+                auto [cell, _] = env.heap.allocate<ConsCell>(v, Sexp());
+                *tail = Sexp(cell);
+                tail = &cell->cdr;
+            };
+
+            auto& tail_node = tmpl.nodes[node.tail];
+            for (uint32_t i = 0; i < node.n_items; ++i) {
+                auto& item = tmpl.nodes[tmpl.items[node.first_item + i]];
+                if (item.kind != Node::SPLICE) {
+                    Sexp v = instantiate(tmpl, tmpl.items[node.first_item + i], env);
+                    RETURN_IF_UNWINDING(env);
+                    append(v);
+                    continue;
+                }
+
+                Sexp spliced = eval(item.value, env);
+                RETURN_IF_UNWINDING(env);
+                // Spliced in last, the list is shared instead of copied, same as the last argument of append
+                if (i + 1 == node.n_items && tail_node.kind == Node::CONSTANT && tail_node.value.is_nil()) {
+                    *tail = spliced;
+                    return res;
+                }
+
+                Sexp curr = spliced;
+                for (; !curr.is_nil() && curr.is_ptr<ConsCell>(); curr = curr.as_ptr<ConsCell>()->cdr)
+                    append(curr.as_ptr<ConsCell>()->car);
+                if (!curr.is_nil())
+                    throw EvalException("(unquote-splicing) expected a list"s);
+            }
+
+            *tail = instantiate(tmpl, node.tail, env);
+            return res;
+        }
+    }
+    assert(false && "unquote-splicing outside of a list");
+    return Sexp();
+}
+
+// (quasiquote template)
+// Compiled the first time it's evaluated, and after that rebuilds only the parts of the template leading to an unquote
+Sexp builtin_quasiquote(Sexp params, Environment& env) {
+    if (!is_cons(params) || !params.as_ptr<ConsCell>()->cdr.is_nil())
+        throw EvalException("(quasiquote) expects exactly one template"s);
+
+    auto& form = *params.as_ptr<ConsCell>();
+    Sexp compiled;
+    if (auto cached = env.form_cache.find(&form)) {
+        compiled = *cached;
+    } else {
+        auto [tmpl, _] = env.heap.allocate<QuasiTemplate>();
+        TemplateCompiler compiler(*tmpl, env);
+        if (!compiler.compile(form.car, 0))
+            compiler.add_constant(form.car);
+        compiled = env.form_cache.add(&form, Sexp(tmpl));
+    }
+
+    auto& tmpl = *compiled.as_ptr<QuasiTemplate>();
+    return instantiate(tmpl, static_cast<uint32_t>(tmpl.nodes.size() - 1), env);
+}
+
+Sexp builtin_unquote(Sexp params, Environment& env) {
+    throw EvalException("(unquote) used outside of quasiquote"s);
+}
+
+Sexp builtin_unquote_splicing(Sexp params, Environment& env) {
+    throw EvalException("(unquote-splicing) used outside of quasiquote"s);
+}
+} // namespace
+
+void setup_scope_for_quasiquote_builtins(Environment& env) {
+    auto& s = *env.global_scope;
+    auto& h = env.heap;
+    auto& p = env.sym_pool;
+    PROC("quasiquote", builtin_quasiquote);
+    PROC("unquote", builtin_unquote);
+    PROC("unquote-splicing", builtin_unquote_splicing);
+}
+
+} // namespace yawarakai
@@ -0,0 +1,207 @@
+module;
+#include "util.hpp"
+
+module yawarakai;
+import std;
+
+using namespace std::literals;
+
+namespace yawarakai {
+
+std::string_view String::flatten() const {
+    if (auto flat = flattened.load(std::memory_order_acquire))
+        return *flat;
+
+    auto res = std::make_unique<std::string>();
+    res->reserve(rope_size);
+    for_each_piece([&](std::string_view piece) { res->append(piece); });
+
+    // Another thread may have beaten us to it, in which case theirs stays
+    std::string* expected = nullptr;
+    if (!flattened.compare_exchange_strong(expected, res.get(), std::memory_order_acq_rel, std::memory_order_acquire))
+        return *expected;
+    return *res.release();
+}
+
+Sexp make_string(std::string v, Environment& env) {
+    auto [h_str, _] = env.heap.allocate<String>();
+    h_str->v = std::move(v);
+    return Sexp(h_str);
+}
+
+namespace {
+/// Strings up to this size are appended by copying, where a rope node would cost more than it saves
+constexpr size_t SMALL_STRING_SIZE = 64;
+
+String& string_arg(Sexp v, std::string_view who) {
+    if (v.is_nil() || !v.is_ptr<String>())
+        throw EvalException(std::format("({}) expected a string", who));
+    return *v.as_ptr<String>();
+}
+
+StringBuilder& string_builder_arg(Sexp v, std::string_view who) {
+    if (v.is_nil() || !v.is_ptr<StringBuilder>())
+        throw EvalException(std::format("({}) expected a string builder", who));
+    return *v.as_ptr<StringBuilder>();
+}
+
+size_t index_arg(Sexp v, std::string_view who) {
+    if (!v.is_int() || v.as_int() < 0)
+        throw EvalException(std::format("({}) expected a non-negative integer index", who));
+    return static_cast<size_t>(v.as_int());
+}
+
+String* concat(String* a, String* b, Environment& env) {
+    if (a->size() == 0)
+        return b;
+    if (b->size() == 0)
+        return a;
+
+    if (a->size() + b->size() <= SMALL_STRING_SIZE) {
+        auto [res, _] = env.heap.allocate<String>();
+        res->v.reserve(a->size() + b->size());
+        a->for_each_piece([&](std::string_view piece) { res->v.append(piece); });
+        res->v.append(b->view());
+        return res;
+    }
+
+    // Appending small pieces one at a time would otherwise make a node per piece: merge them into the last leaf while it's small
+    if (a->is_rope() && !a->right->is_rope() && a->right->size() + b->size() <= SMALL_STRING_SIZE)
+        return concat(a->left, concat(a->right, b, env), env);
+
+    auto [res, _] = env.heap.allocate<String>();
+    res->left = a;
+    res->right = b;
+    res->rope_size = a->size() + b->size();
+    return res;
+}
+
+// (string? x)
+Sexp builtin_is_string(Sexp x, Environment& env) {
+    return Sexp(!x.is_nil() && x.is_ptr<String>());
+}
+
+// (string-length str)
+Sexp builtin_string_length(Sexp str, Environment& env) {
+    auto size = string_arg(str, "string-length"sv).size();
+    if (size > static_cast<size_t>(std::numeric_limits<int32_t>::max()))
+        throw EvalException("(string-length) string too long for an integer"s);
+    return Sexp(static_cast<int32_t>(size));
+}
+
+// (string-append str ...)
+Sexp builtin_string_append(std::span<const Sexp> args, Environment& env) {
+    String* res = nullptr;
+    for (Sexp v : args) {
+        auto& str = string_arg(v, "string-append"sv);
+        res = res ? concat(res, &str, env) : &str;
+    }
+
+    if (!res)
+        return make_string({}, env);
+    return Sexp(res);
+}
+
+// (substring str start [end])
+// Shares the contents of `str` instead of copying them
+Sexp builtin_substring(std::span<const Sexp> args, Environment& env) {
+    auto& str = string_arg(args[0], "substring"sv);
+    size_t start = index_arg(args[1], "substring"sv);
+    size_t end = args.size() > 2 ? index_arg(args[2], "substring"sv) : str.size();
+    if (start > end || end > str.size())
+        throw EvalException(std::format("(substring) range [{}, {}) out of bounds for a string of length {}", start, end, str.size()));
+
+    if (start == 0 && end == str.size())
+        return Sexp(&str);
+
+    auto v = str.view();
+    auto [res, _] = env.heap.allocate<String>();
+    res->borrowed = v.data() + start;
+    res->borrowed_size = end - start;
+    return Sexp(res);
+}
+
+// (string=? a b ...)
+Sexp builtin_string_equal(std::span<const Sexp> args, Environment& env) {
+    for (Sexp v : args) {
+        string_arg(v, "string=?"sv);
+    }
+    for (size_t i = 1; i < args.size(); ++i) {
+        auto& a = *args[i - 1].as_ptr<String>();
+        auto& b = *args[i].as_ptr<String>();
+        if (a.size() != b.size() || a.view() != b.view())
+            return Sexp(false);
+    }
+    return Sexp(true);
+}
+
+// (number->string n)
+Sexp builtin_number_to_string(Sexp n, Environment& env) {
+    if (!n.is_numeric())
+        throw EvalException("(number->string) expected a number"s);
+    // Written the same way as the printer does
+    return make_string(dump_sexp(n, env), env);
+}
+
+// (symbol->string sym)
+Sexp builtin_symbol_to_string(Sexp sym, Environment& env) {
+    if (!sym.is_symbol())
+        throw EvalException("(symbol->string) expected a symbol"s);
+
+    // Symbol names stay put for as long as the pool is around
+    auto& name = env.sym_pool.get(sym.as_symbol());
+    auto [res, _] = env.heap.allocate<String>();
+    res->borrowed = name.data();
+    res->borrowed_size = name.size();
+    return Sexp(res);
+}
+
+// (string->symbol str)
+Sexp builtin_string_to_symbol(Sexp str, Environment& env) {
+    return Sexp(env.sym_pool.intern(string_arg(str, "string->symbol"sv).view()).id());
+}
+
+// (make-string-builder)
+Sexp builtin_make_string_builder(std::span<const Sexp> args, Environment& env) {
+    auto [sb, _] = env.heap.allocate<StringBuilder>();
+    return Sexp(sb);
+}
+
+// (string-builder-append! sb str ...)
+Sexp builtin_string_builder_append(std::span<const Sexp> args, Environment& env) {
+    auto& sb = string_builder_arg(args[0], "string-builder-append!"sv);
+    if (env.is_from_base(HeapPtr(&sb)))
+        throw EvalException("(string-builder-append!) cannot modify a string builder from before the environment was forked"s);
+
+    for (Sexp v : args.subspan(1)) {
+        string_arg(v, "string-builder-append!"sv).for_each_piece([&](std::string_view piece) { sb.buffer.append(piece); });
+    }
+    return Sexp();
+}
+
+// (string-builder->string sb)
+// The builder can carry on being appended to afterwards
+Sexp builtin_string_builder_to_string(Sexp sb, Environment& env) {
+    return make_string(string_builder_arg(sb, "string-builder->string"sv).buffer, env);
+}
+} // namespace
+
+void setup_scope_for_string_builtins(Environment& env) {
+    auto& s = *env.global_scope;
+    auto& h = env.heap;
+    auto& p = env.sym_pool;
+    constexpr auto VARIADIC = PrimitiveProc::VARIADIC;
+    PRIMITIVE("string?", 1, 1, PrimitiveProc::unary<builtin_is_string>, builtin_is_string);
+    PRIMITIVE("string-length", 1, 1, PrimitiveProc::unary<builtin_string_length>, builtin_string_length);
+    PRIMITIVE("string-append", 0, VARIADIC, builtin_string_append);
+    PRIMITIVE("substring", 2, 3, builtin_substring);
+    PRIMITIVE("string=?", 0, VARIADIC, builtin_string_equal);
+    PRIMITIVE("number->string", 1, 1, PrimitiveProc::unary<builtin_number_to_string>, builtin_number_to_string);
+    PRIMITIVE("symbol->string", 1, 1, PrimitiveProc::unary<builtin_symbol_to_string>, builtin_symbol_to_string);
+    PRIMITIVE("string->symbol", 1, 1, PrimitiveProc::unary<builtin_string_to_symbol>, builtin_string_to_symbol);
+    PRIMITIVE("make-string-builder", 0, 0, builtin_make_string_builder);
+    PRIMITIVE("string-builder-append!", 1, VARIADIC, builtin_string_builder_append);
+    PRIMITIVE("string-builder->string", 1, 1, PrimitiveProc::unary<builtin_string_builder_to_string>, builtin_string_builder_to_string);
+}
+
+} // namespace yawarakai
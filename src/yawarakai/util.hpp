@@ -13,3 +13,22 @@
 
 #define DEFER ScopeGuard UNIQUE_NAME(_scope_guard) = [&]()
 #define DEFER_RESTORE_VALUE(v) ScopeGuard UNIQUE_NAME(_scope_guard){CurrentValueRestorer(v)};
+
+/// Returns '() from the enclosing function if a (raise) is on its way out to a (guard), see Environment::unwinding.
+/// Goes after each eval() whose result isn't simply returned.
+#define RETURN_IF_UNWINDING(env) do { if ((env).unwinding) [[unlikely]] return Sexp(); } while (false)
+
+/// Bind a builtin procedure (PROC) or PrimitiveProc (PRIMITIVE) globally, in the setup_scope_for_*_builtins() functions.
+/// They expect the global Scope as `s`, the Heap as `h` and the SymbolPool as `p`. Names that are already bound are left alone.
+#define PROC(name, func)                                      \
+    do {                                                      \
+        auto& sym = p.intern(name);                           \
+        auto [proc, _] = h.allocate<BuiltinProc>(&sym, func); \
+        s.try_define(sym.id(), Sexp(proc));                   \
+    } while (false)
+#define PRIMITIVE(name, min_args, max_args, ...)                                           \
+    do {                                                                                   \
+        auto& sym = p.intern(name);                                                        \
+        auto [proc, _] = h.allocate<PrimitiveProc>(&sym, min_args, max_args, __VA_ARGS__); \
+        s.try_define(sym.id(), Sexp(proc));                                                \
+    } while (false)
@@ -0,0 +1,73 @@
+;; => '()
+(define ch (make-channel))
+
+;; => '()
+(define (producer)
+  (channel-send ch 1)
+  (yield)
+  (channel-send ch 2)
+  'done)
+
+;; => '()
+(define t (spawn producer))
+
+;; Receiving suspends the main program until the producer sends something
+;; => 1
+(channel-receive ch)
+;; => 2
+(channel-receive ch)
+;; => done
+(join t)
+
+;; The three subprocesses run concurrently, this takes ~0.3s and not ~0.9s
+;; => '()
+(define (first-line cmd)
+  (let ((port (open-input-pipe cmd)))
+    (let ((line (read-line port)))
+      (close-port port)
+      line)))
+;; => '()
+(define (reader cmd)
+  (lambda () (first-line cmd)))
+;; => ("a" "b" "c")
+(let ((t1 (spawn (reader "sleep 0.3; echo a")))
+      (t2 (spawn (reader "sleep 0.3; echo b")))
+      (t3 (spawn (reader "sleep 0.3; echo c"))))
+  (cons (join t1) (cons (join t2) (cons (join t3) '()))))
+
+;; Files, here one made for the test so it doesn't matter where it's run from
+;; => '()
+(define path (first-line "f=$(mktemp) && printf 'first\\nsecond\\n' > $f && echo $f")))
+;; => '()
+(define file (open-input-file path))
+;; => ("first" "second" #f)
+`(,(read-line file) ,(read-line file) ,(read-line file))
+;; => '()
+(close-port file)
+;; => #f
+(first-line (string-append "rm " path))
+
+;; Closing a pipe stops its subprocess instead of waiting for it to finish on its own
+;; => '()
+(close-port (open-input-pipe "sleep 100"))
+
+;; A task has room on its stack for as deep as calls may nest (see --max-depth), not just a few hundred
+;; => '()
+(define (count n) (if (= n 0) 0 (+ 1 (count (- n 1)))))
+;; => 5000
+(join (spawn (lambda () (count 5000))))
+
+;; What a task raises without catching it is raised again by (join)
+;; => (caught y)
+(guard (e (#t `(caught ,e))) (join (spawn (lambda () (raise 'y)))))
+
+;; A raise only returns to the guards of its own task
+;; => (task x)
+(let ((t (spawn (lambda () (guard (e (#t `(task ,e))) (yield) (raise 'x))))))
+  (guard (e (#t `(main ,e))) (yield) (join t)))
+
+;; Errors inside a task are rethrown by (join)
+(join (spawn (lambda () (+ 1 "x"))))
+
+;; Nothing else could ever send to `ch`
+(channel-receive ch)
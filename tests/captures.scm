@@ -15,3 +15,14 @@
 (define c2 (make-counter 0))
 ;; => 1
 (c2)
+
+;; Primitives are values like any other procedure
+;; => '()
+(define plus +)
+;; => 3
+(plus 1 2)
+
+;; => '()
+(define (twice f x) (f (f x)))
+;; => 7
+(twice car '((7)))
@@ -0,0 +1,48 @@
+;; Equal literals are the same object, wherever they're read
+;; => '()
+(define table '((1 "one") (2 "two")))
+;; => #t
+(eq? table '((1 "one") (2 "two")))
+;; => #t
+(eq? (cdr table) '((2 "two")))
+;; => #t
+(eq? (car (cdr (car table))) '"one")
+;; => '()
+(define (row n) (if (= n 1) '(1 "one") '(2 "two")))
+;; => #t
+(eq? (row 2) (car (cdr table)))
+
+;; What's built at run time isn't one
+;; => #f
+(eq? table (cons (car table) (cdr table)))
+;; => (3 "three")
+(let ((row (cons 3 (cons "three" '())))) (set-car! row 3) row)
+
+;; Nor can one be changed
+;; => "(set-car!)/(set-cdr!) cannot modify a constant, such as quoted data"
+(guard (e ((error-object? e) (error-object-message e)))
+  (set-car! (car table) 0))
+;; => ((1 "one") (2 "two"))
+table
+
+;; Quoted data inside a quasiquote template
+;; => '()
+(define (tagged x) `(tagged ,x ,'(1 "one")))
+;; => #t
+(eq? (car (cdr (cdr (tagged 5)))) (car table))
+;; => #t
+(eq? (car (cdr (cdr (tagged 5)))) (car (cdr (cdr (tagged 6)))))
+
+;; And inside a macro template, where it has no pattern variables in it
+;; => '()
+(define-syntax first-row
+  (syntax-rules ()
+    ((_) '(1 "one"))
+    ((_ x) '(x "one"))))
+;; => #t
+(eq? (first-row) (car table))
+;; => (7 "one")
+(first-row 7)
+;; => "(set-car!)/(set-cdr!) cannot modify a constant, such as quoted data"
+(guard (e ((error-object? e) (error-object-message e)))
+  (set-car! (first-row) 0))
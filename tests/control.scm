@@ -0,0 +1,68 @@
+;; => '()
+(define (classify n)
+  (cond ((< n 0) 'negative)
+        ((= n 0) 'zero)
+        ((< n 10) 'small)
+        (else 'big)))
+;; => (negative zero small big)
+(cons (classify -5) (cons (classify 0) (cons (classify 3) (cons (classify 42) '()))))
+
+;; A clause without a body gives the value of its test, and => passes it on
+;; => 7
+(cond (#f 1) (7))
+;; => 8
+(cond ((+ 3 4) => (lambda (x) (+ x 1))) (else 0))
+;; => '()
+(cond (#f 1))
+
+;; => '()
+(define (opcode-name op)
+  (case op
+    ((0) 'halt)
+    ((1 2) 'push)
+    ((3) 'add)
+    ((10) 'jump)
+    (else 'unknown)))
+;; => (halt push push add jump unknown unknown)
+(cons (opcode-name 0) (cons (opcode-name 1) (cons (opcode-name 2) (cons (opcode-name 3) (cons (opcode-name 10) (cons (opcode-name 7) (cons (opcode-name 'x) '())))))))
+
+;; => '()
+(define (kind x)
+  (case x
+    ((a e i o u) 'vowel)
+    ((#t #f) 'boolean)
+    ((1.5 -100000) 'number)
+    (else => (lambda (v) (cons 'other (cons v '()))))))
+;; => (vowel boolean number number (other b))
+(cons (kind 'e) (cons (kind #f) (cons (kind 1.5) (cons (kind -100000) (cons (kind 'b) '())))))
+
+;; Without an else clause nothing matches
+;; => '()
+(case 5 ((1) 'one))
+
+;; => 3
+(and 1 2 3)
+;; => #f
+(and 1 #f (car '()))
+;; => #t
+(and)
+;; => 2
+(or #f 2 (car '()))
+;; => #f
+(or)
+
+;; => done
+(when (> 2 1) 'ignored 'done)
+;; => '()
+(when #f 'nope)
+;; => '()
+(unless (> 2 1) 'nope)
+;; => done
+(unless #f 'done)
+
+;; => (case x ((my-or) (quote (my-or))) (else (if a a b)))
+(let ()
+  (define-syntax my-or
+    (syntax-rules ()
+      ((_ a b) (if a a b))))
+  (macroexpand '(case x ((my-or) '(my-or)) (else (my-or a b)))))
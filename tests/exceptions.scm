@@ -18,3 +18,58 @@
 
 ;; This shouldn't cause reading uninitialized values!
 (-)
+
+(sqrt "nine")
+
+(sqrt 9 16)
+
+`(a ,@1 b)
+
+`,@(quote (1 2))
+
+,x
+
+(define-syntax two-args (syntax-rules () ((_ a b) (+ a b))))
+
+(two-args 1)
+
+(define-syntax bad-ellipsis (syntax-rules () ((_ a ...) (+ a))))
+
+(bad-ellipsis 1 2)
+
+(syntax-rules () (1 2))
+
+(set-car! '(1 2) 3)
+
+(set-cdr! (car '((1 2) 3)) 4)
+
+(cond (else 1) (#t 2))
+
+(cond 1)
+
+(case 1 (else 1) ((1) 2))
+
+(case 1 (1 2))
+
+(case)
+
+(cond (#t => 1 2))
+
+(raise 'oops)
+
+(error "something failed:" 42 "x")
+
+(guard (e ((string? e) 'no)) (raise 1))
+
+(guard)
+
+(guard (1) 2)
+
+(error-object-message 5)
+
+(car 1)
+
+;; The rest of a malformed datum must not be read as forms of its own, this should print #f
+(define launched #f)
+(define x #bad (set! launched #t))
+launched
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+# Runs test programs with `--fasl`, once writing the cache and once loading it, and compares both with a plain run.
+# Usage: tests/fasl.py path/to/yawarakai
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+binary = sys.argv[1]
+tests_dir = os.path.dirname(os.path.abspath(__file__))
+work_dir = tempfile.mkdtemp()
+failures = 0
+
+
+def check(what, got, expected):
+    global failures
+    if got != expected:
+        failures += 1
+        print(f"FAIL {what}: expected {expected!r}, got {got!r}")
+    else:
+        print(f"ok {what}")
+
+
+def run(path, *args):
+    # By its name, from its directory, so that locations in errors are the same wherever the copy is
+    res = subprocess.run([binary, *args, os.path.basename(path)], cwd=os.path.dirname(path), capture_output=True, timeout=60)
+    return res.stdout + res.stderr
+
+
+def check_cached(name, parses=True):
+    """Runs `name` twice with --fasl, expecting the same output as without, error locations included.
+    Unless it `parses` as a whole, no cache is written and it's run form by form instead."""
+    # A copy, so that the cache goes next to it instead of into the tree
+    path = os.path.join(work_dir, name)
+    shutil.copy(os.path.join(tests_dir, name), path)
+    cache_path = path + ".fasl"
+
+    plain = run(path)
+    check(f"{name} writing the cache", run(path, "--fasl"), plain)
+    check(f"{name} cache written", os.path.exists(cache_path), parses)
+    check(f"{name} loading the cache", run(path, "--fasl"), plain)
+
+
+# Notably, literals loaded from the cache are constants (constants.scm), and errors point into the source all the same (locations.scm)
+for name in sorted(os.listdir(tests_dir)):
+    if name.endswith(".scm"):
+        # Has a parse error on purpose
+        check_cached(name, parses=name != "exceptions.scm")
+
+# Once the source changes, its cache is stale and the new source is run
+path = os.path.join(work_dir, "printer.scm")
+with open(path, "a") as f:
+    f.write("\n(cons 'changed '())\n")
+check("stale cache", run(path, "--fasl"), run(path))
+check("stale cache rewritten", run(path, "--fasl").endswith(b"(changed)\n"), True)
+
+shutil.rmtree(work_dir)
+sys.exit(1 if failures else 0)
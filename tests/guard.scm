@@ -0,0 +1,122 @@
+;; => 42
+(guard (e (#t e))
+  (raise 42))
+
+;; => 3
+(guard (e (#t e))
+  (+ 1 2))
+
+;; => (caught oops)
+(guard (e ((string? e) 'string)
+          (#t `(caught ,e)))
+  (raise 'oops))
+
+;; => else
+(guard (e ((string? e) 'string)
+          (else 'else))
+  (raise 1))
+
+;; => 2
+(guard (e ((= e 1) => (lambda (x) 2)))
+  (raise 1))
+
+;; Everything between the raise and the guard is abandoned, including the rest of the arguments
+;; => '()
+(define log '())
+;; => raised
+(guard (e (#t e))
+  (+ 1 (raise 'raised) (let () (set! log 'evaluated) 2)))
+;; => '()
+log
+
+;; Scopes entered on the way are left again
+;; => '()
+(define x 'outer)
+;; => (unwound outer)
+`(,(guard (e (#t 'unwound))
+     (let ((x 'inner))
+       (raise x)))
+  ,x)
+
+;; Raised from deep within a recursion
+;; => '()
+(define (descend n)
+  (if (= n 0)
+      (raise 'bottom)
+      (+ 1 (descend (- n 1)))))
+;; => bottom
+(guard (e (#t e))
+  (descend 500))
+
+;; No clause applies, so it goes on to the next guard out
+;; => (outer 5)
+(guard (e (#t `(outer ,e)))
+  (guard (e ((string? e) 'inner))
+    (raise 5)))
+
+;; Raised again from a clause
+;; => (outer (inner 5))
+(guard (e (#t `(outer ,e)))
+  (guard (e (#t (raise `(inner ,e))))
+    (raise 5)))
+
+;; Nothing raised after a guard has finished is caught by it
+;; => '()
+(define (safe-div a b)
+  (guard (e (#t 'division-failed))
+    (if (= b 0) (raise 'zero) (/ a b))))
+;; => (division-failed 5)
+`(,(safe-div 1 0) ,(safe-div 10 2))
+
+;; => '()
+(define e (guard (e (#t e)) (error "bad value:" 1 "two" '(3))))
+;; => #t
+(error-object? e)
+;; => "bad value:"
+(error-object-message e)
+;; => (1 "two" (3))
+(error-object-irritants e)
+;; => #ERROR:bad value: 1 "two" (3)
+e
+;; => #f
+(error-object? 'oops)
+
+;; Errors from builtins are caught as error objects too
+;; => "car(): argument is not not a cons"
+(guard (e ((error-object? e) (error-object-message e)))
+  (car 1))
+;; => caught
+(guard (e (#t 'caught))
+  (+ "string" 1))
+;; With the values they're about as irritants, rather than in the message
+;; => '()
+(define (error-parts thunk)
+  (guard (e ((error-object? e) `(,(error-object-message e) ,(error-object-irritants e))))
+    (thunk)))
+;; => ("car(): argument is not not a cons" (1))
+(error-parts (lambda () (car 1)))
+;; => ("+ cannot accept non-numerical parameters" ("string"))
+(error-parts (lambda () (+ 1 2 "string")))
+;; => ("parameters must be numerical" (a))
+(error-parts (lambda () (< 1 'a)))
+;; => ("wrong number of arguments" (car 2))
+(error-parts (lambda () (car 1 2)))
+;; => ("too few arguments provided to proc" (2 1))
+(error-parts (lambda () (safe-div 1)))
+
+;; Inside cond, case, and, or, when, unless and quasiquote
+;; => (1 2 3 4 5 6 7)
+`(,(guard (e (#t 1)) (cond ((raise 'x) 'no) (else 'no)))
+  ,(guard (e (#t 2)) (case (raise 'x) ((1) 'no) (else 'no)))
+  ,(guard (e (#t 3)) (and (raise 'x) 'no))
+  ,(guard (e (#t 4)) (or (raise #f) 'no))
+  ,(guard (e (#t 5)) (when (raise 'x) 'no))
+  ,(guard (e (#t 6)) (unless (raise #f) 'no))
+  ,(guard (e (#t 7)) `(no ,(raise 'x) no)))
+
+;; define and set! don't happen
+;; => '()
+(define y 1)
+;; => (1 1)
+`(,(guard (e (#t y)) (define y (raise 'x)))
+  ,(guard (e (#t y)) (set! y (raise 'x))))
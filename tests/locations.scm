@@ -0,0 +1,17 @@
+;; Errors point at the form that failed, as file:line:column (the file as it was named on the command line, e.g. run this as `yawarakai tests/locations.scm`)
+
+;; => Eval exception at tests/locations.scm:4:1: car(): argument is not not a cons
+(car 1)
+
+;; => '()
+(define (add-text x)
+  (+ x "text"))
+;; Inside a call, it's the innermost form
+;; => Eval exception at tests/locations.scm:8:3: + cannot accept non-numerical parameters
+   (add-text 1)
+
+;; => Eval exception at tests/locations.scm:17:7: car(): argument is not not a cons
+`(1
+  2
+  ,(+ 3
+      (car 'x)))
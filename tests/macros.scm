@@ -0,0 +1,110 @@
+;; => '()
+(define-syntax my-if
+  (syntax-rules ()
+    ((_ c t e) (if c t e))))
+;; => yes
+(my-if (< 1 2) 'yes 'no)
+
+;; => '()
+(define-syntax my-or
+  (syntax-rules ()
+    ((_) #f)
+    ((_ e) e)
+    ((_ e rest ...) (let ((t e)) (if t t (my-or rest ...))))))
+;; => #f
+(my-or)
+;; => 3
+(my-or #f 3)
+;; => 2
+(my-or #f #f 2 4)
+
+;; => '()
+(define-syntax swap!
+  (syntax-rules ()
+    ((_ a b) (let ((tmp a)) (set! a b) (set! b tmp)))))
+;; => '()
+(define x 1)
+;; => '()
+(define y 2)
+;; => (2 1)
+(let () (swap! x y) (cons x (cons y '())))
+
+;; Ellipses inside ellipses, and patterns after one
+;; => '()
+(define-syntax my-let*
+  (syntax-rules ()
+    ((_ () body ...) (let () body ...))
+    ((_ ((name val) rest ...) body ...) (let ((name val)) (my-let* (rest ...) body ...)))))
+;; => 6
+(my-let* ((a 1) (b (+ a 1)) (c (+ b 1))) (+ a b c))
+
+;; => '()
+(define-syntax flatten-pairs
+  (syntax-rules ()
+    ((_ (a b ...) ...) '(a ... b ... ...))))
+;; => (1 4 2 3 5)
+(flatten-pairs (1 2 3) (4 5))
+
+;; => '()
+(define-syntax last-of
+  (syntax-rules ()
+    ((_ x ... y) 'y)))
+;; => c
+(last-of a b c)
+
+;; Literals only match themselves
+;; => '()
+(define-syntax arrow
+  (syntax-rules (=>)
+    ((_ a => b) (cons a b))
+    ((_ a b c) 'no-arrow)))
+;; => (1 . 2)
+(arrow 1 => 2)
+;; => no-arrow
+(arrow 1 -> 2)
+
+;; A different ellipsis, and (::: :::) for a literal one
+;; => '()
+(define-syntax quote-all
+  (syntax-rules ::: ()
+    ((_ x :::) '((x :::) (::: :::)))))
+;; => ((a b) :::)
+(quote-all a b)
+
+;; The same use evaluated again runs its expansion with the new values
+;; => '()
+(define (bigger a b) (my-if (> a b) a b))
+;; => 7
+(bigger 7 3)
+;; => 9
+(bigger 2 9)
+
+;; The binders a template introduces get fresh names, numbered by the expansions before it
+;; => (let ((t.6 a)) (if t.6 t.6 b))
+(macroexpand '(my-or a b))
+;; => (quote (my-or a b))
+(macroexpand ''(my-or a b))
+;; => #MACRO:my-or
+my-or
+
+;; So they don't capture the user's variables of the same name
+;; => 5
+(let ((t 5)) (my-or #f t))
+;; => (1 . 2)
+(let ((tmp 1) (other 2)) (swap! tmp other) (cons other tmp))
+
+;; Names being bound aren't macro uses, even when a macro has the same name
+;; => (lambda (my-or x) x)
+(macroexpand '(lambda (my-or x) x))
+;; => (define (my-or x) (if x 1 2))
+(macroexpand '(define (my-or x) (my-if x 1 2)))
+;; => (let loop ((my-or 1) (swap! 2)) (if my-or swap! 3))
+(macroexpand '(let loop ((my-or 1) (swap! 2)) (my-if my-or swap! 3)))
+
+;; Uses already expanded follow the macro being redefined
+;; => '()
+(define-syntax my-if
+  (syntax-rules ()
+    ((_ c t e) (if c e t))))
+;; => 3
+(bigger 7 3)
@@ -0,0 +1,50 @@
+;; => '()
+(define (fib n)
+  (if (< n 2)
+      n
+      (+ (fib (- n 1))
+         (fib (- n 2)))))
+
+;; => (1 1 2 3 5 8 13 21 34 55 89 144 233 377 610 987 1597 2584 4181 6765)
+(parallel-map fib '(1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20))
+
+;; Builtins can be mapped too
+;; => (1 3)
+(parallel-map car '((1 2) (3 4)))
+
+;; Results can be heap objects allocated on the worker threads
+;; => ((a) (b) (c))
+(parallel-map (lambda (x) (cons x '())) '(a b c))
+
+;; Nested parallel operations run inline on the worker
+;; => ((5) (8) (13))
+(parallel-map (lambda (x) (parallel-map fib (cons x '()))) '(5 6 7))
+
+;; => '()
+(parallel-for-each fib '(1 2 3))
+
+;; => '()
+(parallel-map fib '())
+
+;; Raised on a worker, caught around the parallel operation
+;; => three
+(guard (e (#t e)) (parallel-map (lambda (x) (if (= x 3) (raise 'three) x)) '(1 2 3 4)))
+
+;; => (1 2 103 4)
+(parallel-map (lambda (x) (guard (e (#t (+ e 100))) (if (= x 3) (raise x) x))) '(1 2 3 4))
+
+;; Variables bound within each call are the worker's own to set!
+;; => (2 4 6)
+(parallel-map (lambda (x) (let ((y x)) (set! y (* y 2)) y)) '(1 2 3))
+
+;; Anything from before the call is shared by the workers, so they can't set! it: not a global, nor a variable the procedure closes over
+;; => '()
+(define total 0)
+;; => Eval exception at tests/parallel.scm:44:32: (set!) cannot change 'total' from a parallel worker, it's shared with the other workers
+(parallel-for-each (lambda (x) (set! total (+ total x))) '(1 2 3))
+;; => '()
+(define count-calls (let ((n 0)) (lambda (x) (set! n (+ n 1)) n)))
+;; => Eval exception at tests/parallel.scm:46:46: (set!) cannot change 'n' from a parallel worker, it's shared with the other workers
+(parallel-map count-calls '(1 2 3))
+;; => (0 . 1)
+(cons total (count-calls 0))
@@ -0,0 +1,49 @@
+;; => (1 . 2)
+(cons 1 2)
+
+;; Shared structure that isn't part of a cycle is just printed again, without labels
+;; => '()
+(define shared '(a b))
+;; => ((a b) a b)
+(cons shared shared)
+
+;; => '()
+(define ring (cons 1 (cons 2 '())))
+;; => '()
+(set-cdr! (cdr ring) ring)
+;; => #0=(1 2 . #0#)
+ring
+
+;; => '()
+(define self (cons 1 '()))
+;; => '()
+(set-car! self self)
+;; => #0=(#0#)
+self
+
+;; => '()
+(define both (cons 0 '()))
+;; => '()
+(set-cdr! both (cons both "tail"))
+;; => #0=(0 #0# . "tail")
+both
+
+;; Only the cycle gets a label, not the shared list inside it
+;; => '()
+(define loop (cons shared (cons shared '())))
+;; => '()
+(set-cdr! (cdr loop) loop)
+;; => #0=((a b) (a b) . #0#)
+loop
+
+;; Empty lists inside data are written as data
+;; => (a () (b ()))
+'(a () (b ()))
+
+;; Procedures are written by name, lambdas have none
+;; => #PROC:<unnamed>
+(lambda (x) x)
+;; => '()
+(define (named x) x)
+;; => (#PROC:named . #PROC:<unnamed>)
+(cons named (lambda () 1))
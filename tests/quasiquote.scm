@@ -0,0 +1,52 @@
+;; => '()
+(define x 5)
+;; => '()
+(define lst '(1 2 3))
+
+;; => (a b c)
+`(a b c)
+
+;; => (a b 5)
+`(a b ,x)
+
+;; => 5
+`,x
+
+;; => (nested (deep 5) (const list) 6)
+`(nested (deep ,x) (const list) ,(+ x 1))
+
+;; => (a 1 2 3 b)
+`(a ,@lst b)
+
+;; => (a 1 2 3)
+`(a ,@lst)
+
+;; => (1 1 2 3 1 2 3 2)
+`(1 ,@lst ,@lst 2)
+
+;; => (a b)
+`(a ,@'() b)
+
+;; Inner unquotes belong to the inner quasiquote, except for the ones nested as deep as it is
+;; => (1 (quasiquote (2 (unquote (3 5)))))
+`(1 `(2 ,(3 ,x)))
+
+;; => (quote 5)
+`',x
+
+;; The same template evaluated again is rebuilt with the new values
+;; => '()
+(define (item n) `(item ,n (fixed part)))
+;; => ((item 1 (fixed part)) (item 2 (fixed part)))
+`(,(item 1) ,(item 2))
+
+;; The parts without unquotes are constants, like quoted data, so a result can't change the template
+;; => '()
+(define (shared-tail) `(a b ,x c d))
+;; => Eval exception at tests/quasiquote.scm:47:1: (set-car!)/(set-cdr!) cannot modify a constant, such as quoted data
+(set-car! (cdr (cdr (cdr (shared-tail)))) 'z)
+;; => (a b 5 c d)
+(shared-tail)
+
+;; => Eval exception at tests/quasiquote.scm:52:1: (quasiquote) expects exactly one template
+(quasiquote . 1)
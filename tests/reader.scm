@@ -0,0 +1,6 @@
+;; Numbers, and symbols that merely start like one
+;; => (1 -2 3 0.5 -0.25 + - ... 1+ -> +-3 -+3 --1)
+'(1 -2 +3 .5 -.25 + - ... 1+ -> +-3 -+3 --1)
+
+;; => "+-3"
+(symbol->string '+-3)
@@ -0,0 +1,231 @@
+#!/usr/bin/env python3
+# Talks to `yawarakai --serve` over its socket, frame by frame.
+# Usage: tests/server.py path/to/yawarakai
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+binary = sys.argv[1]
+socket_path = os.path.join(tempfile.mkdtemp(), "server.sock")
+failures = 0
+
+
+def serve(*args):
+    """Starts a server on `socket_path`, running `args` as its tasks (and options)"""
+    return subprocess.Popen([binary, "--serve", socket_path, "-q", *args])
+
+
+def stop(server):
+    server.terminate()
+    return server.wait()
+
+
+def connect():
+    for _ in range(100):
+        try:
+            s = socket.socket(socket.AF_UNIX)
+            s.connect(socket_path)
+            return s
+        except (FileNotFoundError, ConnectionRefusedError):
+            time.sleep(0.05)
+    raise RuntimeError("server didn't come up")
+
+
+def frame(type, payload):
+    return type + struct.pack("<I", len(payload)) + payload
+
+
+def read_frames(s):
+    """All frames until DONE, as (type, payload), or up to where the server hung up"""
+    data = b""
+    while chunk := s.recv(65536):
+        data += chunk
+    frames = []
+    while len(data) >= 5:
+        size = struct.unpack("<I", data[1:5])[0]
+        frames.append((data[:1], data[5:5 + size]))
+        data = data[5 + size:]
+    return frames
+
+
+def request(*sources, options=b""):
+    s = connect()
+    s.sendall(frame(b"O", options) + b"".join(frame(b"S", name + b"\0" + text) for name, text in sources))
+    s.shutdown(socket.SHUT_WR)
+    return read_frames(s)
+
+
+def check(what, got, expected):
+    global failures
+    if got != expected:
+        failures += 1
+        print(f"FAIL {what}: expected {expected!r}, got {got!r}")
+    else:
+        print(f"ok {what}")
+
+
+def open_fds(pid):
+    return len(os.listdir(f"/proc/{pid}/fd"))
+
+
+def children(pid):
+    """Pids of the processes whose parent is `pid`, zombies included"""
+    res = []
+    for entry in os.listdir("/proc"):
+        if not entry.isdigit():
+            continue
+        try:
+            with open(f"/proc/{entry}/stat") as f:
+                # The name in parentheses may have spaces of its own, the parent's pid is the second field after it
+                fields = f.read().rsplit(")", 1)[1].split()
+        except (FileNotFoundError, ProcessLookupError):
+            continue
+        if int(fields[1]) == pid:
+            res.append(int(entry))
+    return res
+
+
+def output(frames, type=b"o"):
+    return b"".join(payload for t, payload in frames if t == type)
+
+
+# Objects from before the fork of each isolated request
+base = b"""
+(define base-channel (make-channel))
+(define base-port (open-input-file "/dev/null"))
+(define base-task (spawn (lambda () (yield) 'done)))
+(define count-calls (let ((n 0)) (lambda (x) (set! n (+ n 1)) n)))
+(define base-table '((1 "one") (2 "two")))
+"""
+server = serve("-e", base)
+try:
+    frames = request((b"a", b"(+ 1 2)"))
+    check("result", output(frames), b"3\n")
+    check("done", frames[-1], (b"x", b""))
+
+    check("quiet", output(request((b"a", b"(+ 1 2)"), options=b"quiet")), b"")
+
+    # Errors point at the source by the name the client gave it
+    frames = request((b"first", b"1"), (b"second", b"\n (car 1)"))
+    check("location", output(frames, b"e"), b"Eval exception at second:2:2: car(): argument is not not a cons\n")
+
+    # More requests than there are source file ids
+    for i in range(70000):
+        frames = request((f"many-{i}".encode(), b"(car 1)"))
+    check("location after many requests", output(frames, b"e"), b"Eval exception at many-69999:1:1: car(): argument is not not a cons\n")
+
+    # Refused before anything is allocated for it, or run
+    s = connect()
+    s.sendall(frame(b"O", b"") + frame(b"S", b"a\0(+ 1 2)") + b"S" + struct.pack("<I", 0xFFFFFFF0))
+    s.shutdown(socket.SHUT_WR)
+    frames = read_frames(s)
+    check("oversized frame", [type for type, _ in frames], [b"e", b"x"])
+
+    check("still serving", output(request((b"a", b"(+ 1 2)"))), b"3\n")
+
+    # Cut off partway through a frame, by a client that went away (or stalled until the server's timeout): none of it is run
+    s = connect()
+    s.sendall(frame(b"O", b"") + frame(b"S", b"a\0(+ 1 2)") + frame(b"S", b"b\0(+ 3 4)")[:-3])
+    s.shutdown(socket.SHUT_WR)
+    frames = read_frames(s)
+    check("cut off request", frames, [(b"e", b"Request refused: it was cut off partway through a frame\n"), (b"x", b"")])
+
+    # Not a frame at all
+    s = connect()
+    s.sendall(b"Sxx")
+    s.shutdown(socket.SHUT_WR)
+    read_frames(s)
+    check("still serving after garbage", output(request((b"a", b"(+ 1 2)"))), b"3\n")
+
+    # A fork can't leave anything of its own (which goes away with it) in objects of its base
+    def isolated(text):
+        return request((b"a", text), options=b"isolate")
+
+    check("fork sending to a base channel", output(isolated(b"(channel-send base-channel (cons 1 2))"), b"e"),
+          b"Eval exception at a:1:1: (channel-send) cannot modify a channel from before the environment was forked\n")
+    check("fork receiving from a base channel", output(isolated(b"(channel-receive base-channel)"), b"e"),
+          b"Eval exception at a:1:1: (channel-receive) cannot modify a channel from before the environment was forked\n")
+    check("fork reading a base port", output(isolated(b"(read-line base-port)"), b"e"),
+          b"Eval exception at a:1:1: (read-line) cannot modify a port from before the environment was forked\n")
+    check("fork joining a base task", output(isolated(b"(join base-task)"), b"e"),
+          b"Eval exception at a:1:1: (join) cannot wait for a task from before the environment was forked\n")
+    check("fork's own channel", output(isolated(b"(define ch (make-channel)) (channel-send ch (cons 1 2)) (channel-receive ch)")), b"'()\n'()\n(1 . 2)\n")
+
+    # Literals of the base are shared with it, its own are constants too, but of a pool that goes away with it
+    check("fork's literals shared with the base", output(isolated(b"(eq? (cdr base-table) '((2 \"two\")))")), b"#t\n")
+    check("fork's own literals", output(isolated(b"(define t '((3 \"three\"))) (eq? t '((3 \"three\")))")), b"'()\n#t\n")
+    check("fork's own literals are constants", output(isolated(b"(set-car! '(3 \"three\") 0)"), b"e"),
+          b"Eval exception at a:1:1: (set-car!)/(set-cdr!) cannot modify a constant, such as quoted data\n")
+
+    # Its tasks that are still running go away with it, rather than being run later on
+    check("fork's unfinished tasks", output(isolated(b"(define t (spawn (lambda () (yield) (yield) (cons 1 2)))) (yield)")), b"'()\n'()\n")
+    check("after a fork's unfinished tasks", output(request((b"a", b"(yield) (yield) (yield) (join base-task)"))), b"'()\n'()\n'()\ndone\n")
+
+    # Ports it didn't close go away with it too, file and subprocess
+    fds = open_fds(server.pid)
+    isolated(b"(define f (open-input-file \"/dev/null\")) (define p (open-input-pipe \"sleep 100\"))")
+    check("fork's ports closed", open_fds(server.pid), fds)
+    check("fork's subprocesses reaped", children(server.pid), [])
+
+    # Workers of a fork can't set! what they share, base variables included, any more than other workers can
+    frames = isolated(b"(parallel-map count-calls '(1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16))")
+    check("fork's workers", output(frames, b"e"),
+          b"Eval exception at <command line>:5:46: (set!) cannot change 'n' from a parallel worker, it's shared with the other workers\n")
+    check("base after fork's workers", output(request((b"a", b"(count-calls 0)"))), b"1\n")
+finally:
+    stop(server)
+
+# Each request gets the limits afresh
+count = b"""
+(define (count n) (if (= n 0) 0 (+ 1 (count (- n 1)))))
+(define (rounds k) (if (= k 0) 0 (+ (count 900) (rounds (- k 1)))))
+"""
+server = serve("--max-steps", "100000", "--max-depth", "1000", "--timeout", "1000", "-e", count)
+try:
+    check("steps", output(request((b"a", b"(rounds 5)"))), b"4500\n")
+    # (wherever it has got to when the steps run out)
+    check("step limit", b"step limit exceeded" in output(request((b"a", b"(rounds 50)")), b"e"), True)
+    check("steps after the limit", output(request((b"a", b"(rounds 5)"))), b"4500\n")
+    check("depth limit", output(request((b"a", b"(count 2000)")), b"e"), b"Eval exception at <command line>:2:38: maximum call depth of 1000 exceeded\n")
+
+    # Also while waiting for something rather than evaluating
+    check("timeout reading", output(request((b"a", b"(read-line (open-input-pipe \"sleep 5\"))")), b"e"), b"Eval exception at a:1:1: evaluation timed out\n")
+    check("timeout joining", output(request((b"a", b"(join (spawn (lambda () (read-line (open-input-pipe \"sleep 5\")))))")), b"e"),
+          b"Eval exception at a:1:1: evaluation timed out\n")
+    check("timeout receiving", output(request((b"a", b"(channel-receive (let ((ch (make-channel))) (spawn (lambda () (read-line (open-input-pipe \"sleep 5\")))) ch))")), b"e"),
+          b"Eval exception at a:1:1: evaluation timed out\n")
+finally:
+    stop(server)
+
+build = b"""
+(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))
+(define (build-rounds k) (if (= k 0) 0 (let ((l (build 500 '()))) (+ 1 (build-rounds (- k 1))))))
+"""
+server = serve("--max-heap", "4000000", "-e", build)
+try:
+    # Each under the limit, but more than it together: a server that doesn't isolate requests keeps their allocations around
+    for i in range(4):
+        check(f"heap, request {i}", output(request((b"a", b"(build-rounds 20)"))), b"20\n")
+    check("heap limit", b"heap limit of 4000000 bytes exceeded" in output(request((b"a", b"(build-rounds 100)")), b"e"), True)
+finally:
+    stop(server)
+
+# Stopping the server interrupts the request that's running
+server = serve()
+try:
+    s = connect()
+    s.sendall(frame(b"O", b"") + frame(b"S", b"a\0(read-line (open-input-pipe \"sleep 5\"))"))
+    s.shutdown(socket.SHUT_WR)
+    time.sleep(0.5)
+    server.send_signal(signal.SIGINT)
+    check("interrupt", output(read_frames(s), b"e"), b"Eval exception at a:1:1: evaluation interrupted\n")
+    check("exit after interrupt", server.wait(timeout=5), 0)
+finally:
+    stop(server)
+
+sys.exit(1 if failures else 0)
@@ -0,0 +1,66 @@
+;; => "foobar"
+(string-append "foo" "bar")
+
+;; => ""
+(string-append)
+
+;; => 6
+(string-length (string-append "foo" "bar"))
+
+;; => '()
+(define long-a "a rope made of pieces long enough that they aren't just copied into one")
+;; => '()
+(define long-b ", and then some more text")
+;; => '()
+(define rope (string-append long-a long-b))
+;; => "a rope made of pieces long enough that they aren't just copied into one, and then some more text"
+rope
+
+;; => "rope"
+(substring rope 2 6)
+
+;; => "some more text"
+(substring rope 82)
+
+;; => #t
+(string=? rope (string-append "a rope made of pieces long enough" " that they aren't just copied into one, and then some more text"))
+
+;; => #f
+(string=? rope long-a)
+
+;; => '()
+(define (digits n acc)
+  (if (= n 10)
+      acc
+      (digits (+ n 1) (string-append acc (number->string n)))))
+;; => "0123456789"
+(digits 0 "")
+
+;; => '()
+(define (repeat n acc)
+  (if (= n 0)
+      acc
+      (repeat (- n 1) (string-append acc "abc"))))
+;; => 3000
+(string-length (repeat 1000 ""))
+
+;; => '()
+(define sb (make-string-builder))
+;; => '()
+(string-builder-append! sb "x=" (number->string 1.5))
+;; => '()
+(string-builder-append! sb ", y=" (number->string 2))
+;; => "x=1.5, y=2"
+(string-builder->string sb)
+
+;; => "sym"
+(symbol->string 'sym)
+
+;; => #t
+(string? (string-append "a" "b"))
+
+;; => #f
+(string? 'abc)
+
+;; => hello
+(string->symbol "hello")
@@ -6,3 +6,11 @@ target("yawarakai")
     set_kind("binary")
     add_files("src/**.cpp")
     add_files("src/**.cppm")
+    add_syslinks("pthread")
+
+-- Benchmark runner: `xmake run ywrk-bench` runs everything in bench/ and prints the results as JSON
+target("ywrk-bench")
+    set_kind("binary")
+    add_deps("yawarakai")
+    add_files("bench/ywrk-bench.cpp")
+    add_defines("YWRK_BENCH_DIR=\"" .. path.join(os.scriptdir(), "bench") .. "\"")